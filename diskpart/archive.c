@@ -0,0 +1,1468 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/archive.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define ARCHIVE_BLOCK_SIZE          (1024 * 1024)
+#define ARCHIVE_CHUNK_SIZE          4096    /* Compression unit of LZNT1 */
+
+/* Together they stay below MAXIMUM_WAIT_OBJECTS */
+#define ARCHIVE_MAX_SLOTS           32
+#define ARCHIVE_MAX_WORKERS         16
+
+typedef enum _ARCHIVE_SLOT_STATE
+{
+    ArchiveSlotFree,
+    ArchiveSlotReading,     /* Export: the block is read from the disk */
+    ArchiveSlotReady,       /* Waiting for a worker */
+    ArchiveSlotPacking,     /* A worker compresses or decompresses the block */
+    ArchiveSlotWriting      /* Import: the block is written to the disk */
+} ARCHIVE_SLOT_STATE;
+
+typedef struct _ARCHIVE_SLOT
+{
+    ARCHIVE_SLOT_STATE State;
+    HANDLE Event;
+    IO_STATUS_BLOCK Iosb;
+    PUCHAR Data;            /* Uncompressed block, page aligned for unbuffered I/O */
+    PUCHAR Packed;          /* Compressed block */
+    ULONGLONG Block;
+    ULONG Length;
+    ARCHIVE_BLOCK Entry;    /* Index entry of the block */
+    NTSTATUS Status;        /* Result of the worker */
+} ARCHIVE_SLOT, *PARCHIVE_SLOT;
+
+typedef struct _ARCHIVE_CONTEXT *PARCHIVE_CONTEXT;
+
+typedef struct _ARCHIVE_WORKER
+{
+    HANDLE Thread;
+    HANDLE WorkEvent;       /* Set when Slot holds a block, or is NULL to stop */
+    HANDLE DoneEvent;       /* Set when the block has been packed or unpacked */
+    PARCHIVE_SLOT Slot;
+    PARCHIVE_CONTEXT Context;
+    PVOID WorkSpace;        /* Compression work space, export only */
+} ARCHIVE_WORKER, *PARCHIVE_WORKER;
+
+typedef struct _ARCHIVE_CONTEXT
+{
+    BOOL bImport;
+    USHORT Format;          /* COMPRESSION_FORMAT_* | COMPRESSION_ENGINE_*, export only */
+    PARCHIVE Archive;
+    HANDLE DiskHandle;
+    ULONGLONG Offset;       /* Bytes, start of the partition on the disk */
+    ULONG HiddenSectors;    /* Start sector of the partition */
+
+    ULONG SlotCount;
+    ULONG WorkerCount;
+    ARCHIVE_SLOT Slots[ARCHIVE_MAX_SLOTS];
+    ARCHIVE_WORKER Workers[ARCHIVE_MAX_WORKERS];
+
+    ULONGLONG NextBlock;
+    ULONGLONG BlocksDone;
+    ULONGLONG FileOffset;   /* Export: end of the data stored so far */
+    ULONGLONG ZeroBlocks;
+} ARCHIVE_CONTEXT;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+ULONG
+GetArchiveBlockLength(
+    _In_ PARCHIVE_HEADER Header,
+    _In_ ULONGLONG Block)
+{
+    return (ULONG)min((ULONGLONG)Header->BlockSize,
+                      Header->Length - (Block * Header->BlockSize));
+}
+
+
+static
+BOOL
+IsZeroBlock(
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ ULONG Length)
+{
+    PULONGLONG Values = (PULONGLONG)Data;
+    ULONG i;
+
+    /* The length is a multiple of the sector size */
+    for (i = 0; i < Length / sizeof(ULONGLONG); i++)
+    {
+        if (Values[i] != 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Fills in the index entry of a block read from the disk. A block of zeros is
+ * not stored at all, and a block that does not get smaller is stored raw.
+ */
+static
+VOID
+PackArchiveBlock(
+    _In_ PARCHIVE_CONTEXT Context,
+    _In_ PARCHIVE_SLOT Slot,
+    _In_ PVOID WorkSpace)
+{
+    ULONG FinalSize;
+    NTSTATUS Status;
+
+    RtlZeroMemory(&Slot->Entry, sizeof(Slot->Entry));
+    Slot->Entry.Checksum = Crc32c(0, Slot->Data, Slot->Length);
+
+    if (IsZeroBlock(Slot->Data, Slot->Length))
+    {
+        Slot->Entry.Flags = ARCHIVE_BLOCK_ZERO;
+        return;
+    }
+
+    if (Context->Archive->Header.Compression != COMPRESSION_FORMAT_NONE)
+    {
+        Status = RtlCompressBuffer(Context->Format,
+                                   Slot->Data,
+                                   Slot->Length,
+                                   Slot->Packed,
+                                   Slot->Length,
+                                   ARCHIVE_CHUNK_SIZE,
+                                   &FinalSize,
+                                   WorkSpace);
+        if ((Status == STATUS_SUCCESS) && (FinalSize < Slot->Length))
+        {
+            Slot->Entry.Flags = ARCHIVE_BLOCK_COMPRESSED;
+            Slot->Entry.StoredLength = FinalSize;
+            return;
+        }
+    }
+
+    Slot->Entry.StoredLength = Slot->Length;
+}
+
+
+/* Rebuilds a block from its stored data, and checks it against the index */
+static
+NTSTATUS
+UnpackArchiveBlock(
+    _In_ PARCHIVE_HEADER Header,
+    _In_ PARCHIVE_BLOCK Entry,
+    _In_ PUCHAR Packed,
+    _Inout_updates_bytes_(Length) PUCHAR Data,
+    _In_ ULONG Length)
+{
+    ULONG FinalSize;
+    NTSTATUS Status;
+
+    if (Entry->Flags & ARCHIVE_BLOCK_ZERO)
+    {
+        RtlZeroMemory(Data, Length);
+    }
+    else if (Entry->Flags & ARCHIVE_BLOCK_COMPRESSED)
+    {
+        Status = RtlDecompressBuffer(Header->Compression,
+                                     Data,
+                                     Length,
+                                     Packed,
+                                     Entry->StoredLength,
+                                     &FinalSize);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        if (FinalSize != Length)
+            return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    if (Crc32c(0, Data, Length) != Entry->Checksum)
+        return STATUS_CRC_ERROR;
+
+    return STATUS_SUCCESS;
+}
+
+
+/* Reads the stored data of a block: raw blocks into Data, the others into Packed */
+static
+NTSTATUS
+LoadArchiveBlock(
+    _In_ PARCHIVE Archive,
+    _In_ PARCHIVE_BLOCK Entry,
+    _Out_ PUCHAR Data,
+    _Out_ PUCHAR Packed)
+{
+    LARGE_INTEGER FileOffset;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    if (Entry->Flags & ARCHIVE_BLOCK_ZERO)
+        return STATUS_SUCCESS;
+
+    FileOffset.QuadPart = Entry->Offset;
+    Status = NtReadFile(Archive->FileHandle,
+                        NULL,
+                        NULL,
+                        NULL,
+                        &Iosb,
+                        (Entry->Flags & ARCHIVE_BLOCK_COMPRESSED) ? Packed : Data,
+                        Entry->StoredLength,
+                        &FileOffset,
+                        NULL);
+    if (NT_SUCCESS(Status) && (Iosb.Information != Entry->StoredLength))
+        Status = STATUS_FILE_CORRUPT_ERROR;
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+OpenArchiveFile(
+    _In_ PWSTR pszFileName,
+    _In_ ULONG CreateDisposition,
+    _Out_ PHANDLE FileHandle)
+{
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    if (!RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+        return STATUS_OBJECT_NAME_INVALID;
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    Status = NtCreateFile(FileHandle,
+                          (CreateDisposition == FILE_OPEN) ? FILE_GENERIC_READ : FILE_GENERIC_WRITE,
+                          &ObjectAttributes,
+                          &Iosb,
+                          NULL,
+                          FILE_ATTRIBUTE_NORMAL,
+                          FILE_SHARE_READ,
+                          CreateDisposition,
+                          FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
+                          NULL,
+                          0);
+
+    RtlFreeUnicodeString(&Name);
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+CreateArchive(
+    _In_ USHORT Compression,
+    _In_ ULONG BytesPerSector,
+    _In_ ULONGLONG Length,
+    _Out_ PARCHIVE *ppArchive)
+{
+    PARCHIVE Archive;
+    ULONGLONG BlockCount;
+
+    BlockCount = (Length + ARCHIVE_BLOCK_SIZE - 1) / ARCHIVE_BLOCK_SIZE;
+    if (BlockCount > (MAXULONG / sizeof(ARCHIVE_BLOCK)))
+        return STATUS_INVALID_PARAMETER;
+
+    Archive = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ARCHIVE));
+    if (Archive == NULL)
+        return STATUS_NO_MEMORY;
+
+    Archive->Header.Magic = ARCHIVE_MAGIC;
+    Archive->Header.Version = ARCHIVE_VERSION;
+    Archive->Header.Compression = Compression;
+    Archive->Header.BlockSize = ARCHIVE_BLOCK_SIZE;
+    Archive->Header.BytesPerSector = BytesPerSector;
+    Archive->Header.Length = Length;
+    Archive->Header.BlockCount = BlockCount;
+    Archive->CachedBlock = BlockCount;
+
+    Archive->Blocks = RtlAllocateHeap(RtlGetProcessHeap(),
+                                      HEAP_ZERO_MEMORY,
+                                      (SIZE_T)(BlockCount * sizeof(ARCHIVE_BLOCK)));
+    if (Archive->Blocks == NULL)
+    {
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Archive);
+        return STATUS_NO_MEMORY;
+    }
+
+    *ppArchive = Archive;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+CloseArchive(
+    _In_ PARCHIVE Archive)
+{
+    if (Archive->FileHandle != NULL)
+        NtClose(Archive->FileHandle);
+
+    if (Archive->Packed != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Archive->Packed);
+
+    if (Archive->Data != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Archive->Data);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Archive->Blocks);
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Archive);
+}
+
+
+/* Opens an archive and loads its index. Blocks are read on demand */
+NTSTATUS
+OpenArchive(
+    _In_ PWSTR pszFileName,
+    _Out_ PARCHIVE *ppArchive)
+{
+    ARCHIVE_HEADER Header;
+    PARCHIVE Archive = NULL;
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER FileOffset;
+    HANDLE FileHandle;
+    ULONGLONG Block;
+    NTSTATUS Status;
+
+    Status = OpenArchiveFile(pszFileName, FILE_OPEN, &FileHandle);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtReadFile(FileHandle,
+                        NULL,
+                        NULL,
+                        NULL,
+                        &Iosb,
+                        &Header,
+                        sizeof(Header),
+                        NULL,
+                        NULL);
+    if (NT_SUCCESS(Status) &&
+        ((Iosb.Information != sizeof(Header)) ||
+         (Header.Magic != ARCHIVE_MAGIC) ||
+         (Header.Version != ARCHIVE_VERSION) ||
+         (Header.BlockSize != ARCHIVE_BLOCK_SIZE) ||
+         (Header.BytesPerSector == 0) ||
+         (Header.IndexOffset == 0)))
+    {
+        Status = STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    if (NT_SUCCESS(Status))
+        Status = CreateArchive(Header.Compression, Header.BytesPerSector, Header.Length, &Archive);
+
+    if (NT_SUCCESS(Status) && (Archive->Header.BlockCount != Header.BlockCount))
+        Status = STATUS_FILE_CORRUPT_ERROR;
+
+    if (NT_SUCCESS(Status))
+    {
+        Archive->Header = Header;
+        Archive->FileHandle = FileHandle;
+        FileHandle = NULL;
+
+        FileOffset.QuadPart = Header.IndexOffset;
+        Status = NtReadFile(Archive->FileHandle,
+                            NULL,
+                            NULL,
+                            NULL,
+                            &Iosb,
+                            Archive->Blocks,
+                            (ULONG)(Header.BlockCount * sizeof(ARCHIVE_BLOCK)),
+                            &FileOffset,
+                            NULL);
+        if (NT_SUCCESS(Status) && (Iosb.Information != Header.BlockCount * sizeof(ARCHIVE_BLOCK)))
+            Status = STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    /* Stored data must fit the block buffers */
+    for (Block = 0; NT_SUCCESS(Status) && (Block < Header.BlockCount); Block++)
+    {
+        if ((Archive->Blocks[Block].StoredLength > Header.BlockSize) ||
+            (!(Archive->Blocks[Block].Flags & (ARCHIVE_BLOCK_ZERO | ARCHIVE_BLOCK_COMPRESSED)) &&
+             (Archive->Blocks[Block].StoredLength != GetArchiveBlockLength(&Header, Block))))
+        {
+            Status = STATUS_FILE_CORRUPT_ERROR;
+        }
+    }
+
+    if (FileHandle != NULL)
+        NtClose(FileHandle);
+
+    if (!NT_SUCCESS(Status))
+    {
+        if (Archive != NULL)
+            CloseArchive(Archive);
+        return Status;
+    }
+
+    *ppArchive = Archive;
+
+    return STATUS_SUCCESS;
+}
+
+
+/* Reads any range of the archived partition, one block at a time */
+NTSTATUS
+ReadArchive(
+    _In_ PARCHIVE Archive,
+    _In_ ULONGLONG Offset,
+    _Out_writes_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length)
+{
+    ULONGLONG Block;
+    ULONG BlockOffset, BlockLength, CopyLength;
+    NTSTATUS Status;
+
+    if ((Offset > Archive->Header.Length) ||
+        (Length > Archive->Header.Length - Offset))
+    {
+        return STATUS_END_OF_FILE;
+    }
+
+    if (Archive->Data == NULL)
+    {
+        Archive->Data = RtlAllocateHeap(RtlGetProcessHeap(), 0, Archive->Header.BlockSize);
+        Archive->Packed = RtlAllocateHeap(RtlGetProcessHeap(), 0, Archive->Header.BlockSize);
+        if ((Archive->Data == NULL) || (Archive->Packed == NULL))
+            return STATUS_NO_MEMORY;
+    }
+
+    while (Length != 0)
+    {
+        Block = Offset / Archive->Header.BlockSize;
+        BlockOffset = (ULONG)(Offset % Archive->Header.BlockSize);
+        BlockLength = GetArchiveBlockLength(&Archive->Header, Block);
+
+        if (Block != Archive->CachedBlock)
+        {
+            Archive->CachedBlock = Archive->Header.BlockCount;
+
+            Status = LoadArchiveBlock(Archive, &Archive->Blocks[Block], Archive->Data, Archive->Packed);
+            if (NT_SUCCESS(Status))
+            {
+                Status = UnpackArchiveBlock(&Archive->Header,
+                                            &Archive->Blocks[Block],
+                                            Archive->Packed,
+                                            Archive->Data,
+                                            BlockLength);
+            }
+
+            if (!NT_SUCCESS(Status))
+                return Status;
+
+            Archive->CachedBlock = Block;
+        }
+
+        CopyLength = min(Length, BlockLength - BlockOffset);
+        RtlCopyMemory(Buffer, &Archive->Data[BlockOffset], CopyLength);
+
+        Buffer = (PUCHAR)Buffer + CopyLength;
+        Offset += CopyLength;
+        Length -= CopyLength;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+NTAPI
+ArchiveWorkerThread(
+    _In_ PVOID Parameter)
+{
+    PARCHIVE_WORKER Worker = Parameter;
+    PARCHIVE_CONTEXT Context = Worker->Context;
+    PARCHIVE_SLOT Slot;
+
+    for (;;)
+    {
+        NtWaitForSingleObject(Worker->WorkEvent, FALSE, NULL);
+
+        Slot = Worker->Slot;
+        if (Slot == NULL)
+            break;
+
+        if (Context->bImport)
+        {
+            Slot->Status = UnpackArchiveBlock(&Context->Archive->Header,
+                                              &Slot->Entry,
+                                              Slot->Packed,
+                                              Slot->Data,
+                                              Slot->Length);
+        }
+        else
+        {
+            PackArchiveBlock(Context, Slot, Worker->WorkSpace);
+            Slot->Status = STATUS_SUCCESS;
+        }
+
+        NtSetEvent(Worker->DoneEvent, NULL);
+    }
+
+    RtlExitUserThread(STATUS_SUCCESS);
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Starts the next block in the slot. An export reads it from the disk, an
+ * import reads its stored data from the archive.
+ */
+static
+NTSTATUS
+StartArchiveBlock(
+    _In_ PARCHIVE_CONTEXT Context,
+    _In_ PARCHIVE_SLOT Slot)
+{
+    PARCHIVE Archive = Context->Archive;
+    LARGE_INTEGER FileOffset;
+    NTSTATUS Status;
+
+    if (Context->NextBlock >= Archive->Header.BlockCount)
+        return STATUS_SUCCESS;
+
+    Slot->Block = Context->NextBlock++;
+    Slot->Length = GetArchiveBlockLength(&Archive->Header, Slot->Block);
+
+    if (Context->bImport)
+    {
+        /* The archive is read in order, which keeps it sequential on its disk */
+        Slot->Entry = Archive->Blocks[Slot->Block];
+        Status = LoadArchiveBlock(Archive, &Slot->Entry, Slot->Data, Slot->Packed);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        Slot->State = ArchiveSlotReady;
+        return STATUS_SUCCESS;
+    }
+
+    Slot->State = ArchiveSlotReading;
+
+    FileOffset.QuadPart = Context->Offset + (Slot->Block * Archive->Header.BlockSize);
+    Status = NtReadFile(Context->DiskHandle,
+                        Slot->Event,
+                        NULL,
+                        NULL,
+                        &Slot->Iosb,
+                        Slot->Data,
+                        Slot->Length,
+                        &FileOffset,
+                        NULL);
+    if ((Status != STATUS_PENDING) && !NT_SUCCESS(Status))
+    {
+        Slot->State = ArchiveSlotFree;
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/* Appends the packed block to the archive and records it in the index */
+static
+NTSTATUS
+StoreArchiveBlock(
+    _In_ PARCHIVE_CONTEXT Context,
+    _In_ PARCHIVE_SLOT Slot)
+{
+    LARGE_INTEGER FileOffset;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    if (Slot->Entry.Flags & ARCHIVE_BLOCK_ZERO)
+    {
+        Context->ZeroBlocks++;
+    }
+    else
+    {
+        FileOffset.QuadPart = Context->FileOffset;
+        Status = NtWriteFile(Context->Archive->FileHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &Iosb,
+                             (Slot->Entry.Flags & ARCHIVE_BLOCK_COMPRESSED) ? Slot->Packed : Slot->Data,
+                             Slot->Entry.StoredLength,
+                             &FileOffset,
+                             NULL);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        Slot->Entry.Offset = Context->FileOffset;
+        Context->FileOffset += Slot->Entry.StoredLength;
+    }
+
+    Context->Archive->Blocks[Slot->Block] = Slot->Entry;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * The boot sector of the archive holds the start sector of the partition it
+ * was taken from. It gets the start of the partition it is imported to.
+ */
+static
+VOID
+FixArchiveBootSector(
+    _In_ PARCHIVE_CONTEXT Context,
+    _In_ PARCHIVE_SLOT Slot)
+{
+    if ((Slot->Block == 0) &&
+        (*(PUSHORT)&Slot->Data[510] == 0xAA55) &&
+        (*(PULONG)&Slot->Data[0x1C] != 0))
+    {
+        *(PULONG)&Slot->Data[0x1C] = Context->HiddenSectors;
+    }
+}
+
+
+static
+NTSTATUS
+SubmitArchiveWrite(
+    _In_ PARCHIVE_CONTEXT Context,
+    _In_ PARCHIVE_SLOT Slot)
+{
+    LARGE_INTEGER FileOffset;
+    NTSTATUS Status;
+
+    FixArchiveBootSector(Context, Slot);
+
+    Slot->State = ArchiveSlotWriting;
+
+    FileOffset.QuadPart = Context->Offset + (Slot->Block * Context->Archive->Header.BlockSize);
+    Status = NtWriteFile(Context->DiskHandle,
+                         Slot->Event,
+                         NULL,
+                         NULL,
+                         &Slot->Iosb,
+                         Slot->Data,
+                         Slot->Length,
+                         &FileOffset,
+                         NULL);
+    if ((Status != STATUS_PENDING) && !NT_SUCCESS(Status))
+    {
+        Slot->State = ArchiveSlotFree;
+        return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/* Hands the blocks that are ready to idle workers */
+static
+VOID
+DispatchArchiveSlots(
+    _In_ PARCHIVE_CONTEXT Context)
+{
+    ULONG SlotIndex, WorkerIndex = 0;
+
+    for (SlotIndex = 0; SlotIndex < Context->SlotCount; SlotIndex++)
+    {
+        if (Context->Slots[SlotIndex].State != ArchiveSlotReady)
+            continue;
+
+        while ((WorkerIndex < Context->WorkerCount) &&
+               (Context->Workers[WorkerIndex].Slot != NULL))
+        {
+            WorkerIndex++;
+        }
+
+        if (WorkerIndex == Context->WorkerCount)
+            return;
+
+        Context->Slots[SlotIndex].State = ArchiveSlotPacking;
+        Context->Workers[WorkerIndex].Slot = &Context->Slots[SlotIndex];
+        NtSetEvent(Context->Workers[WorkerIndex].WorkEvent, NULL);
+    }
+}
+
+
+/*
+ * The disk I/O is issued from this thread and overlaps with itself, while
+ * the workers compress or decompress the blocks. Every slot and every
+ * worker has its own event, so a single wait covers both. The archive file
+ * is written or read synchronously from this thread, in block order on
+ * import and in completion order on export.
+ */
+static
+NTSTATUS
+RunArchive(
+    _In_ PARCHIVE_CONTEXT Context)
+{
+    HANDLE WaitHandles[ARCHIVE_MAX_SLOTS + ARCHIVE_MAX_WORKERS];
+    PVOID WaitObjects[ARCHIVE_MAX_SLOTS + ARCHIVE_MAX_WORKERS];
+    ULONG WaitCount, ulSlotWaits, Index, ulPercent, ulLastPercent = 0;
+    PARCHIVE_SLOT Slot;
+    PARCHIVE_WORKER Worker;
+    NTSTATUS Status, IoStatus = STATUS_SUCCESS;
+
+    for (;;)
+    {
+        if (NT_SUCCESS(IoStatus))
+        {
+            for (Index = 0; Index < Context->SlotCount; Index++)
+            {
+                if (Context->Slots[Index].State != ArchiveSlotFree)
+                    continue;
+
+                IoStatus = StartArchiveBlock(Context, &Context->Slots[Index]);
+                if (!NT_SUCCESS(IoStatus))
+                {
+                    DPRINT1("Archive read failed (Status 0x%08lx)\n", IoStatus);
+                    break;
+                }
+            }
+        }
+
+        if (NT_SUCCESS(IoStatus))
+            DispatchArchiveSlots(Context);
+
+        WaitCount = 0;
+        for (Index = 0; Index < Context->SlotCount; Index++)
+        {
+            if ((Context->Slots[Index].State == ArchiveSlotReading) ||
+                (Context->Slots[Index].State == ArchiveSlotWriting))
+            {
+                WaitHandles[WaitCount] = Context->Slots[Index].Event;
+                WaitObjects[WaitCount++] = &Context->Slots[Index];
+            }
+        }
+
+        ulSlotWaits = WaitCount;
+        for (Index = 0; Index < Context->WorkerCount; Index++)
+        {
+            if (Context->Workers[Index].Slot != NULL)
+            {
+                WaitHandles[WaitCount] = Context->Workers[Index].DoneEvent;
+                WaitObjects[WaitCount++] = &Context->Workers[Index];
+            }
+        }
+
+        if (WaitCount == 0)
+            break;
+
+        Status = NtWaitForMultipleObjects(WaitCount,
+                                          WaitHandles,
+                                          WaitAny,
+                                          FALSE,
+                                          NULL);
+        if ((Status < STATUS_WAIT_0) || (Status >= STATUS_WAIT_0 + WaitCount))
+        {
+            DPRINT1("NtWaitForMultipleObjects() failed (Status 0x%08lx)\n", Status);
+            IoStatus = Status;
+
+            /* Never release buffers that are still owned by pending requests or workers */
+            for (Index = 0; Index < WaitCount; Index++)
+                NtWaitForSingleObject(WaitHandles[Index], FALSE, NULL);
+            break;
+        }
+
+        Index = Status - STATUS_WAIT_0;
+
+        if (Index < ulSlotWaits)
+        {
+            /* A disk read or write has completed */
+            Slot = WaitObjects[Index];
+            Status = Slot->Iosb.Status;
+            if (NT_SUCCESS(Status) && (Slot->Iosb.Information < Slot->Length))
+                Status = STATUS_END_OF_FILE;
+
+            if (!NT_SUCCESS(Status))
+            {
+                DPRINT1("Archive disk I/O failed (Status 0x%08lx)\n", Status);
+                IoStatus = Status;
+                Slot->State = ArchiveSlotFree;
+                continue;
+            }
+
+            if (Slot->State == ArchiveSlotReading)
+            {
+                Slot->State = ArchiveSlotReady;
+                continue;
+            }
+        }
+        else
+        {
+            /* A worker has packed or unpacked its block */
+            Worker = WaitObjects[Index];
+            Slot = Worker->Slot;
+            Worker->Slot = NULL;
+
+            if (!NT_SUCCESS(IoStatus))
+            {
+                Slot->State = ArchiveSlotFree;
+                continue;
+            }
+
+            Status = Slot->Status;
+            if (NT_SUCCESS(Status))
+            {
+                if (Context->bImport)
+                {
+                    Status = SubmitArchiveWrite(Context, Slot);
+                    if (NT_SUCCESS(Status))
+                        continue;
+                }
+                else
+                {
+                    Status = StoreArchiveBlock(Context, Slot);
+                }
+            }
+
+            if (!NT_SUCCESS(Status))
+            {
+                DPRINT1("Archive block %I64u failed (Status 0x%08lx)\n", Slot->Block, Status);
+                IoStatus = Status;
+                Slot->State = ArchiveSlotFree;
+                continue;
+            }
+        }
+
+        /* The block is on the disk or in the archive */
+        Slot->State = ArchiveSlotFree;
+        Context->BlocksDone++;
+
+        ulPercent = (ULONG)((Context->BlocksDone * 100) / Context->Archive->Header.BlockCount);
+        if (ulPercent != ulLastPercent)
+        {
+            ConResPrintf(StdOut, Context->bImport ? IDS_IMPORT_PROGRESS : IDS_EXPORT_PROGRESS, ulPercent);
+            ulLastPercent = ulPercent;
+        }
+    }
+
+    return IoStatus;
+}
+
+
+static
+ULONG
+GetArchiveWorkerCount(VOID)
+{
+    SYSTEM_BASIC_INFORMATION BasicInfo;
+    NTSTATUS Status;
+
+    Status = NtQuerySystemInformation(SystemBasicInformation,
+                                      &BasicInfo,
+                                      sizeof(BasicInfo),
+                                      NULL);
+    if (!NT_SUCCESS(Status) || (BasicInfo.NumberOfProcessors < 1))
+        return 1;
+
+    return min((ULONG)BasicInfo.NumberOfProcessors, ARCHIVE_MAX_WORKERS);
+}
+
+
+static
+NTSTATUS
+StartArchiveWorkers(
+    _In_ PARCHIVE_CONTEXT Context)
+{
+    PARCHIVE_WORKER Worker;
+    ULONG WorkSpaceSize = 0, FragmentSize;
+    NTSTATUS Status;
+    ULONG Index;
+
+    if (!Context->bImport &&
+        (Context->Archive->Header.Compression != COMPRESSION_FORMAT_NONE))
+    {
+        Status = RtlGetCompressionWorkSpaceSize(Context->Format, &WorkSpaceSize, &FragmentSize);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("RtlGetCompressionWorkSpaceSize() failed (Status 0x%08lx)\n", Status);
+            return Status;
+        }
+    }
+
+    for (Index = 0; Index < Context->WorkerCount; Index++)
+    {
+        Worker = &Context->Workers[Index];
+        Worker->Context = Context;
+
+        if (WorkSpaceSize != 0)
+        {
+            Worker->WorkSpace = RtlAllocateHeap(RtlGetProcessHeap(), 0, WorkSpaceSize);
+            if (Worker->WorkSpace == NULL)
+                return STATUS_NO_MEMORY;
+        }
+
+        Status = NtCreateEvent(&Worker->WorkEvent,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               SynchronizationEvent,
+                               FALSE);
+        if (NT_SUCCESS(Status))
+        {
+            Status = NtCreateEvent(&Worker->DoneEvent,
+                                   EVENT_ALL_ACCESS,
+                                   NULL,
+                                   SynchronizationEvent,
+                                   FALSE);
+        }
+
+        if (NT_SUCCESS(Status))
+        {
+            Status = RtlCreateUserThread(NtCurrentProcess(),
+                                         NULL,
+                                         FALSE,
+                                         0,
+                                         0,
+                                         0,
+                                         ArchiveWorkerThread,
+                                         Worker,
+                                         &Worker->Thread,
+                                         NULL);
+        }
+
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Starting archive worker %lu failed (Status 0x%08lx)\n", Index, Status);
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+StopArchiveWorkers(
+    _In_ PARCHIVE_CONTEXT Context)
+{
+    PARCHIVE_WORKER Worker;
+    ULONG Index;
+
+    for (Index = 0; Index < Context->WorkerCount; Index++)
+    {
+        Worker = &Context->Workers[Index];
+
+        if (Worker->Thread != NULL)
+        {
+            Worker->Slot = NULL;
+            NtSetEvent(Worker->WorkEvent, NULL);
+            NtWaitForSingleObject(Worker->Thread, FALSE, NULL);
+            NtClose(Worker->Thread);
+        }
+
+        if (Worker->DoneEvent != NULL)
+            NtClose(Worker->DoneEvent);
+
+        if (Worker->WorkEvent != NULL)
+            NtClose(Worker->WorkEvent);
+
+        if (Worker->WorkSpace != NULL)
+            RtlFreeHeap(RtlGetProcessHeap(), 0, Worker->WorkSpace);
+    }
+}
+
+
+/*
+ * Sets up the slots and the workers, runs the transfer and tears everything
+ * down again. Each slot owns a block buffer and a packed buffer.
+ */
+static
+NTSTATUS
+TransferArchive(
+    _In_ PARCHIVE_CONTEXT Context,
+    _Out_ PULONGLONG pullElapsedMs)
+{
+    PVOID BufferBase = NULL;
+    SIZE_T BufferSize;
+    LARGE_INTEGER Frequency, StartTime, Now;
+    NTSTATUS Status;
+    ULONG Index;
+
+    Context->WorkerCount = GetArchiveWorkerCount();
+    Context->SlotCount = min(max(Context->WorkerCount * 2, 4), ARCHIVE_MAX_SLOTS);
+
+    /* Page aligned buffers satisfy the alignment rules of unbuffered I/O */
+    BufferSize = (SIZE_T)ARCHIVE_BLOCK_SIZE * 2 * Context->SlotCount;
+    Status = NtAllocateVirtualMemory(NtCurrentProcess(),
+                                     &BufferBase,
+                                     0,
+                                     &BufferSize,
+                                     MEM_RESERVE | MEM_COMMIT,
+                                     PAGE_READWRITE);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtAllocateVirtualMemory() failed (Status 0x%08lx)\n", Status);
+        return Status;
+    }
+
+    for (Index = 0; Index < Context->SlotCount; Index++)
+    {
+        Context->Slots[Index].Data = (PUCHAR)BufferBase + ((SIZE_T)Index * 2 * ARCHIVE_BLOCK_SIZE);
+        Context->Slots[Index].Packed = Context->Slots[Index].Data + ARCHIVE_BLOCK_SIZE;
+
+        Status = NtCreateEvent(&Context->Slots[Index].Event,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               NotificationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("NtCreateEvent() failed (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+    }
+
+    Status = StartArchiveWorkers(Context);
+    if (NT_SUCCESS(Status))
+    {
+        NtQueryPerformanceCounter(&StartTime, &Frequency);
+        Status = RunArchive(Context);
+        NtQueryPerformanceCounter(&Now, NULL);
+
+        *pullElapsedMs = ((ULONGLONG)(Now.QuadPart - StartTime.QuadPart) * 1000) / Frequency.QuadPart;
+        if (*pullElapsedMs == 0)
+            *pullElapsedMs = 1;
+    }
+
+    StopArchiveWorkers(Context);
+
+done:
+    for (Index = 0; Index < Context->SlotCount; Index++)
+    {
+        if (Context->Slots[Index].Event != NULL)
+            NtClose(Context->Slots[Index].Event);
+    }
+
+    BufferSize = 0;
+    NtFreeVirtualMemory(NtCurrentProcess(), &BufferBase, &BufferSize, MEM_RELEASE);
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+OpenArchiveDisk(
+    _In_ ULONG DiskNumber,
+    _In_ ULONG PartitionNumber,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG OpenOptions,
+    _Out_ PHANDLE FileHandle)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition%lu",
+                     DiskNumber,
+                     PartitionNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    return NtOpenFile(FileHandle,
+                      DesiredAccess,
+                      &ObjectAttributes,
+                      &Iosb,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      OpenOptions);
+}
+
+
+/*
+ * Locks and dismounts the volume on the partition, so the file system does
+ * not see its data change underneath it. The returned handle keeps the lock.
+ */
+static
+NTSTATUS
+LockArchivePartition(
+    _Out_ PHANDLE VolumeHandle)
+{
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Status = OpenArchiveDisk(CurrentDisk->DiskNumber,
+                             CurrentPartition->PartitionNumber,
+                             GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
+                             FILE_SYNCHRONOUS_IO_NONALERT,
+                             VolumeHandle);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtFsControlFile(*VolumeHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &Iosb,
+                             FSCTL_LOCK_VOLUME,
+                             NULL,
+                             0,
+                             NULL,
+                             0);
+    if (NT_SUCCESS(Status))
+    {
+        Status = NtFsControlFile(*VolumeHandle,
+                                 NULL,
+                                 NULL,
+                                 NULL,
+                                 &Iosb,
+                                 FSCTL_DISMOUNT_VOLUME,
+                                 NULL,
+                                 0,
+                                 NULL,
+                                 0);
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        NtClose(*VolumeHandle);
+        *VolumeHandle = NULL;
+    }
+
+    return Status;
+}
+
+
+static
+BOOL
+IsArchivePartition(VOID)
+{
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return FALSE;
+    }
+
+    if (CurrentPartition == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+        return FALSE;
+    }
+
+    if ((CurrentPartition->PartitionNumber == 0) ||
+        ((CurrentDisk->PartitionStyle == PARTITION_STYLE_MBR) &&
+         IsContainerPartition(CurrentPartition->Mbr.PartitionType)))
+    {
+        ConResPuts(StdOut, IDS_ARCHIVE_PARTITION_TYPE);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* Writes the index behind the stored blocks, then the final header */
+static
+NTSTATUS
+WriteArchiveIndex(
+    _In_ PARCHIVE_CONTEXT Context)
+{
+    PARCHIVE Archive = Context->Archive;
+    LARGE_INTEGER FileOffset;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Archive->Header.IndexOffset = Context->FileOffset;
+
+    FileOffset.QuadPart = Archive->Header.IndexOffset;
+    Status = NtWriteFile(Archive->FileHandle,
+                         NULL,
+                         NULL,
+                         NULL,
+                         &Iosb,
+                         Archive->Blocks,
+                         (ULONG)(Archive->Header.BlockCount * sizeof(ARCHIVE_BLOCK)),
+                         &FileOffset,
+                         NULL);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    FileOffset.QuadPart = 0;
+    return NtWriteFile(Archive->FileHandle,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &Iosb,
+                       &Archive->Header,
+                       sizeof(Archive->Header),
+                       &FileOffset,
+                       NULL);
+}
+
+
+EXIT_CODE
+ExportPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    ARCHIVE_CONTEXT Context;
+    PWSTR pszFile = NULL, pszSuffix = NULL;
+    USHORT Compression = COMPRESSION_FORMAT_LZNT1;
+    USHORT Engine = COMPRESSION_ENGINE_STANDARD;
+    ULONGLONG ullElapsedMs = 0, ullLength;
+    LARGE_INTEGER FileOffset;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+    INT i;
+
+    DPRINT("ExportPartition()\n");
+
+    RtlZeroMemory(&Context, sizeof(Context));
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"file=", &pszSuffix))
+        {
+            /* file=<file> */
+            if (pszFile != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszFile);
+
+            pszFile = DuplicateQuotedString(pszSuffix);
+            if (pszFile == NULL)
+                goto invalid;
+        }
+        else if (HasPrefix(argv[i], L"compress=", &pszSuffix))
+        {
+            /* compress=lznt1|none */
+            if (_wcsicmp(pszSuffix, L"lznt1") == 0)
+                Compression = COMPRESSION_FORMAT_LZNT1;
+            else if (_wcsicmp(pszSuffix, L"none") == 0)
+                Compression = COMPRESSION_FORMAT_NONE;
+            else
+                goto invalid;
+        }
+        else if (HasPrefix(argv[i], L"level=", &pszSuffix))
+        {
+            /* level=1|2 */
+            if (wcscmp(pszSuffix, L"1") == 0)
+                Engine = COMPRESSION_ENGINE_STANDARD;
+            else if (wcscmp(pszSuffix, L"2") == 0)
+                Engine = COMPRESSION_ENGINE_MAXIMUM;
+            else
+                goto invalid;
+        }
+        else
+        {
+            goto invalid;
+        }
+    }
+
+    if (pszFile == NULL)
+        goto invalid;
+
+    if (!IsArchivePartition())
+        goto done;
+
+    ullLength = CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+
+    Status = CreateArchive(Compression, CurrentDisk->BytesPerSector, ullLength, &Context.Archive);
+    if (NT_SUCCESS(Status))
+        Status = OpenArchiveFile(pszFile, FILE_OVERWRITE_IF, &Context.Archive->FileHandle);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Creating the archive failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_EXPORT_FAIL);
+        goto done;
+    }
+
+    /* The header is written again once the index is known */
+    FileOffset.QuadPart = 0;
+    Status = NtWriteFile(Context.Archive->FileHandle,
+                         NULL,
+                         NULL,
+                         NULL,
+                         &Iosb,
+                         &Context.Archive->Header,
+                         sizeof(Context.Archive->Header),
+                         &FileOffset,
+                         NULL);
+    if (NT_SUCCESS(Status))
+    {
+        /* No FILE_SYNCHRONOUS_IO_* option: the reads are overlapped */
+        Status = OpenArchiveDisk(CurrentDisk->DiskNumber,
+                                 0,
+                                 GENERIC_READ,
+                                 FILE_NO_INTERMEDIATE_BUFFERING,
+                                 &Context.DiskHandle);
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        Context.Format = Compression | Engine;
+        Context.Offset = CurrentPartition->StartSector.QuadPart * CurrentDisk->BytesPerSector;
+        Context.FileOffset = sizeof(ARCHIVE_HEADER);
+
+        Status = TransferArchive(&Context, &ullElapsedMs);
+    }
+
+    if (NT_SUCCESS(Status))
+        Status = WriteArchiveIndex(&Context);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Export failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_EXPORT_FAIL);
+        goto done;
+    }
+
+    ConResPrintf(StdOut, IDS_EXPORT_RESULT,
+                 ullLength / (SIZE_1KB * SIZE_1KB),
+                 (Context.Archive->Header.IndexOffset + SIZE_1KB * SIZE_1KB - 1) / (SIZE_1KB * SIZE_1KB),
+                 Context.ZeroBlocks,
+                 Context.Archive->Header.BlockCount,
+                 ullElapsedMs,
+                 ((ullLength / SIZE_1KB) * 1000) / ullElapsedMs / 1024,
+                 Context.WorkerCount);
+    goto done;
+
+invalid:
+    ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+
+done:
+    if (Context.DiskHandle != NULL)
+        NtClose(Context.DiskHandle);
+
+    if (Context.Archive != NULL)
+        CloseArchive(Context.Archive);
+
+    if (pszFile != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszFile);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+ImportPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    ARCHIVE_CONTEXT Context;
+    PWSTR pszFile = NULL, pszSuffix = NULL;
+    ULONGLONG ullElapsedMs = 0;
+    HANDLE VolumeHandle = NULL;
+    NTSTATUS Status;
+    INT i;
+
+    DPRINT("ImportPartition()\n");
+
+    RtlZeroMemory(&Context, sizeof(Context));
+    Context.bImport = TRUE;
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"file=", &pszSuffix))
+        {
+            /* file=<file> */
+            if (pszFile != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszFile);
+
+            pszFile = DuplicateQuotedString(pszSuffix);
+            if (pszFile == NULL)
+                goto invalid;
+        }
+        else
+        {
+            goto invalid;
+        }
+    }
+
+    if (pszFile == NULL)
+        goto invalid;
+
+    if (!IsArchivePartition())
+        goto done;
+
+    Status = OpenArchive(pszFile, &Context.Archive);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("OpenArchive() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, (Status == STATUS_FILE_CORRUPT_ERROR) ? IDS_IMPORT_INVALID : IDS_IMPORT_FAIL);
+        goto done;
+    }
+
+    if ((Context.Archive->Header.Length == 0) ||
+        (Context.Archive->Header.Length > CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector) ||
+        ((Context.Archive->Header.Length % CurrentDisk->BytesPerSector) != 0))
+    {
+        ConResPuts(StdOut, IDS_IMPORT_TOO_LARGE);
+        goto done;
+    }
+
+    Status = LockArchivePartition(&VolumeHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("LockArchivePartition() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_IMPORT_IN_USE);
+        goto done;
+    }
+
+    /* The locked volume only accepts I/O on the handle that holds the lock */
+    Status = OpenArchiveDisk(CurrentDisk->DiskNumber,
+                             0,
+                             GENERIC_READ | GENERIC_WRITE,
+                             FILE_NO_INTERMEDIATE_BUFFERING,
+                             &Context.DiskHandle);
+    if (NT_SUCCESS(Status))
+    {
+        Context.Offset = CurrentPartition->StartSector.QuadPart * CurrentDisk->BytesPerSector;
+        Context.HiddenSectors = CurrentPartition->StartSector.LowPart;
+
+        Status = TransferArchive(&Context, &ullElapsedMs);
+    }
+
+    NtClose(VolumeHandle);
+
+    /* The partition may hold a different file system now */
+    RescanAndSelect(CurrentDisk->DiskNumber, CurrentPartition->StartSector.QuadPart);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Import failed (Status 0x%08lx)\n", Status);
+        if ((Status == STATUS_CRC_ERROR) || (Status == STATUS_FILE_CORRUPT_ERROR))
+            ConResPuts(StdOut, IDS_IMPORT_INVALID);
+        else
+            ConResPuts(StdOut, IDS_IMPORT_FAIL);
+        goto done;
+    }
+
+    ConResPrintf(StdOut, IDS_IMPORT_RESULT,
+                 Context.Archive->Header.Length / (SIZE_1KB * SIZE_1KB),
+                 Context.Archive->Header.BlockCount,
+                 ullElapsedMs,
+                 ((Context.Archive->Header.Length / SIZE_1KB) * 1000) / ullElapsedMs / 1024,
+                 Context.WorkerCount);
+    goto done;
+
+invalid:
+    ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+
+done:
+    if (Context.DiskHandle != NULL)
+        NtClose(Context.DiskHandle);
+
+    if (Context.Archive != NULL)
+        CloseArchive(Context.Archive);
+
+    if (pszFile != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszFile);
+
+    return EXIT_SUCCESS;
+}
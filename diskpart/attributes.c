@@ -8,10 +8,641 @@
 
 #include "diskpart.h"
 
+#define NDEBUG
+#include <debug.h>
+
+/* Block Limits VPD page, 0x3C bytes after the 4-byte header */
+#define VPD_BLOCK_LIMITS        0xB0
+
+typedef struct _BLOCK_LIMITS_REQUEST
+{
+    SCSI_PASS_THROUGH PassThrough;
+    UCHAR SenseBuffer[32];
+    UCHAR DataBuffer[64];
+} BLOCK_LIMITS_REQUEST;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+NTSTATUS
+OpenDiskDevice(
+    _In_ ULONG DiskNumber,
+    _In_ ACCESS_MASK DesiredAccess,
+    _Out_ PHANDLE FileHandle)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition0",
+                     DiskNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    return NtOpenFile(FileHandle,
+                      DesiredAccess | SYNCHRONIZE,
+                      &ObjectAttributes,
+                      &Iosb,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      FILE_SYNCHRONOUS_IO_NONALERT);
+}
+
+
+BOOL
+QueryStorageProperty(
+    _In_ HANDLE FileHandle,
+    _In_ STORAGE_PROPERTY_ID PropertyId,
+    _Out_ PVOID Buffer,
+    _In_ ULONG BufferSize)
+{
+    STORAGE_PROPERTY_QUERY Query;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Query.PropertyId = PropertyId;
+    Query.QueryType = PropertyStandardQuery;
+
+    RtlZeroMemory(Buffer, BufferSize);
+
+    Status = NtDeviceIoControlFile(FileHandle,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_STORAGE_QUERY_PROPERTY,
+                                   &Query,
+                                   sizeof(Query),
+                                   Buffer,
+                                   BufferSize);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT("IOCTL_STORAGE_QUERY_PROPERTY(%lu) failed (Status 0x%08lx)\n", PropertyId, Status);
+        return FALSE;
+    }
+
+    return (Iosb.Information >= BufferSize);
+}
+
+
+/*
+ * Reads the optimal transfer length and its granularity, in logical blocks,
+ * from the Block Limits VPD page (SBC-3). RAID controllers report their full
+ * stripe and their stripe unit there; the storage property queries have no
+ * such field. Both stay 0 if the device does not report them.
+ */
+BOOL
+QueryBlockLimits(
+    _In_ ULONG DiskNumber,
+    _Out_ PULONG pulGranularity,
+    _Out_ PULONG pulOptimalLength)
+{
+    BLOCK_LIMITS_REQUEST Request;
+    IO_STATUS_BLOCK Iosb;
+    HANDLE FileHandle;
+    PUCHAR Page = Request.DataBuffer;
+    NTSTATUS Status;
+
+    *pulGranularity = 0;
+    *pulOptimalLength = 0;
+
+    /* Pass-through requests need read and write access */
+    Status = OpenDiskDevice(DiskNumber, FILE_READ_DATA | FILE_WRITE_DATA, &FileHandle);
+    if (!NT_SUCCESS(Status))
+        return FALSE;
+
+    RtlZeroMemory(&Request, sizeof(Request));
+    Request.PassThrough.Length = sizeof(SCSI_PASS_THROUGH);
+    Request.PassThrough.CdbLength = 6;
+    Request.PassThrough.SenseInfoLength = sizeof(Request.SenseBuffer);
+    Request.PassThrough.DataIn = SCSI_IOCTL_DATA_IN;
+    Request.PassThrough.DataTransferLength = sizeof(Request.DataBuffer);
+    Request.PassThrough.TimeOutValue = 5;
+    Request.PassThrough.DataBufferOffset = FIELD_OFFSET(BLOCK_LIMITS_REQUEST, DataBuffer);
+    Request.PassThrough.SenseInfoOffset = FIELD_OFFSET(BLOCK_LIMITS_REQUEST, SenseBuffer);
+
+    /* INQUIRY with EVPD set */
+    Request.PassThrough.Cdb[0] = 0x12;
+    Request.PassThrough.Cdb[1] = 0x01;
+    Request.PassThrough.Cdb[2] = VPD_BLOCK_LIMITS;
+    Request.PassThrough.Cdb[4] = sizeof(Request.DataBuffer);
+
+    Status = NtDeviceIoControlFile(FileHandle,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_SCSI_PASS_THROUGH,
+                                   &Request,
+                                   sizeof(Request),
+                                   &Request,
+                                   sizeof(Request));
+    NtClose(FileHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT("IOCTL_SCSI_PASS_THROUGH failed (Status 0x%08lx)\n", Status);
+        return FALSE;
+    }
+
+    /* The optimal transfer length ends at byte 15 of the page */
+    if ((Request.PassThrough.ScsiStatus != 0) ||
+        (Request.PassThrough.DataTransferLength < 16) ||
+        (Page[1] != VPD_BLOCK_LIMITS) ||
+        (((Page[2] << 8) | Page[3]) < 12))
+    {
+        return FALSE;
+    }
+
+    *pulGranularity = ((ULONG)Page[6] << 8) | Page[7];
+    *pulOptimalLength = ((ULONG)Page[12] << 24) | ((ULONG)Page[13] << 16) |
+                        ((ULONG)Page[14] << 8) | Page[15];
+
+    return TRUE;
+}
+
+
+static
+BOOL
+GetCacheInformation(
+    _In_ HANDLE FileHandle,
+    _Out_ PDISK_CACHE_INFORMATION CacheInfo)
+{
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Status = NtDeviceIoControlFile(FileHandle,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_DISK_GET_CACHE_INFORMATION,
+                                   NULL,
+                                   0,
+                                   CacheInfo,
+                                   sizeof(DISK_CACHE_INFORMATION));
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT("IOCTL_DISK_GET_CACHE_INFORMATION failed (Status 0x%08lx)\n", Status);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Queries the storage stack settings that govern the throughput of a disk.
+ * Settings the driver does not report are flagged as invalid.
+ */
+BOOL
+QueryDiskSettings(
+    _In_ PDISKENTRY DiskEntry,
+    _Out_ PDISK_SETTINGS Settings)
+{
+    STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR AlignmentDescriptor;
+    STORAGE_ADAPTER_DESCRIPTOR AdapterDescriptor;
+    DEVICE_SEEK_PENALTY_DESCRIPTOR SeekPenaltyDescriptor;
+    DEVICE_TRIM_DESCRIPTOR TrimDescriptor;
+    HANDLE FileHandle;
+    NTSTATUS Status;
+
+    RtlZeroMemory(Settings, sizeof(DISK_SETTINGS));
+
+    Status = OpenDiskDevice(DiskEntry->DiskNumber, FILE_READ_ATTRIBUTES, &FileHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        return FALSE;
+    }
+
+    if (QueryStorageProperty(FileHandle,
+                             StorageAccessAlignmentProperty,
+                             &AlignmentDescriptor,
+                             sizeof(AlignmentDescriptor)))
+    {
+        Settings->AlignmentValid = TRUE;
+        Settings->LogicalSectorSize = AlignmentDescriptor.BytesPerLogicalSector;
+        Settings->PhysicalSectorSize = AlignmentDescriptor.BytesPerPhysicalSector;
+        Settings->AlignmentOffset = AlignmentDescriptor.BytesOffsetForSectorAlignment;
+    }
+    else
+    {
+        Settings->LogicalSectorSize = DiskEntry->BytesPerSector;
+        Settings->PhysicalSectorSize = DiskEntry->BytesPerSector;
+    }
+
+    if (QueryStorageProperty(FileHandle,
+                             StorageAdapterProperty,
+                             &AdapterDescriptor,
+                             sizeof(AdapterDescriptor)))
+    {
+        Settings->AdapterValid = TRUE;
+        Settings->MaximumTransferLength = AdapterDescriptor.MaximumTransferLength;
+        Settings->CommandQueueing = AdapterDescriptor.CommandQueueing;
+    }
+
+    if (QueryStorageProperty(FileHandle,
+                             StorageDeviceSeekPenaltyProperty,
+                             &SeekPenaltyDescriptor,
+                             sizeof(SeekPenaltyDescriptor)))
+    {
+        Settings->SeekPenaltyValid = TRUE;
+        Settings->IncursSeekPenalty = SeekPenaltyDescriptor.IncursSeekPenalty;
+    }
+
+    if (QueryStorageProperty(FileHandle,
+                             StorageDeviceTrimProperty,
+                             &TrimDescriptor,
+                             sizeof(TrimDescriptor)))
+    {
+        Settings->TrimValid = TRUE;
+        Settings->TrimEnabled = TrimDescriptor.TrimEnabled;
+    }
+
+    Settings->CacheValid = GetCacheInformation(FileHandle, &Settings->CacheInfo);
+
+    NtClose(FileHandle);
+
+    return TRUE;
+}
+
+
+static
+USHORT
+GetReadAhead(
+    _In_ PDISK_CACHE_INFORMATION CacheInfo)
+{
+    if (CacheInfo->DisablePrefetchTransferLength == 0)
+        return 0;
+
+    if (CacheInfo->PrefetchScalar)
+        return CacheInfo->ScalarPrefetch.MaximumBlocks;
+
+    return CacheInfo->BlockPrefetch.Maximum;
+}
+
+
+static
+VOID
+PrintYesNo(
+    _In_ INT nFormatId,
+    _In_ BOOL bValid,
+    _In_ BOOL bValue)
+{
+    WCHAR szBuffer[40];
+
+    LoadStringW(GetModuleHandle(NULL),
+                !bValid ? IDS_STATUS_UNAVAILABLE : (bValue ? IDS_STATUS_YES : IDS_STATUS_NO),
+                szBuffer, ARRAYSIZE(szBuffer));
+    ConResPrintf(StdOut, nFormatId, szBuffer);
+}
+
+
+VOID
+PrintDiskSettings(
+    _In_ PDISKENTRY DiskEntry)
+{
+    DISK_SETTINGS Settings;
+
+    if (!QueryDiskSettings(DiskEntry, &Settings))
+        return;
+
+    ConPuts(StdOut, L"\n");
+    ConResPrintf(StdOut, IDS_DETAIL_INFO_SECTOR_SIZE,
+                 Settings.LogicalSectorSize,
+                 Settings.PhysicalSectorSize);
+    if (Settings.AlignmentValid)
+        ConResPrintf(StdOut, IDS_DETAIL_INFO_ALIGNMENT_OFFSET, Settings.AlignmentOffset);
+    ConResPrintf(StdOut, IDS_DETAIL_INFO_PARTITION_ALIGNMENT,
+                 (DiskEntry->SectorAlignment * DiskEntry->BytesPerSector) / 1024);
+    if (Settings.AdapterValid)
+        ConResPrintf(StdOut, IDS_DETAIL_INFO_MAX_TRANSFER, Settings.MaximumTransferLength / 1024);
+    PrintYesNo(IDS_DETAIL_INFO_QUEUEING, Settings.AdapterValid, Settings.CommandQueueing);
+    PrintYesNo(IDS_DETAIL_INFO_ROTATIONAL, Settings.SeekPenaltyValid, Settings.IncursSeekPenalty);
+    PrintYesNo(IDS_DETAIL_INFO_READ_CACHE, Settings.CacheValid, Settings.CacheInfo.ReadCacheEnabled);
+    PrintYesNo(IDS_DETAIL_INFO_WRITE_CACHE, Settings.CacheValid, Settings.CacheInfo.WriteCacheEnabled);
+    if (Settings.CacheValid)
+        ConResPrintf(StdOut, IDS_DETAIL_INFO_READ_AHEAD, GetReadAhead(&Settings.CacheInfo));
+    PrintYesNo(IDS_DETAIL_INFO_TRIM, Settings.TrimValid, Settings.TrimEnabled);
+}
+
+
+static
+VOID
+SetReadAhead(
+    _Inout_ PDISK_CACHE_INFORMATION CacheInfo,
+    _In_ USHORT Blocks)
+{
+    if (Blocks == 0)
+    {
+        /* A zero transfer length turns prefetching off */
+        CacheInfo->DisablePrefetchTransferLength = 0;
+        return;
+    }
+
+    if (CacheInfo->DisablePrefetchTransferLength == 0)
+        CacheInfo->DisablePrefetchTransferLength = 0xFFFF;
+
+    CacheInfo->PrefetchScalar = FALSE;
+    CacheInfo->BlockPrefetch.Maximum = Blocks;
+    if (CacheInfo->BlockPrefetch.Minimum > Blocks)
+        CacheInfo->BlockPrefetch.Minimum = Blocks;
+}
+
+
+static
+BOOL
+ParseOnOff(
+    _In_ PWSTR pszValue,
+    _Out_ PBOOLEAN pbValue)
+{
+    if (_wcsicmp(pszValue, L"on") == 0)
+    {
+        *pbValue = TRUE;
+        return TRUE;
+    }
+
+    if (_wcsicmp(pszValue, L"off") == 0)
+    {
+        *pbValue = FALSE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/*
+ * Applies a single KEY=VALUE setting to the cache information.
+ * SET options and the lines of a saved profile share this syntax.
+ */
+static
+BOOL
+ApplyCacheSetting(
+    _Inout_ PDISK_CACHE_INFORMATION CacheInfo,
+    _In_ PWSTR pszSetting)
+{
+    PWSTR pszSuffix = NULL;
+    ULONG ulValue;
+
+    if (HasPrefix(pszSetting, L"readcache=", &pszSuffix))
+        return ParseOnOff(pszSuffix, &CacheInfo->ReadCacheEnabled);
+
+    if (HasPrefix(pszSetting, L"writecache=", &pszSuffix))
+        return ParseOnOff(pszSuffix, &CacheInfo->WriteCacheEnabled);
+
+    if (HasPrefix(pszSetting, L"readahead=", &pszSuffix))
+    {
+        if (!IsDecString(pszSuffix))
+            return FALSE;
+
+        ulValue = wcstoul(pszSuffix, NULL, 10);
+        if (ulValue > 0xFFFF)
+            return FALSE;
+
+        SetReadAhead(CacheInfo, (USHORT)ulValue);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+static
+BOOL
+SetCacheInformation(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PDISK_CACHE_INFORMATION CacheInfo)
+{
+    IO_STATUS_BLOCK Iosb;
+    HANDLE FileHandle;
+    NTSTATUS Status;
+
+    Status = OpenDiskDevice(DiskEntry->DiskNumber,
+                            FILE_READ_DATA | FILE_WRITE_DATA,
+                            &FileHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        return FALSE;
+    }
+
+    Status = NtDeviceIoControlFile(FileHandle,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_DISK_SET_CACHE_INFORMATION,
+                                   CacheInfo,
+                                   sizeof(DISK_CACHE_INFORMATION),
+                                   NULL,
+                                   0);
+    NtClose(FileHandle);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("IOCTL_DISK_SET_CACHE_INFORMATION failed (Status 0x%08lx)\n", Status);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static
 EXIT_CODE
-attributes_main(
+SetDiskAttributes(
     _In_ INT argc,
     _In_ PWSTR *argv)
 {
+    DISK_SETTINGS Settings;
+    INT i;
+
+    QueryDiskSettings(CurrentDisk, &Settings);
+    if (!Settings.CacheValid)
+    {
+        ConResPuts(StdOut, IDS_ATTRIBUTES_DISK_UNSUPPORTED);
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 3; i < argc; i++)
+    {
+        if (_wcsicmp(argv[i], L"noerr") == 0)
+            continue;
+
+        if (!ApplyCacheSetting(&Settings.CacheInfo, argv[i]))
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (!SetCacheInformation(CurrentDisk, &Settings.CacheInfo))
+    {
+        ConResPuts(StdOut, IDS_ATTRIBUTES_DISK_SET_FAIL);
+        return EXIT_SUCCESS;
+    }
+
+    ConResPuts(StdOut, IDS_ATTRIBUTES_DISK_SET_SUCCESS);
+
     return EXIT_SUCCESS;
 }
+
+
+static
+EXIT_CODE
+SaveDiskAttributes(
+    _In_ PWSTR pszFileName)
+{
+    DISK_SETTINGS Settings;
+    FILE *file;
+
+    QueryDiskSettings(CurrentDisk, &Settings);
+    if (!Settings.CacheValid)
+    {
+        ConResPuts(StdOut, IDS_ATTRIBUTES_DISK_UNSUPPORTED);
+        return EXIT_SUCCESS;
+    }
+
+    file = _wfopen(pszFileName, L"w");
+    if (file == NULL)
+    {
+        ConResPrintf(StdOut, IDS_ATTRIBUTES_DISK_FILE_FAIL, pszFileName);
+        return EXIT_SUCCESS;
+    }
+
+    /* One SET option per line, so that RESTORE can replay them */
+    fwprintf(file, L"readcache=%s\n", Settings.CacheInfo.ReadCacheEnabled ? L"on" : L"off");
+    fwprintf(file, L"writecache=%s\n", Settings.CacheInfo.WriteCacheEnabled ? L"on" : L"off");
+    fwprintf(file, L"readahead=%hu\n", GetReadAhead(&Settings.CacheInfo));
+    fclose(file);
+
+    ConResPrintf(StdOut, IDS_ATTRIBUTES_DISK_SAVED, pszFileName);
+
+    return EXIT_SUCCESS;
+}
+
+
+static
+EXIT_CODE
+RestoreDiskAttributes(
+    _In_ PWSTR pszFileName)
+{
+    DISK_SETTINGS Settings;
+    WCHAR szLine[MAX_STRING_SIZE];
+    PWSTR pszEnd;
+    FILE *file;
+    BOOL bValid = TRUE;
+
+    QueryDiskSettings(CurrentDisk, &Settings);
+    if (!Settings.CacheValid)
+    {
+        ConResPuts(StdOut, IDS_ATTRIBUTES_DISK_UNSUPPORTED);
+        return EXIT_SUCCESS;
+    }
+
+    file = _wfopen(pszFileName, L"r");
+    if (file == NULL)
+    {
+        ConResPrintf(StdOut, IDS_ATTRIBUTES_DISK_FILE_FAIL, pszFileName);
+        return EXIT_SUCCESS;
+    }
+
+    while (fgetws(szLine, ARRAYSIZE(szLine), file) != NULL)
+    {
+        /* Strip the line break and skip empty lines */
+        pszEnd = szLine + wcslen(szLine);
+        while ((pszEnd > szLine) && iswspace(pszEnd[-1]))
+            *--pszEnd = UNICODE_NULL;
+
+        if (szLine[0] == UNICODE_NULL)
+            continue;
+
+        if (!ApplyCacheSetting(&Settings.CacheInfo, szLine))
+        {
+            bValid = FALSE;
+            break;
+        }
+    }
+
+    fclose(file);
+
+    if (!bValid)
+    {
+        ConResPrintf(StdOut, IDS_ATTRIBUTES_DISK_FILE_FAIL, pszFileName);
+        return EXIT_SUCCESS;
+    }
+
+    if (!SetCacheInformation(CurrentDisk, &Settings.CacheInfo))
+    {
+        ConResPuts(StdOut, IDS_ATTRIBUTES_DISK_SET_FAIL);
+        return EXIT_SUCCESS;
+    }
+
+    ConResPuts(StdOut, IDS_ATTRIBUTES_DISK_SET_SUCCESS);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+AttributesDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PWSTR pszSuffix = NULL, pszFileName = NULL;
+    EXIT_CODE Result;
+
+    DPRINT("AttributesDisk()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 2)
+    {
+        PrintDiskSettings(CurrentDisk);
+        ConPuts(StdOut, L"\n");
+        return EXIT_SUCCESS;
+    }
+
+    if (_wcsicmp(argv[2], L"set") == 0)
+        return SetDiskAttributes(argc, argv);
+
+    if ((argc < 4) || !HasPrefix(argv[3], L"file=", &pszSuffix))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
+    }
+
+    pszFileName = DuplicateQuotedString(pszSuffix);
+    if (pszFileName == NULL)
+        return EXIT_SUCCESS;
+
+    if (_wcsicmp(argv[2], L"save") == 0)
+    {
+        Result = SaveDiskAttributes(pszFileName);
+    }
+    else if (_wcsicmp(argv[2], L"restore") == 0)
+    {
+        Result = RestoreDiskAttributes(pszFileName);
+    }
+    else
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        Result = EXIT_SUCCESS;
+    }
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, pszFileName);
+
+    return Result;
+}
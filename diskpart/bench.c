@@ -0,0 +1,901 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/bench.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define BENCH_MAX_QUEUE_DEPTH   MAXIMUM_WAIT_OBJECTS
+/* Largest bs=, so that bs * qd stays within a sane allocation */
+#define BENCH_MAX_BLOCK_SIZE    (64 * SIZE_1MB)
+#define BENCH_DEFAULT_SECONDS   10
+
+/* Log-linear latency histogram: 32 linear sub-buckets per power of two */
+#define HIST_SUB_BITS           5
+#define HIST_SUB_COUNT          (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT         (HIST_SUB_COUNT / 2)
+#define HIST_BUCKET_COUNT       (64 * HIST_HALF_COUNT)
+
+typedef struct _BENCH_HISTOGRAM
+{
+    ULONGLONG Buckets[HIST_BUCKET_COUNT];
+    ULONGLONG Count;
+    ULONGLONG Total;
+    ULONGLONG Min;
+    ULONGLONG Max;
+} BENCH_HISTOGRAM, *PBENCH_HISTOGRAM;
+
+typedef struct _BENCH_SLOT
+{
+    HANDLE Event;
+    IO_STATUS_BLOCK Iosb;
+    PUCHAR Buffer;
+    LARGE_INTEGER SubmitTime;
+} BENCH_SLOT, *PBENCH_SLOT;
+
+typedef struct _BENCH_TEST
+{
+    BOOL Random;
+    ULONG BlockSize;
+    ULONG QueueDepth;
+    ULONGLONG StartOffset;
+} BENCH_TEST, *PBENCH_TEST;
+
+/* Zone profile: a short sequential read at the start of every zone */
+#define PROFILE_SAMPLE_SIZE     (16 * 1024 * 1024)
+#define PROFILE_BLOCK_SIZE      (1024 * 1024)
+#define PROFILE_QUEUE_DEPTH     4
+
+static LIST_ENTRY DiskProfileListHead = {&DiskProfileListHead, &DiskProfileListHead};
+
+/* FUNCTIONS ******************************************************************/
+
+static
+ULONG
+HistogramIndex(
+    _In_ ULONGLONG ullValue)
+{
+    ULONG Shift = 0;
+
+    if (ullValue < HIST_SUB_COUNT)
+        return (ULONG)ullValue;
+
+    while ((ullValue >> Shift) >= HIST_SUB_COUNT)
+        Shift++;
+
+    return (Shift * HIST_HALF_COUNT) + (ULONG)(ullValue >> Shift);
+}
+
+
+static
+ULONGLONG
+HistogramValue(
+    _In_ ULONG Index)
+{
+    ULONG Shift;
+
+    if (Index < HIST_SUB_COUNT)
+        return Index;
+
+    /* Report the highest value that falls into the bucket */
+    Shift = (Index / HIST_HALF_COUNT) - 1;
+    return ((ULONGLONG)(Index - (Shift * HIST_HALF_COUNT)) << Shift) + ((1ULL << Shift) - 1);
+}
+
+
+static
+VOID
+HistogramRecord(
+    _In_ PBENCH_HISTOGRAM Histogram,
+    _In_ ULONGLONG ullValue)
+{
+    Histogram->Buckets[HistogramIndex(ullValue)]++;
+
+    if ((Histogram->Count == 0) || (ullValue < Histogram->Min))
+        Histogram->Min = ullValue;
+    if (ullValue > Histogram->Max)
+        Histogram->Max = ullValue;
+
+    Histogram->Count++;
+    Histogram->Total += ullValue;
+}
+
+
+/*
+ * Returns the value below which the given fraction of samples fall.
+ * The fraction is given in units of 1/10000 (9990 = 99.9%).
+ */
+static
+ULONGLONG
+HistogramPercentile(
+    _In_ PBENCH_HISTOGRAM Histogram,
+    _In_ ULONG ulFraction)
+{
+    ULONGLONG Target, Sum = 0;
+    ULONG i;
+
+    if (Histogram->Count == 0)
+        return 0;
+
+    Target = ((Histogram->Count * ulFraction) + 9999) / 10000;
+    if (Target == 0)
+        Target = 1;
+
+    for (i = 0; i < HIST_BUCKET_COUNT; i++)
+    {
+        Sum += Histogram->Buckets[i];
+        if (Sum >= Target)
+            return min(HistogramValue(i), Histogram->Max);
+    }
+
+    return Histogram->Max;
+}
+
+
+static
+ULONGLONG
+NextRandom(
+    _Inout_ PULONGLONG pullState)
+{
+    /* xorshift64*, seeded with a constant so that runs are repeatable */
+    *pullState ^= *pullState >> 12;
+    *pullState ^= *pullState << 25;
+    *pullState ^= *pullState >> 27;
+    return *pullState * 0x2545F4914F6CDD1DULL;
+}
+
+
+static
+NTSTATUS
+SubmitRead(
+    _In_ HANDLE FileHandle,
+    _In_ PBENCH_SLOT Slot,
+    _In_ ULONG ulBlockSize,
+    _In_ ULONGLONG ullOffset)
+{
+    LARGE_INTEGER FileOffset;
+    NTSTATUS Status;
+
+    FileOffset.QuadPart = ullOffset;
+    NtQueryPerformanceCounter(&Slot->SubmitTime, NULL);
+
+    Status = NtReadFile(FileHandle,
+                        Slot->Event,
+                        NULL,
+                        NULL,
+                        &Slot->Iosb,
+                        Slot->Buffer,
+                        ulBlockSize,
+                        &FileOffset,
+                        NULL);
+    if ((Status == STATUS_PENDING) || NT_SUCCESS(Status))
+        return STATUS_SUCCESS;
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+RunReadTest(
+    _In_ HANDLE FileHandle,
+    _In_ ULONGLONG ullLength,
+    _In_ PBENCH_TEST Test,
+    _In_ ULONG ulSeconds,
+    _Out_ PBENCH_HISTOGRAM Histogram,
+    _Out_ PULONGLONG pullBytes,
+    _Out_ PULONGLONG pullElapsedUs)
+{
+    BENCH_SLOT Slots[BENCH_MAX_QUEUE_DEPTH];
+    HANDLE WaitHandles[BENCH_MAX_QUEUE_DEPTH];
+    ULONG WaitSlots[BENCH_MAX_QUEUE_DEPTH];
+    ULONG ActiveCount = 0, Index, SlotIndex;
+    PVOID BufferBase = NULL;
+    SIZE_T BufferSize;
+    LARGE_INTEGER Frequency, StartTime, Now;
+    ULONGLONG BlockCount, Issued = 0, NextOffset = 0, Deadline;
+    ULONGLONG RandomState = 0x9E3779B97F4A7C15ULL;
+    ULONGLONG Offset;
+    BOOL bStop = FALSE;
+    NTSTATUS Status, IoStatus = STATUS_SUCCESS;
+
+    RtlZeroMemory(Slots, sizeof(Slots));
+    RtlZeroMemory(Histogram, sizeof(*Histogram));
+    *pullBytes = 0;
+    *pullElapsedUs = 0;
+
+    BlockCount = ullLength / Test->BlockSize;
+
+    /* Page aligned buffers satisfy the alignment rules of unbuffered I/O */
+    BufferSize = (SIZE_T)Test->BlockSize * Test->QueueDepth;
+    Status = NtAllocateVirtualMemory(NtCurrentProcess(),
+                                     &BufferBase,
+                                     0,
+                                     &BufferSize,
+                                     MEM_RESERVE | MEM_COMMIT,
+                                     PAGE_READWRITE);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtAllocateVirtualMemory() failed (Status 0x%08lx)\n", Status);
+        return Status;
+    }
+
+    for (Index = 0; Index < Test->QueueDepth; Index++)
+    {
+        Slots[Index].Buffer = (PUCHAR)BufferBase + ((SIZE_T)Index * Test->BlockSize);
+        Status = NtCreateEvent(&Slots[Index].Event,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               NotificationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("NtCreateEvent() failed (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+    }
+
+    NtQueryPerformanceCounter(&StartTime, &Frequency);
+    Deadline = StartTime.QuadPart + ((ULONGLONG)Frequency.QuadPart * ulSeconds);
+
+    /* Fill the queue */
+    for (Index = 0; (Index < Test->QueueDepth) && (Issued < BlockCount); Index++)
+    {
+        if (Test->Random)
+            Offset = (NextRandom(&RandomState) % BlockCount) * Test->BlockSize;
+        else
+            Offset = NextOffset;
+        NextOffset += Test->BlockSize;
+
+        Status = SubmitRead(FileHandle, &Slots[Index], Test->BlockSize, Test->StartOffset + Offset);
+        if (!NT_SUCCESS(Status))
+        {
+            IoStatus = Status;
+            break;
+        }
+
+        WaitHandles[ActiveCount] = Slots[Index].Event;
+        WaitSlots[ActiveCount] = Index;
+        ActiveCount++;
+        Issued++;
+    }
+
+    /* Reap completions and keep the queue full until the test ends */
+    while (ActiveCount > 0)
+    {
+        Status = NtWaitForMultipleObjects(ActiveCount,
+                                          WaitHandles,
+                                          WaitAny,
+                                          FALSE,
+                                          NULL);
+        if ((Status < STATUS_WAIT_0) || (Status >= STATUS_WAIT_0 + ActiveCount))
+        {
+            DPRINT1("NtWaitForMultipleObjects() failed (Status 0x%08lx)\n", Status);
+            IoStatus = Status;
+            break;
+        }
+
+        Index = Status - STATUS_WAIT_0;
+        SlotIndex = WaitSlots[Index];
+
+        NtQueryPerformanceCounter(&Now, NULL);
+        HistogramRecord(Histogram,
+                        ((ULONGLONG)(Now.QuadPart - Slots[SlotIndex].SubmitTime.QuadPart) * 1000000) / Frequency.QuadPart);
+
+        if (!NT_SUCCESS(Slots[SlotIndex].Iosb.Status))
+        {
+            DPRINT1("Read failed (Status 0x%08lx)\n", Slots[SlotIndex].Iosb.Status);
+            IoStatus = Slots[SlotIndex].Iosb.Status;
+            bStop = TRUE;
+        }
+        else
+        {
+            *pullBytes += Slots[SlotIndex].Iosb.Information;
+        }
+
+        if ((ULONGLONG)Now.QuadPart >= Deadline)
+            bStop = TRUE;
+
+        if (!bStop && (Issued < BlockCount))
+        {
+            if (Test->Random)
+                Offset = (NextRandom(&RandomState) % BlockCount) * Test->BlockSize;
+            else
+                Offset = NextOffset;
+            NextOffset += Test->BlockSize;
+
+            Status = SubmitRead(FileHandle, &Slots[SlotIndex], Test->BlockSize, Test->StartOffset + Offset);
+            if (NT_SUCCESS(Status))
+            {
+                Issued++;
+                continue;
+            }
+
+            IoStatus = Status;
+            bStop = TRUE;
+        }
+
+        /* Retire the slot: its event stays signaled until the next submission */
+        ActiveCount--;
+        WaitHandles[Index] = WaitHandles[ActiveCount];
+        WaitSlots[Index] = WaitSlots[ActiveCount];
+    }
+
+    /* Never release buffers that are still owned by pending reads */
+    for (Index = 0; Index < ActiveCount; Index++)
+        NtWaitForSingleObject(WaitHandles[Index], FALSE, NULL);
+
+    NtQueryPerformanceCounter(&Now, NULL);
+    *pullElapsedUs = ((ULONGLONG)(Now.QuadPart - StartTime.QuadPart) * 1000000) / Frequency.QuadPart;
+    Status = IoStatus;
+
+done:
+    for (Index = 0; Index < Test->QueueDepth; Index++)
+    {
+        if (Slots[Index].Event != NULL)
+            NtClose(Slots[Index].Event);
+    }
+
+    BufferSize = 0;
+    NtFreeVirtualMemory(NtCurrentProcess(), &BufferBase, &BufferSize, MEM_RELEASE);
+
+    return Status;
+}
+
+
+static
+VOID
+PrintTestResult(
+    _In_ PBENCH_TEST Test,
+    _In_ PBENCH_HISTOGRAM Histogram,
+    _In_ ULONGLONG ullBytes,
+    _In_ ULONGLONG ullElapsedUs)
+{
+    WCHAR szTestName[40];
+
+    LoadStringW(GetModuleHandle(NULL),
+                Test->Random ? IDS_BENCH_RANDOM : IDS_BENCH_SEQUENTIAL,
+                szTestName, ARRAYSIZE(szTestName));
+
+    if (ullElapsedUs == 0)
+        ullElapsedUs = 1;
+
+    ConResPrintf(StdOut, IDS_BENCH_TEST,
+                 szTestName,
+                 Test->BlockSize / 1024,
+                 Test->QueueDepth);
+    ConResPrintf(StdOut, IDS_BENCH_THROUGHPUT,
+                 ((ullBytes / SIZE_1KB) * 1000000) / ullElapsedUs / 1024);
+    ConResPrintf(StdOut, IDS_BENCH_IOPS,
+                 (Histogram->Count * 1000000) / ullElapsedUs,
+                 Histogram->Count,
+                 ullElapsedUs / 1000);
+    ConResPrintf(StdOut, IDS_BENCH_LATENCY,
+                 Histogram->Min,
+                 (Histogram->Count != 0) ? (Histogram->Total / Histogram->Count) : 0,
+                 Histogram->Max);
+    ConResPrintf(StdOut, IDS_BENCH_PERCENTILES,
+                 HistogramPercentile(Histogram, 5000),
+                 HistogramPercentile(Histogram, 9900),
+                 HistogramPercentile(Histogram, 9990));
+}
+
+
+static
+NTSTATUS
+OpenBenchTarget(
+    _In_ PUNICODE_STRING Name,
+    _In_ BOOL bBuffered,
+    _Out_ PHANDLE FileHandle)
+{
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    /* No FILE_SYNCHRONOUS_IO_* option: the reads are overlapped */
+    return NtOpenFile(FileHandle,
+                      FILE_READ_DATA | FILE_READ_ATTRIBUTES,
+                      &ObjectAttributes,
+                      &Iosb,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      bBuffered ? 0 : FILE_NO_INTERMEDIATE_BUFFERING);
+}
+
+
+static
+EXIT_CODE
+RunBench(
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _In_ BOOL bPartition)
+{
+    BENCH_TEST Tests[2];
+    ULONG TestCount, i;
+    ULONG ulBlockSize = 0, ulQueueDepth = 0, ulSeconds = BENCH_DEFAULT_SECONDS;
+    ULONG ulSectorSize;
+    ULONGLONG ullLength, ullSizeLimit = 0;
+    ULONGLONG ullBytes, ullElapsedUs;
+    BOOL bSequential = TRUE, bRandom = TRUE, bBuffered = FALSE;
+    PWSTR pszSuffix = NULL, pszFileName = NULL;
+    PBENCH_HISTOGRAM Histogram = NULL;
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name = {0, 0, NULL};
+    BOOL bFreeName = FALSE;
+    HANDLE FileHandle = NULL;
+    FILE_STANDARD_INFORMATION FileInfo;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+    INT j;
+
+    for (j = 2; j < argc; j++)
+    {
+        if (HasPrefix(argv[j], L"test=", &pszSuffix))
+        {
+            /* test=seq|random|all */
+            if (_wcsicmp(pszSuffix, L"seq") == 0)
+            {
+                bSequential = TRUE;
+                bRandom = FALSE;
+            }
+            else if (_wcsicmp(pszSuffix, L"random") == 0)
+            {
+                bSequential = FALSE;
+                bRandom = TRUE;
+            }
+            else if (_wcsicmp(pszSuffix, L"all") == 0)
+            {
+                bSequential = TRUE;
+                bRandom = TRUE;
+            }
+            else
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[j], L"bs=", &pszSuffix))
+        {
+            /* bs=<N> (KB), checked before the multiplication */
+            ULONGLONG ullValue;
+
+            if (!IsDecString(pszSuffix))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+
+            ullValue = _wcstoui64(pszSuffix, NULL, 10);
+            if ((ullValue == 0) || (ullValue > BENCH_MAX_BLOCK_SIZE / SIZE_1KB))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+
+            ulBlockSize = (ULONG)(ullValue * SIZE_1KB);
+        }
+        else if (HasPrefix(argv[j], L"qd=", &pszSuffix))
+        {
+            /* qd=<N> */
+            ulQueueDepth = wcstoul(pszSuffix, NULL, 10);
+            if ((ulQueueDepth == 0) || (ulQueueDepth > BENCH_MAX_QUEUE_DEPTH))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[j], L"size=", &pszSuffix))
+        {
+            /* size=<N> (MB) */
+            ullSizeLimit = _wcstoui64(pszSuffix, NULL, 10) * SIZE_1MB;
+            if (ullSizeLimit == 0)
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[j], L"time=", &pszSuffix))
+        {
+            /* time=<N> (seconds per test) */
+            ulSeconds = wcstoul(pszSuffix, NULL, 10);
+            if (ulSeconds == 0)
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[j], L"file=", &pszSuffix) && !bPartition)
+        {
+            /* file=<path> */
+            pszFileName = pszSuffix;
+        }
+        else if (_wcsicmp(argv[j], L"buffered") == 0)
+        {
+            bBuffered = TRUE;
+        }
+        else
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (pszFileName != NULL)
+    {
+        /* Image files are benchmarked without a selected disk */
+        pszFileName = DuplicateQuotedString(pszFileName);
+        if ((pszFileName == NULL) ||
+            !RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            goto done;
+        }
+
+        bFreeName = TRUE;
+        ulSectorSize = 512;
+        StringCchCopyW(szBuffer, ARRAYSIZE(szBuffer), pszFileName);
+    }
+    else
+    {
+        if (CurrentDisk == NULL)
+        {
+            ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+            return EXIT_SUCCESS;
+        }
+
+        ulSectorSize = CurrentDisk->BytesPerSector;
+
+        if (bPartition)
+        {
+            if (CurrentPartition == NULL)
+            {
+                ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+                return EXIT_SUCCESS;
+            }
+
+            if (CurrentPartition->PartitionNumber == 0)
+            {
+                ConResPuts(StdOut, IDS_BENCH_OPEN_FAIL);
+                return EXIT_SUCCESS;
+            }
+
+            StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                             L"\\Device\\Harddisk%lu\\Partition%lu",
+                             CurrentDisk->DiskNumber,
+                             CurrentPartition->PartitionNumber);
+        }
+        else
+        {
+            StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                             L"\\Device\\Harddisk%lu\\Partition0",
+                             CurrentDisk->DiskNumber);
+        }
+
+        RtlInitUnicodeString(&Name, szBuffer);
+    }
+
+    Status = OpenBenchTarget(&Name, bBuffered, &FileHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_BENCH_OPEN_FAIL);
+        goto done;
+    }
+
+    if (pszFileName != NULL)
+    {
+        Status = NtQueryInformationFile(FileHandle,
+                                        &Iosb,
+                                        &FileInfo,
+                                        sizeof(FileInfo),
+                                        FileStandardInformation);
+        if (!NT_SUCCESS(Status))
+        {
+            ConResPuts(StdOut, IDS_BENCH_OPEN_FAIL);
+            goto done;
+        }
+
+        ullLength = FileInfo.EndOfFile.QuadPart;
+    }
+    else if (bPartition)
+    {
+        ullLength = CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+    }
+    else
+    {
+        ullLength = CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+    }
+
+    if ((ullSizeLimit != 0) && (ullSizeLimit < ullLength))
+        ullLength = ullSizeLimit;
+
+    /* Sequential: 1 MB at QD 8, random: 4 KB at QD 32, unless overridden */
+    TestCount = 0;
+    if (bSequential)
+    {
+        Tests[TestCount].Random = FALSE;
+        Tests[TestCount].BlockSize = (ulBlockSize != 0) ? ulBlockSize : (ULONG)SIZE_1MB;
+        Tests[TestCount].QueueDepth = (ulQueueDepth != 0) ? ulQueueDepth : 8;
+        Tests[TestCount].StartOffset = 0;
+        TestCount++;
+    }
+
+    if (bRandom)
+    {
+        Tests[TestCount].Random = TRUE;
+        Tests[TestCount].BlockSize = (ulBlockSize != 0) ? ulBlockSize : 4096;
+        Tests[TestCount].QueueDepth = (ulQueueDepth != 0) ? ulQueueDepth : 32;
+        Tests[TestCount].StartOffset = 0;
+        TestCount++;
+    }
+
+    for (i = 0; i < TestCount; i++)
+    {
+        if (((Tests[i].BlockSize % ulSectorSize) != 0) ||
+            (ullLength < Tests[i].BlockSize))
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            goto done;
+        }
+    }
+
+    Histogram = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BENCH_HISTOGRAM));
+    if (Histogram == NULL)
+    {
+        DPRINT1("Failed to allocate the histogram!\n");
+        goto done;
+    }
+
+    ConResPrintf(StdOut, IDS_BENCH_TARGET,
+                 szBuffer,
+                 ullLength,
+                 bBuffered ? L"buffered" : L"unbuffered");
+
+    for (i = 0; i < TestCount; i++)
+    {
+        Status = RunReadTest(FileHandle,
+                             ullLength,
+                             &Tests[i],
+                             ulSeconds,
+                             Histogram,
+                             &ullBytes,
+                             &ullElapsedUs);
+        if (!NT_SUCCESS(Status))
+        {
+            ConResPrintf(StdOut, IDS_BENCH_FAIL, Status);
+            break;
+        }
+
+        PrintTestResult(&Tests[i], Histogram, ullBytes, ullElapsedUs);
+    }
+
+    ConPuts(StdOut, L"\n");
+
+done:
+    if (Histogram != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Histogram);
+
+    if (FileHandle != NULL)
+        NtClose(FileHandle);
+
+    if (bFreeName)
+        RtlFreeUnicodeString(&Name);
+
+    if (pszFileName != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszFileName);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+BenchDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    DPRINT("BenchDisk()\n");
+
+    return RunBench(argc, argv, FALSE);
+}
+
+
+EXIT_CODE
+BenchPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    DPRINT("BenchPartition()\n");
+
+    return RunBench(argc, argv, TRUE);
+}
+
+
+static
+BOOL
+IsSameDiskIdentity(
+    _In_ PDISK_PROFILE Profile,
+    _In_ PDISKENTRY DiskEntry)
+{
+    /* Disk numbers are reassigned by a rescan, the device address is not */
+    if ((Profile->SectorCount != DiskEntry->SectorCount.QuadPart) ||
+        (Profile->BytesPerSector != DiskEntry->BytesPerSector) ||
+        (Profile->Port != DiskEntry->Port) ||
+        (Profile->PathId != DiskEntry->PathId) ||
+        (Profile->TargetId != DiskEntry->TargetId) ||
+        (Profile->Lun != DiskEntry->Lun))
+        return FALSE;
+
+    return (_wcsicmp(Profile->Description,
+                     (DiskEntry->Description != NULL) ? DiskEntry->Description : L"") == 0);
+}
+
+
+static
+BOOL
+MeasureDiskProfile(
+    _In_ PDISKENTRY DiskEntry,
+    _Inout_ PDISK_PROFILE Profile)
+{
+    BENCH_TEST Test;
+    PBENCH_HISTOGRAM Histogram;
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    HANDLE FileHandle = NULL;
+    ULONGLONG ullDiskLength, ullZoneLength, ullBytes, ullElapsedUs;
+    ULONG i;
+    NTSTATUS Status;
+
+    ullDiskLength = DiskEntry->SectorCount.QuadPart * DiskEntry->BytesPerSector;
+    ullZoneLength = AlignDown(ullDiskLength / DISK_PROFILE_ZONES, PROFILE_BLOCK_SIZE);
+    if (ullZoneLength < PROFILE_SAMPLE_SIZE)
+        return FALSE;
+
+    Histogram = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(BENCH_HISTOGRAM));
+    if (Histogram == NULL)
+        return FALSE;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition0",
+                     DiskEntry->DiskNumber);
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    Status = OpenBenchTarget(&Name, FALSE, &FileHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        goto done;
+    }
+
+    Test.Random = FALSE;
+    Test.BlockSize = PROFILE_BLOCK_SIZE;
+    Test.QueueDepth = PROFILE_QUEUE_DEPTH;
+
+    for (i = 0; i < DISK_PROFILE_ZONES; i++)
+    {
+        Test.StartOffset = ullZoneLength * i;
+
+        Status = RunReadTest(FileHandle,
+                             PROFILE_SAMPLE_SIZE,
+                             &Test,
+                             1,
+                             Histogram,
+                             &ullBytes,
+                             &ullElapsedUs);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Zone %lu: read failed (Status 0x%08lx)\n", i, Status);
+            goto done;
+        }
+
+        if (ullElapsedUs == 0)
+            ullElapsedUs = 1;
+
+        Profile->Throughput[i] = (ULONG)(((ullBytes / SIZE_1KB) * 1000000) / ullElapsedUs);
+        DPRINT("Zone %lu: %lu KB/s\n", i, Profile->Throughput[i]);
+    }
+
+done:
+    if (FileHandle != NULL)
+        NtClose(FileHandle);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Histogram);
+
+    return NT_SUCCESS(Status);
+}
+
+
+PDISK_PROFILE
+GetDiskProfile(
+    _In_ PDISKENTRY DiskEntry)
+{
+    PLIST_ENTRY Entry;
+    PDISK_PROFILE Profile;
+
+    for (Entry = DiskProfileListHead.Flink; Entry != &DiskProfileListHead; Entry = Entry->Flink)
+    {
+        Profile = CONTAINING_RECORD(Entry, DISK_PROFILE, ListEntry);
+        if (IsSameDiskIdentity(Profile, DiskEntry))
+            return Profile;
+    }
+
+    Profile = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DISK_PROFILE));
+    if (Profile == NULL)
+        return NULL;
+
+    Profile->SectorCount = DiskEntry->SectorCount.QuadPart;
+    Profile->BytesPerSector = DiskEntry->BytesPerSector;
+    Profile->Port = DiskEntry->Port;
+    Profile->PathId = DiskEntry->PathId;
+    Profile->TargetId = DiskEntry->TargetId;
+    Profile->Lun = DiskEntry->Lun;
+    if (DiskEntry->Description != NULL)
+        StringCchCopyW(Profile->Description, ARRAYSIZE(Profile->Description), DiskEntry->Description);
+
+    ConResPrintf(StdOut, IDS_BENCH_PROFILE, DiskEntry->DiskNumber);
+    if (!MeasureDiskProfile(DiskEntry, Profile))
+    {
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Profile);
+        return NULL;
+    }
+
+    InsertTailList(&DiskProfileListHead, &Profile->ListEntry);
+
+    return Profile;
+}
+
+
+ULONG
+GetProfileThroughput(
+    _In_ PDISK_PROFILE Profile,
+    _In_ ULONGLONG ullStartSector,
+    _In_ ULONGLONG ullSectorCount)
+{
+    ULONGLONG ullZoneSectors, ullZoneStart, ullZoneEnd, ullOverlap;
+    ULONGLONG ullWeighted = 0, ullTotal = 0;
+    ULONG i;
+
+    ullZoneSectors = Profile->SectorCount / DISK_PROFILE_ZONES;
+    if ((ullZoneSectors == 0) || (ullSectorCount == 0))
+        return 0;
+
+    /* Average of the zones covered by the range, weighted by the overlap */
+    for (i = 0; i < DISK_PROFILE_ZONES; i++)
+    {
+        ullZoneStart = ullZoneSectors * i;
+        ullZoneEnd = (i == DISK_PROFILE_ZONES - 1) ? Profile->SectorCount : ullZoneStart + ullZoneSectors;
+
+        if ((ullZoneEnd <= ullStartSector) || (ullZoneStart >= ullStartSector + ullSectorCount))
+            continue;
+
+        ullOverlap = min(ullZoneEnd, ullStartSector + ullSectorCount) - max(ullZoneStart, ullStartSector);
+        ullWeighted += ullOverlap * Profile->Throughput[i];
+        ullTotal += ullOverlap;
+    }
+
+    return (ullTotal != 0) ? (ULONG)(ullWeighted / ullTotal) : 0;
+}
+
+
+VOID
+DestroyDiskProfiles(VOID)
+{
+    PLIST_ENTRY Entry;
+    PDISK_PROFILE Profile;
+
+    while (!IsListEmpty(&DiskProfileListHead))
+    {
+        Entry = RemoveHeadList(&DiskProfileListHead);
+        Profile = CONTAINING_RECORD(Entry, DISK_PROFILE, ListEntry);
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Profile);
+    }
+}
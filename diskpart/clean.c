@@ -11,6 +11,137 @@
 #define NDEBUG
 #include <debug.h>
 
+typedef struct _CLEAN_CONTEXT
+{
+    ULONG DiskNumber;
+    ULONGLONG ullLength;
+    BOOL bAll;
+    QOS_SETTINGS Qos;
+} CLEAN_CONTEXT, *PCLEAN_CONTEXT;
+
+
+static
+NTSTATUS
+WipeDisk(
+    _In_opt_ PJOB Job,
+    _In_ PVOID Parameter)
+{
+    PCLEAN_CONTEXT Context = Parameter;
+    PUCHAR SectorsBuffer = NULL;
+    ULONG Size;
+    WCHAR Buffer[MAX_PATH];
+    UNICODE_STRING Name;
+    IO_ENGINE Engine;
+    ULONGLONG Offset, Count, MaxCount;
+    QOS_BUCKET Qos;
+    NTSTATUS Status;
+
+    /* Allocate a 1MB sectors buffer, aligned for unbuffered writes */
+    SectorsBuffer = AllocateIoBuffer(1024 * 1024);
+    if (SectorsBuffer == NULL)
+        return STATUS_NO_MEMORY;
+
+    /* Open the disk for writing */
+    StringCchPrintfW(Buffer, ARRAYSIZE(Buffer),
+                     L"\\Device\\Harddisk%d\\Partition0",
+                     Context->DiskNumber);
+
+    RtlInitUnicodeString(&Name, Buffer);
+
+    Status = OpenIoEngine(&Engine,
+                          &Name,
+                          GENERIC_READ | GENERIC_WRITE,
+                          0);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Failed to open the disk! (Status 0x%08lx)\n", Status);
+        goto done;
+    }
+
+    InitializeQosBucket(&Qos, &Context->Qos, Job);
+    AddQosDevice(&Qos, Engine.FileHandle);
+    Engine.Qos = &Qos;
+
+    /* Clean sectors, every write uses the same zeroed buffer */
+    if (Context->bAll)
+    {
+        MaxCount = Context->ullLength / (1024 * 1024);
+        for (Count = 0; Count < MaxCount; Count++)
+        {
+            if (IsJobCancelled(Job))
+            {
+                Status = STATUS_CANCELLED;
+                goto done;
+            }
+
+            SetJobProgress(Job, (ULONG)((Count * 100) / MaxCount));
+
+            Status = WriteIoEngine(&Engine, Count * (1024 * 1024), SectorsBuffer, 1024 * 1024);
+            if (!NT_SUCCESS(Status))
+            {
+                DPRINT1("Failed to write MB! (Status 0x%08lx)\n", Status);
+                goto done;
+            }
+        }
+
+        Size = (ULONG)(Context->ullLength % (1024 * 1024));
+        if (Size != 0)
+        {
+            Offset = MaxCount * (1024 * 1024);
+            Status = WriteIoEngine(&Engine, Offset, SectorsBuffer, Size);
+            if (!NT_SUCCESS(Status))
+            {
+                DPRINT1("Failed to write the last part! (Status 0x%08lx)\n", Status);
+                goto done;
+            }
+        }
+    }
+    else
+    {
+        /* Clean the first MB */
+        Status = WriteIoEngine(&Engine, 0, SectorsBuffer, 1024 * 1024);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Failed to write the first MB! (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+
+        /* Clean the last MB */
+        Offset = Context->ullLength - (1024 * 1024);
+        Status = WriteIoEngine(&Engine, Offset, SectorsBuffer, 1024 * 1024);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Failed to write the last MB! (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+    }
+
+    /* Wait for the queued writes */
+    Status = FlushIoEngine(&Engine);
+
+done:
+    /* Closing waits for the writes still queued on the buffer */
+    CloseIoEngine(&Engine);
+    FreeIoBuffer(SectorsBuffer);
+
+    return Status;
+}
+
+
+static
+VOID
+CompleteClean(
+    _In_ NTSTATUS Status,
+    _In_ PVOID Parameter)
+{
+    if (NT_SUCCESS(Status))
+        ConResPuts(StdOut, IDS_CLEAN_SUCCESS);
+    else
+        ConResPuts(StdOut, IDS_CLEAN_FAIL);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Parameter);
+}
+
 
 EXIT_CODE
 clean_main(
@@ -20,17 +151,13 @@ clean_main(
     PLIST_ENTRY Entry;
     PPARTENTRY PartEntry;
     PVOLENTRY VolumeEntry;
+    PCLEAN_CONTEXT Context;
     BOOL bAll = FALSE;
-    PUCHAR SectorsBuffer = NULL;
-    ULONG LayoutBufferSize, Size;
+    BOOL bNoWait = FALSE;
+    QOS_SETTINGS Qos;
+    PWSTR pszSuffix = NULL;
+    ULONG LayoutBufferSize;
     INT i;
-    WCHAR Buffer[MAX_PATH];
-    UNICODE_STRING Name;
-    OBJECT_ATTRIBUTES ObjectAttributes;
-    IO_STATUS_BLOCK IoStatusBlock;
-    HANDLE FileHandle = NULL;
-    LARGE_INTEGER Offset, Count, MaxCount;
-    NTSTATUS Status;
 
     DPRINT("Clean()\n");
 
@@ -48,12 +175,26 @@ clean_main(
         return EXIT_SUCCESS;
     }
 
+    GetQosSettings(&Qos);
+
     for (i = 1; i < argc; i++)
     {
-        if (_wcsicmp(argv[1], L"all") == 0)
+        if (_wcsicmp(argv[i], L"all") == 0)
         {
             bAll = TRUE;
         }
+        else if (_wcsicmp(argv[i], L"nowait") == 0)
+        {
+            bNoWait = TRUE;
+        }
+        else if (HasPrefix(argv[i], L"qos=", &pszSuffix))
+        {
+            if (!ParseQosSettings(pszSuffix, &Qos))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
     }
 
     /* Dismount and remove all logical partitions */
@@ -117,134 +258,31 @@ clean_main(
 
     CurrentDisk->LayoutBuffer->PartitionStyle = PARTITION_STYLE_RAW;
 
-    /* Allocate a 1MB sectors buffer */
-    SectorsBuffer = RtlAllocateHeap(RtlGetProcessHeap(),
-                                    HEAP_ZERO_MEMORY,
-                                    1024 * 1024);
-    if (SectorsBuffer == NULL)
-    {
-        DPRINT1("Failed to allocate the sectors buffer!\n");
-        goto done;
-    }
-
-    /* Open the disk for writing */
-    StringCchPrintfW(Buffer, ARRAYSIZE(Buffer),
-                     L"\\Device\\Harddisk%d\\Partition0",
-                     CurrentDisk->DiskNumber);
-
-    RtlInitUnicodeString(&Name, Buffer);
-
-    InitializeObjectAttributes(&ObjectAttributes,
-                               &Name,
-                               OBJ_CASE_INSENSITIVE,
-                               NULL,
-                               NULL);
-
-    Status = NtOpenFile(&FileHandle,
-                        GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
-                        &ObjectAttributes,
-                        &IoStatusBlock,
-                        0,
-                        FILE_SYNCHRONOUS_IO_NONALERT);
-    if (!NT_SUCCESS(Status))
-    {
-        DPRINT1("Failed to open the disk! (Status 0x%08lx)\n", Status);
-        ConResPuts(StdOut, IDS_CLEAN_FAIL);
-        goto done;
-    }
-
-    /* Clean sectors */
-    if (bAll)
+    Context = RtlAllocateHeap(RtlGetProcessHeap(), 0, sizeof(CLEAN_CONTEXT));
+    if (Context == NULL)
     {
-        MaxCount.QuadPart = (CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector) / (1024 * 1024);
-        for (Count.QuadPart = 0; Count.QuadPart < MaxCount.QuadPart; Count.QuadPart++)
-        {
-            Offset.QuadPart = Count.QuadPart * (1024 * 1024);
-            Status = NtWriteFile(FileHandle,
-                                 NULL,
-                                 NULL,
-                                 NULL,
-                                 &IoStatusBlock,
-                                 SectorsBuffer,
-                                 1024 * 1024,
-                                 &Offset,
-                                 NULL);
-            if (!NT_SUCCESS(Status))
-            {
-                DPRINT1("Failed to write MB! (Status 0x%08lx)\n", Status);
-                ConResPuts(StdOut, IDS_CLEAN_FAIL);
-                goto done;
-            }
-        }
-
-        Size = (ULONG)(CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector) % (1024 * 1024);
-        if (Size != 0)
-        {
-            Offset.QuadPart += (1024 * 1024);
-            Status = NtWriteFile(FileHandle,
-                                 NULL,
-                                 NULL,
-                                 NULL,
-                                 &IoStatusBlock,
-                                 SectorsBuffer,
-                                 Size,
-                                 &Offset,
-                                 NULL);
-            if (!NT_SUCCESS(Status))
-            {
-                DPRINT1("Failed to write the last part! (Status 0x%08lx)\n", Status);
-                ConResPuts(StdOut, IDS_CLEAN_FAIL);
-                goto done;
-            }
-        }
-    }
-    else
-    {
-        /* Clean the first MB */
-        Offset.QuadPart = 0;
-        Status = NtWriteFile(FileHandle,
-                             NULL,
-                             NULL,
-                             NULL,
-                             &IoStatusBlock,
-                             SectorsBuffer,
-                             1024 * 1024,
-                             &Offset,
-                             NULL);
-        if (!NT_SUCCESS(Status))
-        {
-            DPRINT1("Failed to write the first MB! (Status 0x%08lx)\n", Status);
-            ConResPuts(StdOut, IDS_CLEAN_FAIL);
-            goto done;
-        }
-
-        /* Clean the last MB */
-        Offset.QuadPart = (CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector) - (1024 * 1024);
-        Status = NtWriteFile(FileHandle,
-                             NULL,
-                             NULL,
-                             NULL,
-                             &IoStatusBlock,
-                             SectorsBuffer,
-                             1024 * 1024,
-                             &Offset,
-                             NULL);
-        if (!NT_SUCCESS(Status))
-        {
-            DPRINT1("Failed to write the last MB! (Status 0x%08lx)\n", Status);
-            ConResPuts(StdOut, IDS_CLEAN_FAIL);
-            goto done;
-        }
+        DPRINT1("Failed to allocate the clean context!\n");
+        return EXIT_SUCCESS;
     }
 
-    ConResPuts(StdOut, IDS_CLEAN_SUCCESS);
+    /* The wipe opens the disk exclusively */
+    CloseDiskHandles(CurrentDisk);
+    InvalidateSectorCache(CurrentDisk);
 
-done:
-    if (FileHandle != NULL)
-        NtClose(FileHandle);
+    Context->DiskNumber = CurrentDisk->DiskNumber;
+    Context->ullLength = CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+    Context->bAll = bAll;
+    Context->Qos = Qos;
 
-    if (SectorsBuffer != NULL)
-        RtlFreeHeap(RtlGetProcessHeap(), 0, SectorsBuffer);
+    /* The partition list is clean now, only the sectors are left */
+    StartJob(bNoWait,
+             argc,
+             argv,
+             CurrentDisk->DiskNumber,
+             JOB_NO_DISK,
+             WipeDisk,
+             CompleteClean,
+             Context);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,1220 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/clone.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define CLONE_CHUNK_SIZE        (4 * 1024 * 1024)
+#define CLONE_BLOCK_SIZE        (64 * 1024)
+#define CLONE_QUEUE_DEPTH       4
+
+typedef struct _CLONE_DISCARD
+{
+    DEVICE_MANAGE_DATA_SET_ATTRIBUTES Attributes;
+    DEVICE_DATA_SET_RANGE Range;
+} CLONE_DISCARD, *PCLONE_DISCARD;
+
+typedef struct _CLONE_SLOT
+{
+    PUCHAR Buffer;
+    ULONGLONG ChunkOffset;  /* Bytes, relative to the start of the source */
+    ULONG ChunkLength;      /* 0 once no chunk is left for the slot */
+    ULONG NextByte;         /* First byte of the chunk that is not written yet */
+    ULONGLONG ReadMark;     /* Source mark that covers the read of the chunk */
+    ULONGLONG WriteMark;    /* Target mark that covers the writes of the chunk */
+} CLONE_SLOT, *PCLONE_SLOT;
+
+typedef struct _CLONE_CONTEXT
+{
+    IO_ENGINE Source;
+    IO_ENGINE Target;
+    ULONGLONG Length;
+    ULONGLONG TargetOffset;
+    BOOL bSkipZero;
+    BOOL bDiscard;
+
+    /* Hidden sectors of a boot sector that is cloned to another offset */
+    BOOL bFixHiddenSectors;
+    ULONG OldHiddenSectors;
+    ULONG NewHiddenSectors;
+
+    /* Ranges used by the file system of the source, NULL to copy everything */
+    PFS_MAP Map;
+    ULONG NextRun;
+
+    ULONGLONG NextOffset;
+    ULONGLONG BytesToRead;
+    ULONGLONG BytesRead;
+    ULONGLONG BytesWritten;
+    ULONGLONG BytesSkipped;
+    ULONGLONG ElapsedMs;    /* 0 until a copy has finished */
+
+    /* Background job that runs the copy, NULL for a synchronous clone */
+    PJOB Job;
+
+    QOS_SETTINGS QosSettings;
+    QOS_BUCKET Qos;
+} CLONE_CONTEXT, *PCLONE_CONTEXT;
+
+/* A clone and the list entries that its completion updates */
+typedef struct _CLONE_JOB
+{
+    CLONE_CONTEXT Clone;
+    PDISKENTRY SourceDisk;          /* Disk clones only */
+    PDISKENTRY TargetDisk;          /* NULL for an image file */
+    PPARTENTRY SourcePartEntry;     /* Partition clones only */
+    PPARTENTRY NewPartEntry;
+} CLONE_JOB, *PCLONE_JOB;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+BOOL
+IsZeroBlock(
+    _In_ PUCHAR Buffer,
+    _In_ ULONG Length)
+{
+    const ULONGLONG *Words = (const ULONGLONG *)Buffer;
+    ULONG Count = Length / sizeof(ULONGLONG);
+    ULONG i;
+
+    /* Blocks are whole sectors, so the words come in groups of eight */
+    for (i = 0; i < Count; i += 8)
+    {
+        /* A branch-free group lets the compiler use vector instructions */
+        if ((Words[i] | Words[i + 1] | Words[i + 2] | Words[i + 3] |
+             Words[i + 4] | Words[i + 5] | Words[i + 6] | Words[i + 7]) != 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Returns the next run of the chunk in the slot that is either all zero or
+ * contains data. Without zero detection the whole chunk is one data run.
+ */
+static
+BOOL
+GetNextCloneRun(
+    _In_ PCLONE_CONTEXT Context,
+    _In_ PCLONE_SLOT Slot,
+    _Out_ PULONG pulStart,
+    _Out_ PULONG pulLength,
+    _Out_ PBOOL pbZero)
+{
+    ULONG ulBlock;
+    BOOL bZero;
+
+    if (Slot->NextByte >= Slot->ChunkLength)
+        return FALSE;
+
+    *pulStart = Slot->NextByte;
+
+    if (!Context->bSkipZero)
+    {
+        *pulLength = Slot->ChunkLength - Slot->NextByte;
+        *pbZero = FALSE;
+        Slot->NextByte = Slot->ChunkLength;
+        return TRUE;
+    }
+
+    ulBlock = min(CLONE_BLOCK_SIZE, Slot->ChunkLength - Slot->NextByte);
+    *pbZero = IsZeroBlock(&Slot->Buffer[Slot->NextByte], ulBlock);
+    Slot->NextByte += ulBlock;
+
+    while (Slot->NextByte < Slot->ChunkLength)
+    {
+        ulBlock = min(CLONE_BLOCK_SIZE, Slot->ChunkLength - Slot->NextByte);
+        bZero = IsZeroBlock(&Slot->Buffer[Slot->NextByte], ulBlock);
+        if (bZero != *pbZero)
+            break;
+
+        Slot->NextByte += ulBlock;
+    }
+
+    *pulLength = Slot->NextByte - *pulStart;
+    return TRUE;
+}
+
+
+/*
+ * Returns the next chunk to read. With an allocation map the chunks never
+ * cross the end of a used run, and the unused space between runs is skipped.
+ */
+static
+BOOL
+GetNextCloneChunk(
+    _In_ PCLONE_CONTEXT Context,
+    _Out_ PULONGLONG pullOffset,
+    _Out_ PULONG pulLength)
+{
+    ULONGLONG ullEnd = Context->Length;
+    PFS_RUN Run;
+
+    if (Context->Map != NULL)
+    {
+        for (;;)
+        {
+            if (Context->NextRun >= Context->Map->RunCount)
+                return FALSE;
+
+            Run = &Context->Map->Runs[Context->NextRun];
+            if (Context->NextOffset < Run->Offset)
+                Context->NextOffset = Run->Offset;
+
+            if (Context->NextOffset < Run->Offset + Run->Length)
+                break;
+
+            Context->NextRun++;
+        }
+
+        ullEnd = Run->Offset + Run->Length;
+    }
+
+    if (Context->NextOffset >= ullEnd)
+        return FALSE;
+
+    *pullOffset = Context->NextOffset;
+    *pulLength = (ULONG)min((ULONGLONG)CLONE_CHUNK_SIZE, ullEnd - Context->NextOffset);
+    Context->NextOffset += *pulLength;
+
+    return TRUE;
+}
+
+
+/*
+ * Trims a zero run of a disk target. The target reads back zeros anyway, so
+ * a refused discard is harmless and only stops further discards.
+ */
+static
+VOID
+DiscardCloneRange(
+    _In_ PCLONE_CONTEXT Context,
+    _In_ HANDLE Event,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONG ulLength)
+{
+    CLONE_DISCARD Discard;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Discard.Attributes.Size = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES);
+    Discard.Attributes.Action = DeviceDsmAction_Trim;
+    Discard.Attributes.Flags = 0;
+    Discard.Attributes.ParameterBlockOffset = 0;
+    Discard.Attributes.ParameterBlockLength = 0;
+    Discard.Attributes.DataSetRangesOffset = FIELD_OFFSET(CLONE_DISCARD, Range);
+    Discard.Attributes.DataSetRangesLength = sizeof(DEVICE_DATA_SET_RANGE);
+    Discard.Range.StartingOffset = ullOffset;
+    Discard.Range.LengthInBytes = ulLength;
+
+    /* The handle of an asynchronous engine is overlapped */
+    Status = NtDeviceIoControlFile(Context->Target.FileHandle,
+                                   Event,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES,
+                                   &Discard,
+                                   sizeof(Discard),
+                                   NULL,
+                                   0);
+    if (Status == STATUS_PENDING)
+    {
+        NtWaitForSingleObject(Event, FALSE, NULL);
+        Status = Iosb.Status;
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Discard failed (Status 0x%08lx)\n", Status);
+        Context->bDiscard = FALSE;
+    }
+}
+
+
+/*
+ * Reads the next chunk into a slot. The writes of the previous chunk of the
+ * slot still use its buffer, so they must be done first.
+ */
+static
+NTSTATUS
+ReadCloneSlot(
+    _In_ PCLONE_CONTEXT Context,
+    _In_ PCLONE_SLOT Slot)
+{
+    NTSTATUS Status;
+
+    Status = WaitForIoEngine(&Context->Target, Slot->WriteMark);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if (!GetNextCloneChunk(Context, &Slot->ChunkOffset, &Slot->ChunkLength))
+    {
+        Slot->ChunkLength = 0;
+        return STATUS_SUCCESS;
+    }
+
+    Slot->NextByte = 0;
+
+    Status = QueueReadIoEngine(&Context->Source, Slot->ChunkOffset, Slot->Buffer, Slot->ChunkLength);
+    Slot->ReadMark = GetIoEngineMark(&Context->Source);
+
+    return Status;
+}
+
+
+/* Writes the data runs of a chunk that has been read, and skips its zero runs */
+static
+NTSTATUS
+WriteCloneSlot(
+    _In_ PCLONE_CONTEXT Context,
+    _In_ PCLONE_SLOT Slot,
+    _In_opt_ HANDLE DiscardEvent)
+{
+    ULONGLONG ullOffset;
+    ULONG ulStart, ulLength;
+    BOOL bZero;
+    NTSTATUS Status;
+
+    while (GetNextCloneRun(Context, Slot, &ulStart, &ulLength, &bZero))
+    {
+        ullOffset = Context->TargetOffset + Slot->ChunkOffset + ulStart;
+
+        if (!bZero)
+        {
+            Status = WriteIoEngine(&Context->Target, ullOffset, &Slot->Buffer[ulStart], ulLength);
+            if (!NT_SUCCESS(Status))
+                return Status;
+
+            Context->BytesWritten += ulLength;
+            continue;
+        }
+
+        Context->BytesSkipped += ulLength;
+
+        if (Context->bDiscard)
+            DiscardCloneRange(Context, DiscardEvent, ullOffset, ulLength);
+    }
+
+    Slot->WriteMark = GetIoEngineMark(&Context->Target);
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Copies the chunks through the engines set with SET IO. The reads of the
+ * next slots are queued while a slot is written, and a slot is only read
+ * again after the slot behind it has been written, which gives its own
+ * writes the time of a whole chunk to complete.
+ */
+static
+NTSTATUS
+RunClone(
+    _In_ PCLONE_CONTEXT Context)
+{
+    CLONE_SLOT Slots[CLONE_QUEUE_DEPTH];
+    PCLONE_SLOT Slot;
+    PUCHAR BufferBase;
+    HANDLE DiscardEvent = NULL;
+    ULONG Index;
+    ULONG ulPercent, ulLastPercent = 0;
+    LARGE_INTEGER Frequency, StartTime, Now;
+    NTSTATUS Status, FlushStatus;
+
+    RtlZeroMemory(Slots, sizeof(Slots));
+
+    Context->BytesToRead = (Context->Map != NULL) ? Context->Map->UsedBytes : Context->Length;
+    if (Context->BytesToRead == 0)
+        return STATUS_SUCCESS;
+
+    BufferBase = AllocateIoBuffer((SIZE_T)CLONE_CHUNK_SIZE * CLONE_QUEUE_DEPTH);
+    if (BufferBase == NULL)
+        return STATUS_NO_MEMORY;
+
+    for (Index = 0; Index < CLONE_QUEUE_DEPTH; Index++)
+        Slots[Index].Buffer = BufferBase + ((SIZE_T)Index * CLONE_CHUNK_SIZE);
+
+    if (Context->bDiscard)
+    {
+        Status = NtCreateEvent(&DiscardEvent,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               NotificationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("NtCreateEvent() failed (Status 0x%08lx)\n", Status);
+            DiscardEvent = NULL;
+            goto done;
+        }
+    }
+
+    /* The target goes first, so a disk target is the device whose latency counts */
+    InitializeQosBucket(&Context->Qos, &Context->QosSettings, Context->Job);
+    AddQosDevice(&Context->Qos, Context->Target.FileHandle);
+    AddQosDevice(&Context->Qos, Context->Source.FileHandle);
+    Context->Source.Qos = &Context->Qos;
+    Context->Target.Qos = &Context->Qos;
+
+    NtQueryPerformanceCounter(&StartTime, &Frequency);
+
+    /* The last slot is read once the first one has been written */
+    Status = STATUS_SUCCESS;
+    for (Index = 0; (Index < CLONE_QUEUE_DEPTH - 1) && NT_SUCCESS(Status); Index++)
+        Status = ReadCloneSlot(Context, &Slots[Index]);
+
+    /* The slots hold the chunks in order, so the first empty slot ends the copy */
+    Index = 0;
+    while (NT_SUCCESS(Status) && (Slots[Index].ChunkLength != 0))
+    {
+        Slot = &Slots[Index];
+
+        Status = WaitForIoEngine(&Context->Source, Slot->ReadMark);
+        if (!NT_SUCCESS(Status))
+            break;
+
+        Context->BytesRead += Slot->ChunkLength;
+
+        if (Context->bFixHiddenSectors &&
+            (Slot->ChunkOffset == 0) &&
+            (*(PUSHORT)&Slot->Buffer[510] == 0xAA55) &&
+            (*(PULONG)&Slot->Buffer[0x1C] == Context->OldHiddenSectors))
+        {
+            *(PULONG)&Slot->Buffer[0x1C] = Context->NewHiddenSectors;
+        }
+
+        Status = WriteCloneSlot(Context, Slot, DiscardEvent);
+        if (!NT_SUCCESS(Status))
+            break;
+
+        ulPercent = (ULONG)((Context->BytesRead * 100) / Context->BytesToRead);
+        if (ulPercent != ulLastPercent)
+        {
+            if (Context->Job != NULL)
+                SetJobProgress(Context->Job, ulPercent);
+            else
+                ConResPrintf(StdOut, IDS_CLONE_PROGRESS, ulPercent);
+            ulLastPercent = ulPercent;
+        }
+
+        /* No new reads are issued once the job is cancelled */
+        if (IsJobCancelled(Context->Job))
+        {
+            Status = STATUS_CANCELLED;
+            break;
+        }
+
+        Status = ReadCloneSlot(Context, &Slots[(Index + CLONE_QUEUE_DEPTH - 1) % CLONE_QUEUE_DEPTH]);
+        Index = (Index + 1) % CLONE_QUEUE_DEPTH;
+    }
+
+    if (!NT_SUCCESS(Status))
+        DPRINT1("Clone I/O failed (Status 0x%08lx)\n", Status);
+
+    /* Never release buffers that are still owned by pending requests */
+    FlushIoEngine(&Context->Source);
+    FlushStatus = FlushIoEngine(&Context->Target);
+    if (NT_SUCCESS(Status))
+        Status = FlushStatus;
+
+    if (NT_SUCCESS(Status))
+    {
+        NtQueryPerformanceCounter(&Now, NULL);
+        Context->ElapsedMs = ((ULONGLONG)(Now.QuadPart - StartTime.QuadPart) * 1000) / Frequency.QuadPart;
+        if (Context->ElapsedMs == 0)
+            Context->ElapsedMs = 1;
+    }
+
+done:
+    if (DiscardEvent != NULL)
+        NtClose(DiscardEvent);
+
+    FreeIoBuffer(BufferBase);
+
+    return Status;
+}
+
+
+/* Jobs open the devices themselves, with the engine that is set with SET IO */
+static
+NTSTATUS
+OpenCloneEngine(
+    _Out_ PIO_ENGINE Engine,
+    _In_ ULONG DiskNumber,
+    _In_ ULONG PartitionNumber,
+    _In_ ACCESS_MASK DesiredAccess)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition%lu",
+                     DiskNumber,
+                     PartitionNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    return OpenIoEngine(Engine,
+                        &Name,
+                        DesiredAccess,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE);
+}
+
+
+/*
+ * Creates the image file with its final size. The file is made sparse first,
+ * so every block that is never written stays a hole.
+ */
+static
+NTSTATUS
+CreateCloneImage(
+    _In_ PWSTR pszFileName,
+    _In_ ULONGLONG ullLength,
+    _Out_ PIO_ENGINE Engine)
+{
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    FILE_END_OF_FILE_INFORMATION EndOfFile;
+    HANDLE TempHandle;
+    NTSTATUS Status;
+
+    if (!RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+        return STATUS_OBJECT_NAME_INVALID;
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    Status = NtCreateFile(&TempHandle,
+                          FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+                          &ObjectAttributes,
+                          &Iosb,
+                          NULL,
+                          FILE_ATTRIBUTE_NORMAL,
+                          0,
+                          FILE_OVERWRITE_IF,
+                          FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
+                          NULL,
+                          0);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    /* File systems without sparse files simply fill the gaps with zeros */
+    NtFsControlFile(TempHandle,
+                    NULL,
+                    NULL,
+                    NULL,
+                    &Iosb,
+                    FSCTL_SET_SPARSE,
+                    NULL,
+                    0,
+                    NULL,
+                    0);
+
+    EndOfFile.EndOfFile.QuadPart = ullLength;
+    Status = NtSetInformationFile(TempHandle,
+                                  &Iosb,
+                                  &EndOfFile,
+                                  sizeof(EndOfFile),
+                                  FileEndOfFileInformation);
+    NtClose(TempHandle);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    /* Read access lets the mapped engine map the image */
+    Status = OpenIoEngine(Engine,
+                          &Name,
+                          FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+                          FILE_SHARE_READ);
+
+done:
+    RtlFreeUnicodeString(&Name);
+
+    return Status;
+}
+
+
+static
+BOOL
+IsDiscardSupported(
+    _In_ PDISKENTRY DiskEntry)
+{
+    DEVICE_TRIM_DESCRIPTOR TrimDescriptor;
+    HANDLE FileHandle;
+
+    if (!NT_SUCCESS(GetDiskHandle(DiskEntry, FALSE, &FileHandle)))
+        return FALSE;
+
+    return QueryStorageProperty(FileHandle,
+                                StorageDeviceTrimProperty,
+                                &TrimDescriptor,
+                                sizeof(TrimDescriptor)) &&
+           TrimDescriptor.TrimEnabled;
+}
+
+
+/*
+ * Builds the allocation map of the selected partition for a clone of the used
+ * blocks only. A file system that cannot be parsed is copied as a whole.
+ */
+static
+PFS_MAP
+GetCloneMap(
+    _In_ ULONG PartitionNumber,
+    _In_ ULONGLONG ullLength)
+{
+    HANDLE FileHandle;
+    PFS_MAP Map = NULL;
+    NTSTATUS Status;
+
+    Status = OpenFsVolume(CurrentDisk->DiskNumber, PartitionNumber, &FileHandle);
+    if (NT_SUCCESS(Status))
+    {
+        Status = CreateFsMap(FileHandle, CurrentDisk->BytesPerSector, ullLength, &Map);
+        NtClose(FileHandle);
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        ConResPuts(StdOut, IDS_CLONE_USED_UNSUPPORTED);
+        return NULL;
+    }
+
+    ConResPrintf(StdOut, IDS_CLONE_USED,
+                 Map->UsedBytes / (SIZE_1KB * SIZE_1KB),
+                 ullLength / (SIZE_1KB * SIZE_1KB),
+                 Map->RunCount);
+
+    return Map;
+}
+
+
+/* A target that is not a disk number is an image file */
+static
+BOOL
+IsDiskTarget(
+    _In_ PWSTR pszTarget)
+{
+    return (pszTarget[0] != UNICODE_NULL) &&
+           (pszTarget[wcsspn(pszTarget, L"0123456789")] == UNICODE_NULL);
+}
+
+
+static
+PDISKENTRY
+GetCloneTargetDisk(
+    _In_ PWSTR pszTarget)
+{
+    PLIST_ENTRY Entry;
+    PDISKENTRY DiskEntry;
+    ULONG ulDiskNumber;
+
+    ulDiskNumber = wcstoul(pszTarget, NULL, 10);
+
+    /* Background jobs on the target finish before it is inspected */
+    if (HasActiveJobs(ulDiskNumber))
+    {
+        ConResPrintf(StdOut, IDS_JOB_WAITING, ulDiskNumber);
+        WaitForDiskJobs(ulDiskNumber);
+    }
+
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
+        if (DiskEntry->DiskNumber == ulDiskNumber)
+            return DiskEntry;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Writes the layout of the source disk to the cloned disk. The disk driver
+ * places the GPT backup structures at the end of the target, which may be
+ * larger than the source. The clone gets a new disk signature or GPT disk id,
+ * and new GPT partition ids, so both disks can be online at the same time.
+ */
+static
+NTSTATUS
+WriteCloneLayout(
+    _In_ PDISKENTRY SourceDisk,
+    _In_ PDISKENTRY TargetDisk)
+{
+    PDRIVE_LAYOUT_INFORMATION_EX LayoutBuffer;
+    HANDLE FileHandle;
+    IO_STATUS_BLOCK Iosb;
+    ULONG BufferSize, Index;
+    NTSTATUS Status;
+
+    BufferSize = sizeof(DRIVE_LAYOUT_INFORMATION_EX) +
+                 ((SourceDisk->LayoutBuffer->PartitionCount - 1) * sizeof(PARTITION_INFORMATION_EX));
+
+    LayoutBuffer = RtlAllocateHeap(RtlGetProcessHeap(), 0, BufferSize);
+    if (LayoutBuffer == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlCopyMemory(LayoutBuffer, SourceDisk->LayoutBuffer, BufferSize);
+    for (Index = 0; Index < LayoutBuffer->PartitionCount; Index++)
+    {
+        LayoutBuffer->PartitionEntry[Index].RewritePartition = TRUE;
+
+        if (LayoutBuffer->PartitionStyle == PARTITION_STYLE_GPT)
+            CreateGUID(&LayoutBuffer->PartitionEntry[Index].Gpt.PartitionId);
+    }
+
+    if (LayoutBuffer->PartitionStyle == PARTITION_STYLE_GPT)
+        CreateGUID(&LayoutBuffer->Gpt.DiskId);
+    else if (LayoutBuffer->PartitionStyle == PARTITION_STYLE_MBR)
+        CreateSignature(&LayoutBuffer->Mbr.Signature);
+
+    Status = GetDiskHandle(TargetDisk, TRUE, &FileHandle);
+    if (NT_SUCCESS(Status))
+    {
+        Status = NtDeviceIoControlFile(FileHandle,
+                                       NULL,
+                                       NULL,
+                                       NULL,
+                                       &Iosb,
+                                       IOCTL_DISK_SET_DRIVE_LAYOUT_EX,
+                                       LayoutBuffer,
+                                       BufferSize,
+                                       NULL,
+                                       0);
+    }
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, LayoutBuffer);
+
+    return Status;
+}
+
+
+/*
+ * Adds the cloned partition to the layout of the target disk. The new entry
+ * keeps the type of the source partition and gets a new GPT partition id.
+ */
+static
+NTSTATUS
+WriteClonePartition(
+    _In_ PDISKENTRY TargetDisk,
+    _In_ PPARTENTRY NewPartEntry,
+    _In_ PPARTENTRY SourcePartEntry)
+{
+    NewPartEntry->LogicalPartition = FALSE;
+    NewPartEntry->IsPartitioned = TRUE;
+    NewPartEntry->New = TRUE;
+    NewPartEntry->PartitionNumber = 0;
+    NewPartEntry->FormatState = SourcePartEntry->FormatState;
+    TargetDisk->Dirty = TRUE;
+
+    if (TargetDisk->PartitionStyle == PARTITION_STYLE_GPT)
+    {
+        CopyMemory(&NewPartEntry->Gpt.PartitionType, &SourcePartEntry->Gpt.PartitionType, sizeof(GUID));
+        CreateGUID(&NewPartEntry->Gpt.PartitionId);
+        NewPartEntry->Gpt.Attributes = SourcePartEntry->Gpt.Attributes;
+
+        UpdateGptDiskLayout(TargetDisk, FALSE);
+        return WriteGptPartitions(TargetDisk);
+    }
+
+    NewPartEntry->Mbr.PartitionType = SourcePartEntry->Mbr.PartitionType;
+    NewPartEntry->Mbr.BootIndicator = FALSE;
+
+    UpdateMbrDiskLayout(TargetDisk);
+    return WriteMbrPartitions(TargetDisk);
+}
+
+
+static
+NTSTATUS
+RunCloneJob(
+    _In_opt_ PJOB Job,
+    _In_ PVOID Parameter)
+{
+    PCLONE_JOB CloneJob = Parameter;
+
+    CloneJob->Clone.Job = Job;
+
+    return RunClone(&CloneJob->Clone);
+}
+
+
+/*
+ * Runs on the interpreter thread once the copy is done, so it may update the
+ * disk list. The data goes first, so a failed clone never shows up as a
+ * partition.
+ */
+static
+VOID
+CompleteCloneJob(
+    _In_ NTSTATUS Status,
+    _In_ PVOID Parameter)
+{
+    PCLONE_JOB CloneJob = Parameter;
+    PCLONE_CONTEXT Context = &CloneJob->Clone;
+
+    CloseIoEngine(&Context->Target);
+    CloseIoEngine(&Context->Source);
+
+    if (Context->Map != NULL)
+        DestroyFsMap(Context->Map);
+
+    if (NT_SUCCESS(Status) && (CloneJob->TargetDisk != NULL))
+    {
+        if (CloneJob->SourcePartEntry != NULL)
+            Status = WriteClonePartition(CloneJob->TargetDisk,
+                                         CloneJob->NewPartEntry,
+                                         CloneJob->SourcePartEntry);
+        else if (CloneJob->SourceDisk->LayoutBuffer != NULL)
+            Status = WriteCloneLayout(CloneJob->SourceDisk, CloneJob->TargetDisk);
+    }
+
+    /* Also drops the claimed entry from the list if the clone failed */
+    if (CloneJob->TargetDisk != NULL)
+        RescanAfterJobs();
+
+    if (Context->ElapsedMs != 0)
+    {
+        ConResPrintf(StdOut, IDS_CLONE_RESULT,
+                     Context->BytesRead / (SIZE_1KB * SIZE_1KB),
+                     Context->BytesWritten / (SIZE_1KB * SIZE_1KB),
+                     Context->BytesSkipped / (SIZE_1KB * SIZE_1KB),
+                     Context->ElapsedMs,
+                     ((Context->BytesRead / SIZE_1KB) * 1000) / Context->ElapsedMs / 1024);
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Clone failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_CLONE_FAIL);
+    }
+    else
+    {
+        ConResPuts(StdOut, IDS_CLONE_SUCCESS);
+    }
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, CloneJob);
+}
+
+
+static
+PCLONE_JOB
+AllocateCloneJob(VOID)
+{
+    PCLONE_JOB CloneJob;
+
+    CloneJob = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(CLONE_JOB));
+    if (CloneJob == NULL)
+        ConResPuts(StdOut, IDS_CLONE_FAIL);
+
+    return CloneJob;
+}
+
+
+static
+VOID
+ClonePartitionToDisk(
+    _In_ PDISKENTRY TargetDisk,
+    _In_ ULONGLONG ullOffset,
+    _In_ BOOL bSparse,
+    _In_ BOOL bUsed,
+    _In_ PQOS_SETTINGS Qos,
+    _In_ BOOL bNoWait,
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PCLONE_JOB CloneJob;
+    PCLONE_CONTEXT Context;
+    PPARTENTRY NewPartEntry;
+    ULONGLONG ullSourceStart = CurrentPartition->StartSector.QuadPart;
+    NTSTATUS Status;
+
+    if (TargetDisk->PartitionStyle != CurrentDisk->PartitionStyle)
+    {
+        ConResPuts(StdOut, IDS_CLONE_STYLE_MISMATCH);
+        return;
+    }
+
+    if (TargetDisk->BytesPerSector != CurrentDisk->BytesPerSector)
+    {
+        ConResPuts(StdOut, IDS_CLONE_SECTOR_MISMATCH);
+        return;
+    }
+
+    if ((TargetDisk->PartitionStyle == PARTITION_STYLE_MBR) &&
+        (GetPrimaryPartitionCount(TargetDisk) >= 4))
+    {
+        ConResPuts(StdOut, IDS_CLONE_NO_SPACE);
+        return;
+    }
+
+    CloneJob = AllocateCloneJob();
+    if (CloneJob == NULL)
+        return;
+
+    NewPartEntry = AllocateUnusedSpace(TargetDisk,
+                                       &TargetDisk->PrimaryPartListHead,
+                                       CurrentPartition->SectorCount.QuadPart,
+                                       ullOffset,
+                                       0,
+                                       PlacementFirst);
+    if (NewPartEntry == NULL)
+    {
+        ConResPuts(StdOut, IDS_CLONE_NO_SPACE);
+        RtlFreeHeap(RtlGetProcessHeap(), 0, CloneJob);
+        return;
+    }
+
+    CloneJob->TargetDisk = TargetDisk;
+    CloneJob->SourcePartEntry = CurrentPartition;
+    CloneJob->NewPartEntry = NewPartEntry;
+
+    Context = &CloneJob->Clone;
+    Context->Length = CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+    Context->TargetOffset = NewPartEntry->StartSector.QuadPart * TargetDisk->BytesPerSector;
+    Context->bSkipZero = bSparse;
+    Context->bDiscard = bSparse && IsDiscardSupported(TargetDisk);
+    Context->bFixHiddenSectors = (NewPartEntry->StartSector.QuadPart != ullSourceStart);
+    Context->OldHiddenSectors = (ULONG)ullSourceStart;
+    Context->NewHiddenSectors = NewPartEntry->StartSector.LowPart;
+    Context->QosSettings = *Qos;
+
+    /* The unused space of the target keeps its old content, as the file system ignores it */
+    if (bUsed)
+        Context->Map = GetCloneMap(CurrentPartition->PartitionNumber, Context->Length);
+
+    Status = OpenCloneEngine(&Context->Source,
+                             CurrentDisk->DiskNumber,
+                             CurrentPartition->PartitionNumber,
+                             FILE_READ_DATA);
+    if (NT_SUCCESS(Status))
+        Status = OpenCloneEngine(&Context->Target,
+                                 TargetDisk->DiskNumber,
+                                 0,
+                                 FILE_READ_DATA | FILE_WRITE_DATA);
+    if (!NT_SUCCESS(Status))
+    {
+        CompleteCloneJob(Status, CloneJob);
+        return;
+    }
+
+    StartJob(bNoWait, argc, argv,
+             CurrentDisk->DiskNumber, TargetDisk->DiskNumber,
+             RunCloneJob, CompleteCloneJob, CloneJob);
+}
+
+
+static
+VOID
+CloneToImage(
+    _In_ PWSTR pszFileName,
+    _In_ ULONG PartitionNumber,
+    _In_ ULONGLONG ullLength,
+    _In_ BOOL bUsed,
+    _In_ PQOS_SETTINGS Qos,
+    _In_ BOOL bNoWait,
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PCLONE_JOB CloneJob;
+    PCLONE_CONTEXT Context;
+    NTSTATUS Status;
+
+    CloneJob = AllocateCloneJob();
+    if (CloneJob == NULL)
+        return;
+
+    Context = &CloneJob->Clone;
+    Context->Length = ullLength;
+    Context->bSkipZero = TRUE;
+    Context->QosSettings = *Qos;
+
+    /* The unused space stays a hole in the image */
+    if (bUsed)
+        Context->Map = GetCloneMap(PartitionNumber, ullLength);
+
+    Status = OpenCloneEngine(&Context->Source,
+                             CurrentDisk->DiskNumber,
+                             PartitionNumber,
+                             FILE_READ_DATA);
+    if (NT_SUCCESS(Status))
+        Status = CreateCloneImage(pszFileName, ullLength, &Context->Target);
+    if (!NT_SUCCESS(Status))
+    {
+        CompleteCloneJob(Status, CloneJob);
+        return;
+    }
+
+    StartJob(bNoWait, argc, argv,
+             CurrentDisk->DiskNumber, JOB_NO_DISK,
+             RunCloneJob, CompleteCloneJob, CloneJob);
+}
+
+
+static
+BOOL
+ParseCloneArguments(
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _Out_ PWSTR *ppszTarget,
+    _Out_ PULONGLONG pullOffset,
+    _Out_ PBOOL pbSparse,
+    _Out_ PBOOL pbUsed,
+    _Out_ PQOS_SETTINGS Qos,
+    _Out_ PBOOL pbNoWait)
+{
+    PWSTR pszSuffix = NULL;
+    ULONGLONG ullBytes;
+    INT i;
+
+    *ppszTarget = NULL;
+    *pullOffset = 0;
+    *pbSparse = FALSE;
+    *pbUsed = FALSE;
+    *pbNoWait = FALSE;
+    GetQosSettings(Qos);
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"target=", &pszSuffix))
+        {
+            /* target=<N> | <file> */
+            if (*ppszTarget != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, *ppszTarget);
+
+            *ppszTarget = DuplicateQuotedString(pszSuffix);
+            if (*ppszTarget == NULL)
+                return FALSE;
+        }
+        else if (HasPrefix(argv[i], L"offset=", &pszSuffix))
+        {
+            /* offset=<N> (KB) */
+            ullBytes = _wcstoui64(pszSuffix, NULL, 10) * SIZE_1KB;
+            if ((ullBytes == 0) || ((ullBytes % CurrentDisk->BytesPerSector) != 0))
+                return FALSE;
+
+            *pullOffset = ullBytes / CurrentDisk->BytesPerSector;
+        }
+        else if (_wcsicmp(argv[i], L"sparse") == 0)
+        {
+            *pbSparse = TRUE;
+        }
+        else if (_wcsicmp(argv[i], L"used") == 0)
+        {
+            *pbUsed = TRUE;
+        }
+        else if (HasPrefix(argv[i], L"qos=", &pszSuffix))
+        {
+            /* qos=<setting>[,<setting>...] */
+            if (!ParseQosSettings(pszSuffix, Qos))
+                return FALSE;
+        }
+        else if (_wcsicmp(argv[i], L"nowait") == 0)
+        {
+            *pbNoWait = TRUE;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+
+    return (*ppszTarget != NULL);
+}
+
+
+EXIT_CODE
+ClonePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PDISKENTRY TargetDisk;
+    PWSTR pszTarget = NULL;
+    ULONGLONG ullOffset;
+    BOOL bSparse, bUsed, bNoWait;
+    QOS_SETTINGS Qos;
+
+    DPRINT("ClonePartition()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    if (CurrentPartition == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+        return EXIT_SUCCESS;
+    }
+
+    if (!ParseCloneArguments(argc, argv, &pszTarget, &ullOffset, &bSparse, &bUsed, &Qos, &bNoWait))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        goto done;
+    }
+
+    if ((CurrentPartition->PartitionNumber == 0) ||
+        ((CurrentDisk->PartitionStyle == PARTITION_STYLE_MBR) &&
+         IsContainerPartition(CurrentPartition->Mbr.PartitionType)))
+    {
+        ConResPuts(StdOut, IDS_CLONE_PARTITION_TYPE);
+        goto done;
+    }
+
+    if (!IsDiskTarget(pszTarget))
+    {
+        /* Image files always hold the partition at offset 0 */
+        if (ullOffset != 0)
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        else
+            CloneToImage(pszTarget,
+                         CurrentPartition->PartitionNumber,
+                         CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector,
+                         bUsed,
+                         &Qos,
+                         bNoWait,
+                         argc,
+                         argv);
+        goto done;
+    }
+
+    TargetDisk = GetCloneTargetDisk(pszTarget);
+    /* Waiting for the jobs on the target may have rebuilt the list */
+    if ((TargetDisk == NULL) || (CurrentPartition == NULL))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        goto done;
+    }
+
+    ClonePartitionToDisk(TargetDisk, ullOffset, bSparse, bUsed, &Qos, bNoWait, argc, argv);
+
+done:
+    if (pszTarget != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszTarget);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+CloneDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PCLONE_JOB CloneJob;
+    PCLONE_CONTEXT Context;
+    PDISKENTRY TargetDisk;
+    PWSTR pszTarget = NULL;
+    ULONGLONG ullOffset;
+    BOOL bSparse, bUsed, bNoWait;
+    QOS_SETTINGS Qos;
+    NTSTATUS Status;
+
+    DPRINT("CloneDisk()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    /* A disk has no single file system to take the used blocks from */
+    if (!ParseCloneArguments(argc, argv, &pszTarget, &ullOffset, &bSparse, &bUsed, &Qos, &bNoWait) ||
+        (ullOffset != 0) || bUsed)
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        goto done;
+    }
+
+    if (!IsDiskTarget(pszTarget))
+    {
+        CloneToImage(pszTarget,
+                     0,
+                     CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector,
+                     FALSE,
+                     &Qos,
+                     bNoWait,
+                     argc,
+                     argv);
+        goto done;
+    }
+
+    TargetDisk = GetCloneTargetDisk(pszTarget);
+    if ((TargetDisk == NULL) || (TargetDisk == CurrentDisk))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        goto done;
+    }
+
+    if (TargetDisk->BytesPerSector != CurrentDisk->BytesPerSector)
+    {
+        ConResPuts(StdOut, IDS_CLONE_SECTOR_MISMATCH);
+        goto done;
+    }
+
+    if (TargetDisk->SectorCount.QuadPart < CurrentDisk->SectorCount.QuadPart)
+    {
+        ConResPuts(StdOut, IDS_CLONE_NO_SPACE);
+        goto done;
+    }
+
+    /* Like CLEAN, the target must not hold any partitions that would be lost */
+    if (!IsDiskEmpty(TargetDisk))
+    {
+        ConResPuts(StdOut, IDS_CLONE_TARGET_NOT_EMPTY);
+        goto done;
+    }
+
+    CloneJob = AllocateCloneJob();
+    if (CloneJob == NULL)
+        goto done;
+
+    CloneJob->SourceDisk = CurrentDisk;
+    CloneJob->TargetDisk = TargetDisk;
+
+    Context = &CloneJob->Clone;
+    Context->Length = CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+    Context->bSkipZero = bSparse;
+    Context->bDiscard = bSparse && IsDiscardSupported(TargetDisk);
+    Context->QosSettings = Qos;
+
+    Status = OpenCloneEngine(&Context->Source,
+                             CurrentDisk->DiskNumber,
+                             0,
+                             FILE_READ_DATA);
+    if (NT_SUCCESS(Status))
+        Status = OpenCloneEngine(&Context->Target,
+                                 TargetDisk->DiskNumber,
+                                 0,
+                                 FILE_READ_DATA | FILE_WRITE_DATA);
+    if (!NT_SUCCESS(Status))
+    {
+        CompleteCloneJob(Status, CloneJob);
+        goto done;
+    }
+
+    StartJob(bNoWait, argc, argv,
+             CurrentDisk->DiskNumber, TargetDisk->DiskNumber,
+             RunCloneJob, CompleteCloneJob, CloneJob);
+
+done:
+    if (pszTarget != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszTarget);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,731 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/compare.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define COMPARE_CHUNK_SIZE          (4 * 1024 * 1024)
+#define COMPARE_QUEUE_DEPTH         4
+#define COMPARE_EXTENT_GROW_COUNT   1024
+
+/* Byte range that differs, relative to the start of the compared objects */
+typedef struct _COMPARE_EXTENT
+{
+    ULONGLONG Offset;
+    ULONGLONG Length;
+} COMPARE_EXTENT, *PCOMPARE_EXTENT;
+
+/* One side of the comparison */
+typedef struct _COMPARE_SIDE
+{
+    IO_ENGINE Engine;
+    ULONGLONG Offset;       /* Bytes, start of the object in the disk or file */
+    ULONGLONG Length;
+} COMPARE_SIDE, *PCOMPARE_SIDE;
+
+typedef struct _COMPARE_SLOT
+{
+    BOOL bBusy;             /* Holds a chunk that has not been compared yet */
+    ULONGLONG SourceMark;   /* Engine marks that cover the reads of the chunk */
+    ULONGLONG TargetMark;
+    PUCHAR SourceBuffer;
+    PUCHAR TargetBuffer;
+    ULONGLONG Chunk;
+    ULONG Length;
+} COMPARE_SLOT, *PCOMPARE_SLOT;
+
+typedef struct _COMPARE_CONTEXT
+{
+    COMPARE_SIDE Source;
+    COMPARE_SIDE Target;
+    ULONG SectorSize;       /* Granularity of the reported ranges */
+    ULONGLONG Length;       /* Bytes compared, the shorter of both sides */
+    BOOL bAll;              /* Report every range instead of stopping at the first one */
+
+    ULONGLONG ChunkCount;
+    ULONGLONG NextChunk;    /* Next chunk to read */
+    ULONGLONG NextCompare;  /* Chunks are compared in order, so ranges can be merged */
+    BOOL bStop;
+
+    ULONG ExtentCount;
+    ULONG MaxExtents;
+    PCOMPARE_EXTENT Extents;
+    ULONGLONG DifferentBytes;
+
+    QOS_SETTINGS QosSettings;
+    QOS_BUCKET Qos;
+} COMPARE_CONTEXT, *PCOMPARE_CONTEXT;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+NTSTATUS
+AddCompareExtent(
+    _In_ PCOMPARE_CONTEXT Context,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONGLONG ullLength)
+{
+    PCOMPARE_EXTENT Extent, NewExtents;
+
+    Context->DifferentBytes += ullLength;
+
+    /* A range that continues in the next chunk is merged */
+    if (Context->ExtentCount > 0)
+    {
+        Extent = &Context->Extents[Context->ExtentCount - 1];
+        if (Extent->Offset + Extent->Length == ullOffset)
+        {
+            Extent->Length += ullLength;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    if (Context->ExtentCount == Context->MaxExtents)
+    {
+        NewExtents = RtlAllocateHeap(RtlGetProcessHeap(),
+                                     0,
+                                     (Context->MaxExtents + COMPARE_EXTENT_GROW_COUNT) * sizeof(COMPARE_EXTENT));
+        if (NewExtents == NULL)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        if (Context->Extents != NULL)
+        {
+            RtlCopyMemory(NewExtents, Context->Extents, Context->ExtentCount * sizeof(COMPARE_EXTENT));
+            RtlFreeHeap(RtlGetProcessHeap(), 0, Context->Extents);
+        }
+
+        Context->Extents = NewExtents;
+        Context->MaxExtents += COMPARE_EXTENT_GROW_COUNT;
+    }
+
+    Context->Extents[Context->ExtentCount].Offset = ullOffset;
+    Context->Extents[Context->ExtentCount].Length = ullLength;
+    Context->ExtentCount++;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * RtlCompareMemory returns the length of the matching prefix, so equal data
+ * is skipped in one call. Differing data is walked sector by sector to find
+ * where the range ends.
+ */
+static
+NTSTATUS
+CompareChunk(
+    _In_ PCOMPARE_CONTEXT Context,
+    _In_ PCOMPARE_SLOT Slot)
+{
+    ULONGLONG ullBase = Slot->Chunk * COMPARE_CHUNK_SIZE;
+    ULONG ulOffset = 0, ulStart, ulSize;
+    NTSTATUS Status;
+
+    while (ulOffset < Slot->Length)
+    {
+        ulOffset += (ULONG)RtlCompareMemory(Slot->SourceBuffer + ulOffset,
+                                            Slot->TargetBuffer + ulOffset,
+                                            Slot->Length - ulOffset);
+        if (ulOffset >= Slot->Length)
+            break;
+
+        ulOffset -= ulOffset % Context->SectorSize;
+        ulStart = ulOffset;
+
+        while (ulOffset < Slot->Length)
+        {
+            ulSize = min(Context->SectorSize, Slot->Length - ulOffset);
+            if (RtlCompareMemory(Slot->SourceBuffer + ulOffset,
+                                 Slot->TargetBuffer + ulOffset,
+                                 ulSize) == ulSize)
+            {
+                break;
+            }
+
+            ulOffset += ulSize;
+        }
+
+        Status = AddCompareExtent(Context, ullBase + ulStart, ulOffset - ulStart);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        if (!Context->bAll)
+        {
+            Context->bStop = TRUE;
+            break;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+SubmitCompareRead(
+    _In_ PCOMPARE_SIDE Side,
+    _In_ PCOMPARE_SLOT Slot,
+    _In_ PUCHAR Buffer,
+    _Out_ PULONGLONG pullMark)
+{
+    NTSTATUS Status;
+
+    Status = QueueReadIoEngine(&Side->Engine,
+                               Side->Offset + (Slot->Chunk * COMPARE_CHUNK_SIZE),
+                               Buffer,
+                               Slot->Length);
+    *pullMark = GetIoEngineMark(&Side->Engine);
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+StartCompareChunk(
+    _In_ PCOMPARE_CONTEXT Context,
+    _In_ PCOMPARE_SLOT Slot)
+{
+    NTSTATUS Status;
+
+    if (Context->bStop || (Context->NextChunk >= Context->ChunkCount))
+        return STATUS_SUCCESS;
+
+    Slot->Chunk = Context->NextChunk++;
+    Slot->Length = (ULONG)min((ULONGLONG)COMPARE_CHUNK_SIZE,
+                              Context->Length - (Slot->Chunk * COMPARE_CHUNK_SIZE));
+    Slot->bBusy = TRUE;
+
+    /* Both sides are read at the same time */
+    Status = SubmitCompareRead(&Context->Source, Slot, Slot->SourceBuffer, &Slot->SourceMark);
+    if (NT_SUCCESS(Status))
+        Status = SubmitCompareRead(&Context->Target, Slot, Slot->TargetBuffer, &Slot->TargetMark);
+
+    return Status;
+}
+
+
+/*
+ * The reads of both sides are queued on their engines, one chunk per slot.
+ * The slots are compared in turn, so the chunks are compared in order, and
+ * a slot is refilled as soon as its chunk has been compared.
+ */
+static
+NTSTATUS
+RunCompare(
+    _In_ PCOMPARE_CONTEXT Context)
+{
+    COMPARE_SLOT Slots[COMPARE_QUEUE_DEPTH];
+    ULONG Index, ulPercent, ulLastPercent = 0;
+    PCOMPARE_SLOT Slot;
+    PUCHAR BufferBase;
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    RtlZeroMemory(Slots, sizeof(Slots));
+
+    BufferBase = AllocateIoBuffer((SIZE_T)COMPARE_CHUNK_SIZE * 2 * COMPARE_QUEUE_DEPTH);
+    if (BufferBase == NULL)
+        return STATUS_NO_MEMORY;
+
+    for (Index = 0; Index < COMPARE_QUEUE_DEPTH; Index++)
+    {
+        Slots[Index].SourceBuffer = BufferBase + ((SIZE_T)Index * 2 * COMPARE_CHUNK_SIZE);
+        Slots[Index].TargetBuffer = Slots[Index].SourceBuffer + COMPARE_CHUNK_SIZE;
+    }
+
+    for (Index = 0; (Index < COMPARE_QUEUE_DEPTH) && NT_SUCCESS(Status); Index++)
+        Status = StartCompareChunk(Context, &Slots[Index]);
+
+    Index = 0;
+    while (NT_SUCCESS(Status) && !Context->bStop && Slots[Index].bBusy)
+    {
+        Slot = &Slots[Index];
+
+        Status = WaitForIoEngine(&Context->Source.Engine, Slot->SourceMark);
+        if (NT_SUCCESS(Status))
+            Status = WaitForIoEngine(&Context->Target.Engine, Slot->TargetMark);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Compare read failed (Status 0x%08lx)\n", Status);
+            break;
+        }
+
+        Status = CompareChunk(Context, Slot);
+        Slot->bBusy = FALSE;
+        Context->NextCompare++;
+
+        ulPercent = (ULONG)((Context->NextCompare * 100) / Context->ChunkCount);
+        if (ulPercent != ulLastPercent)
+        {
+            ConResPrintf(StdOut, IDS_COMPARE_PROGRESS, ulPercent);
+            ulLastPercent = ulPercent;
+        }
+
+        if (NT_SUCCESS(Status))
+            Status = StartCompareChunk(Context, Slot);
+
+        Index = (Index + 1) % COMPARE_QUEUE_DEPTH;
+    }
+
+    /* Never release buffers that are still owned by pending reads */
+    FlushIoEngine(&Context->Source.Engine);
+    FlushIoEngine(&Context->Target.Engine);
+
+    FreeIoBuffer(BufferBase);
+
+    return Status;
+}
+
+
+static
+VOID
+PrintCompareResult(
+    _In_ PCOMPARE_CONTEXT Context,
+    _In_ ULONGLONG ullElapsedMs)
+{
+    ULONGLONG ullCompared;
+    ULONG Index;
+
+    if (Context->ExtentCount == 0)
+    {
+        ConResPuts(StdOut, IDS_COMPARE_IDENTICAL);
+    }
+    else if (!Context->bAll)
+    {
+        ConResPrintf(StdOut, IDS_COMPARE_FIRST,
+                     Context->Extents[0].Offset,
+                     Context->Extents[0].Length);
+    }
+    else
+    {
+        ConResPuts(StdOut, IDS_COMPARE_HEAD);
+        ConResPuts(StdOut, IDS_COMPARE_LINE);
+
+        for (Index = 0; Index < Context->ExtentCount; Index++)
+        {
+            ConResPrintf(StdOut, IDS_COMPARE_FORMAT,
+                         Context->Extents[Index].Offset,
+                         Context->Extents[Index].Length);
+        }
+
+        ConResPrintf(StdOut, IDS_COMPARE_SUMMARY,
+                     Context->DifferentBytes,
+                     Context->ExtentCount);
+    }
+
+    if (ullElapsedMs == 0)
+        ullElapsedMs = 1;
+
+    ullCompared = min(Context->NextCompare * COMPARE_CHUNK_SIZE, Context->Length);
+    ConResPrintf(StdOut, IDS_COMPARE_RESULT,
+                 ullCompared / (SIZE_1KB * SIZE_1KB),
+                 ullElapsedMs,
+                 ((ullCompared / SIZE_1KB) * 1000) / ullElapsedMs / 1024);
+}
+
+
+static
+NTSTATUS
+OpenCompareImage(
+    _In_ PWSTR pszFileName,
+    _Out_ PIO_ENGINE Engine,
+    _Out_ PULONGLONG pullLength)
+{
+    UNICODE_STRING Name;
+    IO_STATUS_BLOCK Iosb;
+    FILE_STANDARD_INFORMATION StandardInfo;
+    NTSTATUS Status;
+
+    if (!RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+        return STATUS_OBJECT_NAME_INVALID;
+
+    Status = OpenIoEngine(Engine, &Name, FILE_GENERIC_READ, FILE_SHARE_READ);
+    RtlFreeUnicodeString(&Name);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtQueryInformationFile(Engine->FileHandle,
+                                    &Iosb,
+                                    &StandardInfo,
+                                    sizeof(StandardInfo),
+                                    FileStandardInformation);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    *pullLength = StandardInfo.EndOfFile.QuadPart;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+PDISKENTRY
+GetCompareDisk(
+    _In_ ULONG DiskNumber)
+{
+    PLIST_ENTRY Entry;
+    PDISKENTRY DiskEntry;
+
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
+        if (DiskEntry->DiskNumber == DiskNumber)
+            return DiskEntry;
+    }
+
+    return NULL;
+}
+
+
+static
+PPARTENTRY
+FindComparePartition(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PLIST_ENTRY ListHead,
+    _In_ ULONG PartitionNumber,
+    _Inout_ PULONG pulNumber)
+{
+    PLIST_ENTRY Entry;
+    PPARTENTRY PartEntry;
+    BOOL bUsed;
+
+    for (Entry = ListHead->Flink; Entry != ListHead; Entry = Entry->Flink)
+    {
+        PartEntry = CONTAINING_RECORD(Entry, PARTENTRY, ListEntry);
+
+        if (DiskEntry->PartitionStyle == PARTITION_STYLE_MBR)
+            bUsed = (PartEntry->Mbr.PartitionType != PARTITION_ENTRY_UNUSED);
+        else
+            bUsed = !IsEqualGUID(&PartEntry->Gpt.PartitionType, &PARTITION_ENTRY_UNUSED_GUID);
+
+        if (!bUsed)
+            continue;
+
+        if (*pulNumber == PartitionNumber)
+            return PartEntry;
+
+        (*pulNumber)++;
+    }
+
+    return NULL;
+}
+
+
+/* Finds a partition by the number that SELECT PARTITION and LIST PARTITION use */
+static
+PPARTENTRY
+GetComparePartition(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ ULONG PartitionNumber)
+{
+    PPARTENTRY PartEntry;
+    ULONG ulNumber = 1;
+
+    PartEntry = FindComparePartition(DiskEntry,
+                                     &DiskEntry->PrimaryPartListHead,
+                                     PartitionNumber,
+                                     &ulNumber);
+    if ((PartEntry == NULL) && (DiskEntry->PartitionStyle == PARTITION_STYLE_MBR))
+    {
+        PartEntry = FindComparePartition(DiskEntry,
+                                         &DiskEntry->LogicalPartListHead,
+                                         PartitionNumber,
+                                         &ulNumber);
+    }
+
+    return PartEntry;
+}
+
+
+static
+BOOL
+IsDiskNumber(
+    _In_ PWSTR pszTarget)
+{
+    return (pszTarget[0] != UNICODE_NULL) &&
+           (pszTarget[wcsspn(pszTarget, L"0123456789")] == UNICODE_NULL);
+}
+
+
+/*
+ * Compares the source range of the current disk with a target, which is an
+ * image file, a whole disk or, when ulPartition is not zero, a partition of
+ * a disk.
+ */
+static
+VOID
+CompareWithTarget(
+    _In_ PCOMPARE_CONTEXT Context,
+    _In_ PWSTR pszTarget,
+    _In_ ULONG ulPartition)
+{
+    PDISKENTRY TargetDisk;
+    PPARTENTRY TargetPartition;
+    LARGE_INTEGER Frequency, StartTime, Now;
+    ULONG ulDiskNumber;
+    NTSTATUS Status;
+
+    if (!IsDiskNumber(pszTarget))
+    {
+        if (ulPartition != 0)
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            return;
+        }
+
+        Status = OpenCompareImage(pszTarget, &Context->Target.Engine, &Context->Target.Length);
+    }
+    else
+    {
+        ulDiskNumber = wcstoul(pszTarget, NULL, 10);
+
+        TargetDisk = GetCompareDisk(ulDiskNumber);
+        if (TargetDisk == NULL)
+        {
+            ConResPrintf(StdOut, IDS_COMPARE_NO_DISK, ulDiskNumber);
+            return;
+        }
+
+        Context->Target.Length = TargetDisk->SectorCount.QuadPart * TargetDisk->BytesPerSector;
+
+        if (ulPartition != 0)
+        {
+            TargetPartition = GetComparePartition(TargetDisk, ulPartition);
+            if (TargetPartition == NULL)
+            {
+                ConResPrintf(StdOut, IDS_COMPARE_NO_PARTITION, ulPartition, ulDiskNumber);
+                return;
+            }
+
+            Context->Target.Offset = TargetPartition->StartSector.QuadPart * TargetDisk->BytesPerSector;
+            Context->Target.Length = TargetPartition->SectorCount.QuadPart * TargetDisk->BytesPerSector;
+        }
+
+        Status = OpenDiskIoEngine(&Context->Target.Engine, TargetDisk);
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Opening the target failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_COMPARE_FAIL);
+        return;
+    }
+
+    Status = OpenDiskIoEngine(&Context->Source.Engine, CurrentDisk);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("OpenDiskIoEngine() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_COMPARE_FAIL);
+        return;
+    }
+
+    Context->SectorSize = CurrentDisk->BytesPerSector;
+
+    Context->Length = min(Context->Source.Length, Context->Target.Length);
+    if (Context->Source.Length != Context->Target.Length)
+    {
+        ConResPrintf(StdOut, IDS_COMPARE_SIZE,
+                     Context->Source.Length / (SIZE_1KB * SIZE_1KB),
+                     Context->Target.Length / (SIZE_1KB * SIZE_1KB),
+                     Context->Length / (SIZE_1KB * SIZE_1KB));
+    }
+
+    if (Context->Length == 0)
+    {
+        ConResPuts(StdOut, IDS_COMPARE_FAIL);
+        return;
+    }
+
+    Context->ChunkCount = (Context->Length + COMPARE_CHUNK_SIZE - 1) / COMPARE_CHUNK_SIZE;
+
+    InitializeQosBucket(&Context->Qos, &Context->QosSettings, NULL);
+    AddQosDevice(&Context->Qos, Context->Source.Engine.FileHandle);
+    AddQosDevice(&Context->Qos, Context->Target.Engine.FileHandle);
+    Context->Source.Engine.Qos = &Context->Qos;
+    Context->Target.Engine.Qos = &Context->Qos;
+
+    NtQueryPerformanceCounter(&StartTime, &Frequency);
+    Status = RunCompare(Context);
+    NtQueryPerformanceCounter(&Now, NULL);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("RunCompare() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_COMPARE_FAIL);
+        return;
+    }
+
+    PrintCompareResult(Context, ((ULONGLONG)(Now.QuadPart - StartTime.QuadPart) * 1000) / Frequency.QuadPart);
+}
+
+
+static
+BOOL
+ParseCompareArguments(
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _In_ BOOL bPartition,
+    _Out_ PWSTR *ppszTarget,
+    _Out_ PULONG pulPartition,
+    _Out_ PBOOL pbAll,
+    _Out_ PQOS_SETTINGS Qos)
+{
+    PWSTR pszSuffix = NULL;
+    INT i;
+
+    *ppszTarget = NULL;
+    *pulPartition = 0;
+    *pbAll = FALSE;
+    GetQosSettings(Qos);
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"target=", &pszSuffix))
+        {
+            /* target=<N> | <file> */
+            if (*ppszTarget != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, *ppszTarget);
+
+            *ppszTarget = DuplicateQuotedString(pszSuffix);
+            if (*ppszTarget == NULL)
+                return FALSE;
+        }
+        else if (bPartition && HasPrefix(argv[i], L"partition=", &pszSuffix))
+        {
+            /* partition=<N> */
+            *pulPartition = wcstoul(pszSuffix, NULL, 10);
+            if (*pulPartition == 0)
+                return FALSE;
+        }
+        else if (_wcsicmp(argv[i], L"all") == 0)
+        {
+            *pbAll = TRUE;
+        }
+        else if (HasPrefix(argv[i], L"qos=", &pszSuffix))
+        {
+            /* qos=<setting>[,<setting>...] */
+            if (!ParseQosSettings(pszSuffix, Qos))
+                return FALSE;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+
+    /* A partition target needs the disk that holds it */
+    if (bPartition && (*ppszTarget != NULL) && IsDiskNumber(*ppszTarget) && (*pulPartition == 0))
+        return FALSE;
+
+    return (*ppszTarget != NULL);
+}
+
+
+static
+VOID
+CleanupCompare(
+    _In_ PCOMPARE_CONTEXT Context,
+    _In_opt_ PWSTR pszTarget)
+{
+    CloseIoEngine(&Context->Source.Engine);
+    CloseIoEngine(&Context->Target.Engine);
+
+    if (Context->Extents != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Context->Extents);
+
+    if (pszTarget != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszTarget);
+}
+
+
+EXIT_CODE
+CompareDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    COMPARE_CONTEXT Context;
+    PWSTR pszTarget = NULL;
+    ULONG ulPartition;
+
+    DPRINT("CompareDisk()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    RtlZeroMemory(&Context, sizeof(Context));
+
+    if (!ParseCompareArguments(argc, argv, FALSE, &pszTarget, &ulPartition, &Context.bAll, &Context.QosSettings))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        CleanupCompare(&Context, pszTarget);
+        return EXIT_SUCCESS;
+    }
+
+    Context.Source.Length = CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+
+    CompareWithTarget(&Context, pszTarget, 0);
+    CleanupCompare(&Context, pszTarget);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+ComparePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    COMPARE_CONTEXT Context;
+    PWSTR pszTarget = NULL;
+    ULONG ulPartition;
+
+    DPRINT("ComparePartition()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    if (CurrentPartition == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+        return EXIT_SUCCESS;
+    }
+
+    RtlZeroMemory(&Context, sizeof(Context));
+
+    if (!ParseCompareArguments(argc, argv, TRUE, &pszTarget, &ulPartition, &Context.bAll, &Context.QosSettings))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        CleanupCompare(&Context, pszTarget);
+        return EXIT_SUCCESS;
+    }
+
+    if ((CurrentPartition->PartitionNumber == 0) ||
+        ((CurrentDisk->PartitionStyle == PARTITION_STYLE_MBR) &&
+         IsContainerPartition(CurrentPartition->Mbr.PartitionType)))
+    {
+        ConResPuts(StdOut, IDS_COMPARE_PARTITION_TYPE);
+        CleanupCompare(&Context, pszTarget);
+        return EXIT_SUCCESS;
+    }
+
+    Context.Source.Offset = CurrentPartition->StartSector.QuadPart * CurrentDisk->BytesPerSector;
+    Context.Source.Length = CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector;
+
+    CompareWithTarget(&Context, pszTarget, ulPartition);
+    CleanupCompare(&Context, pszTarget);
+
+    return EXIT_SUCCESS;
+}
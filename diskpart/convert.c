@@ -16,37 +16,15 @@ CreateDisk(
     _In_ ULONG DiskNumber,
     _In_ PCREATE_DISK DiskInfo)
 {
-    WCHAR DstPath[MAX_PATH];
-    OBJECT_ATTRIBUTES ObjectAttributes;
-    UNICODE_STRING Name;
-    HANDLE FileHandle = NULL;
+    HANDLE FileHandle;
     IO_STATUS_BLOCK Iosb;
     NTSTATUS Status;
 
     DPRINT("CreateDisk(%lu %p)\n", DiskNumber, DiskInfo);
 
-    StringCchPrintfW(DstPath, ARRAYSIZE(DstPath),
-                     L"\\Device\\Harddisk%lu\\Partition0",
-                     CurrentDisk->DiskNumber);
-    RtlInitUnicodeString(&Name, DstPath);
-
-    InitializeObjectAttributes(&ObjectAttributes,
-                               &Name,
-                               OBJ_CASE_INSENSITIVE,
-                               NULL,
-                               NULL);
-
-    Status = NtOpenFile(&FileHandle,
-                        GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
-                        &ObjectAttributes,
-                        &Iosb,
-                        0,
-                        FILE_SYNCHRONOUS_IO_NONALERT);
+    Status = GetDiskHandle(CurrentDisk, TRUE, &FileHandle);
     if (!NT_SUCCESS(Status))
-    {
-        DPRINT1("NtOpenFile() failed (Status %lx)\n", Status);
-        goto done;
-    }
+        return Status;
 
     Status = NtDeviceIoControlFile(FileHandle,
                                    NULL,
@@ -58,10 +36,14 @@ CreateDisk(
                                    sizeof(*DiskInfo),
                                    NULL,
                                    0);
+
+    /* The first sectors have been rewritten */
+    InvalidateSectorCache(CurrentDisk);
+
     if (!NT_SUCCESS(Status))
     {
         DPRINT1("NtDeviceIoControlFile() failed (Status %lx)\n", Status);
-        goto done;
+        return Status;
     }
 
     /* Free the layout buffer */
@@ -76,10 +58,6 @@ CreateDisk(
 
     ReadLayoutBuffer(FileHandle, CurrentDisk);
 
-done:
-    if (FileHandle)
-        NtClose(FileHandle);
-
     return Status;
 }
 
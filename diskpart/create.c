@@ -11,90 +11,349 @@
 #define NDEBUG
 #include <debug.h>
 
+/* FUNCTIONS ******************************************************************/
+
+/*
+ * Parses align=<N> (KB) into sectors of the current disk. The alignment
+ * must be a whole number of sectors and at most 64 MB.
+ */
+BOOL
+ParseAlignment(
+    _In_ PWSTR pszSuffix,
+    _Out_ PULONG pulAlignment)
+{
+    ULONGLONG ullAlignment;
+
+    if (!IsDecString(pszSuffix))
+        return FALSE;
+
+    /* Checked before the multiplication, which could overflow */
+    ullAlignment = _wcstoui64(pszSuffix, NULL, 10);
+    if ((ullAlignment == 0) ||
+        (ullAlignment > MAXIMUM_PARTITION_ALIGNMENT / 1024))
+        return FALSE;
+
+    ullAlignment *= 1024;
+    if ((ullAlignment % CurrentDisk->BytesPerSector) != 0)
+        return FALSE;
+
+    *pulAlignment = (ULONG)(ullAlignment / CurrentDisk->BytesPerSector);
+
+    return TRUE;
+}
+
+
+/*
+ * Parses offset=<N> (KB) into sectors of the current disk. The offset must
+ * be a whole number of sectors and may not overflow when scaled to bytes.
+ */
+BOOL
+ParseOffset(
+    _In_ PWSTR pszSuffix,
+    _Out_ PULONGLONG pullOffset)
+{
+    ULONGLONG ullOffset;
+
+    /* offset=<N> (KB) */
+    if (!IsDecString(pszSuffix))
+        return FALSE;
+
+    /* Checked before the multiplication, which could overflow */
+    ullOffset = _wcstoui64(pszSuffix, NULL, 10);
+    if ((ullOffset == 0) || (ullOffset > MAXULONGLONG / 1024))
+        return FALSE;
+
+    ullOffset *= 1024;
+    if ((ullOffset % CurrentDisk->BytesPerSector) != 0)
+        return FALSE;
+
+    *pullOffset = ullOffset / CurrentDisk->BytesPerSector;
+
+    return TRUE;
+}
+
+
+static
+BOOL
+ParsePlacement(
+    _In_ PWSTR pszSuffix,
+    _Out_ PARTITION_PLACEMENT *pPlacement)
+{
+    /* placement=first|bestfit|fast|slow */
+    if (_wcsicmp(pszSuffix, L"first") == 0)
+        *pPlacement = PlacementFirst;
+    else if (_wcsicmp(pszSuffix, L"bestfit") == 0)
+        *pPlacement = PlacementBestFit;
+    else if (_wcsicmp(pszSuffix, L"fast") == 0)
+        *pPlacement = PlacementFast;
+    else if (_wcsicmp(pszSuffix, L"slow") == 0)
+        *pPlacement = PlacementSlow;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+
+static
+ULONGLONG
+GetAlignedStartSector(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ ULONGLONG ullStartSector,
+    _In_ ULONG ulAlignment)
+{
+    ullStartSector = max(ullStartSector, (ULONGLONG)DiskEntry->AlignmentOffset);
+
+    return AlignDown(ullStartSector - DiskEntry->AlignmentOffset + ulAlignment - 1, ulAlignment) +
+           DiskEntry->AlignmentOffset;
+}
+
+
+/*
+ * Carves ullSectorCount sectors (0: all the remaining space) out of the
+ * unpartitioned entry PartEntry, starting at ullStartSector (0: the start of
+ * the entry). The start is rounded up to ulAlignment sectors (0: the alignment
+ * of the disk), relative to the alignment offset reported by the disk. Space
+ * skipped in front of the start and space left behind the new entry stays
+ * unpartitioned.
+ */
 static
 PPARTENTRY
-InsertGptPartition(
-    _In_ PDISKENTRY pDisk,
-    _In_ ULONGLONG ullSectorSize,
-    _In_ const GUID *pPartitionType)
+ClaimUnusedSpace(
+    _In_ PPARTENTRY PartEntry,
+    _In_ ULONGLONG ullSectorCount,
+    _In_ ULONGLONG ullStartSector,
+    _In_ ULONG ulAlignment)
 {
-    PPARTENTRY PartEntry, NewPartEntry;
+    PDISKENTRY DiskEntry = PartEntry->DiskEntry;
+    PPARTENTRY NewPartEntry;
+    ULONGLONG ullEndSector;
+
+    if (ulAlignment == 0)
+        ulAlignment = DiskEntry->SectorAlignment;
+
+    ullEndSector = PartEntry->StartSector.QuadPart + PartEntry->SectorCount.QuadPart;
+
+    ullStartSector = GetAlignedStartSector(DiskEntry,
+                                           max(ullStartSector, PartEntry->StartSector.QuadPart),
+                                           ulAlignment);
+    if (ullStartSector >= ullEndSector)
+        return NULL;
+
+    if (ullSectorCount == 0)
+        ullSectorCount = ullEndSector - ullStartSector;
+    else if (ullSectorCount > ullEndSector - ullStartSector)
+        return NULL;
+
+    if (ullStartSector > PartEntry->StartSector.QuadPart)
+    {
+        DPRINT("Skip %I64u sectors for alignment\n", ullStartSector - PartEntry->StartSector.QuadPart);
+        NewPartEntry = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PARTENTRY));
+        if (NewPartEntry == NULL)
+        {
+            ConPuts(StdOut, L"Memory allocation failed!\n");
+            return NULL;
+        }
+
+        NewPartEntry->DiskEntry = DiskEntry;
+        NewPartEntry->LogicalPartition = PartEntry->LogicalPartition;
+        NewPartEntry->IsPartitioned = FALSE;
+        NewPartEntry->StartSector.QuadPart = PartEntry->StartSector.QuadPart;
+        NewPartEntry->SectorCount.QuadPart = ullStartSector - PartEntry->StartSector.QuadPart;
+        NewPartEntry->FormatState = Unformatted;
+
+        PartEntry->StartSector.QuadPart = ullStartSector;
+        PartEntry->SectorCount.QuadPart = ullEndSector - ullStartSector;
+
+        InsertTailList(&PartEntry->ListEntry, &NewPartEntry->ListEntry);
+    }
+
+    if (ullSectorCount == PartEntry->SectorCount.QuadPart)
+    {
+        DPRINT("Claim matching unused space!\n");
+        return PartEntry;
+    }
+
+    DPRINT("Claim part of unused space\n");
+    NewPartEntry = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PARTENTRY));
+    if (NewPartEntry == NULL)
+    {
+        ConPuts(StdOut, L"Memory allocation failed!\n");
+        return NULL;
+    }
+
+    NewPartEntry->DiskEntry = DiskEntry;
+    NewPartEntry->LogicalPartition = PartEntry->LogicalPartition;
+    NewPartEntry->StartSector.QuadPart = ullStartSector;
+    NewPartEntry->SectorCount.QuadPart = ullSectorCount;
+
+    PartEntry->StartSector.QuadPart += ullSectorCount;
+    PartEntry->SectorCount.QuadPart -= ullSectorCount;
+
+    InsertTailList(&PartEntry->ListEntry, &NewPartEntry->ListEntry);
+
+    return NewPartEntry;
+}
+
+
+static
+ULONG
+GetPlacementScore(
+    _In_ PDISKENTRY DiskEntry,
+    _In_opt_ PDISK_PROFILE Profile,
+    _In_ ULONGLONG ullStartSector,
+    _In_ ULONGLONG ullSectorCount)
+{
+    if (Profile != NULL)
+        return GetProfileThroughput(Profile, ullStartSector, ullSectorCount);
+
+    /* Without a profile assume a rotating disk: the outer (low) LBAs are fastest */
+    return (ULONG)(((DiskEntry->SectorCount.QuadPart - ullStartSector) * 1000) /
+                   DiskEntry->SectorCount.QuadPart);
+}
+
+
+/*
+ * Picks the unpartitioned entry of ListHead that receives the new partition
+ * and claims ullSectorCount sectors of it. An offset selects the entry that
+ * contains it, otherwise the placement policy decides: the first or the
+ * smallest entry that fits, or the position with the highest (fast) or the
+ * lowest (slow) measured read throughput.
+ */
+PPARTENTRY
+AllocateUnusedSpace(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PLIST_ENTRY ListHead,
+    _In_ ULONGLONG ullSectorCount,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONG ulAlignment,
+    _In_ PARTITION_PLACEMENT Placement)
+{
+    PPARTENTRY PartEntry, BestPartEntry = NULL;
     PLIST_ENTRY ListEntry;
+    PDISK_PROFILE Profile = NULL;
+    ULONGLONG ullStartSector, ullEndSector, ullAvailable;
+    ULONGLONG ullBestStart = 0, ullBestAvailable = 0;
+    ULONGLONG ullCandidates[2];
+    ULONG ulScore, ulBestScore = 0, i;
 
-    for (ListEntry = pDisk->PrimaryPartListHead.Flink;
-         ListEntry != &CurrentDisk->PrimaryPartListHead;
+    if (ulAlignment == 0)
+        ulAlignment = DiskEntry->SectorAlignment;
+
+    if ((ullOffset == 0) && ((Placement == PlacementFast) || (Placement == PlacementSlow)))
+        Profile = GetDiskProfile(DiskEntry);
+
+    for (ListEntry = ListHead->Flink;
+         ListEntry != ListHead;
          ListEntry = ListEntry->Flink)
     {
         PartEntry = CONTAINING_RECORD(ListEntry, PARTENTRY, ListEntry);
         if (PartEntry->IsPartitioned)
             continue;
 
-        if (ullSectorSize == 0ULL)
+        ullEndSector = PartEntry->StartSector.QuadPart + PartEntry->SectorCount.QuadPart;
+
+        if (ullOffset != 0)
         {
-            DPRINT("Claim whole unused space!\n");
-            PartEntry->IsPartitioned = TRUE;
-            PartEntry->New = TRUE;
-            CopyMemory(&PartEntry->Gpt.PartitionType, pPartitionType, sizeof(GUID));
-            CreateGUID(&PartEntry->Gpt.PartitionId);
-            PartEntry->Gpt.Attributes = 0ULL;
-            PartEntry->PartitionNumber = 0;
-            PartEntry->FormatState = Unformatted;
-            PartEntry->FileSystemName[0] = L'\0';
-
-            return PartEntry;
+            if ((ullOffset < PartEntry->StartSector.QuadPart) || (ullOffset >= ullEndSector))
+                continue;
+
+            return ClaimUnusedSpace(PartEntry, ullSectorCount, ullOffset, ulAlignment);
         }
-        else
+
+        ullStartSector = GetAlignedStartSector(DiskEntry, PartEntry->StartSector.QuadPart, ulAlignment);
+        if (ullStartSector >= ullEndSector)
+            continue;
+
+        ullAvailable = ullEndSector - ullStartSector;
+        if (ullSectorCount > ullAvailable)
+            continue;
+
+        switch (Placement)
         {
-            if (ullSectorSize == PartEntry->SectorCount.QuadPart)
-            {
-                DPRINT("Claim matching unused space!\n");
-                PartEntry->IsPartitioned = TRUE;
-                PartEntry->New = TRUE;
-                CopyMemory(&PartEntry->Gpt.PartitionType, pPartitionType, sizeof(GUID));
-                CreateGUID(&PartEntry->Gpt.PartitionId);
-                PartEntry->Gpt.Attributes = 0ULL;
-                PartEntry->PartitionNumber = 0;
-                PartEntry->FormatState = Unformatted;
-                PartEntry->FileSystemName[0] = L'\0';
-
-                return PartEntry;
-            }
-            else if (ullSectorSize < PartEntry->SectorCount.QuadPart)
-            {
-                DPRINT("Claim part of unused space\n");
-                NewPartEntry = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PPARTENTRY));
-                if (NewPartEntry == NULL)
+            case PlacementFirst:
+                return ClaimUnusedSpace(PartEntry, ullSectorCount, 0, ulAlignment);
+
+            case PlacementBestFit:
+                if ((BestPartEntry == NULL) || (ullAvailable < ullBestAvailable))
                 {
-                    ConPuts(StdOut, L"Memory allocation failed!\n");
-                    return NULL;
+                    BestPartEntry = PartEntry;
+                    ullBestStart = ullStartSector;
+                    ullBestAvailable = ullAvailable;
                 }
+                break;
 
-                NewPartEntry->DiskEntry = PartEntry->DiskEntry;
+            case PlacementFast:
+            case PlacementSlow:
+                /* Candidates: the head and the (aligned) tail of the entry */
+                ullCandidates[0] = ullStartSector;
+                ullCandidates[1] = ullStartSector;
+                if ((ullSectorCount != 0) && (ullSectorCount < ullAvailable))
+                {
+                    ullCandidates[1] = AlignDown(ullEndSector - ullSectorCount - DiskEntry->AlignmentOffset,
+                                                 ulAlignment) + DiskEntry->AlignmentOffset;
+                }
 
-                NewPartEntry->StartSector.QuadPart = PartEntry->StartSector.QuadPart;
-                NewPartEntry->SectorCount.QuadPart = ullSectorSize;
+                for (i = 0; i < ARRAYSIZE(ullCandidates); i++)
+                {
+                    ulScore = GetPlacementScore(DiskEntry,
+                                                Profile,
+                                                ullCandidates[i],
+                                                (ullSectorCount != 0) ? ullSectorCount : ullAvailable);
+                    if ((BestPartEntry == NULL) ||
+                        ((Placement == PlacementFast) && (ulScore > ulBestScore)) ||
+                        ((Placement == PlacementSlow) && (ulScore < ulBestScore)))
+                    {
+                        BestPartEntry = PartEntry;
+                        ullBestStart = ullCandidates[i];
+                        ulBestScore = ulScore;
+                    }
+                }
+                break;
+        }
+    }
 
-                NewPartEntry->LogicalPartition = FALSE;
-                NewPartEntry->IsPartitioned = TRUE;
-                NewPartEntry->New = TRUE;
-                CopyMemory(&NewPartEntry->Gpt.PartitionType, pPartitionType, sizeof(GUID));
-                CreateGUID(&NewPartEntry->Gpt.PartitionId);
-                NewPartEntry->Gpt.Attributes = 0ULL;
-                NewPartEntry->PartitionNumber = 0;
-                NewPartEntry->FormatState = Unformatted;
-                NewPartEntry->FileSystemName[0] = L'\0';
+    if (BestPartEntry == NULL)
+        return NULL;
 
-                PartEntry->StartSector.QuadPart += ullSectorSize;
-                PartEntry->SectorCount.QuadPart -= ullSectorSize;
+    DPRINT("Placement %d: start sector %I64u, score %lu\n", Placement, ullBestStart, ulBestScore);
 
-                InsertTailList(ListEntry, &NewPartEntry->ListEntry);
+    return ClaimUnusedSpace(BestPartEntry, ullSectorCount, ullBestStart, ulAlignment);
+}
 
-                return NewPartEntry;
-            }
-        }
-    }
 
-    return NULL;
+static
+PPARTENTRY
+InsertGptPartition(
+    _In_ PDISKENTRY pDisk,
+    _In_ ULONGLONG ullSectorSize,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONG ulAlignment,
+    _In_ PARTITION_PLACEMENT Placement,
+    _In_ const GUID *pPartitionType)
+{
+    PPARTENTRY NewPartEntry;
+
+    NewPartEntry = AllocateUnusedSpace(pDisk,
+                                       &pDisk->PrimaryPartListHead,
+                                       ullSectorSize,
+                                       ullOffset,
+                                       ulAlignment,
+                                       Placement);
+    if (NewPartEntry == NULL)
+        return NULL;
+
+    NewPartEntry->LogicalPartition = FALSE;
+    NewPartEntry->IsPartitioned = TRUE;
+    NewPartEntry->New = TRUE;
+    CopyMemory(&NewPartEntry->Gpt.PartitionType, pPartitionType, sizeof(GUID));
+    CreateGUID(&NewPartEntry->Gpt.PartitionId);
+    NewPartEntry->Gpt.Attributes = 0ULL;
+    NewPartEntry->PartitionNumber = 0;
+    NewPartEntry->FormatState = Unformatted;
+    NewPartEntry->FileSystemName[0] = L'\0';
+
+    return NewPartEntry;
 }
 
 
@@ -106,9 +365,11 @@ CreateEfiPartition(
     PPARTENTRY PartEntry;
     ULONGLONG ullSize = 0ULL;
     ULONGLONG ullSectorCount;
+    ULONGLONG ullOffset = 0ULL;
 #if 0
     BOOL bNoErr = FALSE;
 #endif
+    PARTITION_PLACEMENT Placement = PlacementFirst;
     INT i;
     PWSTR pszSuffix = NULL;
     NTSTATUS Status;
@@ -158,15 +419,21 @@ CreateEfiPartition(
         {
             /* offset=<N> (KB) */
             DPRINT("Offset : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The OFFSET option is not supported yet!\n");
-#if 0
-            ullOffset = _wcstoui64(pszSuffix, NULL, 10);
-            if ((ullOffset == 0) && (errno == ERANGE))
+            if (!ParseOffset(pszSuffix, &ullOffset))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[i], L"placement=", &pszSuffix))
+        {
+            /* placement=first|bestfit|fast|slow */
+            DPRINT("Placement : %s\n", pszSuffix);
+            if (!ParsePlacement(pszSuffix, &Placement))
             {
                 ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
                 return EXIT_SUCCESS;
             }
-#endif
         }
         else if (_wcsicmp(argv[i], L"noerr") == 0)
         {
@@ -180,9 +447,7 @@ CreateEfiPartition(
     }
 
     DPRINT1("Size: %I64u\n", ullSize);
-#if 0
     DPRINT1("Offset: %I64u\n", ullOffset);
-#endif
 
     /* Size */
     if (ullSize != 0)
@@ -198,6 +463,9 @@ CreateEfiPartition(
 
     PartEntry = InsertGptPartition(CurrentDisk,
                                    ullSectorCount,
+                                   ullOffset,
+                                   0,
+                                   Placement,
                                    &PARTITION_SYSTEM_GUID);
     if (PartEntry == FALSE)
     {
@@ -237,10 +505,11 @@ CreateExtendedPartition(
     PLIST_ENTRY ListEntry;
     ULONGLONG ullSize = 0ULL;
     ULONGLONG ullSectorCount;
-#if 0
     ULONGLONG ullOffset = 0ULL;
+#if 0
     BOOL bNoErr = FALSE;
 #endif
+    ULONG ulAlignment = 0;
     INT i;
     PWSTR pszSuffix = NULL;
     NTSTATUS Status;
@@ -308,24 +577,21 @@ CreateExtendedPartition(
         {
             /* offset=<N> (KB) */
             DPRINT("Offset : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The OFFSET option is not supported yet!\n");
-#if 0
-            ullOffset = _wcstoui64(pszSuffix, NULL, 10);
-            if ((ullOffset == 0) && (errno == ERANGE))
+            if (!ParseOffset(pszSuffix, &ullOffset))
             {
                 ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
                 return EXIT_SUCCESS;
             }
-#endif
         }
         else if (HasPrefix(argv[i], L"align=", &pszSuffix))
         {
-            /* align=<N> */
+            /* align=<N> (KB) */
             DPRINT("Align : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The ALIGN option is not supported yet!\n");
-#if 0
-            bAlign = TRUE;
-#endif
+            if (!ParseAlignment(pszSuffix, &ulAlignment))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
         }
         else if (_wcsicmp(argv[i], L"noerr") == 0)
         {
@@ -339,9 +605,7 @@ CreateExtendedPartition(
     }
 
     DPRINT1("Size: %I64u\n", ullSize);
-#if 0
     DPRINT1("Offset: %I64u\n", ullOffset);
-#endif
 
     if (GetPrimaryPartitionCount(CurrentDisk) >= 4)
     {
@@ -362,69 +626,44 @@ CreateExtendedPartition(
 
     DPRINT1("SectorCount: %I64u\n", ullSectorCount);
 
-    ListEntry = CurrentDisk->PrimaryPartListHead.Blink;
-
-    PartEntry = CONTAINING_RECORD(ListEntry, PARTENTRY, ListEntry);
-    if (PartEntry->IsPartitioned)
+    if (ullOffset != 0)
     {
-        ConPuts(StdOut, L"No disk space left for an extended partition!\n");
-        return EXIT_SUCCESS;
-    }
-
-    if (ullSectorCount == 0)
-    {
-        PartEntry->IsPartitioned = TRUE;
-        PartEntry->New = TRUE;
-        PartEntry->Mbr.PartitionType = PARTITION_EXTENDED;
-        PartEntry->FormatState = Unformatted;
-        PartEntry->FileSystemName[0] = L'\0';
-
-        CurrentPartition = PartEntry;
-        CurrentDisk->Dirty = TRUE;
+        NewPartEntry = AllocateUnusedSpace(CurrentDisk,
+                                           &CurrentDisk->PrimaryPartListHead,
+                                           ullSectorCount,
+                                           ullOffset,
+                                           ulAlignment,
+                                           PlacementFirst);
     }
     else
     {
-        if (PartEntry->SectorCount.QuadPart == ullSectorCount)
+        ListEntry = CurrentDisk->PrimaryPartListHead.Blink;
+
+        PartEntry = CONTAINING_RECORD(ListEntry, PARTENTRY, ListEntry);
+        if (PartEntry->IsPartitioned)
         {
-            PartEntry->IsPartitioned = TRUE;
-            PartEntry->New = TRUE;
-            PartEntry->Mbr.PartitionType = PARTITION_EXTENDED;
-            PartEntry->FormatState = Unformatted;
-            PartEntry->FileSystemName[0] = L'\0';
-
-            CurrentPartition = PartEntry;
-            CurrentDisk->Dirty = TRUE;
+            ConPuts(StdOut, L"No disk space left for an extended partition!\n");
+            return EXIT_SUCCESS;
         }
-        else if (PartEntry->SectorCount.QuadPart > ullSectorCount)
-        {
-            NewPartEntry = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PPARTENTRY));
-            if (NewPartEntry == NULL)
-            {
-                ConPuts(StdOut, L"Memory allocation failed!\n");
-                return TRUE;
-            }
-
-            NewPartEntry->DiskEntry = PartEntry->DiskEntry;
 
-            NewPartEntry->StartSector.QuadPart = PartEntry->StartSector.QuadPart;
-            NewPartEntry->SectorCount.QuadPart = ullSectorCount;
-
-            NewPartEntry->LogicalPartition = FALSE;
-            NewPartEntry->IsPartitioned = TRUE;
-            NewPartEntry->New = TRUE;
-            NewPartEntry->Mbr.PartitionType = PARTITION_EXTENDED;
-            NewPartEntry->FormatState = Unformatted;
-            NewPartEntry->FileSystemName[0] = L'\0';
+        NewPartEntry = ClaimUnusedSpace(PartEntry, ullSectorCount, 0, ulAlignment);
+    }
 
-            PartEntry->StartSector.QuadPart += ullSectorCount;
-            PartEntry->SectorCount.QuadPart -= ullSectorCount;
+    if (NewPartEntry == NULL)
+    {
+        ConPuts(StdOut, L"No disk space left for an extended partition!\n");
+        return EXIT_SUCCESS;
+    }
 
-            InsertTailList(ListEntry, &NewPartEntry->ListEntry);
+    NewPartEntry->LogicalPartition = FALSE;
+    NewPartEntry->IsPartitioned = TRUE;
+    NewPartEntry->New = TRUE;
+    NewPartEntry->Mbr.PartitionType = PARTITION_EXTENDED;
+    NewPartEntry->FormatState = Unformatted;
+    NewPartEntry->FileSystemName[0] = L'\0';
 
-            CurrentPartition = NewPartEntry;
-            CurrentDisk->Dirty = TRUE;
-        }
-    }
+    CurrentPartition = NewPartEntry;
+    CurrentDisk->Dirty = TRUE;
 
     UpdateMbrDiskLayout(CurrentDisk);
     Status = WriteMbrPartitions(CurrentDisk);
@@ -446,14 +685,15 @@ CreateLogicalPartition(
     _In_ INT argc,
     _In_ PWSTR *argv)
 {
-    PPARTENTRY PartEntry, NewPartEntry;
-    PLIST_ENTRY ListEntry;
+    PPARTENTRY NewPartEntry;
     ULONGLONG ullSize = 0ULL;
     ULONGLONG ullSectorCount;
-#if 0
     ULONGLONG ullOffset = 0ULL;
+#if 0
     BOOL bNoErr = FALSE;
 #endif
+    ULONG ulAlignment = 0;
+    PARTITION_PLACEMENT Placement = PlacementFirst;
     UCHAR PartitionType = PARTITION_HUGE;
     INT i, length;
     PWSTR pszSuffix = NULL;
@@ -502,15 +742,21 @@ CreateLogicalPartition(
         {
             /* offset=<N> (KB) */
             DPRINT("Offset : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The OFFSET option is not supported yet!\n");
-#if 0
-            ullOffset = _wcstoui64(pszSuffix, NULL, 10);
-            if ((ullOffset == 0) && (errno == ERANGE))
+            if (!ParseOffset(pszSuffix, &ullOffset))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[i], L"placement=", &pszSuffix))
+        {
+            /* placement=first|bestfit|fast|slow */
+            DPRINT("Placement : %s\n", pszSuffix);
+            if (!ParsePlacement(pszSuffix, &Placement))
             {
                 ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
                 return EXIT_SUCCESS;
             }
-#endif
         }
         else if (HasPrefix(argv[i], L"id=", &pszSuffix))
         {
@@ -536,12 +782,13 @@ CreateLogicalPartition(
         }
         else if (HasPrefix(argv[i], L"align=", &pszSuffix))
         {
-            /* align=<N> */
+            /* align=<N> (KB) */
             DPRINT("Align : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The ALIGN option is not supported yet!\n");
-#if 0
-            bAlign = TRUE;
-#endif
+            if (!ParseAlignment(pszSuffix, &ulAlignment))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
         }
         else if (_wcsicmp(argv[i], L"noerr") == 0)
         {
@@ -555,9 +802,7 @@ CreateLogicalPartition(
     }
 
     DPRINT1("Size: %I64u\n", ullSize);
-#if 0
     DPRINT1("Offset: %I64u\n", ullOffset);
-#endif
     DPRINT1("Partition Type: %hx\n", PartitionType);
 
     if (ullSize != 0)
@@ -567,71 +812,23 @@ CreateLogicalPartition(
 
     DPRINT1("SectorCount: %I64u\n", ullSectorCount);
 
-    for (ListEntry = CurrentDisk->LogicalPartListHead.Flink;
-         ListEntry != &CurrentDisk->LogicalPartListHead;
-         ListEntry = ListEntry->Flink)
+    NewPartEntry = AllocateUnusedSpace(CurrentDisk,
+                                       &CurrentDisk->LogicalPartListHead,
+                                       ullSectorCount,
+                                       ullOffset,
+                                       ulAlignment,
+                                       Placement);
+    if (NewPartEntry != NULL)
     {
-        PartEntry = CONTAINING_RECORD(ListEntry, PARTENTRY, ListEntry);
-        if (PartEntry->IsPartitioned)
-            continue;
-
-        if (ullSectorCount == 0)
-        {
-            PartEntry->IsPartitioned = TRUE;
-            PartEntry->New = TRUE;
-            PartEntry->Mbr.PartitionType = PartitionType;
-            PartEntry->FormatState = Unformatted;
-            PartEntry->FileSystemName[0] = L'\0';
-
-            CurrentPartition = PartEntry;
-            CurrentDisk->Dirty = TRUE;
-            break;
-        }
-        else
-        {
-            if (PartEntry->SectorCount.QuadPart == ullSectorCount)
-            {
-                PartEntry->IsPartitioned = TRUE;
-                PartEntry->New = TRUE;
-                PartEntry->Mbr.PartitionType = PartitionType;
-                PartEntry->FormatState = Unformatted;
-                PartEntry->FileSystemName[0] = L'\0';
-
-                CurrentPartition = PartEntry;
-                CurrentDisk->Dirty = TRUE;
-                break;
-            }
-            else if (PartEntry->SectorCount.QuadPart > ullSectorCount)
-            {
-                NewPartEntry = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PPARTENTRY));
-                if (NewPartEntry == NULL)
-                {
-                    ConPuts(StdOut, L"Memory allocation failed!\n");
-                    return TRUE;
-                }
-
-                NewPartEntry->DiskEntry = PartEntry->DiskEntry;
-
-                NewPartEntry->StartSector.QuadPart = PartEntry->StartSector.QuadPart;
-                NewPartEntry->SectorCount.QuadPart = ullSectorCount;
-
-                NewPartEntry->LogicalPartition = TRUE;
-                NewPartEntry->IsPartitioned = TRUE;
-                NewPartEntry->New = TRUE;
-                NewPartEntry->Mbr.PartitionType = PartitionType;
-                NewPartEntry->FormatState = Unformatted;
-                NewPartEntry->FileSystemName[0] = L'\0';
-
-                PartEntry->StartSector.QuadPart += ullSectorCount;
-                PartEntry->SectorCount.QuadPart -= ullSectorCount;
-
-                InsertTailList(ListEntry, &NewPartEntry->ListEntry);
-
-                CurrentPartition = NewPartEntry;
-                CurrentDisk->Dirty = TRUE;
-                break;
-            }
-        }
+        NewPartEntry->LogicalPartition = TRUE;
+        NewPartEntry->IsPartitioned = TRUE;
+        NewPartEntry->New = TRUE;
+        NewPartEntry->Mbr.PartitionType = PartitionType;
+        NewPartEntry->FormatState = Unformatted;
+        NewPartEntry->FileSystemName[0] = L'\0';
+
+        CurrentPartition = NewPartEntry;
+        CurrentDisk->Dirty = TRUE;
     }
 
     UpdateMbrDiskLayout(CurrentDisk);
@@ -657,9 +854,11 @@ CreateMsrPartition(
     PPARTENTRY PartEntry;
     ULONGLONG ullSize = 0ULL;
     ULONGLONG ullSectorSize;
+    ULONGLONG ullOffset = 0ULL;
 #if 0
     BOOL bNoErr = FALSE;
 #endif
+    PARTITION_PLACEMENT Placement = PlacementFirst;
     INT i;
     PWSTR pszSuffix = NULL;
     NTSTATUS Status;
@@ -709,15 +908,21 @@ CreateMsrPartition(
         {
             /* offset=<N> (KB) */
             DPRINT("Offset : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The OFFSET option is not supported yet!\n");
-#if 0
-            ullOffset = _wcstoui64(pszSuffix, NULL, 10);
-            if ((ullOffset == 0) && (errno == ERANGE))
+            if (!ParseOffset(pszSuffix, &ullOffset))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[i], L"placement=", &pszSuffix))
+        {
+            /* placement=first|bestfit|fast|slow */
+            DPRINT("Placement : %s\n", pszSuffix);
+            if (!ParsePlacement(pszSuffix, &Placement))
             {
                 ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
                 return EXIT_SUCCESS;
             }
-#endif
         }
         else if (_wcsicmp(argv[i], L"noerr") == 0)
         {
@@ -731,9 +936,7 @@ CreateMsrPartition(
     }
 
     DPRINT1("Size: %I64u\n", ullSize);
-#if 0
     DPRINT1("Offset: %I64u\n", ullOffset);
-#endif
 
     /* Size */
     if (ullSize != 0)
@@ -749,6 +952,9 @@ CreateMsrPartition(
 
     PartEntry = InsertGptPartition(CurrentDisk,
                                    ullSectorSize,
+                                   ullOffset,
+                                   0,
+                                   Placement,
                                    &PARTITION_MSFT_RESERVED_GUID);
     if (PartEntry == FALSE)
     {
@@ -783,10 +989,12 @@ static
 VOID
 CreatePrimaryMbrPartition(
     _In_ ULONGLONG ullSize,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONG ulAlignment,
+    _In_ PARTITION_PLACEMENT Placement,
     _In_ PWSTR pszPartitionType)
 {
-    PPARTENTRY PartEntry, NewPartEntry;
-    PLIST_ENTRY ListEntry;
+    PPARTENTRY NewPartEntry;
     ULONGLONG ullSectorCount;
     UCHAR PartitionType;
     INT length;
@@ -826,71 +1034,23 @@ CreatePrimaryMbrPartition(
 
     DPRINT1("SectorCount: %I64u\n", ullSectorCount);
 
-    for (ListEntry = CurrentDisk->PrimaryPartListHead.Flink;
-         ListEntry != &CurrentDisk->PrimaryPartListHead;
-         ListEntry = ListEntry->Flink)
+    NewPartEntry = AllocateUnusedSpace(CurrentDisk,
+                                       &CurrentDisk->PrimaryPartListHead,
+                                       ullSectorCount,
+                                       ullOffset,
+                                       ulAlignment,
+                                       Placement);
+    if (NewPartEntry != NULL)
     {
-        PartEntry = CONTAINING_RECORD(ListEntry, PARTENTRY, ListEntry);
-        if (PartEntry->IsPartitioned)
-            continue;
-
-        if (ullSectorCount == 0)
-        {
-            PartEntry->IsPartitioned = TRUE;
-            PartEntry->New = TRUE;
-            PartEntry->Mbr.PartitionType = PartitionType;
-            PartEntry->FormatState = Unformatted;
-            PartEntry->FileSystemName[0] = L'\0';
-
-            CurrentPartition = PartEntry;
-            CurrentDisk->Dirty = TRUE;
-            break;
-        }
-        else
-        {
-            if (PartEntry->SectorCount.QuadPart == ullSectorCount)
-            {
-                PartEntry->IsPartitioned = TRUE;
-                PartEntry->New = TRUE;
-                PartEntry->Mbr.PartitionType = PartitionType;
-                PartEntry->FormatState = Unformatted;
-                PartEntry->FileSystemName[0] = L'\0';
-
-                CurrentPartition = PartEntry;
-                CurrentDisk->Dirty = TRUE;
-                break;
-            }
-            else if (PartEntry->SectorCount.QuadPart > ullSectorCount)
-            {
-                NewPartEntry = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PPARTENTRY));
-                if (NewPartEntry == NULL)
-                {
-                    ConPuts(StdOut, L"Memory allocation failed!\n");
-                    return;
-                }
-
-                NewPartEntry->DiskEntry = PartEntry->DiskEntry;
-
-                NewPartEntry->StartSector.QuadPart = PartEntry->StartSector.QuadPart;
-                NewPartEntry->SectorCount.QuadPart = ullSectorCount;
-
-                NewPartEntry->LogicalPartition = FALSE;
-                NewPartEntry->IsPartitioned = TRUE;
-                NewPartEntry->New = TRUE;
-                NewPartEntry->Mbr.PartitionType = PartitionType;
-                NewPartEntry->FormatState = Unformatted;
-                NewPartEntry->FileSystemName[0] = L'\0';
-
-                PartEntry->StartSector.QuadPart += ullSectorCount;
-                PartEntry->SectorCount.QuadPart -= ullSectorCount;
-
-                InsertTailList(ListEntry, &NewPartEntry->ListEntry);
-
-                CurrentPartition = NewPartEntry;
-                CurrentDisk->Dirty = TRUE;
-                break;
-            }
-        }
+        NewPartEntry->LogicalPartition = FALSE;
+        NewPartEntry->IsPartitioned = TRUE;
+        NewPartEntry->New = TRUE;
+        NewPartEntry->Mbr.PartitionType = PartitionType;
+        NewPartEntry->FormatState = Unformatted;
+        NewPartEntry->FileSystemName[0] = L'\0';
+
+        CurrentPartition = NewPartEntry;
+        CurrentDisk->Dirty = TRUE;
     }
 
     UpdateMbrDiskLayout(CurrentDisk);
@@ -910,6 +1070,9 @@ static
 VOID
 CreatePrimaryGptPartition(
     _In_ ULONGLONG ullSize,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONG ulAlignment,
+    _In_ PARTITION_PLACEMENT Placement,
     _In_ PWSTR pszPartitionType)
 {
     PPARTENTRY PartEntry;
@@ -945,6 +1108,9 @@ CreatePrimaryGptPartition(
 
     PartEntry = InsertGptPartition(CurrentDisk,
                                    ullSectorCount,
+                                   ullOffset,
+                                   ulAlignment,
+                                   Placement,
                                    &guidPartitionType);
     if (PartEntry == FALSE)
     {
@@ -979,10 +1145,12 @@ CreatePrimaryPartition(
     _In_ PWSTR *argv)
 {
     ULONGLONG ullSize = 0ULL;
-#if 0
     ULONGLONG ullOffset = 0ULL;
+#if 0
     BOOL bNoErr = FALSE;
 #endif
+    ULONG ulAlignment = 0;
+    PARTITION_PLACEMENT Placement = PlacementFirst;
     INT i;
     PWSTR pszSuffix = NULL;
     PWSTR pszPartitionType = NULL;
@@ -1045,15 +1213,21 @@ CreatePrimaryPartition(
         {
             /* offset=<N> (KB) */
             DPRINT("Offset : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The OFFSET option is not supported yet!\n");
-#if 0
-            ullOffset = _wcstoui64(pszSuffix, NULL, 10);
-            if ((ullOffset == 0) && (errno == ERANGE))
+            if (!ParseOffset(pszSuffix, &ullOffset))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[i], L"placement=", &pszSuffix))
+        {
+            /* placement=first|bestfit|fast|slow */
+            DPRINT("Placement : %s\n", pszSuffix);
+            if (!ParsePlacement(pszSuffix, &Placement))
             {
                 ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
                 return EXIT_SUCCESS;
             }
-#endif
         }
         else if (HasPrefix(argv[i], L"id=", &pszSuffix))
         {
@@ -1063,12 +1237,13 @@ CreatePrimaryPartition(
         }
         else if (HasPrefix(argv[i], L"align=", &pszSuffix))
         {
-            /* align=<N> */
+            /* align=<N> (KB) */
             DPRINT("Align : %s\n", pszSuffix);
-            ConPuts(StdOut, L"The ALIGN option is not supported yet!\n");
-#if 0
-            bAlign = TRUE;
-#endif
+            if (!ParseAlignment(pszSuffix, &ulAlignment))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
         }
         else if (_wcsicmp(argv[i], L"noerr") == 0)
         {
@@ -1082,18 +1257,16 @@ CreatePrimaryPartition(
     }
 
     DPRINT("Size: %I64u\n", ullSize);
-#if 0
     DPRINT1("Offset: %I64u\n", ullOffset);
-#endif
 
     if (CurrentDisk->PartitionStyle == PARTITION_STYLE_MBR)
     {
         DPRINT("Partition Type: %s\n", pszPartitionType);
-        CreatePrimaryMbrPartition(ullSize, pszPartitionType);
+        CreatePrimaryMbrPartition(ullSize, ullOffset, ulAlignment, Placement, pszPartitionType);
     }
     else if (CurrentDisk->PartitionStyle == PARTITION_STYLE_GPT)
     {
-        CreatePrimaryGptPartition(ullSize, pszPartitionType);
+        CreatePrimaryGptPartition(ullSize, ullOffset, ulAlignment, Placement, pszPartitionType);
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,754 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/deploy.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define DEPLOY_CHUNK_SIZE       (4 * 1024 * 1024)
+#define DEPLOY_RING_SIZE        16
+#define DEPLOY_VERIFY_SIZE      (1024 * 1024)
+/* Disks that one DEPLOY command writes to */
+#define DEPLOY_MAX_TARGETS      63
+
+typedef enum _DEPLOY_STATE
+{
+    DeployWriting,
+    DeployVerifying,
+    DeployDone,
+    DeployFailed
+} DEPLOY_STATE;
+
+typedef struct _DEPLOY_TARGET
+{
+    ULONG DiskNumber;
+    IO_ENGINE Engine;
+    DEPLOY_STATE State;
+    NTSTATUS Status;
+
+    /* Engine mark that covers the write of the chunk in each slot of the ring */
+    ULONGLONG RingMarks[DEPLOY_RING_SIZE];
+    ULONGLONG BytesWritten;
+    LARGE_INTEGER StartTime;
+    LARGE_INTEGER EndTime;
+
+    /* Read back of the written image */
+    PUCHAR VerifyBuffer;
+    ULONG Checksum;
+} DEPLOY_TARGET, *PDEPLOY_TARGET;
+
+typedef struct _DEPLOY_CONTEXT
+{
+    IO_ENGINE Image;
+    BOOL bVerify;
+    QOS_SETTINGS QosSettings;
+    QOS_BUCKET Qos;
+
+    ULONGLONG ImageLength;
+    ULONGLONG ChunkCount;
+    ULONG Checksum;
+    PUCHAR Ring;
+    LARGE_INTEGER Frequency;
+
+    ULONG TargetCount;
+    DEPLOY_TARGET Targets[DEPLOY_MAX_TARGETS];
+} DEPLOY_CONTEXT, *PDEPLOY_CONTEXT;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+ULONG
+GetDeployChunkLength(
+    _In_ PDEPLOY_CONTEXT Context,
+    _In_ ULONGLONG ullChunk)
+{
+    return (ULONG)min((ULONGLONG)DEPLOY_CHUNK_SIZE,
+                      Context->ImageLength - (ullChunk * DEPLOY_CHUNK_SIZE));
+}
+
+
+static
+VOID
+FailDeployTarget(
+    _In_ PDEPLOY_TARGET Target,
+    _In_ NTSTATUS Status)
+{
+    DPRINT1("Disk %lu failed (Status 0x%08lx)\n", Target->DiskNumber, Status);
+
+    Target->State = DeployFailed;
+    Target->Status = Status;
+    NtQueryPerformanceCounter(&Target->EndTime, NULL);
+
+    ConResPrintf(StdOut, IDS_DEPLOY_TARGET_FAILED, Target->DiskNumber, Status);
+}
+
+
+/*
+ * Reads the next chunk of the image into its slot of the ring. The writes of
+ * the chunk that had the slot before must be done on every target first, so
+ * a slow disk only holds up the others once it lags behind by the whole ring.
+ */
+static
+NTSTATUS
+ReadDeployChunk(
+    _In_ PDEPLOY_CONTEXT Context,
+    _In_ ULONGLONG ullChunk)
+{
+    PDEPLOY_TARGET Target;
+    ULONG Slot = (ULONG)(ullChunk % DEPLOY_RING_SIZE);
+    ULONG ulLength = GetDeployChunkLength(Context, ullChunk);
+    ULONG Index;
+    NTSTATUS Status;
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Target = &Context->Targets[Index];
+        if (Target->State != DeployWriting)
+            continue;
+
+        Status = WaitForIoEngine(&Target->Engine, Target->RingMarks[Slot]);
+        if (!NT_SUCCESS(Status))
+            FailDeployTarget(Target, Status);
+    }
+
+    Status = ReadIoEngine(&Context->Image,
+                          ullChunk * DEPLOY_CHUNK_SIZE,
+                          &Context->Ring[(SIZE_T)Slot * DEPLOY_CHUNK_SIZE],
+                          ulLength);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Context->Checksum = RtlComputeCrc32(Context->Checksum,
+                                        &Context->Ring[(SIZE_T)Slot * DEPLOY_CHUNK_SIZE],
+                                        ulLength);
+
+    return STATUS_SUCCESS;
+}
+
+
+/* Queues the write of a chunk of the ring on every target that is left */
+static
+VOID
+WriteDeployChunk(
+    _In_ PDEPLOY_CONTEXT Context,
+    _In_ ULONGLONG ullChunk)
+{
+    PDEPLOY_TARGET Target;
+    ULONG Slot = (ULONG)(ullChunk % DEPLOY_RING_SIZE);
+    ULONG ulLength = GetDeployChunkLength(Context, ullChunk);
+    ULONG Index;
+    NTSTATUS Status;
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Target = &Context->Targets[Index];
+        if (Target->State != DeployWriting)
+            continue;
+
+        Status = WriteIoEngine(&Target->Engine,
+                               ullChunk * DEPLOY_CHUNK_SIZE,
+                               &Context->Ring[(SIZE_T)Slot * DEPLOY_CHUNK_SIZE],
+                               ulLength);
+        if (!NT_SUCCESS(Status))
+        {
+            FailDeployTarget(Target, Status);
+            continue;
+        }
+
+        Target->RingMarks[Slot] = GetIoEngineMark(&Target->Engine);
+        Target->BytesWritten += ulLength;
+    }
+}
+
+
+/*
+ * Reads the image back from every target that was written. The reads of all
+ * targets are queued before the first one is waited for, so an asynchronous
+ * engine verifies the disks at the same time.
+ */
+static
+VOID
+VerifyDeployTargets(
+    _In_ PDEPLOY_CONTEXT Context)
+{
+    PDEPLOY_TARGET Target;
+    ULONGLONG ullOffset;
+    ULONG ulLength, Index;
+    NTSTATUS Status;
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Target = &Context->Targets[Index];
+        if (Target->State != DeployVerifying)
+            continue;
+
+        Target->VerifyBuffer = AllocateIoBuffer(DEPLOY_VERIFY_SIZE);
+        if (Target->VerifyBuffer == NULL)
+            FailDeployTarget(Target, STATUS_NO_MEMORY);
+    }
+
+    for (ullOffset = 0; ullOffset < Context->ImageLength; ullOffset += ulLength)
+    {
+        ulLength = (ULONG)min((ULONGLONG)DEPLOY_VERIFY_SIZE, Context->ImageLength - ullOffset);
+
+        for (Index = 0; Index < Context->TargetCount; Index++)
+        {
+            Target = &Context->Targets[Index];
+            if (Target->State != DeployVerifying)
+                continue;
+
+            Status = QueueReadIoEngine(&Target->Engine, ullOffset, Target->VerifyBuffer, ulLength);
+            if (!NT_SUCCESS(Status))
+                FailDeployTarget(Target, Status);
+        }
+
+        for (Index = 0; Index < Context->TargetCount; Index++)
+        {
+            Target = &Context->Targets[Index];
+            if (Target->State != DeployVerifying)
+                continue;
+
+            Status = WaitForIoEngine(&Target->Engine, GetIoEngineMark(&Target->Engine));
+            if (!NT_SUCCESS(Status))
+            {
+                FailDeployTarget(Target, Status);
+                continue;
+            }
+
+            Target->Checksum = RtlComputeCrc32(Target->Checksum, Target->VerifyBuffer, ulLength);
+        }
+    }
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Target = &Context->Targets[Index];
+        if (Target->State == DeployVerifying)
+            Target->State = DeployDone;
+    }
+}
+
+
+/*
+ * Reads the image once into a ring of chunks and writes every chunk to all
+ * targets through the engine that is set with SET IO. An asynchronous engine
+ * keeps the writes of all targets in flight while the next chunks are read.
+ * A failing disk is dropped and the others carry on.
+ */
+static
+NTSTATUS
+RunDeploy(
+    _In_ PDEPLOY_CONTEXT Context)
+{
+    ULONGLONG ullChunk;
+    ULONG Index;
+    ULONG ulPercent, ulLastPercent = 0;
+    LARGE_INTEGER StartTime;
+    PDEPLOY_TARGET Target;
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    Context->Ring = AllocateIoBuffer((SIZE_T)DEPLOY_CHUNK_SIZE * DEPLOY_RING_SIZE);
+    if (Context->Ring == NULL)
+        return STATUS_NO_MEMORY;
+
+    /*
+     * One bucket paces the whole command, so the limits hold for the sum of
+     * the targets. The first target that was opened feeds back the latency.
+     */
+    InitializeQosBucket(&Context->Qos, &Context->QosSettings, NULL);
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Target = &Context->Targets[Index];
+        if (Target->State == DeployFailed)
+            continue;
+
+        AddQosDevice(&Context->Qos, Target->Engine.FileHandle);
+        Target->Engine.Qos = &Context->Qos;
+    }
+
+    AddQosDevice(&Context->Qos, Context->Image.FileHandle);
+    Context->Image.Qos = &Context->Qos;
+
+    NtQueryPerformanceCounter(&StartTime, &Context->Frequency);
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Context->Targets[Index].StartTime = StartTime;
+
+        /* Disks that could not be opened failed before the start */
+        if (Context->Targets[Index].State == DeployFailed)
+            Context->Targets[Index].EndTime = StartTime;
+    }
+
+    for (ullChunk = 0; ullChunk < Context->ChunkCount; ullChunk++)
+    {
+        Status = ReadDeployChunk(Context, ullChunk);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Image read failed (Status 0x%08lx)\n", Status);
+            break;
+        }
+
+        WriteDeployChunk(Context, ullChunk);
+
+        ulPercent = (ULONG)(((ullChunk + 1) * 100) / Context->ChunkCount);
+        if (ulPercent != ulLastPercent)
+        {
+            ConResPrintf(StdOut, IDS_DEPLOY_PROGRESS, ulPercent);
+            ulLastPercent = ulPercent;
+        }
+    }
+
+    /* Never release the ring while requests still own parts of it */
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Target = &Context->Targets[Index];
+
+        if ((FlushIoEngine(&Target->Engine) != STATUS_SUCCESS) && (Target->State == DeployWriting))
+            FailDeployTarget(Target, Target->Engine.Status);
+
+        if (NT_SUCCESS(Status) && (Target->State == DeployWriting))
+        {
+            NtQueryPerformanceCounter(&Target->EndTime, NULL);
+            Target->State = Context->bVerify ? DeployVerifying : DeployDone;
+        }
+    }
+
+    if (NT_SUCCESS(Status) && Context->bVerify)
+        VerifyDeployTargets(Context);
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        FreeIoBuffer(Context->Targets[Index].VerifyBuffer);
+        Context->Targets[Index].VerifyBuffer = NULL;
+    }
+
+    FreeIoBuffer(Context->Ring);
+    Context->Ring = NULL;
+
+    return Status;
+}
+
+
+static
+VOID
+PrintDeployResults(
+    _In_ PDEPLOY_CONTEXT Context)
+{
+    WCHAR szStatus[40];
+    WCHAR szChecksum[16];
+    PDEPLOY_TARGET Target;
+    ULONGLONG ullElapsedMs;
+    ULONG Index;
+    INT nStatusId;
+
+    ConResPrintf(StdOut, IDS_DEPLOY_SOURCE, Context->ImageLength / (SIZE_1KB * SIZE_1KB), Context->Checksum);
+    ConResPuts(StdOut, IDS_DEPLOY_HEAD);
+    ConResPuts(StdOut, IDS_DEPLOY_LINE);
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Target = &Context->Targets[Index];
+
+        if (Target->State != DeployDone)
+            nStatusId = IDS_DEPLOY_STATUS_FAILED;
+        else if (!Context->bVerify)
+            nStatusId = IDS_DEPLOY_STATUS_WRITTEN;
+        else if (Target->Checksum != Context->Checksum)
+            nStatusId = IDS_DEPLOY_STATUS_MISMATCH;
+        else
+            nStatusId = IDS_DEPLOY_STATUS_VERIFIED;
+
+        LoadStringW(GetModuleHandle(NULL),
+                    nStatusId,
+                    szStatus, ARRAYSIZE(szStatus));
+
+        if (Context->bVerify && (Target->State == DeployDone))
+            StringCchPrintfW(szChecksum, ARRAYSIZE(szChecksum), L"%08lX", Target->Checksum);
+        else
+            StringCchCopyW(szChecksum, ARRAYSIZE(szChecksum), L"-");
+
+        ullElapsedMs = ((ULONGLONG)(Target->EndTime.QuadPart - Target->StartTime.QuadPart) * 1000) / Context->Frequency.QuadPart;
+        if (ullElapsedMs == 0)
+            ullElapsedMs = 1;
+
+        ConResPrintf(StdOut, IDS_DEPLOY_FORMAT,
+                     Target->DiskNumber,
+                     szStatus,
+                     Target->BytesWritten / (SIZE_1KB * SIZE_1KB),
+                     ullElapsedMs,
+                     ((Target->BytesWritten / SIZE_1KB) * 1000) / ullElapsedMs / 1024,
+                     szChecksum);
+    }
+}
+
+
+static
+NTSTATUS
+OpenDeployImage(
+    _In_ PWSTR pszFileName,
+    _Out_ PIO_ENGINE Engine,
+    _Out_ PULONGLONG pullLength)
+{
+    UNICODE_STRING Name;
+    IO_STATUS_BLOCK Iosb;
+    FILE_STANDARD_INFORMATION StandardInfo;
+    NTSTATUS Status;
+
+    if (!RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+        return STATUS_OBJECT_NAME_INVALID;
+
+    Status = OpenIoEngine(Engine, &Name, FILE_GENERIC_READ, FILE_SHARE_READ);
+    RtlFreeUnicodeString(&Name);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtQueryInformationFile(Engine->FileHandle,
+                                    &Iosb,
+                                    &StandardInfo,
+                                    sizeof(StandardInfo),
+                                    FileStandardInformation);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    *pullLength = StandardInfo.EndOfFile.QuadPart;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+OpenDeployDisk(
+    _In_ ULONG DiskNumber,
+    _Out_ PIO_ENGINE Engine)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition0",
+                     DiskNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    return OpenIoEngine(Engine,
+                        &Name,
+                        FILE_READ_DATA | FILE_WRITE_DATA,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE);
+}
+
+
+/* Makes the disk driver read the partition table that came with the image */
+static
+VOID
+UpdateDeployDisk(
+    _In_ PDEPLOY_TARGET Target)
+{
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Status = NtDeviceIoControlFile(Target->Engine.FileHandle,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_DISK_UPDATE_PROPERTIES,
+                                   NULL,
+                                   0,
+                                   NULL,
+                                   0);
+    if (Status == STATUS_PENDING)
+        NtWaitForSingleObject(Target->Engine.FileHandle, FALSE, NULL);
+}
+
+
+static
+PDISKENTRY
+GetDeployDisk(
+    _In_ ULONG DiskNumber)
+{
+    PLIST_ENTRY Entry;
+    PDISKENTRY DiskEntry;
+
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
+        if (DiskEntry->DiskNumber == DiskNumber)
+            return DiskEntry;
+    }
+
+    return NULL;
+}
+
+
+/* Adds a target disk to the context, unless it is already in the list */
+static
+BOOL
+AddDeployTarget(
+    _In_ PDEPLOY_CONTEXT Context,
+    _In_ ULONG DiskNumber)
+{
+    ULONG Index;
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        if (Context->Targets[Index].DiskNumber == DiskNumber)
+            return TRUE;
+    }
+
+    if (Context->TargetCount >= DEPLOY_MAX_TARGETS)
+        return FALSE;
+
+    Context->Targets[Context->TargetCount].DiskNumber = DiskNumber;
+    Context->TargetCount++;
+
+    return TRUE;
+}
+
+
+/* disks=<N>[-<N>][,<N>[-<N>]...] */
+static
+BOOL
+ParseDeployDisks(
+    _In_ PDEPLOY_CONTEXT Context,
+    _In_ PWSTR pszList)
+{
+    PWSTR pszEnd;
+    ULONG ulFirst, ulLast, ulDisk;
+
+    for (;;)
+    {
+        if (!iswdigit(*pszList))
+            return FALSE;
+
+        ulFirst = wcstoul(pszList, &pszEnd, 10);
+        ulLast = ulFirst;
+
+        if (*pszEnd == L'-')
+        {
+            pszList = pszEnd + 1;
+            if (!iswdigit(*pszList))
+                return FALSE;
+
+            ulLast = wcstoul(pszList, &pszEnd, 10);
+            if (ulLast < ulFirst)
+                return FALSE;
+        }
+
+        for (ulDisk = ulFirst; ulDisk <= ulLast; ulDisk++)
+        {
+            if (!AddDeployTarget(Context, ulDisk))
+                return FALSE;
+        }
+
+        if (*pszEnd == UNICODE_NULL)
+            return TRUE;
+
+        if (*pszEnd != L',')
+            return FALSE;
+
+        pszList = pszEnd + 1;
+    }
+}
+
+
+/*
+ * Checks that every target disk can take the image: it must exist, be large
+ * enough, have a sector size that divides the image size and, like the
+ * target of CLONE DISK, hold no partitions. Background jobs on the targets
+ * finish first, so they neither race with the writes nor hide partitions.
+ */
+static
+BOOL
+CheckDeployTargets(
+    _In_ PDEPLOY_CONTEXT Context)
+{
+    PDISKENTRY DiskEntry;
+    ULONG Index;
+
+    /* Completed jobs may rescan the disk list, so wait before looking it up */
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        if (HasActiveJobs(Context->Targets[Index].DiskNumber))
+        {
+            ConResPrintf(StdOut, IDS_JOB_WAITING, Context->Targets[Index].DiskNumber);
+            WaitForDiskJobs(Context->Targets[Index].DiskNumber);
+        }
+    }
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        DiskEntry = GetDeployDisk(Context->Targets[Index].DiskNumber);
+        if (DiskEntry == NULL)
+        {
+            ConResPrintf(StdOut, IDS_DEPLOY_NO_DISK, Context->Targets[Index].DiskNumber);
+            return FALSE;
+        }
+
+        if ((DiskEntry->SectorCount.QuadPart * DiskEntry->BytesPerSector < Context->ImageLength) ||
+            ((Context->ImageLength % DiskEntry->BytesPerSector) != 0))
+        {
+            ConResPrintf(StdOut, IDS_DEPLOY_TOO_SMALL, DiskEntry->DiskNumber);
+            return FALSE;
+        }
+
+        if (GetPrimaryPartitionCount(DiskEntry) != 0)
+        {
+            ConResPrintf(StdOut, IDS_DEPLOY_NOT_EMPTY, DiskEntry->DiskNumber);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+EXIT_CODE
+deploy_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PDEPLOY_CONTEXT Context;
+    PWSTR pszImage = NULL, pszSuffix = NULL;
+    ULONG ulCurrentDisk = MAXULONG;
+    ULONGLONG ullCurrentStart = 0;
+    ULONG Index, ulFailed = 0;
+    NTSTATUS Status;
+    INT i;
+
+    DPRINT("deploy_main()\n");
+
+    Context = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DEPLOY_CONTEXT));
+    if (Context == NULL)
+    {
+        ConResPuts(StdOut, IDS_DEPLOY_FAIL);
+        return EXIT_SUCCESS;
+    }
+
+    Context->bVerify = TRUE;
+    GetQosSettings(&Context->QosSettings);
+
+    for (i = 1; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"image=", &pszSuffix))
+        {
+            /* image=<file> */
+            if (pszImage != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszImage);
+
+            pszImage = DuplicateQuotedString(pszSuffix);
+            if (pszImage == NULL)
+                goto invalid;
+        }
+        else if (HasPrefix(argv[i], L"disks=", &pszSuffix))
+        {
+            /* disks=<list> */
+            if (!ParseDeployDisks(Context, pszSuffix))
+                goto invalid;
+        }
+        else if (_wcsicmp(argv[i], L"noverify") == 0)
+        {
+            Context->bVerify = FALSE;
+        }
+        else if (HasPrefix(argv[i], L"qos=", &pszSuffix))
+        {
+            /* qos=<setting>[,<setting>...] */
+            if (!ParseQosSettings(pszSuffix, &Context->QosSettings))
+                goto invalid;
+        }
+        else
+        {
+            goto invalid;
+        }
+    }
+
+    if ((pszImage == NULL) || (Context->TargetCount == 0))
+        goto invalid;
+
+    Status = OpenDeployImage(pszImage, &Context->Image, &Context->ImageLength);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("OpenDeployImage() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_DEPLOY_FAIL);
+        CloseIoEngine(&Context->Image);
+        goto done;
+    }
+
+    if ((Context->ImageLength == 0) || !CheckDeployTargets(Context))
+    {
+        if (Context->ImageLength == 0)
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        CloseIoEngine(&Context->Image);
+        goto done;
+    }
+
+    Context->ChunkCount = (Context->ImageLength + DEPLOY_CHUNK_SIZE - 1) / DEPLOY_CHUNK_SIZE;
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        Status = OpenDeployDisk(Context->Targets[Index].DiskNumber,
+                                &Context->Targets[Index].Engine);
+        if (!NT_SUCCESS(Status))
+            FailDeployTarget(&Context->Targets[Index], Status);
+    }
+
+    Status = RunDeploy(Context);
+    CloseIoEngine(&Context->Image);
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        /* A disk that failed during the read back holds the whole image too */
+        if (Context->Targets[Index].BytesWritten == Context->ImageLength)
+            UpdateDeployDisk(&Context->Targets[Index]);
+
+        CloseIoEngine(&Context->Targets[Index].Engine);
+    }
+
+    /* The targets have new partition tables */
+    if (CurrentDisk != NULL)
+    {
+        ulCurrentDisk = CurrentDisk->DiskNumber;
+        if (CurrentPartition != NULL)
+            ullCurrentStart = CurrentPartition->StartSector.QuadPart;
+    }
+    RescanAndSelect(ulCurrentDisk, ullCurrentStart);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Deploy failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_DEPLOY_FAIL);
+        goto done;
+    }
+
+    PrintDeployResults(Context);
+
+    for (Index = 0; Index < Context->TargetCount; Index++)
+    {
+        if ((Context->Targets[Index].State != DeployDone) ||
+            (Context->bVerify && (Context->Targets[Index].Checksum != Context->Checksum)))
+            ulFailed++;
+    }
+
+    if (ulFailed != 0)
+        ConResPrintf(StdOut, IDS_DEPLOY_PARTIAL, ulFailed, Context->TargetCount);
+    else
+        ConResPuts(StdOut, IDS_DEPLOY_SUCCESS);
+
+    goto done;
+
+invalid:
+    ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+
+done:
+    if (pszImage != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszImage);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Context);
+
+    return EXIT_SUCCESS;
+}
@@ -113,6 +113,11 @@ DetailDisk(
                 szBuffer, ARRAYSIZE(szBuffer));
     ConResPrintf(StdOut, IDS_DETAIL_INFO_BOOT_DSK, szBuffer);
 
+    PrintDiskSettings(CurrentDisk);
+    ConResPrintf(StdOut, IDS_DETAIL_INFO_SECTOR_CACHE,
+                 CurrentDisk->SectorCacheHits,
+                 CurrentDisk->SectorCacheMisses);
+
     Entry = VolumeListHead.Flink;
     while (Entry != &VolumeListHead)
     {
@@ -151,6 +156,7 @@ DetailPartition(
     PVOLENTRY VolumeEntry;
     BOOL bVolumeFound = FALSE, bPrintHeader = TRUE;
     WCHAR szBuffer[40];
+    ULONG ulBoundary;
 
     DPRINT("DetailPartition()\n");
 
@@ -204,6 +210,25 @@ DetailPartition(
     }
     ConResPrintf(StdOut, IDS_DETAIL_PARTITION_OFFSET, PartOffset);
 
+    ulBoundary = GetPartitionMisalignment(CurrentDisk, PartEntry);
+    if (ulBoundary == 0)
+    {
+        LoadStringW(GetModuleHandle(NULL), IDS_STATUS_YES, szBuffer, ARRAYSIZE(szBuffer));
+        ConResPrintf(StdOut, IDS_DETAIL_PARTITION_ALIGNED, szBuffer);
+    }
+    else
+    {
+        ConResPrintf(StdOut,
+                     (ulBoundary == CurrentDisk->PhysicalSectorSize) ? IDS_DETAIL_PARTITION_MISALIGNED_SECTOR : IDS_DETAIL_PARTITION_MISALIGNED_STRIPE,
+                     ulBoundary);
+    }
+
+    if (PartEntry->FormatState == Preformatted)
+    {
+        ConResPrintf(StdOut, IDS_DETAIL_PARTITION_FILESYSTEM, PartEntry->FileSystemName);
+        ConResPrintf(StdOut, IDS_DETAIL_PARTITION_LABEL, PartEntry->VolumeLabel);
+    }
+
     Entry = VolumeListHead.Flink;
     while (Entry != &VolumeListHead)
     {
@@ -235,6 +260,53 @@ DetailPartition(
 }
 
 
+/*
+ * Asks the file system for the allocation unit of the volume, as the one in
+ * the volume list is stale once the volume was formatted again.
+ */
+static
+ULONG
+GetVolumeAllocationUnit(
+    _In_ PVOLENTRY VolumeEntry)
+{
+    FILE_FS_SIZE_INFORMATION SizeInfo;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    UNICODE_STRING Name;
+    IO_STATUS_BLOCK Iosb;
+    HANDLE VolumeHandle;
+    NTSTATUS Status;
+
+    RtlInitUnicodeString(&Name, VolumeEntry->DeviceName);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               0,
+                               NULL,
+                               NULL);
+
+    Status = NtOpenFile(&VolumeHandle,
+                        SYNCHRONIZE,
+                        &ObjectAttributes,
+                        &Iosb,
+                        0,
+                        FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT);
+    if (!NT_SUCCESS(Status))
+        return 0;
+
+    Status = NtQueryVolumeInformationFile(VolumeHandle,
+                                          &Iosb,
+                                          &SizeInfo,
+                                          sizeof(FILE_FS_SIZE_INFORMATION),
+                                          FileFsSizeInformation);
+    NtClose(VolumeHandle);
+
+    if (!NT_SUCCESS(Status))
+        return 0;
+
+    return SizeInfo.SectorsPerAllocationUnit * SizeInfo.BytesPerSector;
+}
+
+
 EXIT_CODE
 DetailVolume(
     _In_ INT argc,
@@ -242,7 +314,9 @@ DetailVolume(
 {
     PDISKENTRY DiskEntry;
     PLIST_ENTRY Entry;
-    BOOL bDiskFound = FALSE, bPrintHeader = TRUE;
+    FORMAT_RECOMMENDATION Recommendation;
+    ULONG ulAllocationUnit;
+    BOOL bDiskFound = FALSE, bPrintHeader = TRUE, bRecommended;
 
     DPRINT("DetailVolume()\n");
 
@@ -284,6 +358,23 @@ DetailVolume(
     if (bDiskFound == FALSE)
         ConResPuts(StdOut, IDS_DETAIL_NO_DISKS);
 
+    /* The unit the volume was formatted with, then what FORMAT RECOMMENDED would pick */
+    ulAllocationUnit = GetVolumeAllocationUnit(CurrentVolume);
+    bRecommended = GetRecommendedFormat(CurrentVolume, CurrentVolume->pszFilesystem, WorkloadDefault, &Recommendation);
+
+    if ((ulAllocationUnit != 0) || bRecommended)
+        ConPuts(StdOut, L"\n");
+
+    if (ulAllocationUnit != 0)
+        ConResPrintf(StdOut, IDS_DETAIL_VOLUME_CLUSTER_SIZE, ulAllocationUnit);
+
+    if (bRecommended)
+    {
+        ConResPrintf(StdOut, IDS_DETAIL_VOLUME_RECOMMENDED, Recommendation.ClusterSize);
+        if (Recommendation.StripeWidth != 0)
+            ConResPrintf(StdOut, IDS_DETAIL_VOLUME_STRIPE, Recommendation.Stride, Recommendation.StripeWidth);
+    }
+
     /* TODO: Print more volume details */
 
     ConPuts(StdOut, L"\n");
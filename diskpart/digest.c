@@ -0,0 +1,794 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/digest.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define DIGEST_MANIFEST_MAGIC       0x464D5044  /* "DPMF" */
+#define DIGEST_MANIFEST_VERSION     1
+
+/* Header of a manifest file, followed by the digest of every chunk */
+typedef struct _DIGEST_MANIFEST_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    DIGEST_ALGORITHM Algorithm;
+    ULONG ChunkSize;
+    ULONG DigestSize;
+    ULONG Reserved;
+    ULONGLONG Length;
+    LARGE_INTEGER WriteTime;
+    ULONGLONG ChunkCount;
+} DIGEST_MANIFEST_HEADER, *PDIGEST_MANIFEST_HEADER;
+
+#define ROTR32(x, n)    (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const ULONG Sha256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* CRC-32C (Castagnoli), reflected polynomial 0x82F63B78 */
+static const ULONG Crc32cTable[256] =
+{
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+#define XXH_PRIME32_1   0x9E3779B1U
+#define XXH_PRIME32_2   0x85EBCA77U
+#define XXH_PRIME32_3   0xC2B2AE3DU
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1   0x165667919E3779F9ULL
+#define XXH_PRIME_MX2   0x9FB21C651E98DF25ULL
+
+#define XXH3_SECRET_SIZE    192
+#define XXH3_STRIPE_LENGTH  64
+
+/* Default secret of XXH3 */
+static const UCHAR Xxh3Secret[XXH3_SECRET_SIZE] =
+{
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+/* FUNCTIONS ******************************************************************/
+
+static
+VOID
+Sha256Transform(
+    _Inout_ PSHA256_CONTEXT Context,
+    _In_reads_bytes_(64) const UCHAR *Block)
+{
+    ULONG W[64];
+    ULONG a, b, c, d, e, f, g, h, t1, t2;
+    ULONG i;
+
+    for (i = 0; i < 16; i++)
+    {
+        W[i] = ((ULONG)Block[i * 4] << 24) | ((ULONG)Block[i * 4 + 1] << 16) |
+               ((ULONG)Block[i * 4 + 2] << 8) | (ULONG)Block[i * 4 + 3];
+    }
+
+    for (i = 16; i < 64; i++)
+    {
+        W[i] = W[i - 16] + W[i - 7] +
+               (ROTR32(W[i - 15], 7) ^ ROTR32(W[i - 15], 18) ^ (W[i - 15] >> 3)) +
+               (ROTR32(W[i - 2], 17) ^ ROTR32(W[i - 2], 19) ^ (W[i - 2] >> 10));
+    }
+
+    a = Context->State[0];
+    b = Context->State[1];
+    c = Context->State[2];
+    d = Context->State[3];
+    e = Context->State[4];
+    f = Context->State[5];
+    g = Context->State[6];
+    h = Context->State[7];
+
+    for (i = 0; i < 64; i++)
+    {
+        t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+             ((e & f) ^ (~e & g)) + Sha256K[i] + W[i];
+        t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+             ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    Context->State[0] += a;
+    Context->State[1] += b;
+    Context->State[2] += c;
+    Context->State[3] += d;
+    Context->State[4] += e;
+    Context->State[5] += f;
+    Context->State[6] += g;
+    Context->State[7] += h;
+}
+
+
+VOID
+Sha256Init(
+    _Out_ PSHA256_CONTEXT Context)
+{
+    Context->State[0] = 0x6a09e667;
+    Context->State[1] = 0xbb67ae85;
+    Context->State[2] = 0x3c6ef372;
+    Context->State[3] = 0xa54ff53a;
+    Context->State[4] = 0x510e527f;
+    Context->State[5] = 0x9b05688c;
+    Context->State[6] = 0x1f83d9ab;
+    Context->State[7] = 0x5be0cd19;
+    Context->Length = 0;
+    Context->BufferLength = 0;
+}
+
+
+VOID
+Sha256Update(
+    _Inout_ PSHA256_CONTEXT Context,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length)
+{
+    const UCHAR *Bytes = Data;
+    ULONG ulCopy;
+
+    Context->Length += Length;
+
+    if (Context->BufferLength != 0)
+    {
+        ulCopy = (ULONG)min(Length, (SIZE_T)(64 - Context->BufferLength));
+        RtlCopyMemory(&Context->Buffer[Context->BufferLength], Bytes, ulCopy);
+        Context->BufferLength += ulCopy;
+        Bytes += ulCopy;
+        Length -= ulCopy;
+
+        if (Context->BufferLength < 64)
+            return;
+
+        Sha256Transform(Context, Context->Buffer);
+        Context->BufferLength = 0;
+    }
+
+    /* Whole blocks are hashed in place */
+    while (Length >= 64)
+    {
+        Sha256Transform(Context, Bytes);
+        Bytes += 64;
+        Length -= 64;
+    }
+
+    RtlCopyMemory(Context->Buffer, Bytes, Length);
+    Context->BufferLength = (ULONG)Length;
+}
+
+
+VOID
+Sha256Final(
+    _Inout_ PSHA256_CONTEXT Context,
+    _Out_writes_bytes_(SHA256_DIGEST_SIZE) PUCHAR Digest)
+{
+    ULONGLONG ullBits = Context->Length * 8;
+    ULONG i;
+
+    Context->Buffer[Context->BufferLength++] = 0x80;
+
+    if (Context->BufferLength > 56)
+    {
+        RtlZeroMemory(&Context->Buffer[Context->BufferLength], 64 - Context->BufferLength);
+        Sha256Transform(Context, Context->Buffer);
+        Context->BufferLength = 0;
+    }
+
+    RtlZeroMemory(&Context->Buffer[Context->BufferLength], 56 - Context->BufferLength);
+    for (i = 0; i < 8; i++)
+        Context->Buffer[56 + i] = (UCHAR)(ullBits >> (56 - (i * 8)));
+
+    Sha256Transform(Context, Context->Buffer);
+
+    for (i = 0; i < 8; i++)
+    {
+        Digest[i * 4] = (UCHAR)(Context->State[i] >> 24);
+        Digest[i * 4 + 1] = (UCHAR)(Context->State[i] >> 16);
+        Digest[i * 4 + 2] = (UCHAR)(Context->State[i] >> 8);
+        Digest[i * 4 + 3] = (UCHAR)Context->State[i];
+    }
+}
+
+
+VOID
+Sha256(
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length,
+    _Out_writes_bytes_(SHA256_DIGEST_SIZE) PUCHAR Digest)
+{
+    SHA256_CONTEXT Context;
+
+    Sha256Init(&Context);
+    Sha256Update(&Context, Data, Length);
+    Sha256Final(&Context, Digest);
+}
+
+
+ULONG
+Crc32c(
+    _In_ ULONG Crc,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length)
+{
+    const UCHAR *Bytes = Data;
+
+    Crc = ~Crc;
+    while (Length-- != 0)
+        Crc = Crc32cTable[(Crc ^ *Bytes++) & 0xFF] ^ (Crc >> 8);
+
+    return ~Crc;
+}
+
+
+static
+ULONG
+ReadLe32(
+    _In_reads_bytes_(4) const UCHAR *Bytes)
+{
+    ULONG Value;
+
+    RtlCopyMemory(&Value, Bytes, sizeof(Value));
+    return Value;
+}
+
+
+static
+ULONGLONG
+ReadLe64(
+    _In_reads_bytes_(8) const UCHAR *Bytes)
+{
+    ULONGLONG Value;
+
+    RtlCopyMemory(&Value, Bytes, sizeof(Value));
+    return Value;
+}
+
+
+/* Folds the 128-bit product of two 64-bit values into 64 bits */
+static
+ULONGLONG
+Xxh3Mul128Fold64(
+    _In_ ULONGLONG Left,
+    _In_ ULONGLONG Right)
+{
+    ULONGLONG LoLo = (Left & 0xFFFFFFFF) * (Right & 0xFFFFFFFF);
+    ULONGLONG HiLo = (Left >> 32) * (Right & 0xFFFFFFFF);
+    ULONGLONG LoHi = (Left & 0xFFFFFFFF) * (Right >> 32);
+    ULONGLONG HiHi = (Left >> 32) * (Right >> 32);
+    ULONGLONG Cross = (LoLo >> 32) + (HiLo & 0xFFFFFFFF) + LoHi;
+    ULONGLONG Upper = (HiLo >> 32) + (Cross >> 32) + HiHi;
+    ULONGLONG Lower = (Cross << 32) | (LoLo & 0xFFFFFFFF);
+
+    return Lower ^ Upper;
+}
+
+
+static
+ULONGLONG
+Xxh64Avalanche(
+    _In_ ULONGLONG Hash)
+{
+    Hash ^= Hash >> 33;
+    Hash *= XXH_PRIME64_2;
+    Hash ^= Hash >> 29;
+    Hash *= XXH_PRIME64_3;
+    Hash ^= Hash >> 32;
+    return Hash;
+}
+
+
+static
+ULONGLONG
+Xxh3Avalanche(
+    _In_ ULONGLONG Hash)
+{
+    Hash ^= Hash >> 37;
+    Hash *= XXH_PRIME_MX1;
+    Hash ^= Hash >> 32;
+    return Hash;
+}
+
+
+static
+ULONGLONG
+Xxh3Mix16(
+    _In_reads_bytes_(16) const UCHAR *Input,
+    _In_reads_bytes_(16) const UCHAR *Secret)
+{
+    return Xxh3Mul128Fold64(ReadLe64(Input) ^ ReadLe64(Secret),
+                            ReadLe64(Input + 8) ^ ReadLe64(Secret + 8));
+}
+
+
+static
+ULONGLONG
+Xxh3Short(
+    _In_reads_bytes_(Length) const UCHAR *Input,
+    _In_ SIZE_T Length)
+{
+    const UCHAR *Secret = Xxh3Secret;
+    ULONGLONG Acc, AccEnd, Low, High;
+    ULONG Combined;
+    SIZE_T i;
+
+    if (Length == 0)
+        return Xxh64Avalanche(ReadLe64(Secret + 56) ^ ReadLe64(Secret + 64));
+
+    if (Length <= 3)
+    {
+        Combined = ((ULONG)Input[0] << 16) | ((ULONG)Input[Length >> 1] << 24) |
+                   (ULONG)Input[Length - 1] | ((ULONG)Length << 8);
+        return Xxh64Avalanche(Combined ^ (ULONGLONG)(ReadLe32(Secret) ^ ReadLe32(Secret + 4)));
+    }
+
+    if (Length <= 8)
+    {
+        Acc = ((ULONGLONG)ReadLe32(Input + Length - 4) + ((ULONGLONG)ReadLe32(Input) << 32)) ^
+              (ReadLe64(Secret + 8) ^ ReadLe64(Secret + 16));
+        Acc ^= ((Acc << 49) | (Acc >> 15)) ^ ((Acc << 24) | (Acc >> 40));
+        Acc *= XXH_PRIME_MX2;
+        Acc ^= (Acc >> 35) + Length;
+        Acc *= XXH_PRIME_MX2;
+        return Acc ^ (Acc >> 28);
+    }
+
+    if (Length <= 16)
+    {
+        Low = ReadLe64(Input) ^ (ReadLe64(Secret + 24) ^ ReadLe64(Secret + 32));
+        High = ReadLe64(Input + Length - 8) ^ (ReadLe64(Secret + 40) ^ ReadLe64(Secret + 48));
+        Acc = Length + RtlUlonglongByteSwap(Low) + High + Xxh3Mul128Fold64(Low, High);
+        return Xxh3Avalanche(Acc);
+    }
+
+    Acc = Length * XXH_PRIME64_1;
+
+    if (Length <= 128)
+    {
+        /* Pairs of 16-byte blocks from both ends of the input */
+        for (i = 0; i < (Length - 1) / 32 + 1; i++)
+        {
+            Acc += Xxh3Mix16(Input + (16 * i), Secret + (32 * i));
+            Acc += Xxh3Mix16(Input + Length - (16 * (i + 1)), Secret + (32 * i) + 16);
+        }
+
+        return Xxh3Avalanche(Acc);
+    }
+
+    for (i = 0; i < 8; i++)
+        Acc += Xxh3Mix16(Input + (16 * i), Secret + (16 * i));
+
+    Acc = Xxh3Avalanche(Acc);
+    AccEnd = Xxh3Mix16(Input + Length - 16, Secret + 136 - 17);
+
+    for (i = 8; i < Length / 16; i++)
+        AccEnd += Xxh3Mix16(Input + (16 * i), Secret + (16 * (i - 8)) + 3);
+
+    return Xxh3Avalanche(Acc + AccEnd);
+}
+
+
+static
+VOID
+Xxh3Accumulate(
+    _Inout_updates_(8) PULONGLONG Acc,
+    _In_reads_bytes_(XXH3_STRIPE_LENGTH) const UCHAR *Input,
+    _In_reads_bytes_(XXH3_STRIPE_LENGTH) const UCHAR *Secret)
+{
+    ULONGLONG Value, Key;
+    ULONG i;
+
+    for (i = 0; i < 8; i++)
+    {
+        Value = ReadLe64(Input + (8 * i));
+        Key = Value ^ ReadLe64(Secret + (8 * i));
+        Acc[i ^ 1] += Value;
+        Acc[i] += (Key & 0xFFFFFFFF) * (Key >> 32);
+    }
+}
+
+
+static
+VOID
+Xxh3Scramble(
+    _Inout_updates_(8) PULONGLONG Acc,
+    _In_reads_bytes_(XXH3_STRIPE_LENGTH) const UCHAR *Secret)
+{
+    ULONG i;
+
+    for (i = 0; i < 8; i++)
+    {
+        Acc[i] ^= Acc[i] >> 47;
+        Acc[i] ^= ReadLe64(Secret + (8 * i));
+        Acc[i] *= XXH_PRIME32_1;
+    }
+}
+
+
+/* XXH3 64-bit hash with the default secret and a zero seed */
+ULONGLONG
+Xxh3(
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length)
+{
+    const SIZE_T StripesPerBlock = (XXH3_SECRET_SIZE - XXH3_STRIPE_LENGTH) / 8;
+    const SIZE_T BlockLength = XXH3_STRIPE_LENGTH * StripesPerBlock;
+    const UCHAR *Input = Data;
+    ULONGLONG Acc[8] = {XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+                        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1};
+    ULONGLONG Result;
+    SIZE_T Blocks, Stripes, n, i;
+
+    if (Length <= 240)
+        return Xxh3Short(Input, Length);
+
+    Blocks = (Length - 1) / BlockLength;
+    for (n = 0; n < Blocks; n++)
+    {
+        for (i = 0; i < StripesPerBlock; i++)
+            Xxh3Accumulate(Acc, Input + (n * BlockLength) + (i * XXH3_STRIPE_LENGTH), Xxh3Secret + (i * 8));
+
+        Xxh3Scramble(Acc, Xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LENGTH);
+    }
+
+    Stripes = ((Length - 1) - (Blocks * BlockLength)) / XXH3_STRIPE_LENGTH;
+    for (i = 0; i < Stripes; i++)
+        Xxh3Accumulate(Acc, Input + (Blocks * BlockLength) + (i * XXH3_STRIPE_LENGTH), Xxh3Secret + (i * 8));
+
+    /* The last stripe always ends at the end of the input */
+    Xxh3Accumulate(Acc, Input + Length - XXH3_STRIPE_LENGTH,
+                   Xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LENGTH - 7);
+
+    Result = Length * XXH_PRIME64_1;
+    for (i = 0; i < 4; i++)
+    {
+        Result += Xxh3Mul128Fold64(Acc[2 * i] ^ ReadLe64(Xxh3Secret + 11 + (16 * i)),
+                                   Acc[2 * i + 1] ^ ReadLe64(Xxh3Secret + 11 + (16 * i) + 8));
+    }
+
+    return Xxh3Avalanche(Result);
+}
+
+
+ULONG
+GetDigestSize(
+    _In_ DIGEST_ALGORITHM Algorithm)
+{
+    switch (Algorithm)
+    {
+        case DigestXxh3:
+            return 8;
+
+        case DigestCrc32c:
+            return 4;
+
+        case DigestSha256:
+            return SHA256_DIGEST_SIZE;
+
+        default:
+            return 0;
+    }
+}
+
+
+/* Stores the digest with the most significant byte first, the way it is printed */
+VOID
+ComputeDigest(
+    _In_ DIGEST_ALGORITHM Algorithm,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length,
+    _Out_writes_bytes_(MAXIMUM_DIGEST_SIZE) PUCHAR Digest)
+{
+    ULONGLONG ullHash;
+    ULONG i, ulSize;
+
+    switch (Algorithm)
+    {
+        case DigestXxh3:
+            ullHash = Xxh3(Data, Length);
+            break;
+
+        case DigestCrc32c:
+            ullHash = Crc32c(0, Data, Length);
+            break;
+
+        case DigestSha256:
+            Sha256(Data, Length, Digest);
+            return;
+
+        default:
+            return;
+    }
+
+    ulSize = GetDigestSize(Algorithm);
+    for (i = 0; i < ulSize; i++)
+        Digest[i] = (UCHAR)(ullHash >> ((ulSize - 1 - i) * 8));
+}
+
+
+NTSTATUS
+CreateDigestManifest(
+    _In_ DIGEST_ALGORITHM Algorithm,
+    _In_ ULONG ChunkSize,
+    _In_ ULONGLONG Length,
+    _In_opt_ PLARGE_INTEGER WriteTime,
+    _Out_ PDIGEST_MANIFEST *ppManifest)
+{
+    PDIGEST_MANIFEST Manifest;
+    ULONGLONG ullChunkCount;
+    SIZE_T Size;
+
+    *ppManifest = NULL;
+
+    if ((ChunkSize == 0) || (GetDigestSize(Algorithm) == 0))
+        return STATUS_INVALID_PARAMETER;
+
+    ullChunkCount = (Length + ChunkSize - 1) / ChunkSize;
+    if (ullChunkCount > (MAXULONG / MAXIMUM_DIGEST_SIZE))
+        return STATUS_INVALID_PARAMETER;
+
+    Size = sizeof(DIGEST_MANIFEST) + ((SIZE_T)ullChunkCount * GetDigestSize(Algorithm));
+    Manifest = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, Size);
+    if (Manifest == NULL)
+        return STATUS_NO_MEMORY;
+
+    Manifest->Algorithm = Algorithm;
+    Manifest->ChunkSize = ChunkSize;
+    Manifest->DigestSize = GetDigestSize(Algorithm);
+    Manifest->Length = Length;
+    if (WriteTime != NULL)
+        Manifest->WriteTime = *WriteTime;
+    Manifest->ChunkCount = ullChunkCount;
+    Manifest->Digests = (PUCHAR)(Manifest + 1);
+
+    *ppManifest = Manifest;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DestroyDigestManifest(
+    _In_ PDIGEST_MANIFEST Manifest)
+{
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Manifest);
+}
+
+
+static
+NTSTATUS
+OpenManifestFile(
+    _In_ PWSTR pszFileName,
+    _In_ ULONG CreateDisposition,
+    _Out_ PHANDLE FileHandle)
+{
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    if (!RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+        return STATUS_OBJECT_NAME_INVALID;
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    Status = NtCreateFile(FileHandle,
+                          (CreateDisposition == FILE_OPEN) ? FILE_GENERIC_READ : FILE_GENERIC_WRITE,
+                          &ObjectAttributes,
+                          &Iosb,
+                          NULL,
+                          FILE_ATTRIBUTE_NORMAL,
+                          FILE_SHARE_READ,
+                          CreateDisposition,
+                          FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY,
+                          NULL,
+                          0);
+
+    RtlFreeUnicodeString(&Name);
+
+    return Status;
+}
+
+
+NTSTATUS
+LoadDigestManifest(
+    _In_ PWSTR pszFileName,
+    _Out_ PDIGEST_MANIFEST *ppManifest)
+{
+    DIGEST_MANIFEST_HEADER Header;
+    PDIGEST_MANIFEST Manifest = NULL;
+    IO_STATUS_BLOCK Iosb;
+    HANDLE FileHandle;
+    ULONG ulLength;
+    NTSTATUS Status;
+
+    *ppManifest = NULL;
+
+    Status = OpenManifestFile(pszFileName, FILE_OPEN, &FileHandle);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtReadFile(FileHandle,
+                        NULL,
+                        NULL,
+                        NULL,
+                        &Iosb,
+                        &Header,
+                        sizeof(Header),
+                        NULL,
+                        NULL);
+    if (NT_SUCCESS(Status) &&
+        ((Iosb.Information != sizeof(Header)) ||
+         (Header.Magic != DIGEST_MANIFEST_MAGIC) ||
+         (Header.Version != DIGEST_MANIFEST_VERSION) ||
+         (Header.DigestSize != GetDigestSize(Header.Algorithm))))
+    {
+        Status = STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        Status = CreateDigestManifest(Header.Algorithm,
+                                      Header.ChunkSize,
+                                      Header.Length,
+                                      &Header.WriteTime,
+                                      &Manifest);
+    }
+
+    if (NT_SUCCESS(Status) && (Manifest->ChunkCount != Header.ChunkCount))
+        Status = STATUS_FILE_CORRUPT_ERROR;
+
+    if (NT_SUCCESS(Status))
+    {
+        ulLength = (ULONG)(Manifest->ChunkCount * Manifest->DigestSize);
+        Status = NtReadFile(FileHandle,
+                            NULL,
+                            NULL,
+                            NULL,
+                            &Iosb,
+                            Manifest->Digests,
+                            ulLength,
+                            NULL,
+                            NULL);
+        if (NT_SUCCESS(Status) && (Iosb.Information != ulLength))
+            Status = STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    NtClose(FileHandle);
+
+    if (!NT_SUCCESS(Status))
+    {
+        if (Manifest != NULL)
+            DestroyDigestManifest(Manifest);
+        return Status;
+    }
+
+    *ppManifest = Manifest;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+SaveDigestManifest(
+    _In_ PWSTR pszFileName,
+    _In_ PDIGEST_MANIFEST Manifest)
+{
+    DIGEST_MANIFEST_HEADER Header;
+    IO_STATUS_BLOCK Iosb;
+    HANDLE FileHandle;
+    NTSTATUS Status;
+
+    RtlZeroMemory(&Header, sizeof(Header));
+    Header.Magic = DIGEST_MANIFEST_MAGIC;
+    Header.Version = DIGEST_MANIFEST_VERSION;
+    Header.Algorithm = Manifest->Algorithm;
+    Header.ChunkSize = Manifest->ChunkSize;
+    Header.DigestSize = Manifest->DigestSize;
+    Header.Length = Manifest->Length;
+    Header.WriteTime = Manifest->WriteTime;
+    Header.ChunkCount = Manifest->ChunkCount;
+
+    Status = OpenManifestFile(pszFileName, FILE_OVERWRITE_IF, &FileHandle);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtWriteFile(FileHandle,
+                         NULL,
+                         NULL,
+                         NULL,
+                         &Iosb,
+                         &Header,
+                         sizeof(Header),
+                         NULL,
+                         NULL);
+    if (NT_SUCCESS(Status))
+    {
+        Status = NtWriteFile(FileHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &Iosb,
+                             Manifest->Digests,
+                             (ULONG)(Manifest->ChunkCount * Manifest->DigestSize),
+                             NULL,
+                             NULL);
+    }
+
+    NtClose(FileHandle);
+
+    return Status;
+}
@@ -0,0 +1,150 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/diskhandle.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+/*
+ * Keeps the handles of the disks open between commands, so a script that
+ * works on one disk opens it once. Each disk gets a read-only handle and a
+ * read-write handle, opened when first needed; the read-write handle also
+ * serves reads once it is open.
+ *
+ * Only the interpreter thread uses the cache. Jobs open the disks they work
+ * on themselves. The handles are closed when the partition list is rescanned
+ * and when the least recently used disk makes room for another one.
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define DISK_HANDLE_CACHE_SIZE  32
+
+/* Disks with an open handle, the most recently used first */
+static LIST_ENTRY DiskHandleListHead = {&DiskHandleListHead, &DiskHandleListHead};
+static ULONG DiskHandleCount = 0;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+NTSTATUS
+OpenDiskHandle(
+    _In_ ULONG DiskNumber,
+    _In_ BOOL bWrite,
+    _Out_ PHANDLE FileHandle)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition0",
+                     DiskNumber);
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    /* Shared, as the read-only and the read-write handle may both be open */
+    return NtOpenFile(FileHandle,
+                      bWrite ? (GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE) :
+                               (FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE),
+                      &ObjectAttributes,
+                      &Iosb,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      FILE_SYNCHRONOUS_IO_NONALERT);
+}
+
+
+VOID
+CloseDiskHandles(
+    _In_ PDISKENTRY DiskEntry)
+{
+    if ((DiskEntry->ReadHandle == NULL) && (DiskEntry->WriteHandle == NULL))
+        return;
+
+    if (DiskEntry->ReadHandle != NULL)
+    {
+        NtClose(DiskEntry->ReadHandle);
+        DiskEntry->ReadHandle = NULL;
+    }
+
+    if (DiskEntry->WriteHandle != NULL)
+    {
+        NtClose(DiskEntry->WriteHandle);
+        DiskEntry->WriteHandle = NULL;
+    }
+
+    RemoveEntryList(&DiskEntry->HandleListEntry);
+    DiskHandleCount--;
+}
+
+
+/*
+ * Returns a synchronous handle to the whole disk. The handle belongs to the
+ * cache and must not be closed by the caller.
+ */
+NTSTATUS
+GetDiskHandle(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ BOOL bWrite,
+    _Out_ PHANDLE FileHandle)
+{
+    PDISKENTRY OldestEntry;
+    HANDLE Handle;
+    NTSTATUS Status;
+
+    Handle = DiskEntry->WriteHandle;
+    if ((Handle == NULL) && !bWrite)
+        Handle = DiskEntry->ReadHandle;
+
+    if (Handle != NULL)
+    {
+        RemoveEntryList(&DiskEntry->HandleListEntry);
+        InsertHeadList(&DiskHandleListHead, &DiskEntry->HandleListEntry);
+
+        *FileHandle = Handle;
+        return STATUS_SUCCESS;
+    }
+
+    Status = OpenDiskHandle(DiskEntry->DiskNumber, bWrite, &Handle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        return Status;
+    }
+
+    if ((DiskEntry->ReadHandle != NULL) || (DiskEntry->WriteHandle != NULL))
+    {
+        RemoveEntryList(&DiskEntry->HandleListEntry);
+    }
+    else
+    {
+        if (DiskHandleCount >= DISK_HANDLE_CACHE_SIZE)
+        {
+            OldestEntry = CONTAINING_RECORD(DiskHandleListHead.Blink, DISKENTRY, HandleListEntry);
+            CloseDiskHandles(OldestEntry);
+        }
+
+        DiskHandleCount++;
+    }
+
+    InsertHeadList(&DiskHandleListHead, &DiskEntry->HandleListEntry);
+
+    if (bWrite)
+        DiskEntry->WriteHandle = Handle;
+    else
+        DiskEntry->ReadHandle = Handle;
+
+    *FileHandle = Handle;
+
+    return STATUS_SUCCESS;
+}
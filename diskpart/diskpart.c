@@ -36,13 +36,16 @@ ShowHeader(VOID)
  * RunScript(const char *filename):
  * opens the file, reads the contents, convert the text into readable
  * code for the computer, and then execute commands in order.
+ * With ulMaxDisks above 1, the parts that use different disks run in parallel.
  */
 EXIT_CODE
-RunScript(LPCWSTR filename)
+RunScript(
+    LPCWSTR filename,
+    ULONG ulMaxDisks)
 {
     FILE *script;
     WCHAR tmp_string[MAX_STRING_SIZE];
-    EXIT_CODE Result;
+    EXIT_CODE Result = EXIT_SUCCESS;
 
     /* Open the file for processing */
     script = _wfopen(filename, L"r");
@@ -54,20 +57,24 @@ RunScript(LPCWSTR filename)
     }
 
     /* Read and process the script */
-    while (fgetws(tmp_string, MAX_STRING_SIZE, script) != NULL)
+    if ((ulMaxDisks <= 1) || !RunParallelScript(script, ulMaxDisks, &Result))
     {
-        Result = InterpretScript(tmp_string);
-        if (Result != EXIT_SUCCESS)
+        while (fgetws(tmp_string, MAX_STRING_SIZE, script) != NULL)
         {
-            fclose(script);
-            return (Result == EXIT_EXIT) ? EXIT_SUCCESS : Result;
+            Result = InterpretScript(tmp_string, script);
+            if (Result != EXIT_SUCCESS)
+                break;
         }
     }
 
     /* Close the file */
     fclose(script);
 
-    return EXIT_SUCCESS;
+    /* The jobs started with NOWAIT finish with the script, and fail it if they fail */
+    if (!WaitForJobs(0) && ((Result == EXIT_SUCCESS) || (Result == EXIT_EXIT)))
+        Result = EXIT_FATAL;
+
+    return (Result == EXIT_EXIT) ? EXIT_SUCCESS : Result;
 }
 
 /*
@@ -79,7 +86,7 @@ int wmain(int argc, const LPWSTR argv[])
     LPCWSTR script = NULL;
     LPCWSTR tmpBuffer = NULL;
     WCHAR appTitle[50];
-    int index, timeout;
+    int index, timeout, maxdisks;
     int result = EXIT_SUCCESS;
 
     /* Initialize the Console Standard Streams */
@@ -94,6 +101,7 @@ int wmain(int argc, const LPWSTR argv[])
     /* Sets the timeout value to 0 just in case the user doesn't
     specify a value */
     timeout = 0;
+    maxdisks = 0;
 
     CreatePartitionList();
     CreateVolumeList();
@@ -154,6 +162,19 @@ int wmain(int argc, const LPWSTR argv[])
                         timeout = 0;
                 }
             }
+            /* Checks for the parallel flag */
+            else if (_wcsicmp(tmpBuffer, L"j") == 0)
+            {
+                if ((index + 1) < argc)
+                {
+                    index++;
+                    maxdisks = _wtoi(argv[index]);
+
+                    /* Like the timeout, a negative number means none */
+                    if (maxdisks < 0)
+                        maxdisks = 0;
+                }
+            }
             else
             {
                 /* Assume that the flag doesn't exist. */
@@ -169,12 +190,17 @@ int wmain(int argc, const LPWSTR argv[])
         /* Now we process the filename if it exists */
         if (script != NULL)
         {
-            /* if the timeout is greater than 0, then assume
-            that the user specified a specific time. */
-            if (timeout > 0)
-                Sleep(timeout * 1000);
+            /* Wait up to the timeout for hot-plugged disks to settle,
+            and see the ones that arrived meanwhile. */
+            if ((timeout > 0) && WaitForDevices(timeout))
+            {
+                DestroyVolumeList();
+                DestroyPartitionList();
+                CreatePartitionList();
+                CreateVolumeList();
+            }
 
-            result = RunScript(script);
+            result = RunScript(script, maxdisks);
             if (result != EXIT_SUCCESS)
                 goto done;
         }
@@ -191,8 +217,10 @@ int wmain(int argc, const LPWSTR argv[])
     ConResPuts(StdOut, IDS_APP_LEAVING);
 
 done:
+    DestroyJobs();
     DestroyVolumeList();
     DestroyPartitionList();
+    DestroyDiskProfiles();
 
     return result;
 }
@@ -114,6 +114,14 @@ typedef enum _VOLUME_TYPE
     VOLUME_TYPE_UNKNOWN
 } VOLUME_TYPE, *PVOLUME_TYPE;
 
+typedef enum _PARTITION_PLACEMENT
+{
+    PlacementFirst,
+    PlacementBestFit,
+    PlacementFast,
+    PlacementSlow
+} PARTITION_PLACEMENT;
+
 typedef struct _MBR_PARTITION_DATA
 {
     BOOLEAN BootIndicator;
@@ -202,6 +210,11 @@ typedef struct _DISKENTRY
     ULONG SectorAlignment;
     ULONG CylinderAlignment;
 
+    ULONG PhysicalSectorSize;   /* Bytes */
+    ULONG OptimalTransferSize;  /* Bytes, full stripe, 0 if not reported */
+    ULONG OptimalGranularity;   /* Bytes, stripe unit, 0 if not reported */
+    ULONG AlignmentOffset;      /* Sectors */
+
     ULARGE_INTEGER StartSector;
     ULARGE_INTEGER EndSector;
 
@@ -233,6 +246,17 @@ typedef struct _DISKENTRY
 
     BOOL IsBoot;
 
+    /* Cached handles, see diskhandle.c */
+    HANDLE ReadHandle;
+    HANDLE WriteHandle;
+    LIST_ENTRY HandleListEntry;
+
+    /* Cached metadata sectors, see sectorcache.c */
+    LIST_ENTRY SectorCacheListHead;
+    ULONG SectorCacheCount;
+    ULONG SectorCacheHits;
+    ULONG SectorCacheMisses;
+
 } DISKENTRY, *PDISKENTRY;
 
 typedef struct _VOLENTRY
@@ -263,6 +287,52 @@ typedef struct _VOLENTRY
 
 } VOLENTRY, *PVOLENTRY;
 
+#define SELECTION_NO_VOLUME ((ULONG)-1)
+
+/* A selection that is kept while the lists are rebuilt, as the entries are freed */
+typedef struct _SELECTION
+{
+    ULONG DiskNumber;           /* JOB_NO_DISK: no disk selected */
+    ULONGLONG ullStartSector;   /* 0: no partition selected */
+    ULONG VolumeNumber;
+} SELECTION, *PSELECTION;
+
+typedef enum _FORMAT_WORKLOAD
+{
+    WorkloadDefault,
+    WorkloadSmallFiles,
+    WorkloadLargeFiles
+} FORMAT_WORKLOAD;
+
+typedef struct _FORMAT_RECOMMENDATION
+{
+    ULONG ClusterSize;          /* Bytes */
+    ULONG Stride;               /* Clusters per stripe unit, 0 if not reported */
+    ULONG StripeWidth;          /* Clusters per stripe, 0 if not reported */
+    BOOL bRotational;
+} FORMAT_RECOMMENDATION, *PFORMAT_RECOMMENDATION;
+
+typedef struct _DISK_SETTINGS
+{
+    BOOL AlignmentValid;
+    ULONG LogicalSectorSize;
+    ULONG PhysicalSectorSize;
+    ULONG AlignmentOffset;
+
+    BOOL AdapterValid;
+    ULONG MaximumTransferLength;
+    BOOLEAN CommandQueueing;
+
+    BOOL SeekPenaltyValid;
+    BOOLEAN IncursSeekPenalty;
+
+    BOOL TrimValid;
+    BOOLEAN TrimEnabled;
+
+    BOOL CacheValid;
+    DISK_CACHE_INFORMATION CacheInfo;
+} DISK_SETTINGS, *PDISK_SETTINGS;
+
 #define SIZE_1KB    (1024ULL)
 #define SIZE_10KB   (10ULL * 1024ULL)
 #define SIZE_1MB    (1024ULL * 1024ULL)
@@ -272,6 +342,206 @@ typedef struct _VOLENTRY
 #define SIZE_1TB    (1024ULL * 1024ULL * 1024ULL * 1024ULL)
 #define SIZE_10TB   (10ULL * 1024ULL * 1024ULL * 1024ULL * 1024ULL)
 
+/* Sequential read throughput across the LBA range of a disk */
+#define DISK_PROFILE_ZONES  16
+
+typedef struct _DISK_PROFILE
+{
+    LIST_ENTRY ListEntry;
+
+    /* Disk identity */
+    WCHAR Description[64];
+    ULONGLONG SectorCount;
+    ULONG BytesPerSector;
+    USHORT Port;
+    USHORT PathId;
+    USHORT TargetId;
+    USHORT Lun;
+
+    ULONG Throughput[DISK_PROFILE_ZONES];   /* KB/s */
+} DISK_PROFILE, *PDISK_PROFILE;
+
+/* Byte ranges of a volume that its file system uses */
+typedef struct _FS_RUN
+{
+    ULONGLONG Offset;
+    ULONGLONG Length;
+} FS_RUN, *PFS_RUN;
+
+typedef struct _FS_MAP
+{
+    ULONGLONG Length;       /* Size of the volume */
+    ULONGLONG UsedBytes;    /* Sum of the run lengths */
+    ULONG RunCount;
+    ULONG MaxRuns;
+    PFS_RUN Runs;
+} FS_MAP, *PFS_MAP;
+
+#define SHA256_DIGEST_SIZE  32
+
+typedef struct _SHA256_CONTEXT
+{
+    ULONG State[8];
+    ULONGLONG Length;       /* Bytes hashed so far */
+    UCHAR Buffer[64];
+    ULONG BufferLength;
+} SHA256_CONTEXT, *PSHA256_CONTEXT;
+
+typedef enum _DIGEST_ALGORITHM
+{
+    DigestNone,
+    DigestXxh3,
+    DigestCrc32c,
+    DigestSha256
+} DIGEST_ALGORITHM;
+
+#define MAXIMUM_DIGEST_SIZE SHA256_DIGEST_SIZE
+
+/* Digests of the fixed-size chunks of an image, a disk or a partition */
+typedef struct _DIGEST_MANIFEST
+{
+    DIGEST_ALGORITHM Algorithm;
+    ULONG ChunkSize;
+    ULONG DigestSize;
+    ULONGLONG Length;
+    LARGE_INTEGER WriteTime;    /* Last write time of an image file, zero otherwise */
+    ULONGLONG ChunkCount;
+    PUCHAR Digests;
+} DIGEST_MANIFEST, *PDIGEST_MANIFEST;
+
+#define ARCHIVE_MAGIC           0x52415044  /* "DPAR" */
+#define ARCHIVE_VERSION         1
+
+#define ARCHIVE_BLOCK_ZERO          0x0001  /* Not stored, the block is all zeros */
+#define ARCHIVE_BLOCK_COMPRESSED    0x0002  /* Stored compressed, raw otherwise */
+
+/* Header of an archive file, rewritten once the index has been written */
+typedef struct _ARCHIVE_HEADER
+{
+    ULONG Magic;
+    ULONG Version;
+    USHORT Compression;     /* COMPRESSION_FORMAT_*, the engine is not needed to decompress */
+    USHORT Reserved;
+    ULONG BlockSize;
+    ULONG BytesPerSector;
+    ULONG Reserved2;
+    ULONGLONG Length;       /* Size of the partition */
+    ULONGLONG BlockCount;
+    ULONGLONG IndexOffset;  /* One ARCHIVE_BLOCK per block */
+} ARCHIVE_HEADER, *PARCHIVE_HEADER;
+
+typedef struct _ARCHIVE_BLOCK
+{
+    ULONGLONG Offset;       /* Offset of the stored data in the archive file */
+    ULONG StoredLength;
+    ULONG Checksum;         /* CRC32C of the uncompressed data */
+    USHORT Flags;
+    USHORT Reserved[3];
+} ARCHIVE_BLOCK, *PARCHIVE_BLOCK;
+
+/* An archive opened for random access */
+typedef struct _ARCHIVE
+{
+    HANDLE FileHandle;
+    ARCHIVE_HEADER Header;
+    PARCHIVE_BLOCK Blocks;
+    ULONGLONG CachedBlock;  /* Block held in Data, or Header.BlockCount */
+    PUCHAR Data;
+    PUCHAR Packed;
+} ARCHIVE, *PARCHIVE;
+
+/* Upper bound for partition alignment derived from the disk topology */
+#define MAXIMUM_PARTITION_ALIGNMENT (64 * 1024 * 1024)
+
+/* Disk numbers of a background job: none, or any disk when waiting */
+#define JOB_NO_DISK             ((ULONG)-1)
+#define JOB_ALL_DISKS           ((ULONG)-2)
+
+typedef struct _JOB *PJOB;
+
+/* Does the I/O of a command, Job is NULL when the command runs in place */
+typedef NTSTATUS (*PJOB_ROUTINE)(_In_opt_ PJOB Job, _In_ PVOID Context);
+
+/* Reports the result and releases the context, always on the interpreter thread */
+typedef VOID (*PJOB_COMPLETION)(_In_ NTSTATUS Status, _In_ PVOID Context);
+
+typedef enum _QOS_PRIORITY
+{
+    QosPriorityNormal,
+    QosPriorityLow,
+    QosPriorityIdle
+} QOS_PRIORITY;
+
+/* I/O limits of the bulk commands, zero for no limit */
+typedef struct _QOS_SETTINGS
+{
+    ULONG ulBandwidth;      /* MB/s */
+    ULONG ulIops;
+    ULONG ulLatency;        /* Milliseconds per request above which the limits back off */
+    QOS_PRIORITY Priority;
+} QOS_SETTINGS, *PQOS_SETTINGS;
+
+/* Token bucket that paces the requests of one command */
+typedef struct _QOS_BUCKET
+{
+    QOS_SETTINGS Settings;
+    PJOB Job;
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER LastRefill;
+    LONGLONG ByteTokens;        /* Negative while the bucket is in debt */
+    LONGLONG RequestTokens;     /* Thousandths of a request */
+
+    /* Latency feedback, DeviceHandle is NULL when the limits stay fixed */
+    HANDLE DeviceHandle;
+    ULONG Scale;                /* Share of the limits in use, 1024 for all */
+    ULONGLONG BaseRate;         /* Bytes/s backed off from without a bandwidth limit */
+    LARGE_INTEGER LastSample;
+    ULONGLONG SampleBytes;
+    ULONGLONG LastServiceTime;
+    ULONG LastRequestCount;
+} QOS_BUCKET, *PQOS_BUCKET;
+
+typedef enum _IO_ENGINE_TYPE
+{
+    IoEngineBuffered,
+    IoEngineDirect,
+    IoEngineAsync,
+    IoEngineMapped
+} IO_ENGINE_TYPE;
+
+typedef struct _IO_REQUEST
+{
+    HANDLE Event;
+    IO_STATUS_BLOCK Iosb;
+    ULONG Length;               /* Bytes the request must transfer */
+    ULONGLONG Sequence;         /* Order of issue, for WaitForIoEngine */
+    BOOL bPending;
+} IO_REQUEST, *PIO_REQUEST;
+
+/* Disk, partition or image file opened with the engine set by SET IO */
+typedef struct _IO_ENGINE
+{
+    IO_ENGINE_TYPE Type;
+    HANDLE FileHandle;
+    NTSTATUS Status;            /* First failed request */
+    BOOL bWrite;                /* Opened for writing, flushed to the media */
+    ULONG Alignment;            /* Unbuffered reads are rounded up to it, 0 if unknown */
+
+    /* Asynchronous engine */
+    ULONG QueueDepth;
+    ULONG NextRequest;
+    ULONGLONG Submitted;        /* Requests issued so far */
+    PIO_REQUEST Requests;
+
+    /* Mapped engine */
+    HANDLE SectionHandle;
+    PUCHAR View;
+    SIZE_T ViewSize;
+
+    PQOS_BUCKET Qos;            /* Optional, throttles every request */
+    BOOL bCachedHandle;         /* FileHandle belongs to the disk handle cache */
+} IO_ENGINE, *PIO_ENGINE;
+
 
 /* GLOBAL VARIABLES ***********************************************************/
 
@@ -297,6 +567,33 @@ add_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* archive.c */
+NTSTATUS
+OpenArchive(
+    _In_ PWSTR pszFileName,
+    _Out_ PARCHIVE *ppArchive);
+
+NTSTATUS
+ReadArchive(
+    _In_ PARCHIVE Archive,
+    _In_ ULONGLONG Offset,
+    _Out_writes_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length);
+
+VOID
+CloseArchive(
+    _In_ PARCHIVE Archive);
+
+EXIT_CODE
+ExportPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+ImportPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* assign.c */
 EXIT_CODE
 assign_main(
@@ -309,9 +606,31 @@ attach_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
-/* attributes.h */
+/* attributes.c */
+BOOL
+QueryStorageProperty(
+    _In_ HANDLE FileHandle,
+    _In_ STORAGE_PROPERTY_ID PropertyId,
+    _Out_ PVOID Buffer,
+    _In_ ULONG BufferSize);
+
+BOOL
+QueryBlockLimits(
+    _In_ ULONG DiskNumber,
+    _Out_ PULONG pulGranularity,
+    _Out_ PULONG pulOptimalLength);
+
+BOOL
+QueryDiskSettings(
+    _In_ PDISKENTRY DiskEntry,
+    _Out_ PDISK_SETTINGS Settings);
+
+VOID
+PrintDiskSettings(
+    _In_ PDISKENTRY DiskEntry);
+
 EXIT_CODE
-attributes_main(
+AttributesDisk(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
@@ -321,6 +640,30 @@ automount_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* bench.c */
+EXIT_CODE
+BenchDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+BenchPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+PDISK_PROFILE
+GetDiskProfile(
+    _In_ PDISKENTRY DiskEntry);
+
+ULONG
+GetProfileThroughput(
+    _In_ PDISK_PROFILE Profile,
+    _In_ ULONGLONG ullStartSector,
+    _In_ ULONGLONG ullSectorCount);
+
+VOID
+DestroyDiskProfiles(VOID);
+
 /* break.c */
 EXIT_CODE
 break_main(
@@ -333,12 +676,34 @@ clean_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* clone.c */
+EXIT_CODE
+CloneDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+ClonePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* compact.c */
 EXIT_CODE
 compact_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* compare.c */
+EXIT_CODE
+CompareDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+ComparePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* convert.c */
 NTSTATUS
 CreateDisk(
@@ -356,6 +721,25 @@ ConvertMBR(
     _In_ PWSTR *argv);
 
 /* create.c */
+PPARTENTRY
+AllocateUnusedSpace(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PLIST_ENTRY ListHead,
+    _In_ ULONGLONG ullSectorCount,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONG ulAlignment,
+    _In_ PARTITION_PLACEMENT Placement);
+
+BOOL
+ParseAlignment(
+    _In_ PWSTR pszSuffix,
+    _Out_ PULONG pulAlignment);
+
+BOOL
+ParseOffset(
+    _In_ PWSTR pszSuffix,
+    _Out_ PULONGLONG pullOffset);
+
 EXIT_CODE
 CreateEfiPartition(
     _In_ INT argc,
@@ -398,6 +782,12 @@ DeleteVolume(
     _In_ PWSTR *argv);
 
 
+/* deploy.c */
+EXIT_CODE
+deploy_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* detach.c */
 EXIT_CODE
 detach_main(
@@ -420,6 +810,83 @@ DetailVolume(
     INT argc,
     PWSTR *argv);
 
+/* digest.c */
+VOID
+Sha256Init(
+    _Out_ PSHA256_CONTEXT Context);
+
+VOID
+Sha256Update(
+    _Inout_ PSHA256_CONTEXT Context,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length);
+
+VOID
+Sha256Final(
+    _Inout_ PSHA256_CONTEXT Context,
+    _Out_writes_bytes_(SHA256_DIGEST_SIZE) PUCHAR Digest);
+
+VOID
+Sha256(
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length,
+    _Out_writes_bytes_(SHA256_DIGEST_SIZE) PUCHAR Digest);
+
+ULONG
+Crc32c(
+    _In_ ULONG Crc,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length);
+
+ULONGLONG
+Xxh3(
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length);
+
+ULONG
+GetDigestSize(
+    _In_ DIGEST_ALGORITHM Algorithm);
+
+VOID
+ComputeDigest(
+    _In_ DIGEST_ALGORITHM Algorithm,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length,
+    _Out_writes_bytes_(MAXIMUM_DIGEST_SIZE) PUCHAR Digest);
+
+NTSTATUS
+CreateDigestManifest(
+    _In_ DIGEST_ALGORITHM Algorithm,
+    _In_ ULONG ChunkSize,
+    _In_ ULONGLONG Length,
+    _In_opt_ PLARGE_INTEGER WriteTime,
+    _Out_ PDIGEST_MANIFEST *ppManifest);
+
+VOID
+DestroyDigestManifest(
+    _In_ PDIGEST_MANIFEST Manifest);
+
+NTSTATUS
+LoadDigestManifest(
+    _In_ PWSTR pszFileName,
+    _Out_ PDIGEST_MANIFEST *ppManifest);
+
+NTSTATUS
+SaveDigestManifest(
+    _In_ PWSTR pszFileName,
+    _In_ PDIGEST_MANIFEST Manifest);
+
+/* diskhandle.c */
+VOID
+CloseDiskHandles(
+    _In_ PDISKENTRY DiskEntry);
+
+NTSTATUS
+GetDiskHandle(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ BOOL bWrite,
+    _Out_ PHANDLE FileHandle);
+
 /* diskpart.c */
 
 /* dump.c */
@@ -433,6 +900,11 @@ DumpPartition(
     _In_ INT argc,
     _In_ LPWSTR *argv);
 
+EXIT_CODE
+DumpArchive(
+    _In_ INT argc,
+    _In_ LPWSTR *argv);
+
 
 /* expand.c */
 EXIT_CODE
@@ -446,24 +918,87 @@ extend_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* fatfmt.c */
+NTSTATUS
+FormatFatVolume(
+    _In_ PUNICODE_STRING VolumeName,
+    _In_ BOOLEAN bExfat,
+    _In_ BOOLEAN bQuick,
+    _In_ PCWSTR pszLabel,
+    _In_ ULONG ulClusterSize,
+    _In_ PQOS_SETTINGS Qos,
+    _In_opt_ PJOB Job);
+
+ULONG
+GetFatClusterSize(
+    _In_ BOOLEAN bExfat,
+    _In_ ULONGLONG ullLength);
+
 /* filesystem.c */
 EXIT_CODE
 filesystems_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* foreach.c */
+EXIT_CODE
+ForEachDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _In_ FILE *Stream);
+
 /* format.c */
 EXIT_CODE
 format_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+BOOL
+GetRecommendedFormat(
+    _In_ PVOLENTRY VolumeEntry,
+    _In_opt_ PCWSTR pszFileSystem,
+    _In_ FORMAT_WORKLOAD Workload,
+    _Out_ PFORMAT_RECOMMENDATION Recommendation);
+
+/* fsmap.c */
+NTSTATUS
+OpenFsVolume(
+    _In_ ULONG DiskNumber,
+    _In_ ULONG PartitionNumber,
+    _Out_ PHANDLE FileHandle);
+
+NTSTATUS
+CreateFsMap(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG BytesPerSector,
+    _In_ ULONGLONG ullLength,
+    _Out_ PFS_MAP *ppMap);
+
+VOID
+DestroyFsMap(
+    _In_ PFS_MAP Map);
+
+VOID
+ProbeFileSystems(
+    _In_ PDISKENTRY DiskEntry);
+
 /* gpt.c */
 EXIT_CODE
 gpt_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* hash.c */
+EXIT_CODE
+HashDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+HashPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* help.c */
 EXIT_CODE
 help_main(
@@ -492,7 +1027,8 @@ inactive_main(
 /* interpreter.c */
 EXIT_CODE
 InterpretScript(
-    _In_ LPWSTR line);
+    _In_ LPWSTR line,
+    _In_opt_ FILE *Stream);
 
 EXIT_CODE
 InterpretCmd(
@@ -502,6 +1038,138 @@ InterpretCmd(
 VOID
 InterpretMain(VOID);
 
+/* ioengine.c */
+PVOID
+AllocateIoBuffer(
+    _In_ SIZE_T Length);
+
+VOID
+FreeIoBuffer(
+    _In_opt_ PVOID Buffer);
+
+NTSTATUS
+OpenIoEngine(
+    _Out_ PIO_ENGINE Engine,
+    _In_ PUNICODE_STRING Name,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG ShareAccess);
+
+NTSTATUS
+OpenDiskIoEngine(
+    _Out_ PIO_ENGINE Engine,
+    _In_ PDISKENTRY DiskEntry);
+
+NTSTATUS
+ReadIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullOffset,
+    _Out_writes_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength);
+
+NTSTATUS
+QueueReadIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullOffset,
+    _Out_writes_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength);
+
+NTSTATUS
+WriteIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullOffset,
+    _In_reads_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength);
+
+ULONGLONG
+GetIoEngineMark(
+    _In_ PIO_ENGINE Engine);
+
+NTSTATUS
+WaitForIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullMark);
+
+NTSTATUS
+FlushIoEngine(
+    _Inout_ PIO_ENGINE Engine);
+
+VOID
+CloseIoEngine(
+    _Inout_ PIO_ENGINE Engine);
+
+EXIT_CODE
+SetIo(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+/* jobs.c */
+VOID
+StartJob(
+    _In_ BOOL bNoWait,
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _In_ ULONG DiskNumber,
+    _In_ ULONG OtherDiskNumber,
+    _In_ PJOB_ROUTINE Routine,
+    _In_ PJOB_COMPLETION Completion,
+    _In_ PVOID Context);
+
+VOID
+SetAlwaysNoWait(
+    _In_ BOOL bNoWait,
+    _In_ BOOL bQuiet);
+
+BOOL
+IsJobCancelled(
+    _In_opt_ PJOB Job);
+
+VOID
+SetJobProgress(
+    _In_opt_ PJOB Job,
+    _In_ ULONG ulPercent);
+
+BOOL
+HasActiveJobs(
+    _In_ ULONG DiskNumber);
+
+VOID
+ReapJobs(VOID);
+
+VOID
+RescanAfterJobs(VOID);
+
+VOID
+WaitForDiskJobs(
+    _In_ ULONG DiskNumber);
+
+VOID
+WaitForAnyJob(VOID);
+
+VOID
+WaitForSelectedDisk(VOID);
+
+BOOL
+WaitForJobs(
+    _In_ ULONG JobId);
+
+VOID
+DestroyJobs(VOID);
+
+EXIT_CODE
+cancel_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+jobs_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+wait_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* list.c */
 EXIT_CODE
 ListDisk(
@@ -589,6 +1257,23 @@ PrintBusType(
     _In_ INT cchBufferMax,
     _In_ STORAGE_BUS_TYPE Bustype);
 
+/* monitor.c */
+EXIT_CODE
+MonitorDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+/* move.c */
+EXIT_CODE
+MovePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
+EXIT_CODE
+RealignPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* mountmgr.h */
 BOOL
 GetAutomountState(
@@ -615,6 +1300,11 @@ BOOL
 DeleteDriveLetter(
     _In_ WCHAR DriveLetter);
 
+NTSTATUS
+WaitForMountManagerChange(
+    _Inout_ PULONG EpicNumber,
+    _In_ ULONG ulMilliseconds);
+
 /* offline.c */
 EXIT_CODE
 offline_main(
@@ -627,6 +1317,13 @@ online_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* parallel.c */
+BOOL
+RunParallelScript(
+    _In_ FILE *Stream,
+    _In_ ULONG ulMaxDisks,
+    _Out_ EXIT_CODE *pResult);
+
 /* partlist.c */
 #ifdef DUMP_PARTITION_TABLE
 VOID
@@ -645,6 +1342,11 @@ AlignDown(
     _In_ ULONGLONG Value,
     _In_ ULONG Alignment);
 
+ULONG
+GetPartitionMisalignment(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PPARTENTRY PartEntry);
+
 NTSTATUS
 CreatePartitionList(VOID);
 
@@ -654,6 +1356,28 @@ DestroyPartitionList(VOID);
 NTSTATUS
 CreateVolumeList(VOID);
 
+PDISKENTRY
+GetDiskForVolume(
+    _In_ PVOLENTRY VolumeEntry);
+
+VOID
+SelectDiskAndPartition(
+    _In_ ULONG DiskNumber,
+    _In_ ULONGLONG ullStartSector);
+
+VOID
+RescanAndSelect(
+    _In_ ULONG DiskNumber,
+    _In_ ULONGLONG ullStartSector);
+
+VOID
+SaveSelection(
+    _Out_ PSELECTION Selection);
+
+VOID
+RestoreSelection(
+    _In_ PSELECTION Selection);
+
 VOID
 DestroyVolumeList(VOID);
 
@@ -699,6 +1423,10 @@ ULONG
 GetPrimaryPartitionCount(
     _In_ PDISKENTRY DiskEntry);
 
+BOOL
+IsDiskEmpty(
+    _In_ PDISKENTRY DiskEntry);
+
 NTSTATUS
 DismountVolume(
     _In_ PPARTENTRY PartEntry);
@@ -712,6 +1440,37 @@ RemoveVolume(
     _In_ PVOLENTRY VolumeEntry);
 
 
+/* qos.c */
+VOID
+GetQosSettings(
+    _Out_ PQOS_SETTINGS Settings);
+
+BOOL
+ParseQosSettings(
+    _In_ PWSTR pszValue,
+    _Inout_ PQOS_SETTINGS Settings);
+
+VOID
+InitializeQosBucket(
+    _Out_ PQOS_BUCKET Bucket,
+    _In_ PQOS_SETTINGS Settings,
+    _In_opt_ PJOB Job);
+
+VOID
+AddQosDevice(
+    _Inout_ PQOS_BUCKET Bucket,
+    _In_ HANDLE FileHandle);
+
+NTSTATUS
+ThrottleQosRequest(
+    _Inout_ PQOS_BUCKET Bucket,
+    _In_ ULONG ulLength);
+
+EXIT_CODE
+SetQos(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* recover.c */
 EXIT_CODE
 recover_main(
@@ -736,6 +1495,12 @@ rescan_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* restore.c */
+EXIT_CODE
+RestorePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv);
+
 /* retain.c */
 EXIT_CODE
 retain_main(
@@ -748,6 +1513,30 @@ san_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* sectorcache.c */
+NTSTATUS
+ReadCachedSectors(
+    _In_ PDISKENTRY DiskEntry,
+    _In_opt_ HANDLE FileHandle,
+    _In_ ULONGLONG ullSector,
+    _In_ ULONG ulSectorCount,
+    _Out_writes_bytes_(ulSectorCount * DiskEntry->BytesPerSector) PVOID Buffer);
+
+VOID
+CacheSectors(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ ULONGLONG ullOffset,
+    _In_reads_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength);
+
+VOID
+InvalidateSectorCache(
+    _In_ PDISKENTRY DiskEntry);
+
+VOID
+InvalidateDiskSectorCache(
+    _In_ ULONG DiskNumber);
+
 /* select.c */
 EXIT_CODE
 SelectDisk(
@@ -775,6 +1564,15 @@ setid_main(
     _In_ INT argc,
     _In_ PWSTR *argv);
 
+/* settle.c */
+BOOL
+WaitForDevices(
+    _In_ ULONG ulSeconds);
+
+VOID
+WaitForPartitionDevices(
+    _In_ PDISKENTRY DiskEntry);
+
 /* shrink.c */
 EXIT_CODE
 shrink_main(
@@ -44,19 +44,43 @@ HexDump(
 }
 
 
+static
+VOID
+DumpSector(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ ULONGLONG ullSector)
+{
+    PUCHAR pSectorBuffer = NULL;
+    NTSTATUS Status;
+
+    pSectorBuffer = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, DiskEntry->BytesPerSector);
+    if (pSectorBuffer == NULL)
+    {
+        DPRINT1("\n");
+        /* Error message */
+        return;
+    }
+
+    /* The partition tables and boot sectors are usually cached already */
+    Status = ReadCachedSectors(DiskEntry, NULL, ullSector, 1, pSectorBuffer);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("ReadCachedSectors failed, status=%x\n", Status);
+        goto done;
+    }
+
+    HexDump(pSectorBuffer, DiskEntry->BytesPerSector);
+
+done:
+    RtlFreeHeap(RtlGetProcessHeap(), 0, pSectorBuffer);
+}
+
+
 EXIT_CODE
 DumpDisk(
     _In_ INT argc,
     _In_ PWSTR *argv)
 {
-    OBJECT_ATTRIBUTES ObjectAttributes;
-    IO_STATUS_BLOCK Iosb;
-    NTSTATUS Status;
-    WCHAR Buffer[MAX_PATH];
-    UNICODE_STRING Name;
-    HANDLE FileHandle = NULL;
-    PUCHAR pSectorBuffer = NULL;
-    LARGE_INTEGER FileOffset;
     LONGLONG Sector;
     LPWSTR endptr = NULL;
 
@@ -82,61 +106,7 @@ DumpDisk(
         return EXIT_SUCCESS;
     }
 
-    pSectorBuffer = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, CurrentDisk->BytesPerSector);
-    if (pSectorBuffer == NULL)
-    {
-        DPRINT1("\n");
-        /* Error message */
-        goto done;
-    }
-
-    swprintf(Buffer,
-             L"\\Device\\Harddisk%d\\Partition0",
-             CurrentDisk->DiskNumber);
-    RtlInitUnicodeString(&Name,
-                        Buffer);
-
-    InitializeObjectAttributes(&ObjectAttributes,
-                               &Name,
-                               0,
-                               NULL,
-                               NULL);
-
-    Status = NtOpenFile(&FileHandle,
-                        FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE,
-                        &ObjectAttributes,
-                        &Iosb,
-                        FILE_SHARE_READ,
-                        FILE_SYNCHRONOUS_IO_NONALERT);
-    if (!NT_SUCCESS(Status))
-    {
-        DPRINT1("\n");
-        goto done;
-    }
-
-    FileOffset.QuadPart = Sector * CurrentDisk->BytesPerSector;
-    Status = NtReadFile(FileHandle,
-                        NULL,
-                        NULL,
-                        NULL,
-                        &Iosb,
-                        (PVOID)pSectorBuffer,
-                        CurrentDisk->BytesPerSector,
-                        &FileOffset,
-                        NULL);
-    if (!NT_SUCCESS(Status))
-    {
-        DPRINT1("NtReadFile failed, status=%x\n", Status);
-        goto done;
-    }
-
-    HexDump(pSectorBuffer, CurrentDisk->BytesPerSector);
-
-done:
-    if (FileHandle)
-        NtClose(FileHandle);
-
-    RtlFreeHeap(RtlGetProcessHeap(), 0, pSectorBuffer);
+    DumpSector(CurrentDisk, Sector);
 
     return EXIT_SUCCESS;
 }
@@ -147,14 +117,6 @@ DumpPartition(
     _In_ INT argc,
     _In_ PWSTR *argv)
 {
-    OBJECT_ATTRIBUTES ObjectAttributes;
-    IO_STATUS_BLOCK Iosb;
-    NTSTATUS Status;
-    WCHAR Buffer[MAX_PATH];
-    UNICODE_STRING Name;
-    HANDLE FileHandle = NULL;
-    PUCHAR pSectorBuffer = NULL;
-    LARGE_INTEGER FileOffset;
     LONGLONG Sector;
     LPWSTR endptr = NULL;
 
@@ -187,62 +149,89 @@ DumpPartition(
         return EXIT_SUCCESS;
     }
 
-    pSectorBuffer = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, CurrentDisk->BytesPerSector);
-    if (pSectorBuffer == NULL)
+    if ((ULONGLONG)Sector >= CurrentPartition->SectorCount.QuadPart)
     {
-        DPRINT1("\n");
-        /* Error message */
-        goto done;
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
+    }
+
+    /* Read through the disk, so the sector cache of the disk is used */
+    DumpSector(CurrentDisk, CurrentPartition->StartSector.QuadPart + Sector);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+DumpArchive(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PARCHIVE Archive = NULL;
+    PWSTR pszFile = NULL;
+    PUCHAR pSectorBuffer = NULL;
+    LONGLONG Sector;
+    LPWSTR endptr = NULL;
+    NTSTATUS Status;
+
+    /* DUMP ARCHIVE <file> <sector> */
+    if (argc < 4)
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
+    }
+
+    Sector = _wcstoi64(argv[3], &endptr, 0);
+    if (((Sector == 0) && (endptr == argv[3])) ||
+        (Sector < 0))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
     }
 
-    swprintf(Buffer,
-             L"\\Device\\Harddisk%d\\Partition%d",
-             CurrentDisk->DiskNumber,
-             CurrentPartition->PartitionNumber);
-    RtlInitUnicodeString(&Name,
-                        Buffer);
-
-    InitializeObjectAttributes(&ObjectAttributes,
-                               &Name,
-                               0,
-                               NULL,
-                               NULL);
-
-    Status = NtOpenFile(&FileHandle,
-                        FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE,
-                        &ObjectAttributes,
-                        &Iosb,
-                        FILE_SHARE_READ,
-                        FILE_SYNCHRONOUS_IO_NONALERT);
+    pszFile = DuplicateQuotedString(argv[2]);
+    if (pszFile == NULL)
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
+    }
+
+    Status = OpenArchive(pszFile, &Archive);
     if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("OpenArchive failed, status=%x\n", Status);
+        ConResPuts(StdOut, IDS_IMPORT_INVALID);
+        goto done;
+    }
+
+    pSectorBuffer = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, Archive->Header.BytesPerSector);
+    if (pSectorBuffer == NULL)
     {
         DPRINT1("\n");
         goto done;
     }
 
-    FileOffset.QuadPart = Sector * CurrentDisk->BytesPerSector;
-    Status = NtReadFile(FileHandle,
-                        NULL,
-                        NULL,
-                        NULL,
-                        &Iosb,
-                        (PVOID)pSectorBuffer,
-                        CurrentDisk->BytesPerSector,
-                        &FileOffset,
-                        NULL);
+    /* Only the block that holds the sector is decompressed */
+    Status = ReadArchive(Archive,
+                         (ULONGLONG)Sector * Archive->Header.BytesPerSector,
+                         pSectorBuffer,
+                         Archive->Header.BytesPerSector);
     if (!NT_SUCCESS(Status))
     {
-        DPRINT1("NtReadFile failed, status=%x\n", Status);
+        DPRINT1("ReadArchive failed, status=%x\n", Status);
         goto done;
     }
 
-    HexDump(pSectorBuffer, CurrentDisk->BytesPerSector);
+    HexDump(pSectorBuffer, Archive->Header.BytesPerSector);
 
 done:
-    if (FileHandle)
-        NtClose(FileHandle);
+    if (Archive != NULL)
+        CloseArchive(Archive);
 
-    RtlFreeHeap(RtlGetProcessHeap(), 0, pSectorBuffer);
+    if (pSectorBuffer != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pSectorBuffer);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, pszFile);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,995 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/fatfmt.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define FORMAT_CHUNK_SIZE       (4 * 1024 * 1024)
+#define FORMAT_QUEUE_DEPTH      8
+#define FORMAT_LABEL_LENGTH     11
+
+#define FAT32_RESERVED_SECTORS  32
+#define FAT32_FSINFO_SECTOR     1
+#define FAT32_BACKUP_SECTOR     6
+#define FAT32_BOOT_SECTORS      3       /* Boot sector, FSInfo and the third boot sector */
+#define FAT32_MIN_CLUSTERS      65525
+#define FAT32_MAX_CLUSTERS      0x0FFFFFF4
+#define FAT32_MAX_CLUSTER_SIZE  (64 * 1024)
+#define FAT32_MEDIA_FIXED       0xF8
+#define FAT32_ATTRIBUTE_LABEL   0x08
+
+#define EXFAT_BOOT_SECTORS      12      /* Sectors of one boot region */
+#define EXFAT_EXTENDED_SECTORS  8
+#define EXFAT_CHECKSUM_SECTOR   11
+#define EXFAT_FIRST_CLUSTER     2
+#define EXFAT_MAX_CLUSTERS      0xFFFFFFF5
+#define EXFAT_MAX_CLUSTER_SIZE  (32 * 1024 * 1024)
+#define EXFAT_ENTRY_SIZE        32
+#define EXFAT_ENTRY_BITMAP      0x81
+#define EXFAT_ENTRY_UPCASE      0x82
+#define EXFAT_ENTRY_LABEL       0x83
+#define EXFAT_UPCASE_CHARS      0x100
+#define EXFAT_UPCASE_ENTRIES    (2 * EXFAT_UPCASE_CHARS)
+
+typedef struct _FORMAT_DISCARD
+{
+    DEVICE_MANAGE_DATA_SET_ATTRIBUTES Attributes;
+    DEVICE_DATA_SET_RANGE Range;
+} FORMAT_DISCARD, *PFORMAT_DISCARD;
+
+typedef struct _FORMAT_CONTEXT
+{
+    HANDLE VolumeHandle;
+    ULONG BytesPerSector;
+    ULONGLONG SectorCount;
+    ULONGLONG HiddenSectors;
+    ULONG SectorsPerTrack;
+    ULONG TracksPerCylinder;
+    DWORD SerialNumber;
+    BOOLEAN bQuick;
+    WCHAR szLabel[FORMAT_LABEL_LENGTH + 1];
+    PJOB Job;
+    QOS_BUCKET Qos;
+
+    /* Every write of a batch shares the zero buffer or a metadata buffer */
+    HANDLE Events[FORMAT_QUEUE_DEPTH];
+    IO_STATUS_BLOCK Iosb[FORMAT_QUEUE_DEPTH];
+    ULONG Pending;
+    NTSTATUS Status;
+    PUCHAR ZeroBuffer;
+} FORMAT_CONTEXT, *PFORMAT_CONTEXT;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+NTSTATUS
+ControlFormatVolume(
+    _In_ PFORMAT_CONTEXT Context,
+    _In_ BOOLEAN bFsControl,
+    _In_ ULONG IoControlCode,
+    _In_reads_bytes_opt_(InputLength) PVOID InputBuffer,
+    _In_ ULONG InputLength,
+    _Out_writes_bytes_opt_(OutputLength) PVOID OutputBuffer,
+    _In_ ULONG OutputLength)
+{
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    /* Only called while no write is queued, so the first event is free */
+    if (bFsControl)
+    {
+        Status = NtFsControlFile(Context->VolumeHandle,
+                                 Context->Events[0],
+                                 NULL,
+                                 NULL,
+                                 &Iosb,
+                                 IoControlCode,
+                                 InputBuffer,
+                                 InputLength,
+                                 OutputBuffer,
+                                 OutputLength);
+    }
+    else
+    {
+        Status = NtDeviceIoControlFile(Context->VolumeHandle,
+                                       Context->Events[0],
+                                       NULL,
+                                       NULL,
+                                       &Iosb,
+                                       IoControlCode,
+                                       InputBuffer,
+                                       InputLength,
+                                       OutputBuffer,
+                                       OutputLength);
+    }
+
+    if (Status == STATUS_PENDING)
+    {
+        NtWaitForSingleObject(Context->Events[0], FALSE, NULL);
+        Status = Iosb.Status;
+    }
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+FlushFormatWrites(
+    _In_ PFORMAT_CONTEXT Context)
+{
+    NTSTATUS Status;
+    ULONG i;
+
+    if (Context->Pending == 0)
+        return Context->Status;
+
+    Status = NtWaitForMultipleObjects(Context->Pending,
+                                      Context->Events,
+                                      WaitAll,
+                                      FALSE,
+                                      NULL);
+    if (Status != STATUS_WAIT_0)
+    {
+        DPRINT1("NtWaitForMultipleObjects() failed (Status 0x%08lx)\n", Status);
+
+        /* Never release buffers that are still owned by pending requests */
+        for (i = 0; i < Context->Pending; i++)
+            NtWaitForSingleObject(Context->Events[i], FALSE, NULL);
+    }
+
+    for (i = 0; i < Context->Pending; i++)
+    {
+        if (!NT_SUCCESS(Context->Iosb[i].Status) && NT_SUCCESS(Context->Status))
+            Context->Status = Context->Iosb[i].Status;
+    }
+
+    Context->Pending = 0;
+
+    return Context->Status;
+}
+
+
+static
+NTSTATUS
+QueueFormatWrite(
+    _In_ PFORMAT_CONTEXT Context,
+    _In_ ULONGLONG ullOffset,
+    _In_reads_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength)
+{
+    LARGE_INTEGER FileOffset;
+    NTSTATUS Status;
+
+    if (Context->Pending == FORMAT_QUEUE_DEPTH)
+    {
+        Status = FlushFormatWrites(Context);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    if (IsJobCancelled(Context->Job))
+    {
+        Context->Status = STATUS_CANCELLED;
+        return STATUS_CANCELLED;
+    }
+
+    /* The layout is written front to back, so the offset tells the progress */
+    SetJobProgress(Context->Job,
+                   (ULONG)((ullOffset * 100) / (Context->SectorCount * Context->BytesPerSector)));
+
+    Status = ThrottleQosRequest(&Context->Qos, ulLength);
+    if (!NT_SUCCESS(Status))
+    {
+        Context->Status = Status;
+        return Status;
+    }
+
+    FileOffset.QuadPart = ullOffset;
+    Status = NtWriteFile(Context->VolumeHandle,
+                         Context->Events[Context->Pending],
+                         NULL,
+                         NULL,
+                         &Context->Iosb[Context->Pending],
+                         Buffer,
+                         ulLength,
+                         &FileOffset,
+                         NULL);
+    if ((Status != STATUS_PENDING) && !NT_SUCCESS(Status))
+    {
+        DPRINT1("NtWriteFile() failed (Status 0x%08lx)\n", Status);
+        Context->Status = Status;
+        return Status;
+    }
+
+    Context->Pending++;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Writes a metadata region: the prepared buffer at its start, then zeros up
+ * to its end. The zeros come from one shared buffer in large requests, so a
+ * region of any size costs only a few writes.
+ */
+static
+NTSTATUS
+WriteFormatRegion(
+    _In_ PFORMAT_CONTEXT Context,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONGLONG ullLength,
+    _In_reads_bytes_opt_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength)
+{
+    ULONG ulChunk;
+    NTSTATUS Status;
+
+    if (ulLength != 0)
+    {
+        Status = QueueFormatWrite(Context, ullOffset, Buffer, ulLength);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        ullOffset += ulLength;
+        ullLength -= ulLength;
+    }
+
+    while (ullLength != 0)
+    {
+        ulChunk = (ULONG)min(ullLength, (ULONGLONG)FORMAT_CHUNK_SIZE);
+
+        Status = QueueFormatWrite(Context, ullOffset, Context->ZeroBuffer, ulChunk);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        ullOffset += ulChunk;
+        ullLength -= ulChunk;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Releases the data area instead of writing it. A quick format leaves it
+ * alone when the device refuses, a full format zeros it then.
+ */
+static
+NTSTATUS
+ClearFormatDataArea(
+    _In_ PFORMAT_CONTEXT Context,
+    _In_ ULONGLONG ullOffset)
+{
+    FORMAT_DISCARD Discard;
+    ULONGLONG ullLength;
+    NTSTATUS Status;
+
+    ullLength = (Context->SectorCount * Context->BytesPerSector) - ullOffset;
+    if (ullLength == 0)
+        return STATUS_SUCCESS;
+
+    Status = FlushFormatWrites(Context);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    RtlZeroMemory(&Discard, sizeof(Discard));
+    Discard.Attributes.Size = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES);
+    Discard.Attributes.Action = DeviceDsmAction_Trim;
+    Discard.Attributes.DataSetRangesOffset = FIELD_OFFSET(FORMAT_DISCARD, Range);
+    Discard.Attributes.DataSetRangesLength = sizeof(DEVICE_DATA_SET_RANGE);
+    Discard.Range.StartingOffset = ullOffset;
+    Discard.Range.LengthInBytes = ullLength;
+
+    Status = ControlFormatVolume(Context,
+                                 FALSE,
+                                 IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES,
+                                 &Discard,
+                                 sizeof(Discard),
+                                 NULL,
+                                 0);
+    if (NT_SUCCESS(Status) || Context->bQuick)
+        return STATUS_SUCCESS;
+
+    DPRINT1("Discard failed (Status 0x%08lx)\n", Status);
+
+    Status = WriteFormatRegion(Context, ullOffset, ullLength, NULL, 0);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    return FlushFormatWrites(Context);
+}
+
+
+static
+ULONG
+GetFat32ClusterSize(
+    _In_ ULONGLONG ullLength)
+{
+    if (ullLength <= 64 * SIZE_1MB)
+        return 512;
+    else if (ullLength <= 128 * SIZE_1MB)
+        return 1024;
+    else if (ullLength <= 256 * SIZE_1MB)
+        return 2048;
+    else if (ullLength <= 8 * SIZE_1GB)
+        return 4096;
+    else if (ullLength <= 16 * SIZE_1GB)
+        return 8192;
+    else if (ullLength <= 32 * SIZE_1GB)
+        return 16384;
+
+    return 32768;
+}
+
+
+static
+ULONG
+GetExfatClusterSize(
+    _In_ ULONGLONG ullLength)
+{
+    if (ullLength <= 256 * SIZE_1MB)
+        return 4096;
+    else if (ullLength <= 32 * SIZE_1GB)
+        return 32768;
+
+    return 128 * 1024;
+}
+
+
+/* The allocation unit used when UNIT= is not given */
+ULONG
+GetFatClusterSize(
+    _In_ BOOLEAN bExfat,
+    _In_ ULONGLONG ullLength)
+{
+    return bExfat ? GetExfatClusterSize(ullLength) : GetFat32ClusterSize(ullLength);
+}
+
+
+static
+ULONG
+GetFormatShift(
+    _In_ ULONG Value)
+{
+    ULONG ulShift = 0;
+
+    while ((1UL << ulShift) < Value)
+        ulShift++;
+
+    return ulShift;
+}
+
+
+static
+VOID
+SetFat32LabelEntry(
+    _In_ PFORMAT_CONTEXT Context,
+    _Out_writes_bytes_(32) PUCHAR Entry)
+{
+    LARGE_INTEGER SystemTime;
+    TIME_FIELDS TimeFields;
+    ULONG i;
+
+    RtlFillMemory(Entry, FORMAT_LABEL_LENGTH, ' ');
+    for (i = 0; Context->szLabel[i] != UNICODE_NULL; i++)
+        Entry[i] = (UCHAR)RtlUpcaseUnicodeChar(Context->szLabel[i]);
+
+    Entry[11] = FAT32_ATTRIBUTE_LABEL;
+
+    NtQuerySystemTime(&SystemTime);
+    RtlTimeToTimeFields(&SystemTime, &TimeFields);
+    *(PUSHORT)&Entry[22] = (USHORT)((TimeFields.Hour << 11) | (TimeFields.Minute << 5) | (TimeFields.Second / 2));
+    *(PUSHORT)&Entry[24] = (USHORT)(((TimeFields.Year - 1980) << 9) | (TimeFields.Month << 5) | TimeFields.Day);
+}
+
+
+/*
+ * Lays out a FAT32 volume: reserved sectors with the boot sector, FSInfo and
+ * their backups, two FATs and the root directory in the first cluster. The
+ * reserved area is padded so that the data area starts on a cluster boundary.
+ */
+static
+NTSTATUS
+FormatFat32(
+    _In_ PFORMAT_CONTEXT Context,
+    _In_ ULONG ulClusterSize)
+{
+    ULONG BytesPerSector = Context->BytesPerSector;
+    ULONG ulSectorsPerCluster, ulReserved, ulFatSectors, ulClusterCount;
+    ULONG ulTotalSectors, ulDataStart, ulBootLength, ulFatLength, i;
+    PUCHAR Buffer = NULL, Boot, FsInfo, Fat, Root;
+    NTSTATUS Status;
+
+    if (ulClusterSize == 0)
+        ulClusterSize = max(GetFat32ClusterSize(Context->SectorCount * BytesPerSector), BytesPerSector);
+
+    if ((ulClusterSize < BytesPerSector) ||
+        (ulClusterSize > FAT32_MAX_CLUSTER_SIZE) ||
+        ((ulClusterSize & (ulClusterSize - 1)) != 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    /* The boot sector counts sectors in 32 bits */
+    ulTotalSectors = (ULONG)min(Context->SectorCount, 0xFFFFFFFFULL);
+    ulSectorsPerCluster = ulClusterSize / BytesPerSector;
+    if (ulTotalSectors <= FAT32_RESERVED_SECTORS + ulSectorsPerCluster)
+        return STATUS_INVALID_PARAMETER;
+
+    /* Large enough for every cluster that fits beside both FATs */
+    ulFatSectors = (ULONG)(((ULONGLONG)ulTotalSectors - FAT32_RESERVED_SECTORS + (2 * ulSectorsPerCluster) +
+                            ((BytesPerSector / 4) * ulSectorsPerCluster) + 1) /
+                           (((BytesPerSector / 4) * ulSectorsPerCluster) + 2));
+
+    ulReserved = (ULONG)AlignDown(FAT32_RESERVED_SECTORS + (2ULL * ulFatSectors) + ulSectorsPerCluster - 1,
+                                  ulSectorsPerCluster) - (2 * ulFatSectors);
+    ulDataStart = ulReserved + (2 * ulFatSectors);
+    if (ulDataStart >= ulTotalSectors)
+        return STATUS_INVALID_PARAMETER;
+
+    ulClusterCount = (ulTotalSectors - ulDataStart) / ulSectorsPerCluster;
+    if ((ulClusterCount < FAT32_MIN_CLUSTERS) || (ulClusterCount > FAT32_MAX_CLUSTERS))
+        return STATUS_INVALID_PARAMETER;
+
+    DPRINT("FAT32: %lu reserved, %lu per FAT, %lu clusters of %lu bytes\n",
+           ulReserved, ulFatSectors, ulClusterCount, ulClusterSize);
+
+    /* Boot sectors and their backups, the head of a FAT and the root directory */
+    ulBootLength = (FAT32_BACKUP_SECTOR + FAT32_BOOT_SECTORS) * BytesPerSector;
+    ulFatLength = BytesPerSector;
+    Buffer = AllocateIoBuffer(ulBootLength + ulFatLength + BytesPerSector);
+    if (Buffer == NULL)
+        return STATUS_NO_MEMORY;
+
+    Boot = Buffer;
+    FsInfo = &Boot[FAT32_FSINFO_SECTOR * BytesPerSector];
+    Fat = &Buffer[ulBootLength];
+    Root = &Fat[ulFatLength];
+
+    /* No boot code: hand the boot over to the next device */
+    Boot[0] = 0xEB;
+    Boot[1] = 0x58;
+    Boot[2] = 0x90;
+    RtlCopyMemory(&Boot[3], "MSWIN4.1", 8);
+    *(PUSHORT)&Boot[0x0B] = (USHORT)BytesPerSector;
+    Boot[0x0D] = (UCHAR)ulSectorsPerCluster;
+    *(PUSHORT)&Boot[0x0E] = (USHORT)ulReserved;
+    Boot[0x10] = 2;
+    Boot[0x15] = FAT32_MEDIA_FIXED;
+    *(PUSHORT)&Boot[0x18] = (USHORT)Context->SectorsPerTrack;
+    *(PUSHORT)&Boot[0x1A] = (USHORT)Context->TracksPerCylinder;
+    *(PULONG)&Boot[0x1C] = (ULONG)Context->HiddenSectors;
+    *(PULONG)&Boot[0x20] = ulTotalSectors;
+    *(PULONG)&Boot[0x24] = ulFatSectors;
+    *(PULONG)&Boot[0x2C] = 2;
+    *(PUSHORT)&Boot[0x30] = FAT32_FSINFO_SECTOR;
+    *(PUSHORT)&Boot[0x32] = FAT32_BACKUP_SECTOR;
+    Boot[0x40] = 0x80;
+    Boot[0x42] = 0x29;
+    *(PULONG)&Boot[0x43] = Context->SerialNumber;
+    RtlFillMemory(&Boot[0x47], FORMAT_LABEL_LENGTH, ' ');
+    RtlCopyMemory(&Boot[0x47], "NO NAME", 7);
+    RtlCopyMemory(&Boot[0x52], "FAT32   ", 8);
+    Boot[0x5A] = 0xCD;
+    Boot[0x5B] = 0x18;
+    *(PUSHORT)&Boot[510] = 0xAA55;
+
+    *(PULONG)&FsInfo[0] = 0x41615252;
+    *(PULONG)&FsInfo[484] = 0x61417272;
+    *(PULONG)&FsInfo[488] = ulClusterCount - 1;
+    *(PULONG)&FsInfo[492] = 3;
+    *(PULONG)&FsInfo[508] = 0xAA550000;
+
+    *(PUSHORT)&Boot[(2 * BytesPerSector) + 510] = 0xAA55;
+
+    if (Context->szLabel[0] != UNICODE_NULL)
+    {
+        SetFat32LabelEntry(Context, Root);
+        RtlCopyMemory(&Boot[0x47], Root, FORMAT_LABEL_LENGTH);
+    }
+
+    RtlCopyMemory(&Boot[FAT32_BACKUP_SECTOR * BytesPerSector], Boot, FAT32_BOOT_SECTORS * BytesPerSector);
+
+    /* Media descriptor, the end-of-chain marker and the root directory */
+    *(PULONG)&Fat[0] = 0x0FFFFF00 | FAT32_MEDIA_FIXED;
+    *(PULONG)&Fat[4] = 0x0FFFFFFF;
+    *(PULONG)&Fat[8] = 0x0FFFFFFF;
+
+    Status = WriteFormatRegion(Context,
+                               0,
+                               (ULONGLONG)ulReserved * BytesPerSector,
+                               Boot,
+                               ulBootLength);
+
+    for (i = 0; (i < 2) && NT_SUCCESS(Status); i++)
+    {
+        Status = WriteFormatRegion(Context,
+                                   ((ULONGLONG)ulReserved + ((ULONGLONG)i * ulFatSectors)) * BytesPerSector,
+                                   (ULONGLONG)ulFatSectors * BytesPerSector,
+                                   Fat,
+                                   ulFatLength);
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        Status = WriteFormatRegion(Context,
+                                   (ULONGLONG)ulDataStart * BytesPerSector,
+                                   ulClusterSize,
+                                   Root,
+                                   BytesPerSector);
+    }
+
+    if (NT_SUCCESS(Status))
+        Status = ClearFormatDataArea(Context, ((ULONGLONG)ulDataStart * BytesPerSector) + ulClusterSize);
+
+    FlushFormatWrites(Context);
+    FreeIoBuffer(Buffer);
+
+    return NT_SUCCESS(Status) ? Context->Status : Status;
+}
+
+
+/*
+ * Builds a compressed up-case table for the ASCII and Latin-1 letters. A run
+ * of characters that map to themselves is stored as 0xFFFF and its length,
+ * and characters past the end of the table map to themselves too.
+ */
+static
+ULONG
+BuildExfatUpcaseTable(
+    _Out_writes_(EXFAT_UPCASE_ENTRIES) PUSHORT Table)
+{
+    ULONG ulCount = 0, ulRun = 0;
+    USHORT c, Upper;
+
+    for (c = 0; c < EXFAT_UPCASE_CHARS; c++)
+    {
+        if (((c >= 'a') && (c <= 'z')) ||
+            ((c >= 0xE0) && (c <= 0xFE) && (c != 0xF7)))
+        {
+            Upper = c - 0x20;
+        }
+        else if (c == 0xFF)
+        {
+            Upper = 0x178;
+        }
+        else
+        {
+            ulRun++;
+            continue;
+        }
+
+        if (ulRun != 0)
+        {
+            Table[ulCount++] = 0xFFFF;
+            Table[ulCount++] = (USHORT)ulRun;
+            ulRun = 0;
+        }
+
+        Table[ulCount++] = Upper;
+    }
+
+    return ulCount;
+}
+
+
+static
+ULONG
+GetExfatChecksum(
+    _In_ ULONG ulChecksum,
+    _In_reads_bytes_(ulLength) PUCHAR Data,
+    _In_ ULONG ulLength,
+    _In_ BOOLEAN bBootSector)
+{
+    ULONG i;
+
+    for (i = 0; i < ulLength; i++)
+    {
+        /* VolumeFlags and PercentInUse change without a new checksum */
+        if (bBootSector && ((i == 106) || (i == 107) || (i == 112)))
+            continue;
+
+        ulChecksum = ((ulChecksum & 1) ? 0x80000000 : 0) + (ulChecksum >> 1) + Data[i];
+    }
+
+    return ulChecksum;
+}
+
+
+/*
+ * Lays out an exFAT volume: two boot regions, one FAT aligned to a cluster,
+ * then the allocation bitmap, the up-case table and the root directory in
+ * the first clusters of the heap. Every structure starts on a cluster.
+ */
+static
+NTSTATUS
+FormatExfat(
+    _In_ PFORMAT_CONTEXT Context,
+    _In_ ULONG ulClusterSize)
+{
+    ULONG BytesPerSector = Context->BytesPerSector;
+    ULONGLONG ullHeapOffset, ullFatLength;
+    ULONG ulSectorShift, ulClusterShift, ulFatOffset, ulClusterCount;
+    ULONG ulBitmapBytes, ulBitmapClusters, ulUpcaseEntries, ulUpcaseClusters, ulUsed;
+    ULONG ulBootLength, ulFatLength, ulBitmapLength, ulUpcaseLength, ulChecksum, i;
+    PUCHAR Buffer = NULL, Boot, Fat, Bitmap, Upcase, Root, Entry;
+    NTSTATUS Status;
+
+    if (ulClusterSize == 0)
+        ulClusterSize = max(GetExfatClusterSize(Context->SectorCount * BytesPerSector), BytesPerSector);
+
+    if ((ulClusterSize < BytesPerSector) ||
+        (ulClusterSize > EXFAT_MAX_CLUSTER_SIZE) ||
+        ((ulClusterSize & (ulClusterSize - 1)) != 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ulSectorShift = GetFormatShift(BytesPerSector);
+    ulClusterShift = GetFormatShift(ulClusterSize) - ulSectorShift;
+
+    ulFatOffset = (ULONG)AlignDown((2 * EXFAT_BOOT_SECTORS) + (1ULL << ulClusterShift) - 1, 1UL << ulClusterShift);
+    ullFatLength = (((Context->SectorCount >> ulClusterShift) + EXFAT_FIRST_CLUSTER) * sizeof(ULONG) + BytesPerSector - 1) >> ulSectorShift;
+    ullHeapOffset = AlignDown(ulFatOffset + ullFatLength + (1ULL << ulClusterShift) - 1, 1UL << ulClusterShift);
+    if ((ullHeapOffset > 0xFFFFFFFF) || (ullHeapOffset >= Context->SectorCount))
+        return STATUS_INVALID_PARAMETER;
+
+    if (((Context->SectorCount - ullHeapOffset) >> ulClusterShift) > EXFAT_MAX_CLUSTERS)
+        return STATUS_INVALID_PARAMETER;
+
+    ulClusterCount = (ULONG)((Context->SectorCount - ullHeapOffset) >> ulClusterShift);
+
+    ulBitmapBytes = (ULONG)(((ULONGLONG)ulClusterCount + 7) / 8);
+    ulBitmapClusters = (ULONG)(((ULONGLONG)ulBitmapBytes + ulClusterSize - 1) / ulClusterSize);
+
+    /* Sized for the worst case, the real table is much smaller */
+    ulUpcaseClusters = (EXFAT_UPCASE_ENTRIES * sizeof(USHORT) + ulClusterSize - 1) / ulClusterSize;
+    ulUsed = ulBitmapClusters + ulUpcaseClusters + 1;
+    if (ulClusterCount <= ulUsed)
+        return STATUS_INVALID_PARAMETER;
+
+    DPRINT("exFAT: FAT at %lu, heap at %I64u, %lu clusters of %lu bytes\n",
+           ulFatOffset, ullHeapOffset, ulClusterCount, ulClusterSize);
+
+    /* Both boot regions, the chains of the FAT, the used bits, up-case and root */
+    ulBootLength = 2 * EXFAT_BOOT_SECTORS * BytesPerSector;
+    ulFatLength = (ULONG)AlignDown(((EXFAT_FIRST_CLUSTER + ulUsed) * sizeof(ULONG)) + BytesPerSector - 1, BytesPerSector);
+    ulBitmapLength = (ULONG)AlignDown(((ulUsed + 7) / 8) + BytesPerSector - 1, BytesPerSector);
+    ulUpcaseLength = (ULONG)AlignDown((EXFAT_UPCASE_ENTRIES * sizeof(USHORT)) + BytesPerSector - 1, BytesPerSector);
+    Buffer = AllocateIoBuffer(ulBootLength + ulFatLength + ulBitmapLength + ulUpcaseLength + BytesPerSector);
+    if (Buffer == NULL)
+        return STATUS_NO_MEMORY;
+
+    Boot = Buffer;
+    Fat = &Boot[ulBootLength];
+    Bitmap = &Fat[ulFatLength];
+    Upcase = &Bitmap[ulBitmapLength];
+    Root = &Upcase[ulUpcaseLength];
+
+    /* No boot code: hand the boot over to the next device */
+    Boot[0] = 0xEB;
+    Boot[1] = 0x76;
+    Boot[2] = 0x90;
+    RtlCopyMemory(&Boot[3], "EXFAT   ", 8);
+    *(PULONGLONG)&Boot[0x40] = Context->HiddenSectors;
+    *(PULONGLONG)&Boot[0x48] = Context->SectorCount;
+    *(PULONG)&Boot[0x50] = ulFatOffset;
+    *(PULONG)&Boot[0x54] = (ULONG)ullFatLength;
+    *(PULONG)&Boot[0x58] = (ULONG)ullHeapOffset;
+    *(PULONG)&Boot[0x5C] = ulClusterCount;
+    *(PULONG)&Boot[0x60] = EXFAT_FIRST_CLUSTER + ulBitmapClusters + ulUpcaseClusters;
+    *(PULONG)&Boot[0x64] = Context->SerialNumber;
+    *(PUSHORT)&Boot[0x68] = 0x0100;
+    Boot[0x6C] = (UCHAR)ulSectorShift;
+    Boot[0x6D] = (UCHAR)ulClusterShift;
+    Boot[0x6E] = 1;
+    Boot[0x6F] = 0x80;
+    Boot[0x70] = (UCHAR)(((ULONGLONG)ulUsed * 100) / ulClusterCount);
+    Boot[0x78] = 0xCD;
+    Boot[0x79] = 0x18;
+    *(PUSHORT)&Boot[510] = 0xAA55;
+
+    for (i = 1; i <= EXFAT_EXTENDED_SECTORS; i++)
+        *(PULONG)&Boot[((i + 1) * BytesPerSector) - 4] = 0xAA550000;
+
+    ulChecksum = GetExfatChecksum(0, Boot, BytesPerSector, TRUE);
+    ulChecksum = GetExfatChecksum(ulChecksum,
+                                  &Boot[BytesPerSector],
+                                  (EXFAT_CHECKSUM_SECTOR - 1) * BytesPerSector,
+                                  FALSE);
+    for (i = 0; i < BytesPerSector / sizeof(ULONG); i++)
+        ((PULONG)&Boot[EXFAT_CHECKSUM_SECTOR * BytesPerSector])[i] = ulChecksum;
+
+    RtlCopyMemory(&Boot[EXFAT_BOOT_SECTORS * BytesPerSector], Boot, EXFAT_BOOT_SECTORS * BytesPerSector);
+
+    /* Media descriptor, then one contiguous chain per structure */
+    ((PULONG)Fat)[0] = 0xFFFFFFF8;
+    ((PULONG)Fat)[1] = 0xFFFFFFFF;
+    for (i = 0; i < ulUsed; i++)
+        ((PULONG)Fat)[EXFAT_FIRST_CLUSTER + i] = EXFAT_FIRST_CLUSTER + i + 1;
+    ((PULONG)Fat)[EXFAT_FIRST_CLUSTER + ulBitmapClusters - 1] = 0xFFFFFFFF;
+    ((PULONG)Fat)[EXFAT_FIRST_CLUSTER + ulBitmapClusters + ulUpcaseClusters - 1] = 0xFFFFFFFF;
+    ((PULONG)Fat)[EXFAT_FIRST_CLUSTER + ulUsed - 1] = 0xFFFFFFFF;
+
+    RtlFillMemory(Bitmap, ulUsed / 8, 0xFF);
+    if (ulUsed % 8)
+        Bitmap[ulUsed / 8] = (UCHAR)((1 << (ulUsed % 8)) - 1);
+
+    ulUpcaseEntries = BuildExfatUpcaseTable((PUSHORT)Upcase);
+
+    Entry = Root;
+    if (Context->szLabel[0] != UNICODE_NULL)
+    {
+        Entry[0] = EXFAT_ENTRY_LABEL;
+        Entry[1] = (UCHAR)wcslen(Context->szLabel);
+        RtlCopyMemory(&Entry[2], Context->szLabel, Entry[1] * sizeof(WCHAR));
+        Entry += EXFAT_ENTRY_SIZE;
+    }
+
+    Entry[0] = EXFAT_ENTRY_BITMAP;
+    *(PULONG)&Entry[20] = EXFAT_FIRST_CLUSTER;
+    *(PULONGLONG)&Entry[24] = ulBitmapBytes;
+    Entry += EXFAT_ENTRY_SIZE;
+
+    Entry[0] = EXFAT_ENTRY_UPCASE;
+    *(PULONG)&Entry[4] = GetExfatChecksum(0, Upcase, ulUpcaseEntries * sizeof(USHORT), FALSE);
+    *(PULONG)&Entry[20] = EXFAT_FIRST_CLUSTER + ulBitmapClusters;
+    *(PULONGLONG)&Entry[24] = ulUpcaseEntries * sizeof(USHORT);
+
+    /* The gap up to the FAT is cleared too, so no stale signature survives */
+    Status = WriteFormatRegion(Context,
+                               0,
+                               (ULONGLONG)ulFatOffset * BytesPerSector,
+                               Boot,
+                               ulBootLength);
+
+    if (NT_SUCCESS(Status))
+    {
+        Status = WriteFormatRegion(Context,
+                                   (ULONGLONG)ulFatOffset * BytesPerSector,
+                                   ullFatLength * BytesPerSector,
+                                   Fat,
+                                   ulFatLength);
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        Status = WriteFormatRegion(Context,
+                                   ullHeapOffset * BytesPerSector,
+                                   (ULONGLONG)ulBitmapClusters * ulClusterSize,
+                                   Bitmap,
+                                   ulBitmapLength);
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        Status = WriteFormatRegion(Context,
+                                   (ullHeapOffset * BytesPerSector) + ((ULONGLONG)ulBitmapClusters * ulClusterSize),
+                                   (ULONGLONG)ulUpcaseClusters * ulClusterSize,
+                                   Upcase,
+                                   ulUpcaseLength);
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        Status = WriteFormatRegion(Context,
+                                   (ullHeapOffset * BytesPerSector) + ((ULONGLONG)(ulUsed - 1) * ulClusterSize),
+                                   ulClusterSize,
+                                   Root,
+                                   BytesPerSector);
+    }
+
+    if (NT_SUCCESS(Status))
+        Status = ClearFormatDataArea(Context, (ullHeapOffset * BytesPerSector) + ((ULONGLONG)ulUsed * ulClusterSize));
+
+    FlushFormatWrites(Context);
+    FreeIoBuffer(Buffer);
+
+    return NT_SUCCESS(Status) ? Context->Status : Status;
+}
+
+
+static
+NTSTATUS
+GetFormatLabel(
+    _In_ PFORMAT_CONTEXT Context,
+    _In_ PCWSTR pszLabel,
+    _In_ BOOLEAN bExfat)
+{
+    ULONG i;
+
+    if (wcslen(pszLabel) > FORMAT_LABEL_LENGTH)
+        return STATUS_INVALID_PARAMETER;
+
+    for (i = 0; pszLabel[i] != UNICODE_NULL; i++)
+    {
+        /* FAT32 keeps the label in the OEM code page, so stay within ASCII */
+        if ((!bExfat && (pszLabel[i] >= 0x80)) ||
+            (pszLabel[i] < 0x20) ||
+            (wcschr(L"\"*/:<>?\\|", pszLabel[i]) != NULL))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        Context->szLabel[i] = pszLabel[i];
+    }
+
+    Context->szLabel[i] = UNICODE_NULL;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+GetFormatGeometry(
+    _In_ PFORMAT_CONTEXT Context)
+{
+    DISK_GEOMETRY Geometry;
+    GET_LENGTH_INFORMATION LengthInfo;
+    PARTITION_INFORMATION_EX PartitionInfo;
+    NTSTATUS Status;
+
+    Status = ControlFormatVolume(Context,
+                                 FALSE,
+                                 IOCTL_DISK_GET_DRIVE_GEOMETRY,
+                                 NULL,
+                                 0,
+                                 &Geometry,
+                                 sizeof(Geometry));
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = ControlFormatVolume(Context,
+                                 FALSE,
+                                 IOCTL_DISK_GET_LENGTH_INFO,
+                                 NULL,
+                                 0,
+                                 &LengthInfo,
+                                 sizeof(LengthInfo));
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if ((Geometry.BytesPerSector < 512) ||
+        ((Geometry.BytesPerSector & (Geometry.BytesPerSector - 1)) != 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Context->BytesPerSector = Geometry.BytesPerSector;
+    Context->SectorCount = (ULONGLONG)LengthInfo.Length.QuadPart / Geometry.BytesPerSector;
+    Context->SectorsPerTrack = Geometry.SectorsPerTrack ? min(Geometry.SectorsPerTrack, 63) : 63;
+    Context->TracksPerCylinder = Geometry.TracksPerCylinder ? min(Geometry.TracksPerCylinder, 255) : 255;
+
+    /* Volumes that are not partitions start at sector zero */
+    Status = ControlFormatVolume(Context,
+                                 FALSE,
+                                 IOCTL_DISK_GET_PARTITION_INFO_EX,
+                                 NULL,
+                                 0,
+                                 &PartitionInfo,
+                                 sizeof(PartitionInfo));
+    if (NT_SUCCESS(Status))
+        Context->HiddenSectors = (ULONGLONG)PartitionInfo.StartingOffset.QuadPart / Geometry.BytesPerSector;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Formats a volume as FAT32 or exFAT without a file system library. The
+ * layout is computed here and written with a few large overlapped requests;
+ * the data area is discarded rather than written. A job is cancelled between
+ * two writes, which are paced by the I/O limits.
+ */
+NTSTATUS
+FormatFatVolume(
+    _In_ PUNICODE_STRING VolumeName,
+    _In_ BOOLEAN bExfat,
+    _In_ BOOLEAN bQuick,
+    _In_ PCWSTR pszLabel,
+    _In_ ULONG ulClusterSize,
+    _In_ PQOS_SETTINGS Qos,
+    _In_opt_ PJOB Job)
+{
+    FORMAT_CONTEXT Context;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+    ULONG i;
+
+    RtlZeroMemory(&Context, sizeof(Context));
+    Context.bQuick = bQuick;
+    Context.Job = Job;
+
+    Status = GetFormatLabel(&Context, pszLabel, bExfat);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    CreateSignature(&Context.SerialNumber);
+
+    for (i = 0; i < FORMAT_QUEUE_DEPTH; i++)
+    {
+        Status = NtCreateEvent(&Context.Events[i],
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               NotificationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("NtCreateEvent() failed (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+    }
+
+    Context.ZeroBuffer = AllocateIoBuffer(FORMAT_CHUNK_SIZE);
+    if (Context.ZeroBuffer == NULL)
+    {
+        Status = STATUS_NO_MEMORY;
+        goto done;
+    }
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               VolumeName,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    /* No FILE_SYNCHRONOUS_IO_* option: the writes are overlapped */
+    Status = NtOpenFile(&Context.VolumeHandle,
+                        GENERIC_READ | GENERIC_WRITE,
+                        &ObjectAttributes,
+                        &Iosb,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        FILE_NO_INTERMEDIATE_BUFFERING);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        Context.VolumeHandle = NULL;
+        goto done;
+    }
+
+    Status = ControlFormatVolume(&Context, TRUE, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0);
+    if (NT_SUCCESS(Status))
+        Status = ControlFormatVolume(&Context, TRUE, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Failed to lock the volume (Status 0x%08lx)\n", Status);
+        goto done;
+    }
+
+    Status = GetFormatGeometry(&Context);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    InitializeQosBucket(&Context.Qos, Qos, Job);
+    AddQosDevice(&Context.Qos, Context.VolumeHandle);
+
+    if (bExfat)
+        Status = FormatExfat(&Context, ulClusterSize);
+    else
+        Status = FormatFat32(&Context, ulClusterSize);
+
+done:
+    /* The new file system is mounted once the lock is gone */
+    if (Context.VolumeHandle != NULL)
+        NtClose(Context.VolumeHandle);
+
+    FreeIoBuffer(Context.ZeroBuffer);
+
+    for (i = 0; i < FORMAT_QUEUE_DEPTH; i++)
+    {
+        if (Context.Events[i] != NULL)
+            NtClose(Context.Events[i]);
+    }
+
+    return Status;
+}
@@ -0,0 +1,404 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/foreach.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+/*
+ * FOREACH DISK runs a block of commands on every disk that matches a filter.
+ *
+ * The interpreter has a single selection, so the block runs in lock step:
+ * each command runs on every disk before the next command starts, with the
+ * selection of that disk restored around it. The commands that support
+ * NOWAIT start jobs, so the long operations of all the disks overlap, and a
+ * command only waits for the earlier jobs of its own disk. Every command is
+ * echoed with its disk number, so the output of each disk can be told apart.
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define FOREACH_MAX_LINES   64
+#define FOREACH_ANY_BUS     ((ULONG)-1)
+#define FOREACH_ANY_STYLE   ((DWORD)-1)
+
+typedef struct _FOREACH_FILTER
+{
+    ULONGLONG ullMinSize;   /* MB */
+    ULONGLONG ullMaxSize;   /* MB, 0 for no limit */
+    ULONG BusType;          /* FOREACH_ANY_BUS for any bus */
+    DWORD PartitionStyle;   /* FOREACH_ANY_STYLE for any style */
+    PWSTR pszModel;         /* Part of the disk description, NULL for any */
+    BOOL bEmpty;
+} FOREACH_FILTER, *PFOREACH_FILTER;
+
+typedef struct _FOREACH_DISK
+{
+    ULONG MatchNumber;          /* The disk that matched the filter */
+    SELECTION Selection;        /* What the block selected on it */
+    BOOL bStopped;
+} FOREACH_DISK, *PFOREACH_DISK;
+
+/* Indexed by STORAGE_BUS_TYPE */
+static PCWSTR BusTypeNames[] =
+{
+    L"unknown", L"scsi", L"atapi", L"ata", L"1394", L"ssa", L"fibre", L"usb",
+    L"raid", L"iscsi", L"sas", L"sata", L"sd", L"mmc", L"virtual",
+    L"filebackedvirtual", L"spaces", L"nvme"
+};
+
+/* FUNCTIONS ******************************************************************/
+
+static
+BOOL
+ContainsText(
+    _In_opt_ PCWSTR pszString,
+    _In_ PCWSTR pszText)
+{
+    SIZE_T Length = wcslen(pszText);
+
+    if (pszString == NULL)
+        return FALSE;
+
+    for (; *pszString != UNICODE_NULL; pszString++)
+    {
+        if (_wcsnicmp(pszString, pszText, Length) == 0)
+            return TRUE;
+    }
+
+    return (Length == 0);
+}
+
+
+static
+BOOL
+IsDiskMatching(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PFOREACH_FILTER Filter)
+{
+    ULONGLONG ullSize;
+
+    ullSize = (DiskEntry->SectorCount.QuadPart * DiskEntry->BytesPerSector) / SIZE_1MB;
+    if (ullSize < Filter->ullMinSize)
+        return FALSE;
+
+    if ((Filter->ullMaxSize != 0) && (ullSize > Filter->ullMaxSize))
+        return FALSE;
+
+    if ((Filter->BusType != FOREACH_ANY_BUS) && ((ULONG)DiskEntry->BusType != Filter->BusType))
+        return FALSE;
+
+    if ((Filter->PartitionStyle != FOREACH_ANY_STYLE) &&
+        (DiskEntry->PartitionStyle != Filter->PartitionStyle))
+        return FALSE;
+
+    if ((Filter->pszModel != NULL) && !ContainsText(DiskEntry->Description, Filter->pszModel))
+        return FALSE;
+
+    if (Filter->bEmpty && !IsDiskEmpty(DiskEntry))
+        return FALSE;
+
+    return TRUE;
+}
+
+
+static
+BOOL
+ParseForEachArguments(
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _Out_ PFOREACH_FILTER Filter,
+    _Out_ PULONG pulMax)
+{
+    PWSTR pszSuffix = NULL;
+    ULONG Index;
+    INT i = 2;
+
+    RtlZeroMemory(Filter, sizeof(*Filter));
+    Filter->BusType = FOREACH_ANY_BUS;
+    Filter->PartitionStyle = FOREACH_ANY_STYLE;
+    *pulMax = 0;
+
+    if ((argc < 2) || (_wcsicmp(argv[1], L"disk") != 0))
+        return FALSE;
+
+    if ((i < argc) && (_wcsicmp(argv[i], L"where") == 0))
+        i++;
+
+    for (; i < argc; i++)
+    {
+        if (wcscmp(argv[i], L"{") == 0)
+        {
+            /* The block may start on the same line */
+            if (i != argc - 1)
+                return FALSE;
+        }
+        else if (HasPrefix(argv[i], L"minsize=", &pszSuffix))
+        {
+            /* minsize=<N> (MB) */
+            Filter->ullMinSize = _wcstoui64(pszSuffix, NULL, 10);
+        }
+        else if (HasPrefix(argv[i], L"maxsize=", &pszSuffix))
+        {
+            /* maxsize=<N> (MB) */
+            Filter->ullMaxSize = _wcstoui64(pszSuffix, NULL, 10);
+            if (Filter->ullMaxSize == 0)
+                return FALSE;
+        }
+        else if (HasPrefix(argv[i], L"bus=", &pszSuffix))
+        {
+            /* bus=<type> */
+            for (Index = 0; Index < ARRAYSIZE(BusTypeNames); Index++)
+            {
+                if (_wcsicmp(pszSuffix, BusTypeNames[Index]) == 0)
+                    break;
+            }
+
+            if (Index == ARRAYSIZE(BusTypeNames))
+                return FALSE;
+
+            Filter->BusType = Index;
+        }
+        else if (HasPrefix(argv[i], L"model=", &pszSuffix))
+        {
+            /* model=<text> */
+            if (Filter->pszModel != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, Filter->pszModel);
+
+            Filter->pszModel = DuplicateQuotedString(pszSuffix);
+            if (Filter->pszModel == NULL)
+                return FALSE;
+        }
+        else if (HasPrefix(argv[i], L"style=", &pszSuffix))
+        {
+            /* style=gpt|mbr|raw */
+            if (_wcsicmp(pszSuffix, L"gpt") == 0)
+                Filter->PartitionStyle = PARTITION_STYLE_GPT;
+            else if (_wcsicmp(pszSuffix, L"mbr") == 0)
+                Filter->PartitionStyle = PARTITION_STYLE_MBR;
+            else if (_wcsicmp(pszSuffix, L"raw") == 0)
+                Filter->PartitionStyle = PARTITION_STYLE_RAW;
+            else
+                return FALSE;
+        }
+        else if (_wcsicmp(argv[i], L"empty") == 0)
+        {
+            Filter->bEmpty = TRUE;
+        }
+        else if (HasPrefix(argv[i], L"max=", &pszSuffix))
+        {
+            /* max=<N> */
+            *pulMax = wcstoul(pszSuffix, NULL, 10);
+            if (*pulMax == 0)
+                return FALSE;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Reads the lines up to the closing brace into pszLines, FOREACH_MAX_LINES
+ * lines of MAX_STRING_SIZE characters. The opening brace ends the FOREACH
+ * line, or is alone on the next line.
+ */
+static
+BOOL
+ReadForEachBlock(
+    _In_ FILE *Stream,
+    _In_ BOOL bOpened,
+    _Out_ PWSTR pszLines,
+    _Out_ PULONG pulLineCount)
+{
+    WCHAR szBuffer[MAX_STRING_SIZE];
+    PWSTR pszLine;
+    SIZE_T Length;
+
+    *pulLineCount = 0;
+
+    for (;;)
+    {
+        if (Stream == stdin)
+            ConResPuts(StdOut, IDS_FOREACH_PROMPT);
+
+        if (fgetws(szBuffer, ARRAYSIZE(szBuffer), Stream) == NULL)
+            return FALSE;
+
+        pszLine = szBuffer + wcsspn(szBuffer, L" \t");
+        Length = wcslen(pszLine);
+        while ((Length > 0) && iswspace(pszLine[Length - 1]))
+            pszLine[--Length] = UNICODE_NULL;
+
+        if (Length == 0)
+            continue;
+
+        if (!bOpened)
+        {
+            if (wcscmp(pszLine, L"{") != 0)
+                return FALSE;
+
+            bOpened = TRUE;
+            continue;
+        }
+
+        if (wcscmp(pszLine, L"}") == 0)
+            return TRUE;
+
+        /* Blocks do not nest, and no line may run out of the block */
+        if ((_wcsnicmp(pszLine, L"foreach", 7) == 0) &&
+            ((pszLine[7] == UNICODE_NULL) || iswspace(pszLine[7])))
+            return FALSE;
+
+        if (*pulLineCount == FOREACH_MAX_LINES)
+            return FALSE;
+
+        StringCchCopyW(pszLines + (*pulLineCount * MAX_STRING_SIZE), MAX_STRING_SIZE, pszLine);
+        (*pulLineCount)++;
+    }
+}
+
+
+EXIT_CODE
+ForEachDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _In_ FILE *Stream)
+{
+    FOREACH_FILTER Filter;
+    SELECTION Selection;
+    PFOREACH_DISK Disks = NULL;
+    PLIST_ENTRY Entry;
+    PDISKENTRY DiskEntry;
+    WCHAR szLine[MAX_STRING_SIZE];
+    PWSTR pszLines;
+    ULONG ulMax, LineCount, DiskCount = 0;
+    ULONG ulFirst, ulLast, Line, Index;
+    BOOL bArgsValid, bFailed = FALSE;
+    EXIT_CODE Result;
+
+    DPRINT("ForEachDisk()\n");
+
+    pszLines = RtlAllocateHeap(RtlGetProcessHeap(), 0,
+                               FOREACH_MAX_LINES * MAX_STRING_SIZE * sizeof(WCHAR));
+    if (pszLines == NULL)
+        return EXIT_FATAL;
+
+    /* The block is always consumed, so a bad FOREACH line never runs it on the selection */
+    bArgsValid = ParseForEachArguments(argc, argv, &Filter, &ulMax);
+    if (!ReadForEachBlock(Stream, (wcscmp(argv[argc - 1], L"{") == 0), pszLines, &LineCount))
+    {
+        ConResPuts(StdErr, IDS_FOREACH_BAD_BLOCK);
+        bFailed = TRUE;
+        goto done;
+    }
+
+    if (!bArgsValid)
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        goto done;
+    }
+
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+        DiskCount++;
+
+    if (DiskCount > 0)
+    {
+        Disks = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, DiskCount * sizeof(FOREACH_DISK));
+        if (Disks == NULL)
+        {
+            bFailed = TRUE;
+            goto done;
+        }
+    }
+
+    DiskCount = 0;
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
+        if (!IsDiskMatching(DiskEntry, &Filter))
+            continue;
+
+        Disks[DiskCount].MatchNumber = DiskEntry->DiskNumber;
+        Disks[DiskCount].Selection.DiskNumber = DiskEntry->DiskNumber;
+        Disks[DiskCount].Selection.VolumeNumber = SELECTION_NO_VOLUME;
+        DiskCount++;
+    }
+
+    if ((DiskCount == 0) || (LineCount == 0))
+    {
+        ConResPuts(StdOut, IDS_FOREACH_NONE);
+        goto done;
+    }
+
+    if ((ulMax == 0) || (ulMax > DiskCount))
+        ulMax = DiskCount;
+
+    ConResPrintf(StdOut, IDS_FOREACH_START, DiskCount, ulMax);
+
+    SaveSelection(&Selection);
+    SetAlwaysNoWait(TRUE, FALSE);
+
+    for (ulFirst = 0; ulFirst < DiskCount; ulFirst += ulMax)
+    {
+        ulLast = min(ulFirst + ulMax, DiskCount);
+
+        for (Line = 0; Line < LineCount; Line++)
+        {
+            for (Index = ulFirst; Index < ulLast; Index++)
+            {
+                if (Disks[Index].bStopped)
+                    continue;
+
+                /* Completions may rebuild the lists, so select afterwards */
+                ReapJobs();
+                RestoreSelection(&Disks[Index].Selection);
+
+                StringCchCopyW(szLine, ARRAYSIZE(szLine), pszLines + (Line * MAX_STRING_SIZE));
+                ConResPrintf(StdOut, IDS_FOREACH_COMMAND, Disks[Index].MatchNumber, szLine);
+
+                Result = InterpretScript(szLine, NULL);
+
+                ReapJobs();
+                SaveSelection(&Disks[Index].Selection);
+
+                /* EXIT ends the block for this disk only */
+                if (Result != EXIT_SUCCESS)
+                {
+                    Disks[Index].bStopped = TRUE;
+                    if (Result != EXIT_EXIT)
+                    {
+                        ConResPrintf(StdOut, IDS_FOREACH_STOPPED, Disks[Index].MatchNumber);
+                        bFailed = TRUE;
+                    }
+                }
+            }
+        }
+
+        /* The next disks start once the jobs of these ones have finished */
+        if (!WaitForJobs(0))
+            bFailed = TRUE;
+    }
+
+    SetAlwaysNoWait(FALSE, FALSE);
+    RestoreSelection(&Selection);
+
+done:
+    if (Disks != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Disks);
+
+    if (Filter.pszModel != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Filter.pszModel);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, pszLines);
+
+    return bFailed ? EXIT_FATAL : EXIT_SUCCESS;
+}
@@ -13,6 +13,25 @@
 #define NDEBUG
 #include <debug.h>
 
+/* The file system libraries keep their state in globals and report through a
+   callback without context, so their jobs claim this pseudo disk number and
+   run one at a time */
+#define FORMAT_LIBRARY_DISK     ((ULONG)-3)
+
+typedef struct _FORMAT_JOB
+{
+    UNICODE_STRING DriveRoot;
+    WCHAR szFileSystem[32];
+    WCHAR szLabel[MAX_PATH];
+    BOOLEAN bQuickFormat;
+    BOOLEAN bBackwardCompatible;
+    ULONG ulClusterSize;
+    QOS_SETTINGS Qos;           /* Built-in FAT32 and exFAT formats only */
+} FORMAT_JOB, *PFORMAT_JOB;
+
+/* Job of the file system library format in progress, NULL in place */
+static PJOB FormatLibraryJob = NULL;
+
 static
 BOOL
 GetFsModule(
@@ -76,7 +95,10 @@ FormatCallback(
     {
         case PROGRESS:
             percent = (PDWORD)Argument;
-            ConResPrintf(StdOut, IDS_FORMAT_PROGRESS, *percent);
+            if (FormatLibraryJob != NULL)
+                SetJobProgress(FormatLibraryJob, *percent);
+            else
+                ConResPrintf(StdOut, IDS_FORMAT_PROGRESS, *percent);
             break;
 
         case DONE:
@@ -87,6 +109,213 @@ FormatCallback(
             break;
     }
 
+    /* Returning FALSE stops the library */
+    return !IsJobCancelled(FormatLibraryJob);
+}
+
+
+static
+BOOL
+IsFatFileSystem(
+    _In_ PCWSTR pszFileSystem)
+{
+    return (_wcsicmp(pszFileSystem, L"FAT32") == 0) ||
+           (_wcsicmp(pszFileSystem, L"EXFAT") == 0);
+}
+
+
+static
+NTSTATUS
+RunFormat(
+    _In_opt_ PJOB Job,
+    _In_ PVOID Parameter)
+{
+    PFORMAT_JOB Context = Parameter;
+    UNICODE_STRING LabelString;
+    HMODULE hModule = NULL;
+    PULIB_FORMAT pFormat = NULL;
+    BOOLEAN Success = FALSE;
+    NTSTATUS Status;
+
+    /* FAT32 and exFAT are laid out here, without a file system library */
+    if (IsFatFileSystem(Context->szFileSystem))
+    {
+        Status = FormatFatVolume(&Context->DriveRoot,
+                                 (_wcsicmp(Context->szFileSystem, L"EXFAT") == 0),
+                                 Context->bQuickFormat,
+                                 Context->szLabel,
+                                 Context->ulClusterSize,
+                                 &Context->Qos,
+                                 Job);
+        if (!NT_SUCCESS(Status))
+            DPRINT1("FormatFatVolume() failed (Status 0x%08lx)\n", Status);
+        else if (Job == NULL)
+            ConResPrintf(StdOut, IDS_FORMAT_PROGRESS, 100);
+
+        return Status;
+    }
+
+    if (!GetFsModule(Context->szFileSystem, &hModule))
+    {
+        DPRINT1("GetFsModule() failed\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    RtlInitUnicodeString(&LabelString, Context->szLabel);
+
+    pFormat = (PULIB_FORMAT)GetProcAddress(hModule, "Format");
+    if (pFormat)
+    {
+        FormatLibraryJob = Job;
+        Success = (pFormat)(&Context->DriveRoot,
+                            FormatCallback,
+                            Context->bQuickFormat,
+                            Context->bBackwardCompatible,
+                            FMIFS_HARDDISK, //MediaType,
+                            &LabelString,
+                            Context->ulClusterSize);
+        FormatLibraryJob = NULL;
+    }
+
+    FreeLibrary(hModule);
+
+    if (!Success)
+        return IsJobCancelled(Job) ? STATUS_CANCELLED : STATUS_UNSUCCESSFUL;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+CompleteFormat(
+    _In_ NTSTATUS Status,
+    _In_ PVOID Parameter)
+{
+    PFORMAT_JOB Context = Parameter;
+
+    ConPuts(StdOut, L"\n");
+    if (NT_SUCCESS(Status))
+        ConResPrintf(StdOut, IDS_FORMAT_SUCCESS);
+    else
+        ConResPrintf(StdOut, IDS_FORMAT_FAIL);
+
+    RtlFreeUnicodeString(&Context->DriveRoot);
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Context);
+}
+
+
+static
+VOID
+GetClusterLimits(
+    _In_ PCWSTR pszFileSystem,
+    _Out_ PULONG pulMaxClusterSize,
+    _Out_ PULONGLONG pullMaxClusters)
+{
+    if (_wcsicmp(pszFileSystem, L"FAT") == 0)
+    {
+        *pulMaxClusterSize = 64 * 1024;
+        *pullMaxClusters = 65524;
+    }
+    else if (_wcsicmp(pszFileSystem, L"FAT32") == 0)
+    {
+        *pulMaxClusterSize = 64 * 1024;
+        *pullMaxClusters = 0x0FFFFFF4;
+    }
+    else if (_wcsicmp(pszFileSystem, L"EXFAT") == 0)
+    {
+        *pulMaxClusterSize = 32 * 1024 * 1024;
+        *pullMaxClusters = 0xFFFFFFF5;
+    }
+    else
+    {
+        *pulMaxClusterSize = 64 * 1024;
+        *pullMaxClusters = 0xFFFFFFFF;
+    }
+}
+
+
+/*
+ * Picks the allocation unit for a volume from its size, the geometry of the
+ * disk beneath it and the expected workload. The unit never drops below the
+ * physical sector, which would turn every write into a read-modify-write,
+ * and large-file volumes get one unit per stripe unit, so that sequential
+ * I/O always covers whole stripes. The stride and stripe width are the same
+ * geometry counted in units, as mkfs.ext4 and mkfs.xfs expect them; both
+ * stay 0 unless the disk reports a stripe in its Block Limits page.
+ */
+BOOL
+GetRecommendedFormat(
+    _In_ PVOLENTRY VolumeEntry,
+    _In_opt_ PCWSTR pszFileSystem,
+    _In_ FORMAT_WORKLOAD Workload,
+    _Out_ PFORMAT_RECOMMENDATION Recommendation)
+{
+    PDISKENTRY DiskEntry;
+    DISK_SETTINGS Settings;
+    ULONGLONG ullLength, ullMaxClusters;
+    ULONG ulMaxClusterSize, ulClusterSize, ulSectorSize = 512, ulStripeSize = 0, ulStripeUnit = 0;
+
+    RtlZeroMemory(Recommendation, sizeof(FORMAT_RECOMMENDATION));
+
+    ullLength = VolumeEntry->Size.QuadPart;
+    if (ullLength == 0)
+        return FALSE;
+
+    if ((pszFileSystem == NULL) || (*pszFileSystem == UNICODE_NULL))
+        pszFileSystem = L"FAT";
+
+    DiskEntry = GetDiskForVolume(VolumeEntry);
+    if (DiskEntry != NULL)
+    {
+        ulSectorSize = max(DiskEntry->BytesPerSector, DiskEntry->PhysicalSectorSize);
+        ulStripeSize = DiskEntry->OptimalTransferSize;
+        ulStripeUnit = DiskEntry->OptimalGranularity;
+
+        if (QueryDiskSettings(DiskEntry, &Settings) && Settings.SeekPenaltyValid)
+            Recommendation->bRotational = Settings.IncursSeekPenalty;
+    }
+
+    GetClusterLimits(pszFileSystem, &ulMaxClusterSize, &ullMaxClusters);
+
+    if (_wcsicmp(pszFileSystem, L"FAT32") == 0)
+        ulClusterSize = GetFatClusterSize(FALSE, ullLength);
+    else if (_wcsicmp(pszFileSystem, L"EXFAT") == 0)
+        ulClusterSize = GetFatClusterSize(TRUE, ullLength);
+    else if (_wcsicmp(pszFileSystem, L"FAT") == 0)
+        ulClusterSize = 512;
+    else
+        ulClusterSize = 4096;
+
+    /* Without a reported unit, the largest power of two dividing the stripe is one */
+    if (ulStripeUnit == 0)
+        ulStripeUnit = ulStripeSize & (~ulStripeSize + 1);
+
+    if (Workload == WorkloadSmallFiles)
+    {
+        ulClusterSize = min(ulClusterSize, 4096);
+    }
+    else if (Workload == WorkloadLargeFiles)
+    {
+        if (ulStripeUnit != 0)
+            ulClusterSize = max(ulClusterSize, ulStripeUnit);
+        else
+            ulClusterSize = max(ulClusterSize, Recommendation->bRotational ? 64 * 1024 : 32 * 1024);
+    }
+
+    ulClusterSize = min(max(ulClusterSize, ulSectorSize), ulMaxClusterSize);
+
+    /* Small units on a large volume run out of cluster numbers */
+    while ((ullLength / ulClusterSize > ullMaxClusters) && (ulClusterSize < ulMaxClusterSize))
+        ulClusterSize *= 2;
+
+    Recommendation->ClusterSize = ulClusterSize;
+    if (ulStripeSize != 0)
+    {
+        Recommendation->Stride = max(ulStripeUnit / ulClusterSize, 1);
+        Recommendation->StripeWidth = max(ulStripeSize / ulClusterSize, 1);
+    }
+
     return TRUE;
 }
 
@@ -97,17 +326,21 @@ format_main(
     _In_ PWSTR *argv)
 {
     UNICODE_STRING usDriveRoot;
-    UNICODE_STRING LabelString;
     PWSTR pszSuffix = NULL;
     PWSTR pszFileSystem = NULL;
     PWSTR pszLabel = NULL;
     BOOLEAN bQuickFormat = FALSE;
+    BOOLEAN bRecommended = FALSE;
+    BOOL bNoWait = FALSE;
+    FORMAT_WORKLOAD Workload = WorkloadDefault;
+    FORMAT_RECOMMENDATION Recommendation;
+    QOS_SETTINGS Qos;
     ULONG ulClusterSize = 0;
-    HMODULE hModule = NULL;
-    PULIB_FORMAT pFormat = NULL;
+    PFORMAT_JOB Context;
+    PDISKENTRY DiskEntry;
+    ULONG ulDiskNumber, ulLibraryDisk;
 //    FMIFS_MEDIA_FLAG MediaType = FMIFS_HARDDISK;
     INT i;
-    BOOLEAN Success = FALSE;
 
 
     if (CurrentVolume == NULL)
@@ -116,6 +349,8 @@ format_main(
         return EXIT_SUCCESS;
     }
 
+    GetQosSettings(&Qos);
+
     for (i = 1; i < argc; i++)
     {
         if (_wcsicmp(argv[i], L"noerr") == 0)
@@ -155,13 +390,39 @@ format_main(
             if ((ulClusterSize == 0) && (errno == ERANGE))
             {
                 ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
-                goto done;
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[i], L"workload=", &pszSuffix))
+        {
+            /* workload=<small-files|large-files> */
+            if (_wcsicmp(pszSuffix, L"small-files") == 0)
+            {
+                Workload = WorkloadSmallFiles;
+            }
+            else if (_wcsicmp(pszSuffix, L"large-files") == 0)
+            {
+                Workload = WorkloadLargeFiles;
+            }
+            else
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[i], L"qos=", &pszSuffix))
+        {
+            /* qos=<setting>[,<setting>...] */
+            if (!ParseQosSettings(pszSuffix, &Qos))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
             }
         }
         else if (_wcsicmp(argv[i], L"recommended") == 0)
         {
             /* recommended */
-            ConPuts(StdOut, L"The RECOMMENDED option is not supported yet!\n");
+            bRecommended = TRUE;
         }
         else if (_wcsicmp(argv[i], L"quick") == 0)
         {
@@ -186,7 +447,7 @@ format_main(
         else if (_wcsicmp(argv[i], L"nowait") == 0)
         {
             /* nowait */
-            ConPuts(StdOut, L"The NOWAIT option is not supported yet!\n");
+            bNoWait = TRUE;
         }
         else if (_wcsicmp(argv[i], L"noerr") == 0)
         {
@@ -244,46 +505,71 @@ format_main(
     if (pszFileSystem == NULL)
         pszFileSystem = L"FAT";
 
-    BOOLEAN bBackwardCompatible = FALSE; // Default to latest FS versions.
+    /* An explicit UNIT= wins over the recommendation */
+    if (bRecommended && (ulClusterSize == 0) &&
+        GetRecommendedFormat(CurrentVolume, pszFileSystem, Workload, &Recommendation))
+    {
+        ulClusterSize = Recommendation.ClusterSize;
+        if (Recommendation.StripeWidth != 0)
+        {
+            ConResPrintf(StdOut, IDS_FORMAT_RECOMMENDED,
+                         ulClusterSize,
+                         Recommendation.Stride,
+                         Recommendation.StripeWidth);
+        }
+        else
+        {
+            ConResPrintf(StdOut, IDS_FORMAT_RECOMMENDED_UNIT, ulClusterSize);
+        }
+    }
+
+    Context = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(FORMAT_JOB));
+    if (Context == NULL)
+    {
+        DPRINT1("Failed to allocate the format context!\n");
+        RtlFreeUnicodeString(&usDriveRoot);
+        ConResPrintf(StdOut, IDS_FORMAT_FAIL);
+        return EXIT_SUCCESS;
+    }
+
+    Context->DriveRoot = usDriveRoot;
+    StringCchCopyW(Context->szFileSystem, ARRAYSIZE(Context->szFileSystem), pszFileSystem);
+    if (pszLabel != NULL)
+        StringCchCopyW(Context->szLabel, ARRAYSIZE(Context->szLabel), pszLabel);
+    Context->bQuickFormat = bQuickFormat;
+    Context->ulClusterSize = ulClusterSize;
+    Context->Qos = Qos;
+
+    Context->bBackwardCompatible = FALSE; // Default to latest FS versions.
     if (_wcsicmp(pszFileSystem, L"FAT") == 0)
-        bBackwardCompatible = TRUE;
+        Context->bBackwardCompatible = TRUE;
     // else if (wcsicmp(pszFileSystem, L"FAT32") == 0)
         // bBackwardCompatible = FALSE;
 
-    if (pszLabel == NULL)
-        pszLabel = L"";
-
-    RtlInitUnicodeString(&LabelString, pszLabel);
+    DiskEntry = GetDiskForVolume(CurrentVolume);
+    ulDiskNumber = (DiskEntry != NULL) ? DiskEntry->DiskNumber : JOB_NO_DISK;
 
-    if (!GetFsModule(pszFileSystem, &hModule))
-    {
-        DPRINT1("GetFsModule() failed\n");
-        goto done;
-    }
-
-    pFormat = (PULIB_FORMAT)GetProcAddress(hModule, "Format");
-    if (pFormat)
+    if (IsFatFileSystem(pszFileSystem))
     {
-        Success = (pFormat)(&usDriveRoot,
-                            FormatCallback,
-                            bQuickFormat,
-                            bBackwardCompatible,
-                            FMIFS_HARDDISK, //MediaType,
-                            &LabelString,
-                            ulClusterSize);
+        ulLibraryDisk = JOB_NO_DISK;
     }
-
-done:
-    ConPuts(StdOut, L"\n");
-    if (Success)
-        ConResPrintf(StdOut, IDS_FORMAT_SUCCESS);
     else
-        ConResPrintf(StdOut, IDS_FORMAT_FAIL);
+    {
+        ulLibraryDisk = FORMAT_LIBRARY_DISK;
 
-    if (hModule)
-        FreeLibrary(hModule);
+        /* A library format in place must not overlap with one in a job */
+        if (!bNoWait)
+            WaitForDiskJobs(FORMAT_LIBRARY_DISK);
+    }
 
-    RtlFreeUnicodeString(&usDriveRoot);
+    StartJob(bNoWait,
+             argc,
+             argv,
+             ulDiskNumber,
+             ulLibraryDisk,
+             RunFormat,
+             CompleteFormat,
+             Context);
 
     return EXIT_SUCCESS;
 }
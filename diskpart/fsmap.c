@@ -0,0 +1,1423 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/fsmap.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define FS_PROBE_SIZE           4096
+#define FS_BITMAP_CHUNK_SIZE    (1024 * 1024)
+#define FS_HEAD_SIZE            (64 * 1024)
+#define FS_RUN_GROW_COUNT       1024
+
+/* Gaps below this size are cheaper to read than to seek over */
+#define FS_RUN_MERGE_GAP        (1024 * 1024)
+
+/* NTFS */
+#define NTFS_BITMAP_RECORD      6
+#define NTFS_VOLUME_RECORD      3
+#define NTFS_FIXUP_STRIDE       512
+#define NTFS_ATTRIBUTE_VOLUME_NAME 0x60
+#define NTFS_ATTRIBUTE_DATA     0x80
+#define NTFS_ATTRIBUTE_END      0xFFFFFFFF
+
+/* HPFS */
+#define HPFS_SUPERBLOCK_OFFSET  (16 * 512)
+#define HPFS_SUPERBLOCK_MAGIC   0xF995E849
+
+/* ext2/3/4 */
+#define EXT_SUPERBLOCK_OFFSET   1024
+#define EXT_SUPERBLOCK_MAGIC    0xEF53
+#define EXT_INCOMPAT_META_BG    0x0010
+#define EXT_INCOMPAT_64BIT      0x0080
+#define EXT_BG_BLOCK_UNINIT     0x0002
+#define EXT_COMPAT_HAS_JOURNAL  0x0004
+#define EXT_INCOMPAT_EXTENTS    0x0040
+#define EXT_INCOMPAT_FLEX_BG    0x0200
+
+/* exFAT */
+#define EXFAT_ENTRY_END         0x00
+#define EXFAT_ENTRY_LABEL       0x83
+
+/* XFS */
+#define XFS_LABEL_OFFSET        0x6C
+
+/* btrfs, the superblock lies right behind the probed head */
+#define BTRFS_SUPERBLOCK_OFFSET (64 * 1024)
+#define BTRFS_LABEL_OFFSET      0x12B
+
+/* Linux swap, the signature ends the first page */
+#define SWAP_LABEL_OFFSET       0x41C
+
+/* LUKS */
+#define LUKS2_LABEL_OFFSET      0x18
+
+/* One read of the head of every partition covers all superblocks */
+#define FS_PROBE_LENGTH         (FS_HEAD_SIZE + FS_PROBE_SIZE)
+#define FS_PROBE_BATCH          32
+
+typedef enum _FS_LABEL_SOURCE
+{
+    FsLabelNone,
+    FsLabelNtfsVolume,      /* $VOLUME_NAME attribute of MFT record 3 */
+    FsLabelExfatRoot        /* Label entry of the root directory */
+} FS_LABEL_SOURCE;
+
+typedef struct _FS_PROBE
+{
+    PPARTENTRY PartEntry;
+    HANDLE Event;
+    IO_STATUS_BLOCK Iosb;
+    PUCHAR Buffer;
+    ULONGLONG Offset;       /* Bytes, start of the read on the disk */
+    ULONG Length;           /* Bytes to read, 0 for none */
+    FS_LABEL_SOURCE LabelSource;
+    ULONG LabelOffset;      /* Of the label structure in the buffer */
+    ULONG LabelLength;
+} FS_PROBE, *PFS_PROBE;
+
+/* FUNCTIONS ******************************************************************/
+
+/*
+ * Reads from the volume at any offset. Requests that do not start and end on
+ * a sector boundary go through a bounce buffer, as the device only accepts
+ * whole sectors.
+ */
+static
+NTSTATUS
+ReadFsBytes(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG BytesPerSector,
+    _In_ ULONGLONG ullOffset,
+    _Out_writes_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength)
+{
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER FileOffset;
+    ULONGLONG ullStart, ullEnd;
+    PUCHAR Bounce;
+    NTSTATUS Status;
+
+    ullStart = AlignDown(ullOffset, BytesPerSector);
+    ullEnd = AlignDown(ullOffset + ulLength + BytesPerSector - 1, BytesPerSector);
+
+    if ((ullStart == ullOffset) && (ullEnd == ullOffset + ulLength))
+    {
+        FileOffset.QuadPart = ullOffset;
+        Status = NtReadFile(FileHandle,
+                            NULL,
+                            NULL,
+                            NULL,
+                            &Iosb,
+                            Buffer,
+                            ulLength,
+                            &FileOffset,
+                            NULL);
+        if (NT_SUCCESS(Status) && (Iosb.Information != ulLength))
+            Status = STATUS_END_OF_FILE;
+
+        return Status;
+    }
+
+    Bounce = RtlAllocateHeap(RtlGetProcessHeap(), 0, (SIZE_T)(ullEnd - ullStart));
+    if (Bounce == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    FileOffset.QuadPart = ullStart;
+    Status = NtReadFile(FileHandle,
+                        NULL,
+                        NULL,
+                        NULL,
+                        &Iosb,
+                        Bounce,
+                        (ULONG)(ullEnd - ullStart),
+                        &FileOffset,
+                        NULL);
+    if (NT_SUCCESS(Status) && (Iosb.Information != (ULONG)(ullEnd - ullStart)))
+        Status = STATUS_END_OF_FILE;
+
+    if (NT_SUCCESS(Status))
+        RtlCopyMemory(Buffer, &Bounce[ullOffset - ullStart], ulLength);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Bounce);
+
+    return Status;
+}
+
+
+static
+BOOLEAN
+ReadProbeBlock(
+    _In_ HANDLE FileHandle,
+    _In_ ULONGLONG ullOffset,
+    _Out_writes_bytes_(FS_PROBE_SIZE) PUCHAR Buffer)
+{
+    if (FileHandle == NULL)
+        return FALSE;
+
+    /* A probe block is a whole number of sectors for every sector size */
+    return NT_SUCCESS(ReadFsBytes(FileHandle, FS_PROBE_SIZE, ullOffset, Buffer, FS_PROBE_SIZE));
+}
+
+
+static
+BOOLEAN
+IsPowerOfTwo(
+    _In_ ULONG ulValue)
+{
+    return (ulValue != 0) && ((ulValue & (ulValue - 1)) == 0);
+}
+
+
+static
+BOOLEAN
+IsFatBootSector(
+    _In_ PUCHAR Buffer)
+{
+    USHORT usBytesPerSector = *(PUSHORT)&Buffer[0x0B];
+
+    return (*(PUSHORT)&Buffer[510] == 0xAA55) &&
+           (usBytesPerSector >= 512) && (usBytesPerSector <= 4096) &&
+           IsPowerOfTwo(usBytesPerSector) &&
+           IsPowerOfTwo(Buffer[0x0D]) &&            /* Sectors per cluster */
+           (*(PUSHORT)&Buffer[0x0E] != 0) &&        /* Reserved sectors */
+           (Buffer[0x10] != 0) &&                   /* Number of FATs */
+           ((Buffer[0x15] == 0xF0) || (Buffer[0x15] >= 0xF8)) &&
+           ((*(PUSHORT)&Buffer[0x16] != 0) || (*(PULONG)&Buffer[0x24] != 0));
+}
+
+
+static
+BOOLEAN
+IsNtfsBootSector(
+    _In_ PUCHAR Buffer)
+{
+    USHORT usBytesPerSector = *(PUSHORT)&Buffer[0x0B];
+
+    return (*(PUSHORT)&Buffer[510] == 0xAA55) &&
+           (RtlCompareMemory(&Buffer[3], "NTFS    ", 8) == 8) &&
+           (usBytesPerSector >= 512) && (usBytesPerSector <= 4096) &&
+           IsPowerOfTwo(usBytesPerSector) &&
+           (Buffer[0x0D] != 0);
+}
+
+
+/*
+ * FAT: the type follows from the number of clusters alone. Returns 0 if the
+ * boot sector describes no data area.
+ */
+static
+ULONG
+GetFatBits(
+    _In_ PUCHAR BootSector,
+    _Out_ PULONG pulDataStart,
+    _Out_ PULONG pulClusterCount)
+{
+    ULONG ulSectorSize, ulFatSize, ulTotalSectors, ulRootSectors;
+
+    ulSectorSize = *(PUSHORT)&BootSector[0x0B];
+    ulFatSize = *(PUSHORT)&BootSector[0x16];
+    if (ulFatSize == 0)
+        ulFatSize = *(PULONG)&BootSector[0x24];
+    ulTotalSectors = *(PUSHORT)&BootSector[0x13];
+    if (ulTotalSectors == 0)
+        ulTotalSectors = *(PULONG)&BootSector[0x20];
+
+    ulRootSectors = ((*(PUSHORT)&BootSector[0x11] * 32) + ulSectorSize - 1) / ulSectorSize;
+    *pulDataStart = *(PUSHORT)&BootSector[0x0E] + (BootSector[0x10] * ulFatSize) + ulRootSectors;
+    if (*pulDataStart >= ulTotalSectors)
+        return 0;
+
+    *pulClusterCount = (ulTotalSectors - *pulDataStart) / BootSector[0x0D];
+    if (*pulClusterCount < 4085)
+        return 12;
+    else if (*pulClusterCount < 65525)
+        return 16;
+    else
+        return 32;
+}
+
+
+static
+ULONG
+GetNtfsClusterSize(
+    _In_ PUCHAR BootSector)
+{
+    /* Values above 0xE0 are negative powers of two, in bytes */
+    if (BootSector[0x0D] > 0xE0)
+        return 1 << (256 - BootSector[0x0D]);
+
+    return *(PUSHORT)&BootSector[0x0B] * BootSector[0x0D];
+}
+
+
+/* Returns 0 for a record size no NTFS driver accepts */
+static
+ULONG
+GetNtfsRecordSize(
+    _In_ PUCHAR BootSector,
+    _In_ ULONG ulClusterSize)
+{
+    ULONG ulRecordSize;
+
+    /* Values of 0x80 and above are negative powers of two, in bytes */
+    if (BootSector[0x40] < 0x80)
+        ulRecordSize = BootSector[0x40] * ulClusterSize;
+    else if (BootSector[0x40] > 0xE0)
+        ulRecordSize = 1 << (256 - BootSector[0x40]);
+    else
+        ulRecordSize = 0;
+
+    if ((ulRecordSize < 1024) || (ulRecordSize > 65536))
+        return 0;
+
+    return ulRecordSize;
+}
+
+
+NTSTATUS
+OpenFsVolume(
+    _In_ ULONG DiskNumber,
+    _In_ ULONG PartitionNumber,
+    _Out_ PHANDLE FileHandle)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition%lu",
+                     DiskNumber,
+                     PartitionNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    return NtOpenFile(FileHandle,
+                      FILE_READ_DATA | SYNCHRONIZE,
+                      &ObjectAttributes,
+                      &Iosb,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      FILE_SYNCHRONOUS_IO_NONALERT);
+}
+
+
+/*
+ * Appends a used range to the map. The ranges arrive in ascending order, so
+ * a range that touches or nearly touches the last run extends it.
+ */
+static
+NTSTATUS
+AddFsRun(
+    _In_ PFS_MAP Map,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONGLONG ullLength)
+{
+    PFS_RUN Run, NewRuns;
+    ULONGLONG ullEnd;
+
+    if (ullOffset >= Map->Length)
+        return STATUS_SUCCESS;
+
+    ullEnd = min(ullOffset + ullLength, Map->Length);
+    if (ullEnd == ullOffset)
+        return STATUS_SUCCESS;
+
+    if (Map->RunCount > 0)
+    {
+        Run = &Map->Runs[Map->RunCount - 1];
+        if (ullOffset <= Run->Offset + Run->Length + FS_RUN_MERGE_GAP)
+        {
+            if (ullEnd > Run->Offset + Run->Length)
+                Run->Length = ullEnd - Run->Offset;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    if (Map->RunCount == Map->MaxRuns)
+    {
+        NewRuns = RtlAllocateHeap(RtlGetProcessHeap(),
+                                  0,
+                                  (Map->MaxRuns + FS_RUN_GROW_COUNT) * sizeof(FS_RUN));
+        if (NewRuns == NULL)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        if (Map->Runs != NULL)
+        {
+            RtlCopyMemory(NewRuns, Map->Runs, Map->RunCount * sizeof(FS_RUN));
+            RtlFreeHeap(RtlGetProcessHeap(), 0, Map->Runs);
+        }
+
+        Map->Runs = NewRuns;
+        Map->MaxRuns += FS_RUN_GROW_COUNT;
+    }
+
+    Map->Runs[Map->RunCount].Offset = ullOffset;
+    Map->Runs[Map->RunCount].Length = ullEnd - ullOffset;
+    Map->RunCount++;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Adds the allocated clusters of a piece of an allocation bitmap. Bit 0 of
+ * the piece describes the cluster that starts at ullBase.
+ */
+static
+NTSTATUS
+AddFsBitmapRuns(
+    _In_ PFS_MAP Map,
+    _In_ PUCHAR Bitmap,
+    _In_ ULONG ulBitCount,
+    _In_ ULONGLONG ullBase,
+    _In_ ULONG ulClusterSize)
+{
+    ULONG ulBit = 0, ulFirst;
+    NTSTATUS Status;
+
+    while (ulBit < ulBitCount)
+    {
+        /* Whole free bytes are the common case on a sparsely used volume */
+        if (((ulBit & 7) == 0) && (Bitmap[ulBit / 8] == 0))
+        {
+            ulBit += 8;
+            continue;
+        }
+
+        if ((Bitmap[ulBit / 8] & (1 << (ulBit & 7))) == 0)
+        {
+            ulBit++;
+            continue;
+        }
+
+        ulFirst = ulBit;
+        while ((ulBit < ulBitCount) && (Bitmap[ulBit / 8] & (1 << (ulBit & 7))))
+            ulBit++;
+
+        Status = AddFsRun(Map,
+                          ullBase + (ULONGLONG)ulFirst * ulClusterSize,
+                          (ULONGLONG)(ulBit - ulFirst) * ulClusterSize);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * FAT: the reserved area, the FATs and the FAT12/16 root directory are always
+ * used. A data cluster is used when its FAT entry is not zero.
+ */
+static
+NTSTATUS
+BuildFatMap(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG BytesPerSector,
+    _In_ PUCHAR BootSector,
+    _In_ PFS_MAP Map)
+{
+    ULONG ulSectorSize, ulClusterSize, ulDataStart, ulClusterCount;
+    ULONG ulFatBits, ulEntriesPerChunk, ulChunkSize;
+    ULONG ulCluster, ulIndex, ulEntry, ulFirstUsed;
+    ULONGLONG ullFatOffset;
+    PUCHAR Buffer = NULL;
+    NTSTATUS Status;
+
+    ulSectorSize = *(PUSHORT)&BootSector[0x0B];
+    ulClusterSize = ulSectorSize * BootSector[0x0D];
+
+    ulFatBits = GetFatBits(BootSector, &ulDataStart, &ulClusterCount);
+    if (ulFatBits == 0)
+        return STATUS_UNRECOGNIZED_VOLUME;
+
+    Status = AddFsRun(Map, 0, (ULONGLONG)ulDataStart * ulSectorSize);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    /* A FAT12 table never exceeds 6 KB, so it is always read in one piece */
+    ulEntriesPerChunk = (ulFatBits == 12) ? (ulClusterCount + 2) : (FS_BITMAP_CHUNK_SIZE * 8 / ulFatBits);
+    ulChunkSize = (ulFatBits == 12) ? (((ulClusterCount + 2) * 3 + 1) / 2) : FS_BITMAP_CHUNK_SIZE;
+
+    /* One spare byte lets the last FAT12 entry be fetched as a word */
+    Buffer = RtlAllocateHeap(RtlGetProcessHeap(), 0, ulChunkSize + 1);
+    if (Buffer == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    ullFatOffset = (ULONGLONG)*(PUSHORT)&BootSector[0x0E] * ulSectorSize;
+    ulFirstUsed = 0;
+
+    for (ulCluster = 0; ulCluster < ulClusterCount + 2; ulCluster += ulEntriesPerChunk)
+    {
+        ulEntriesPerChunk = min(ulEntriesPerChunk, ulClusterCount + 2 - ulCluster);
+
+        Status = ReadFsBytes(FileHandle,
+                             BytesPerSector,
+                             ullFatOffset + ((ULONGLONG)ulCluster * ulFatBits / 8),
+                             Buffer,
+                             (ulEntriesPerChunk * ulFatBits + 7) / 8);
+        if (!NT_SUCCESS(Status))
+            goto done;
+
+        for (ulIndex = 0; ulIndex < ulEntriesPerChunk; ulIndex++)
+        {
+            if (ulFatBits == 12)
+            {
+                ulEntry = *(PUSHORT)&Buffer[ulIndex + ulIndex / 2];
+                ulEntry = (ulIndex & 1) ? (ulEntry >> 4) : (ulEntry & 0xFFF);
+            }
+            else if (ulFatBits == 16)
+            {
+                ulEntry = ((PUSHORT)Buffer)[ulIndex];
+            }
+            else
+            {
+                ulEntry = ((PULONG)Buffer)[ulIndex] & 0x0FFFFFFF;
+            }
+
+            /* Entries 0 and 1 are reserved and do not describe clusters */
+            if ((ulCluster + ulIndex < 2) || (ulEntry == 0))
+            {
+                if (ulFirstUsed != 0)
+                {
+                    Status = AddFsRun(Map,
+                                      ((ULONGLONG)ulDataStart * ulSectorSize) + ((ULONGLONG)(ulFirstUsed - 2) * ulClusterSize),
+                                      (ULONGLONG)(ulCluster + ulIndex - ulFirstUsed) * ulClusterSize);
+                    if (!NT_SUCCESS(Status))
+                        goto done;
+
+                    ulFirstUsed = 0;
+                }
+            }
+            else if (ulFirstUsed == 0)
+            {
+                ulFirstUsed = ulCluster + ulIndex;
+            }
+        }
+    }
+
+    if (ulFirstUsed != 0)
+    {
+        Status = AddFsRun(Map,
+                          ((ULONGLONG)ulDataStart * ulSectorSize) + ((ULONGLONG)(ulFirstUsed - 2) * ulClusterSize),
+                          (ULONGLONG)(ulClusterCount + 2 - ulFirstUsed) * ulClusterSize);
+        if (!NT_SUCCESS(Status))
+            goto done;
+    }
+
+    /* The sectors behind the last whole cluster are not described by the FAT */
+    Status = AddFsRun(Map,
+                      ((ULONGLONG)ulDataStart * ulSectorSize) + ((ULONGLONG)ulClusterCount * ulClusterSize),
+                      Map->Length);
+
+done:
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Buffer);
+
+    return Status;
+}
+
+
+/*
+ * Applies the update sequence array of an MFT record, which replaces the last
+ * two bytes of every 512 byte stride.
+ */
+static
+BOOLEAN
+FixupNtfsRecord(
+    _Inout_ PUCHAR Record,
+    _In_ ULONG ulRecordSize)
+{
+    USHORT usOffset = *(PUSHORT)&Record[4];
+    USHORT usCount = *(PUSHORT)&Record[6];
+    PUSHORT Array;
+    ULONG i;
+
+    if ((RtlCompareMemory(Record, "FILE", 4) != 4) ||
+        (usCount == 0) ||
+        ((ULONG)(usCount - 1) * NTFS_FIXUP_STRIDE > ulRecordSize) ||
+        (usOffset + (ULONG)usCount * sizeof(USHORT) > ulRecordSize))
+        return FALSE;
+
+    Array = (PUSHORT)&Record[usOffset];
+    for (i = 1; i < usCount; i++)
+    {
+        if (*(PUSHORT)&Record[(i * NTFS_FIXUP_STRIDE) - 2] != Array[0])
+            return FALSE;
+
+        *(PUSHORT)&Record[(i * NTFS_FIXUP_STRIDE) - 2] = Array[i];
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * NTFS: every cluster, the MFT and the boot sector included, is described by
+ * the $Bitmap file. Its unnamed $DATA attribute is decoded from the mapping
+ * pairs of MFT record 6 and read run by run.
+ */
+static
+NTSTATUS
+BuildNtfsMap(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG BytesPerSector,
+    _In_ PUCHAR BootSector,
+    _In_ PFS_MAP Map)
+{
+    ULONG ulClusterSize, ulRecordSize, ulAttribute, ulLength;
+    ULONGLONG ullClusterCount, ullVcn = 0, ullRunLength, ullBitsLeft;
+    LONGLONG llLcn = 0, llDelta;
+    PUCHAR Record = NULL, Buffer = NULL, Pairs;
+    ULONG ulHeader, ulLengthBytes, ulOffsetBytes, i, ulChunk;
+    ULONGLONG ullDone;
+    NTSTATUS Status;
+
+    ulClusterSize = GetNtfsClusterSize(BootSector);
+    ullClusterCount = *(PULONGLONG)&BootSector[0x28] * *(PUSHORT)&BootSector[0x0B] / ulClusterSize;
+
+    ulRecordSize = GetNtfsRecordSize(BootSector, ulClusterSize);
+    if (ulRecordSize == 0)
+        return STATUS_UNRECOGNIZED_VOLUME;
+
+    Record = RtlAllocateHeap(RtlGetProcessHeap(), 0, ulRecordSize);
+    Buffer = RtlAllocateHeap(RtlGetProcessHeap(), 0, FS_BITMAP_CHUNK_SIZE);
+    if ((Record == NULL) || (Buffer == NULL))
+    {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto done;
+    }
+
+    Status = ReadFsBytes(FileHandle,
+                         BytesPerSector,
+                         (*(PULONGLONG)&BootSector[0x30] * ulClusterSize) + (NTFS_BITMAP_RECORD * ulRecordSize),
+                         Record,
+                         ulRecordSize);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    Status = STATUS_UNRECOGNIZED_VOLUME;
+    if (!FixupNtfsRecord(Record, ulRecordSize))
+        goto done;
+
+    /* Find the unnamed non-resident $DATA attribute */
+    ulAttribute = *(PUSHORT)&Record[0x14];
+    for (;;)
+    {
+        if ((ulAttribute + 8 > ulRecordSize) ||
+            (*(PULONG)&Record[ulAttribute] == NTFS_ATTRIBUTE_END))
+            goto done;
+
+        ulLength = *(PULONG)&Record[ulAttribute + 4];
+        if ((ulLength < 0x18) || (ulAttribute + ulLength > ulRecordSize))
+            goto done;
+
+        if ((*(PULONG)&Record[ulAttribute] == NTFS_ATTRIBUTE_DATA) &&
+            (Record[ulAttribute + 9] == 0))
+            break;
+
+        ulAttribute += ulLength;
+    }
+
+    /* A resident bitmap or one split by an attribute list is not handled */
+    if ((Record[ulAttribute + 8] == 0) || (ulLength < 0x40))
+        goto done;
+
+    Pairs = &Record[ulAttribute + *(PUSHORT)&Record[ulAttribute + 0x20]];
+    ullBitsLeft = ullClusterCount;
+
+    while ((Pairs < &Record[ulAttribute + ulLength]) && (*Pairs != 0) && (ullBitsLeft > 0))
+    {
+        ulHeader = *Pairs++;
+        ulLengthBytes = ulHeader & 0x0F;
+        ulOffsetBytes = ulHeader >> 4;
+
+        /* A sparse run has no place in the bitmap of a volume */
+        if ((ulLengthBytes == 0) || (ulLengthBytes > 8) ||
+            (ulOffsetBytes == 0) || (ulOffsetBytes > 8))
+            goto done;
+
+        ullRunLength = 0;
+        for (i = 0; i < ulLengthBytes; i++)
+            ullRunLength |= (ULONGLONG)*Pairs++ << (i * 8);
+
+        llDelta = 0;
+        for (i = 0; i < ulOffsetBytes; i++)
+            llDelta |= (LONGLONG)*Pairs++ << (i * 8);
+        if ((Pairs[-1] & 0x80) && (ulOffsetBytes < 8))
+            llDelta -= (LONGLONG)1 << (ulOffsetBytes * 8);
+        llLcn += llDelta;
+
+        for (ullDone = 0; (ullDone < ullRunLength * ulClusterSize) && (ullBitsLeft > 0); ullDone += ulChunk)
+        {
+            ulChunk = (ULONG)min((ULONGLONG)FS_BITMAP_CHUNK_SIZE, ullRunLength * ulClusterSize - ullDone);
+
+            Status = ReadFsBytes(FileHandle,
+                                 BytesPerSector,
+                                 ((ULONGLONG)llLcn * ulClusterSize) + ullDone,
+                                 Buffer,
+                                 ulChunk);
+            if (!NT_SUCCESS(Status))
+                goto done;
+
+            Status = AddFsBitmapRuns(Map,
+                                     Buffer,
+                                     (ULONG)min((ULONGLONG)ulChunk * 8, ullBitsLeft),
+                                     (ullVcn * ulClusterSize * 8 + ullDone * 8) * ulClusterSize,
+                                     ulClusterSize);
+            if (!NT_SUCCESS(Status))
+                goto done;
+
+            ullBitsLeft -= min((ULONGLONG)ulChunk * 8, ullBitsLeft);
+        }
+
+        ullVcn += ullRunLength;
+    }
+
+    Status = STATUS_UNRECOGNIZED_VOLUME;
+    if (ullBitsLeft > 0)
+        goto done;
+
+    /* The backup boot sector lies behind the last cluster */
+    Status = AddFsRun(Map, ullClusterCount * ulClusterSize, Map->Length);
+
+done:
+    if (Buffer != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Buffer);
+
+    if (Record != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Record);
+
+    return Status;
+}
+
+
+/*
+ * ext2/3/4: the block bitmap of every group marks the superblock copies, the
+ * group descriptors and the inode tables as used. A group whose bitmap was
+ * never initialized is copied as a whole.
+ */
+static
+NTSTATUS
+BuildExtMap(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG BytesPerSector,
+    _In_ PUCHAR Superblock,
+    _In_ PFS_MAP Map)
+{
+    ULONG ulBlockSize, ulFirstDataBlock, ulBlocksPerGroup, ulIncompat;
+    ULONG ulDescSize, ulGroupCount, ulGroup, ulBits;
+    ULONGLONG ullBlockCount, ullBitmapBlock, ullGroupStart;
+    PUCHAR Descriptors = NULL, Bitmap = NULL, Desc;
+    NTSTATUS Status;
+
+    if (*(PULONG)&Superblock[0x18] > 6)
+        return STATUS_UNRECOGNIZED_VOLUME;
+
+    ulBlockSize = 1024 << *(PULONG)&Superblock[0x18];
+    ulFirstDataBlock = *(PULONG)&Superblock[0x14];
+    ulBlocksPerGroup = *(PULONG)&Superblock[0x20];
+    ulIncompat = *(PULONG)&Superblock[0x60];
+
+    ullBlockCount = *(PULONG)&Superblock[0x04];
+    ulDescSize = 32;
+    if (ulIncompat & EXT_INCOMPAT_64BIT)
+    {
+        ullBlockCount |= (ULONGLONG)*(PULONG)&Superblock[0x150] << 32;
+        ulDescSize = *(PUSHORT)&Superblock[0xFE];
+    }
+
+    /* META_BG scatters the group descriptors across the volume */
+    if ((ulIncompat & EXT_INCOMPAT_META_BG) ||
+        (ulBlocksPerGroup == 0) || (ulBlocksPerGroup > ulBlockSize * 8) ||
+        (ulDescSize < 32) || (ulDescSize > 1024) || (ullBlockCount <= ulFirstDataBlock))
+        return STATUS_UNRECOGNIZED_VOLUME;
+
+    ulGroupCount = (ULONG)((ullBlockCount - ulFirstDataBlock + ulBlocksPerGroup - 1) / ulBlocksPerGroup);
+
+    Descriptors = RtlAllocateHeap(RtlGetProcessHeap(), 0, ulGroupCount * ulDescSize);
+    Bitmap = RtlAllocateHeap(RtlGetProcessHeap(), 0, ulBlockSize);
+    if ((Descriptors == NULL) || (Bitmap == NULL))
+    {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto done;
+    }
+
+    Status = ReadFsBytes(FileHandle,
+                         BytesPerSector,
+                         (ULONGLONG)(ulFirstDataBlock + 1) * ulBlockSize,
+                         Descriptors,
+                         ulGroupCount * ulDescSize);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    /* The boot block in front of a 1 KB block file system is not in any group */
+    Status = AddFsRun(Map, 0, (ULONGLONG)ulFirstDataBlock * ulBlockSize);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    for (ulGroup = 0; ulGroup < ulGroupCount; ulGroup++)
+    {
+        Desc = &Descriptors[ulGroup * ulDescSize];
+        ullGroupStart = ulFirstDataBlock + ((ULONGLONG)ulGroup * ulBlocksPerGroup);
+        ulBits = (ULONG)min((ULONGLONG)ulBlocksPerGroup, ullBlockCount - ullGroupStart);
+
+        if (*(PUSHORT)&Desc[0x12] & EXT_BG_BLOCK_UNINIT)
+        {
+            Status = AddFsRun(Map, ullGroupStart * ulBlockSize, (ULONGLONG)ulBits * ulBlockSize);
+            if (!NT_SUCCESS(Status))
+                goto done;
+            continue;
+        }
+
+        ullBitmapBlock = *(PULONG)&Desc[0x00];
+        if (ulDescSize >= 64)
+            ullBitmapBlock |= (ULONGLONG)*(PULONG)&Desc[0x20] << 32;
+
+        if ((ullBitmapBlock == 0) || (ullBitmapBlock >= ullBlockCount))
+        {
+            Status = STATUS_UNRECOGNIZED_VOLUME;
+            goto done;
+        }
+
+        Status = ReadFsBytes(FileHandle,
+                             BytesPerSector,
+                             ullBitmapBlock * ulBlockSize,
+                             Bitmap,
+                             ulBlockSize);
+        if (!NT_SUCCESS(Status))
+            goto done;
+
+        Status = AddFsBitmapRuns(Map, Bitmap, ulBits, ullGroupStart * ulBlockSize, ulBlockSize);
+        if (!NT_SUCCESS(Status))
+            goto done;
+    }
+
+    Status = AddFsRun(Map, ullBlockCount * ulBlockSize, Map->Length);
+
+done:
+    if (Bitmap != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Bitmap);
+
+    if (Descriptors != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Descriptors);
+
+    return Status;
+}
+
+
+/*
+ * Builds the list of the byte ranges of a volume that its file system uses.
+ * Everything the allocation map does not describe is treated as used, and
+ * nearby ranges are coalesced into long runs. Returns
+ * STATUS_UNRECOGNIZED_VOLUME if the file system is not supported.
+ */
+NTSTATUS
+CreateFsMap(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG BytesPerSector,
+    _In_ ULONGLONG ullLength,
+    _Out_ PFS_MAP *ppMap)
+{
+    UCHAR Buffer[FS_PROBE_SIZE];
+    PFS_MAP Map;
+    ULONGLONG ullUsed = 0;
+    ULONG i;
+    NTSTATUS Status;
+
+    *ppMap = NULL;
+
+    if (!ReadProbeBlock(FileHandle, 0, Buffer))
+        return STATUS_UNRECOGNIZED_VOLUME;
+
+    Map = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(FS_MAP));
+    if (Map == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Map->Length = ullLength;
+
+    /* Boot code and boot loader stages live in front of every file system */
+    Status = AddFsRun(Map, 0, FS_HEAD_SIZE);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    if (IsNtfsBootSector(Buffer))
+        Status = BuildNtfsMap(FileHandle, BytesPerSector, Buffer, Map);
+    else if (IsFatBootSector(Buffer))
+        Status = BuildFatMap(FileHandle, BytesPerSector, Buffer, Map);
+    else if (*(PUSHORT)&Buffer[EXT_SUPERBLOCK_OFFSET + 0x38] == EXT_SUPERBLOCK_MAGIC)
+        Status = BuildExtMap(FileHandle, BytesPerSector, &Buffer[EXT_SUPERBLOCK_OFFSET], Map);
+    else
+        Status = STATUS_UNRECOGNIZED_VOLUME;
+
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    /* Unbuffered copies need whole sectors; the merge gap keeps the runs apart */
+    for (i = 0; i < Map->RunCount; i++)
+    {
+        Map->Runs[i].Length = AlignDown(Map->Runs[i].Offset + Map->Runs[i].Length + BytesPerSector - 1, BytesPerSector);
+        Map->Runs[i].Offset = AlignDown(Map->Runs[i].Offset, BytesPerSector);
+        Map->Runs[i].Length = min(Map->Runs[i].Length, ullLength) - Map->Runs[i].Offset;
+        ullUsed += Map->Runs[i].Length;
+    }
+    Map->UsedBytes = ullUsed;
+
+    DPRINT("%lu runs, %I64u of %I64u bytes used\n", Map->RunCount, ullUsed, ullLength);
+
+done:
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("No allocation map (Status 0x%08lx)\n", Status);
+        DestroyFsMap(Map);
+        return Status;
+    }
+
+    *ppMap = Map;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DestroyFsMap(
+    _In_ PFS_MAP Map)
+{
+    if (Map->Runs != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Map->Runs);
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, Map);
+}
+
+
+static
+VOID
+SetProbeResult(
+    _In_ PPARTENTRY PartEntry,
+    _In_ PCSTR pszFileSystem,
+    _In_reads_bytes_opt_(ulLength) PUCHAR Label,
+    _In_ ULONG ulLength)
+{
+    ULONG i;
+
+    PartEntry->FormatState = Preformatted;
+    StringCchCopyA(PartEntry->FileSystemName, ARRAYSIZE(PartEntry->FileSystemName), pszFileSystem);
+    RtlZeroMemory(PartEntry->VolumeLabel, sizeof(PartEntry->VolumeLabel));
+
+    if (Label == NULL)
+        return;
+
+    /* Labels are padded with blanks or zeros */
+    ulLength = min(ulLength, sizeof(PartEntry->VolumeLabel) - 1);
+    for (i = 0; (i < ulLength) && (Label[i] != 0); i++)
+        PartEntry->VolumeLabel[i] = Label[i];
+
+    while ((i > 0) && (PartEntry->VolumeLabel[i - 1] == ' '))
+        PartEntry->VolumeLabel[--i] = 0;
+}
+
+
+static
+VOID
+SetProbeUnicodeLabel(
+    _In_ PPARTENTRY PartEntry,
+    _In_reads_(cchLabel) PWCHAR Label,
+    _In_ ULONG cchLabel)
+{
+    ULONG ulLength;
+
+    RtlZeroMemory(PartEntry->VolumeLabel, sizeof(PartEntry->VolumeLabel));
+    RtlUnicodeToMultiByteN(PartEntry->VolumeLabel,
+                           sizeof(PartEntry->VolumeLabel) - 1,
+                           &ulLength,
+                           Label,
+                           cchLabel * sizeof(WCHAR));
+}
+
+
+/*
+ * Asks for a second read that holds the label of a file system which keeps
+ * it outside of the head. The window is twice the probe size, so that a
+ * structure of up to FS_PROBE_SIZE bytes fits whatever its alignment.
+ */
+static
+VOID
+SetProbeLabelRead(
+    _In_ PFS_PROBE Probe,
+    _In_ FS_LABEL_SOURCE LabelSource,
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONG ulLength)
+{
+    PPARTENTRY PartEntry = Probe->PartEntry;
+    ULONG BytesPerSector = PartEntry->DiskEntry->BytesPerSector;
+    ULONGLONG ullStart;
+
+    ullStart = AlignDown(ullOffset, FS_PROBE_SIZE);
+    if (ullStart + (2 * FS_PROBE_SIZE) > PartEntry->SectorCount.QuadPart * BytesPerSector)
+        return;
+
+    Probe->LabelSource = LabelSource;
+    Probe->LabelOffset = (ULONG)(ullOffset - ullStart);
+    Probe->LabelLength = ulLength;
+    Probe->Offset = (PartEntry->StartSector.QuadPart * BytesPerSector) + ullStart;
+    Probe->Length = 2 * FS_PROBE_SIZE;
+}
+
+
+/*
+ * Identifies the file system from the head of the partition, in the order
+ * blkid uses, so that signatures left behind by an older file system lose
+ * against the one that was created last.
+ */
+static
+BOOLEAN
+ProbeFileSystem(
+    _In_ PFS_PROBE Probe,
+    _In_ ULONG ulLength)
+{
+    PPARTENTRY PartEntry = Probe->PartEntry;
+    PUCHAR Buffer = Probe->Buffer;
+    PUCHAR Ext = &Buffer[EXT_SUPERBLOCK_OFFSET];
+    ULONG ulPageSize, ulClusterSize, ulRecordSize, ulDataStart, ulClusterCount;
+    ULONG ulFatBits;
+    ULONGLONG ullRoot;
+
+    if (ulLength < FS_PROBE_SIZE)
+        return FALSE;
+
+    if (RtlCompareMemory(Buffer, "LUKS\xBA\xBE", 6) == 6)
+    {
+        /* Only LUKS2 headers carry a label, the version is big-endian */
+        SetProbeResult(PartEntry, "LUKS", (Buffer[7] == 2) ? &Buffer[LUKS2_LABEL_OFFSET] : NULL, 48);
+        return TRUE;
+    }
+
+    if (RtlCompareMemory(Buffer, "XFSB", 4) == 4)
+    {
+        SetProbeResult(PartEntry, "XFS", &Buffer[XFS_LABEL_OFFSET], 12);
+        return TRUE;
+    }
+
+    if ((ulLength >= BTRFS_SUPERBLOCK_OFFSET + FS_PROBE_SIZE) &&
+        (RtlCompareMemory(&Buffer[BTRFS_SUPERBLOCK_OFFSET + 0x40], "_BHRfS_M", 8) == 8))
+    {
+        SetProbeResult(PartEntry, "BTRFS", &Buffer[BTRFS_SUPERBLOCK_OFFSET + BTRFS_LABEL_OFFSET], 256);
+        return TRUE;
+    }
+
+    if (*(PUSHORT)&Ext[0x38] == EXT_SUPERBLOCK_MAGIC)
+    {
+        if (*(PULONG)&Ext[0x60] & (EXT_INCOMPAT_EXTENTS | EXT_INCOMPAT_64BIT | EXT_INCOMPAT_FLEX_BG))
+            SetProbeResult(PartEntry, "EXT4", &Ext[0x78], 16);
+        else if (*(PULONG)&Ext[0x5C] & EXT_COMPAT_HAS_JOURNAL)
+            SetProbeResult(PartEntry, "EXT3", &Ext[0x78], 16);
+        else
+            SetProbeResult(PartEntry, "EXT2", &Ext[0x78], 16);
+        return TRUE;
+    }
+
+    for (ulPageSize = FS_PROBE_SIZE; ulPageSize <= min(ulLength, FS_HEAD_SIZE); ulPageSize *= 2)
+    {
+        if (RtlCompareMemory(&Buffer[ulPageSize - 10], "SWAPSPACE2", 10) == 10)
+        {
+            SetProbeResult(PartEntry, "SWAP", &Buffer[SWAP_LABEL_OFFSET], 16);
+            return TRUE;
+        }
+
+        if (RtlCompareMemory(&Buffer[ulPageSize - 10], "SWAP-SPACE", 10) == 10)
+        {
+            SetProbeResult(PartEntry, "SWAP", NULL, 0);
+            return TRUE;
+        }
+    }
+
+    if ((*(PUSHORT)&Buffer[510] == 0xAA55) &&
+        (RtlCompareMemory(&Buffer[3], "EXFAT   ", 8) == 8))
+    {
+        SetProbeResult(PartEntry, "EXFAT", NULL, 0);
+
+        /* The label is an entry of the root directory */
+        if ((Buffer[0x6C] >= 9) && (Buffer[0x6C] <= 12) &&
+            (Buffer[0x6C] + Buffer[0x6D] <= 25) &&
+            (*(PULONG)&Buffer[0x60] >= 2))
+        {
+            ullRoot = ((ULONGLONG)*(PULONG)&Buffer[0x58] << Buffer[0x6C]) +
+                      ((ULONGLONG)(*(PULONG)&Buffer[0x60] - 2) << (Buffer[0x6C] + Buffer[0x6D]));
+            SetProbeLabelRead(Probe, FsLabelExfatRoot, ullRoot, FS_PROBE_SIZE);
+        }
+        return TRUE;
+    }
+
+    if (IsNtfsBootSector(Buffer))
+    {
+        SetProbeResult(PartEntry, "NTFS", NULL, 0);
+
+        /* The label is an attribute of the $Volume file */
+        ulClusterSize = GetNtfsClusterSize(Buffer);
+        ulRecordSize = GetNtfsRecordSize(Buffer, ulClusterSize);
+        if ((ulRecordSize != 0) && (ulRecordSize <= FS_PROBE_SIZE))
+        {
+            SetProbeLabelRead(Probe,
+                              FsLabelNtfsVolume,
+                              (*(PULONGLONG)&Buffer[0x30] * ulClusterSize) + (NTFS_VOLUME_RECORD * ulRecordSize),
+                              ulRecordSize);
+        }
+        return TRUE;
+    }
+
+    if (IsFatBootSector(Buffer))
+    {
+        ulFatBits = GetFatBits(Buffer, &ulDataStart, &ulClusterCount);
+        if (ulFatBits == 0)
+            return FALSE;
+
+        /* The extended BPB of FAT32 follows its larger BPB */
+        if (*(PUSHORT)&Buffer[0x16] == 0)
+            SetProbeResult(PartEntry, "FAT32", (Buffer[0x42] == 0x29) ? &Buffer[0x47] : NULL, 11);
+        else
+            SetProbeResult(PartEntry, (ulFatBits == 12) ? "FAT12" : "FAT16", (Buffer[0x26] == 0x29) ? &Buffer[0x2B] : NULL, 11);
+
+        if (strcmp(PartEntry->VolumeLabel, "NO NAME") == 0)
+            PartEntry->VolumeLabel[0] = 0;
+        return TRUE;
+    }
+
+    if ((ulLength >= HPFS_SUPERBLOCK_OFFSET + FS_PROBE_SIZE) &&
+        (*(PULONG)&Buffer[HPFS_SUPERBLOCK_OFFSET] == HPFS_SUPERBLOCK_MAGIC))
+    {
+        SetProbeResult(PartEntry, "HPFS", (Buffer[0x26] == 0x29) ? &Buffer[0x2B] : NULL, 11);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+static
+VOID
+ProbeVolumeLabel(
+    _In_ PFS_PROBE Probe)
+{
+    PUCHAR Data = &Probe->Buffer[Probe->LabelOffset];
+    ULONG ulAttribute, ulLength, ulValueOffset, ulValueLength, i;
+
+    if (Probe->LabelSource == FsLabelNtfsVolume)
+    {
+        if (!FixupNtfsRecord(Data, Probe->LabelLength))
+            return;
+
+        ulAttribute = *(PUSHORT)&Data[0x14];
+        while ((ulAttribute + 0x18 <= Probe->LabelLength) &&
+               (*(PULONG)&Data[ulAttribute] != NTFS_ATTRIBUTE_END))
+        {
+            ulLength = *(PULONG)&Data[ulAttribute + 4];
+            if ((ulLength < 0x18) || (ulAttribute + ulLength > Probe->LabelLength))
+                return;
+
+            /* The volume name is always resident */
+            if ((*(PULONG)&Data[ulAttribute] == NTFS_ATTRIBUTE_VOLUME_NAME) &&
+                (Data[ulAttribute + 8] == 0))
+            {
+                ulValueLength = *(PULONG)&Data[ulAttribute + 0x10];
+                ulValueOffset = *(PUSHORT)&Data[ulAttribute + 0x14];
+                if (ulValueOffset + ulValueLength <= ulLength)
+                {
+                    SetProbeUnicodeLabel(Probe->PartEntry,
+                                         (PWCHAR)&Data[ulAttribute + ulValueOffset],
+                                         ulValueLength / sizeof(WCHAR));
+                }
+                return;
+            }
+
+            ulAttribute += ulLength;
+        }
+    }
+    else if (Probe->LabelSource == FsLabelExfatRoot)
+    {
+        for (i = 0; i < Probe->LabelLength; i += 32)
+        {
+            if (Data[i] == EXFAT_ENTRY_END)
+                return;
+
+            if (Data[i] == EXFAT_ENTRY_LABEL)
+            {
+                SetProbeUnicodeLabel(Probe->PartEntry, (PWCHAR)&Data[i + 2], min(Data[i + 1], 11));
+                return;
+            }
+        }
+    }
+}
+
+
+static
+BOOLEAN
+IsFsHeadEmpty(
+    _In_reads_bytes_(ulLength) PUCHAR Buffer,
+    _In_ ULONG ulLength)
+{
+    ULONG i;
+
+    for (i = 0; i < ulLength; i++)
+    {
+        if (Buffer[i] != 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* Issues the reads of all probes at once and waits for all of them */
+static
+VOID
+ReadProbes(
+    _In_ HANDLE DiskHandle,
+    _In_ PFS_PROBE Probes,
+    _In_ ULONG ulCount)
+{
+    HANDLE WaitHandles[FS_PROBE_BATCH];
+    LARGE_INTEGER FileOffset;
+    ULONG WaitCount = 0, i;
+    NTSTATUS Status;
+
+    for (i = 0; i < ulCount; i++)
+    {
+        if (Probes[i].Length == 0)
+            continue;
+
+        FileOffset.QuadPart = Probes[i].Offset;
+        Status = NtReadFile(DiskHandle,
+                            Probes[i].Event,
+                            NULL,
+                            NULL,
+                            &Probes[i].Iosb,
+                            Probes[i].Buffer,
+                            Probes[i].Length,
+                            &FileOffset,
+                            NULL);
+        if ((Status != STATUS_PENDING) && !NT_SUCCESS(Status))
+        {
+            Probes[i].Iosb.Status = Status;
+            Probes[i].Iosb.Information = 0;
+            continue;
+        }
+
+        WaitHandles[WaitCount++] = Probes[i].Event;
+    }
+
+    if (WaitCount == 0)
+        return;
+
+    Status = NtWaitForMultipleObjects(WaitCount,
+                                      WaitHandles,
+                                      WaitAll,
+                                      FALSE,
+                                      NULL);
+    if (Status != STATUS_WAIT_0)
+    {
+        DPRINT1("NtWaitForMultipleObjects() failed (Status 0x%08lx)\n", Status);
+
+        /* Never release buffers that are still owned by pending requests */
+        for (i = 0; i < WaitCount; i++)
+            NtWaitForSingleObject(WaitHandles[i], FALSE, NULL);
+    }
+}
+
+
+static
+VOID
+RunProbeBatch(
+    _In_ HANDLE DiskHandle,
+    _In_ PFS_PROBE Probes,
+    _In_ ULONG ulCount)
+{
+    PPARTENTRY PartEntry;
+    ULONG BytesPerSector, i;
+
+    for (i = 0; i < ulCount; i++)
+    {
+        PartEntry = Probes[i].PartEntry;
+        BytesPerSector = PartEntry->DiskEntry->BytesPerSector;
+
+        /* A small partition is read as a whole, never beyond its end */
+        Probes[i].Offset = PartEntry->StartSector.QuadPart * BytesPerSector;
+        Probes[i].Length = (ULONG)min((ULONGLONG)FS_PROBE_LENGTH,
+                                      PartEntry->SectorCount.QuadPart * BytesPerSector);
+        Probes[i].Length = (ULONG)AlignDown(Probes[i].Length, BytesPerSector);
+        Probes[i].LabelSource = FsLabelNone;
+    }
+
+    ReadProbes(DiskHandle, Probes, ulCount);
+
+    for (i = 0; i < ulCount; i++)
+    {
+        Probes[i].Length = 0;
+
+        if (!NT_SUCCESS(Probes[i].Iosb.Status))
+        {
+            DPRINT1("Probe read failed (Status 0x%08lx)\n", Probes[i].Iosb.Status);
+            continue;
+        }
+
+        /* Keeps the boot sector for later readers */
+        CacheSectors(Probes[i].PartEntry->DiskEntry,
+                     Probes[i].Offset,
+                     Probes[i].Buffer,
+                     (ULONG)min(Probes[i].Iosb.Information, FS_PROBE_SIZE));
+
+        if (!ProbeFileSystem(&Probes[i], (ULONG)Probes[i].Iosb.Information))
+        {
+            Probes[i].PartEntry->FormatState =
+                IsFsHeadEmpty(Probes[i].Buffer, (ULONG)Probes[i].Iosb.Information) ? Unformatted : UnknownFormat;
+        }
+    }
+
+    /* Labels kept outside of the head need one more read */
+    ReadProbes(DiskHandle, Probes, ulCount);
+
+    for (i = 0; i < ulCount; i++)
+    {
+        if ((Probes[i].Length != 0) && NT_SUCCESS(Probes[i].Iosb.Status))
+            ProbeVolumeLabel(&Probes[i]);
+    }
+}
+
+
+/*
+ * Fills in the file system name, the label and the format state of every
+ * partition of the disk, blkid style: the head of every partition is read
+ * with one request, all requests of a batch overlap on the disk, and every
+ * signature is checked in memory. NTFS and exFAT labels take a second,
+ * equally batched, read.
+ */
+VOID
+ProbeFileSystems(
+    _In_ PDISKENTRY DiskEntry)
+{
+    FS_PROBE Probes[FS_PROBE_BATCH];
+    PLIST_ENTRY ListHeads[2], Entry;
+    PPARTENTRY PartEntry;
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    HANDLE DiskHandle = NULL;
+    PVOID BufferBase = NULL;
+    SIZE_T BufferSize;
+    ULONG ulCount = 0, i;
+    NTSTATUS Status;
+
+    RtlZeroMemory(Probes, sizeof(Probes));
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition0",
+                     DiskEntry->DiskNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    /* No FILE_SYNCHRONOUS_IO_* option: the reads are overlapped */
+    Status = NtOpenFile(&DiskHandle,
+                        FILE_READ_DATA,
+                        &ObjectAttributes,
+                        &Iosb,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        FILE_NO_INTERMEDIATE_BUFFERING);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        return;
+    }
+
+    /* Page aligned buffers satisfy the alignment rules of unbuffered I/O */
+    BufferSize = (SIZE_T)FS_PROBE_LENGTH * FS_PROBE_BATCH;
+    Status = NtAllocateVirtualMemory(NtCurrentProcess(),
+                                     &BufferBase,
+                                     0,
+                                     &BufferSize,
+                                     MEM_RESERVE | MEM_COMMIT,
+                                     PAGE_READWRITE);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtAllocateVirtualMemory() failed (Status 0x%08lx)\n", Status);
+        BufferBase = NULL;
+        goto done;
+    }
+
+    for (i = 0; i < FS_PROBE_BATCH; i++)
+    {
+        Probes[i].Buffer = (PUCHAR)BufferBase + ((SIZE_T)i * FS_PROBE_LENGTH);
+
+        Status = NtCreateEvent(&Probes[i].Event,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               NotificationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("NtCreateEvent() failed (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+    }
+
+    ListHeads[0] = &DiskEntry->PrimaryPartListHead;
+    ListHeads[1] = &DiskEntry->LogicalPartListHead;
+
+    for (i = 0; i < ARRAYSIZE(ListHeads); i++)
+    {
+        for (Entry = ListHeads[i]->Flink; Entry != ListHeads[i]; Entry = Entry->Flink)
+        {
+            PartEntry = CONTAINING_RECORD(Entry, PARTENTRY, ListEntry);
+
+            if (!PartEntry->IsPartitioned ||
+                (PartEntry->PartitionNumber == 0) ||
+                ((DiskEntry->PartitionStyle == PARTITION_STYLE_MBR) &&
+                 IsContainerPartition(PartEntry->Mbr.PartitionType)))
+            {
+                continue;
+            }
+
+            Probes[ulCount++].PartEntry = PartEntry;
+            if (ulCount == FS_PROBE_BATCH)
+            {
+                RunProbeBatch(DiskHandle, Probes, ulCount);
+                ulCount = 0;
+            }
+        }
+    }
+
+    if (ulCount != 0)
+        RunProbeBatch(DiskHandle, Probes, ulCount);
+
+done:
+    for (i = 0; i < FS_PROBE_BATCH; i++)
+    {
+        if (Probes[i].Event != NULL)
+            NtClose(Probes[i].Event);
+    }
+
+    if (BufferBase != NULL)
+    {
+        BufferSize = 0;
+        NtFreeVirtualMemory(NtCurrentProcess(), &BufferBase, &BufferSize, MEM_RELEASE);
+    }
+
+    NtClose(DiskHandle);
+}
@@ -0,0 +1,637 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/hash.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define HASH_DEFAULT_CHUNK_SIZE     (1024 * 1024)
+#define HASH_MINIMUM_CHUNK_SIZE     (4 * 1024)
+#define HASH_MAXIMUM_CHUNK_SIZE     (64 * 1024 * 1024)
+#define HASH_BUFFER_BUDGET          (256 * 1024 * 1024)
+
+#define HASH_MAX_SLOTS              32
+/* Stays below MAXIMUM_WAIT_OBJECTS */
+#define HASH_MAX_WORKERS            16
+
+typedef enum _HASH_SLOT_STATE
+{
+    HashSlotFree,
+    HashSlotReading,
+    HashSlotHashing
+} HASH_SLOT_STATE;
+
+typedef struct _HASH_SLOT
+{
+    HASH_SLOT_STATE State;
+    ULONGLONG ReadMark;     /* Engine mark that covers the read of the chunk */
+    PUCHAR Buffer;
+    ULONGLONG Chunk;
+    ULONG Length;
+} HASH_SLOT, *PHASH_SLOT;
+
+typedef struct _HASH_WORKER
+{
+    HANDLE Thread;
+    HANDLE WorkEvent;       /* Set when Slot holds a chunk, or is NULL to stop */
+    HANDLE DoneEvent;       /* Set when the chunk has been hashed */
+    PHASH_SLOT Slot;
+    PDIGEST_MANIFEST Manifest;
+} HASH_WORKER, *PHASH_WORKER;
+
+typedef struct _HASH_CONTEXT
+{
+    IO_ENGINE Engine;
+    ULONGLONG Offset;       /* Bytes, start of the hashed range on the disk */
+    QOS_SETTINGS QosSettings;
+    QOS_BUCKET Qos;
+    PDIGEST_MANIFEST Manifest;
+
+    ULONG SlotCount;
+    ULONG WorkerCount;
+    HASH_SLOT Slots[HASH_MAX_SLOTS];
+    HASH_WORKER Workers[HASH_MAX_WORKERS];
+
+    ULONGLONG NextChunk;
+    ULONGLONG ChunksDone;
+} HASH_CONTEXT, *PHASH_CONTEXT;
+
+typedef struct _HASH_ALGORITHM_NAME
+{
+    PCWSTR pszName;
+    DIGEST_ALGORITHM Algorithm;
+} HASH_ALGORITHM_NAME;
+
+static const HASH_ALGORITHM_NAME HashAlgorithms[] =
+{
+    {L"XXH3", DigestXxh3},
+    {L"CRC32C", DigestCrc32c},
+    {L"SHA256", DigestSha256}
+};
+
+/* FUNCTIONS ******************************************************************/
+
+static
+NTSTATUS
+NTAPI
+HashWorkerThread(
+    _In_ PVOID Parameter)
+{
+    PHASH_WORKER Worker = Parameter;
+    PHASH_SLOT Slot;
+
+    for (;;)
+    {
+        NtWaitForSingleObject(Worker->WorkEvent, FALSE, NULL);
+
+        Slot = Worker->Slot;
+        if (Slot == NULL)
+            break;
+
+        ComputeDigest(Worker->Manifest->Algorithm,
+                      Slot->Buffer,
+                      Slot->Length,
+                      &Worker->Manifest->Digests[Slot->Chunk * Worker->Manifest->DigestSize]);
+
+        NtSetEvent(Worker->DoneEvent, NULL);
+    }
+
+    RtlExitUserThread(STATUS_SUCCESS);
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+SubmitHashRead(
+    _In_ PHASH_CONTEXT Context,
+    _In_ PHASH_SLOT Slot)
+{
+    NTSTATUS Status;
+
+    if (Context->NextChunk >= Context->Manifest->ChunkCount)
+        return STATUS_SUCCESS;
+
+    Slot->Chunk = Context->NextChunk++;
+    Slot->Length = (ULONG)min((ULONGLONG)Context->Manifest->ChunkSize,
+                              Context->Manifest->Length - (Slot->Chunk * Context->Manifest->ChunkSize));
+
+    Status = QueueReadIoEngine(&Context->Engine,
+                               Context->Offset + (Slot->Chunk * Context->Manifest->ChunkSize),
+                               Slot->Buffer,
+                               Slot->Length);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Slot->ReadMark = GetIoEngineMark(&Context->Engine);
+    Slot->State = HashSlotReading;
+
+    return STATUS_SUCCESS;
+}
+
+
+/* The reads complete in the order they were issued */
+static
+PHASH_SLOT
+GetOldestHashRead(
+    _In_ PHASH_CONTEXT Context)
+{
+    PHASH_SLOT Slot = NULL;
+    ULONG Index;
+
+    for (Index = 0; Index < Context->SlotCount; Index++)
+    {
+        if ((Context->Slots[Index].State == HashSlotReading) &&
+            ((Slot == NULL) || (Context->Slots[Index].Chunk < Slot->Chunk)))
+        {
+            Slot = &Context->Slots[Index];
+        }
+    }
+
+    return Slot;
+}
+
+
+static
+PHASH_WORKER
+GetIdleHashWorker(
+    _In_ PHASH_CONTEXT Context)
+{
+    ULONG Index;
+
+    for (Index = 0; Index < Context->WorkerCount; Index++)
+    {
+        if (Context->Workers[Index].Slot == NULL)
+            return &Context->Workers[Index];
+    }
+
+    return NULL;
+}
+
+
+/*
+ * The reads are queued on the engine from this thread and overlap with each
+ * other, while the workers hash the chunks that have been read. The oldest
+ * read goes to a worker as soon as one is idle, otherwise this thread waits
+ * for a worker to finish its chunk.
+ */
+static
+NTSTATUS
+RunHash(
+    _In_ PHASH_CONTEXT Context)
+{
+    HANDLE WaitHandles[HASH_MAX_WORKERS];
+    PHASH_WORKER WaitWorkers[HASH_MAX_WORKERS];
+    ULONG WaitCount, Index, ulPercent, ulLastPercent = 0;
+    PHASH_SLOT Slot;
+    PHASH_WORKER Worker;
+    NTSTATUS Status, IoStatus = STATUS_SUCCESS;
+
+    for (Index = 0; Index < Context->SlotCount; Index++)
+    {
+        IoStatus = SubmitHashRead(Context, &Context->Slots[Index]);
+        if (!NT_SUCCESS(IoStatus))
+            break;
+    }
+
+    for (;;)
+    {
+        Slot = GetOldestHashRead(Context);
+        Worker = GetIdleHashWorker(Context);
+
+        if (NT_SUCCESS(IoStatus) && (Slot != NULL) && (Worker != NULL))
+        {
+            IoStatus = WaitForIoEngine(&Context->Engine, Slot->ReadMark);
+            if (!NT_SUCCESS(IoStatus))
+            {
+                DPRINT1("Hash read failed (Status 0x%08lx)\n", IoStatus);
+                continue;
+            }
+
+            Slot->State = HashSlotHashing;
+            Worker->Slot = Slot;
+            NtSetEvent(Worker->WorkEvent, NULL);
+            continue;
+        }
+
+        WaitCount = 0;
+        for (Index = 0; Index < Context->WorkerCount; Index++)
+        {
+            if (Context->Workers[Index].Slot != NULL)
+            {
+                WaitHandles[WaitCount] = Context->Workers[Index].DoneEvent;
+                WaitWorkers[WaitCount++] = &Context->Workers[Index];
+            }
+        }
+
+        if (WaitCount == 0)
+            break;
+
+        Status = NtWaitForMultipleObjects(WaitCount,
+                                          WaitHandles,
+                                          WaitAny,
+                                          FALSE,
+                                          NULL);
+        if ((Status < STATUS_WAIT_0) || (Status >= STATUS_WAIT_0 + WaitCount))
+        {
+            DPRINT1("NtWaitForMultipleObjects() failed (Status 0x%08lx)\n", Status);
+            IoStatus = Status;
+
+            /* Never release buffers that are still owned by workers */
+            for (Index = 0; Index < WaitCount; Index++)
+                NtWaitForSingleObject(WaitHandles[Index], FALSE, NULL);
+            break;
+        }
+
+        /* A worker has hashed its chunk */
+        Worker = WaitWorkers[Status - STATUS_WAIT_0];
+        Slot = Worker->Slot;
+        Worker->Slot = NULL;
+        Slot->State = HashSlotFree;
+        Context->ChunksDone++;
+
+        ulPercent = (ULONG)((Context->ChunksDone * 100) / Context->Manifest->ChunkCount);
+        if (ulPercent != ulLastPercent)
+        {
+            ConResPrintf(StdOut, IDS_HASH_PROGRESS, ulPercent);
+            ulLastPercent = ulPercent;
+        }
+
+        if (NT_SUCCESS(IoStatus))
+        {
+            IoStatus = SubmitHashRead(Context, Slot);
+            if (!NT_SUCCESS(IoStatus))
+                DPRINT1("Hash read failed (Status 0x%08lx)\n", IoStatus);
+        }
+    }
+
+    /* Never release buffers that are still owned by pending reads */
+    FlushIoEngine(&Context->Engine);
+
+    return IoStatus;
+}
+
+
+static
+ULONG
+GetHashWorkerCount(VOID)
+{
+    SYSTEM_BASIC_INFORMATION BasicInfo;
+    NTSTATUS Status;
+
+    Status = NtQuerySystemInformation(SystemBasicInformation,
+                                      &BasicInfo,
+                                      sizeof(BasicInfo),
+                                      NULL);
+    if (!NT_SUCCESS(Status) || (BasicInfo.NumberOfProcessors < 1))
+        return 1;
+
+    return min((ULONG)BasicInfo.NumberOfProcessors, HASH_MAX_WORKERS);
+}
+
+
+static
+NTSTATUS
+StartHashWorkers(
+    _In_ PHASH_CONTEXT Context)
+{
+    PHASH_WORKER Worker;
+    NTSTATUS Status;
+    ULONG Index;
+
+    for (Index = 0; Index < Context->WorkerCount; Index++)
+    {
+        Worker = &Context->Workers[Index];
+        Worker->Manifest = Context->Manifest;
+
+        Status = NtCreateEvent(&Worker->WorkEvent,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               SynchronizationEvent,
+                               FALSE);
+        if (NT_SUCCESS(Status))
+        {
+            Status = NtCreateEvent(&Worker->DoneEvent,
+                                   EVENT_ALL_ACCESS,
+                                   NULL,
+                                   SynchronizationEvent,
+                                   FALSE);
+        }
+
+        if (NT_SUCCESS(Status))
+        {
+            Status = RtlCreateUserThread(NtCurrentProcess(),
+                                         NULL,
+                                         FALSE,
+                                         0,
+                                         0,
+                                         0,
+                                         HashWorkerThread,
+                                         Worker,
+                                         &Worker->Thread,
+                                         NULL);
+        }
+
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Starting hash worker %lu failed (Status 0x%08lx)\n", Index, Status);
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+StopHashWorkers(
+    _In_ PHASH_CONTEXT Context)
+{
+    PHASH_WORKER Worker;
+    ULONG Index;
+
+    for (Index = 0; Index < Context->WorkerCount; Index++)
+    {
+        Worker = &Context->Workers[Index];
+
+        if (Worker->Thread != NULL)
+        {
+            Worker->Slot = NULL;
+            NtSetEvent(Worker->WorkEvent, NULL);
+            NtWaitForSingleObject(Worker->Thread, FALSE, NULL);
+            NtClose(Worker->Thread);
+        }
+
+        if (Worker->DoneEvent != NULL)
+            NtClose(Worker->DoneEvent);
+
+        if (Worker->WorkEvent != NULL)
+            NtClose(Worker->WorkEvent);
+    }
+}
+
+
+static
+VOID
+PrintHashResult(
+    _In_ PHASH_CONTEXT Context,
+    _In_ PCWSTR pszAlgorithm,
+    _In_ ULONGLONG ullElapsedMs)
+{
+    UCHAR Digest[MAXIMUM_DIGEST_SIZE];
+    WCHAR szDigest[(MAXIMUM_DIGEST_SIZE * 2) + 1];
+    PDIGEST_MANIFEST Manifest = Context->Manifest;
+    ULONG i;
+
+    /* The digest of the whole range is the digest of the chunk digests */
+    ComputeDigest(Manifest->Algorithm,
+                  Manifest->Digests,
+                  (SIZE_T)(Manifest->ChunkCount * Manifest->DigestSize),
+                  Digest);
+
+    for (i = 0; i < Manifest->DigestSize; i++)
+        StringCchPrintfW(&szDigest[i * 2], 3, L"%02x", Digest[i]);
+
+    if (ullElapsedMs == 0)
+        ullElapsedMs = 1;
+
+    ConResPrintf(StdOut, IDS_HASH_RESULT,
+                 pszAlgorithm,
+                 Manifest->ChunkSize / SIZE_1KB,
+                 Manifest->ChunkCount,
+                 szDigest,
+                 Manifest->Length / (SIZE_1KB * SIZE_1KB),
+                 ullElapsedMs,
+                 ((Manifest->Length / SIZE_1KB) * 1000) / ullElapsedMs / 1024,
+                 Context->WorkerCount);
+}
+
+
+static
+VOID
+HashDiskRange(
+    _In_ ULONGLONG ullOffset,
+    _In_ ULONGLONG ullLength,
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    HASH_CONTEXT Context;
+    PCWSTR pszAlgorithm = HashAlgorithms[0].pszName;
+    DIGEST_ALGORITHM Algorithm = HashAlgorithms[0].Algorithm;
+    ULONG ChunkSize = HASH_DEFAULT_CHUNK_SIZE;
+    PWSTR pszManifest = NULL, pszSuffix = NULL;
+    PUCHAR BufferBase = NULL;
+    LARGE_INTEGER Frequency, StartTime, Now;
+    ULONGLONG ullValue;
+    NTSTATUS Status;
+    ULONG Index;
+    INT i;
+
+    RtlZeroMemory(&Context, sizeof(Context));
+    GetQosSettings(&Context.QosSettings);
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"algo=", &pszSuffix))
+        {
+            /* algo=xxh3|crc32c|sha256 */
+            for (Index = 0; Index < ARRAYSIZE(HashAlgorithms); Index++)
+            {
+                if (_wcsicmp(pszSuffix, HashAlgorithms[Index].pszName) == 0)
+                    break;
+            }
+
+            if (Index == ARRAYSIZE(HashAlgorithms))
+                goto invalid;
+
+            pszAlgorithm = HashAlgorithms[Index].pszName;
+            Algorithm = HashAlgorithms[Index].Algorithm;
+        }
+        else if (HasPrefix(argv[i], L"chunk=", &pszSuffix))
+        {
+            /* chunk=<N> (KB) */
+            if (!IsDecString(pszSuffix))
+                goto invalid;
+
+            /* Checked before the multiplication, which could overflow */
+            ullValue = _wcstoui64(pszSuffix, NULL, 10);
+            if (ullValue > HASH_MAXIMUM_CHUNK_SIZE / SIZE_1KB)
+                goto invalid;
+
+            ullValue *= SIZE_1KB;
+            if ((ullValue < HASH_MINIMUM_CHUNK_SIZE) ||
+                ((ullValue & (ullValue - 1)) != 0))
+            {
+                goto invalid;
+            }
+
+            ChunkSize = (ULONG)ullValue;
+        }
+        else if (HasPrefix(argv[i], L"manifest=", &pszSuffix))
+        {
+            /* manifest=<file> */
+            if (pszManifest != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszManifest);
+
+            pszManifest = DuplicateQuotedString(pszSuffix);
+            if (pszManifest == NULL)
+                goto invalid;
+        }
+        else if (HasPrefix(argv[i], L"qos=", &pszSuffix))
+        {
+            /* qos=<setting>[,<setting>...] */
+            if (!ParseQosSettings(pszSuffix, &Context.QosSettings))
+                goto invalid;
+        }
+        else
+        {
+            goto invalid;
+        }
+    }
+
+    if ((ChunkSize % CurrentDisk->BytesPerSector) != 0)
+        goto invalid;
+
+    Status = CreateDigestManifest(Algorithm, ChunkSize, ullLength, NULL, &Context.Manifest);
+    if (!NT_SUCCESS(Status))
+    {
+        ConResPuts(StdOut, IDS_HASH_FAIL);
+        goto done;
+    }
+
+    Context.Offset = ullOffset;
+    Context.WorkerCount = GetHashWorkerCount();
+
+    /* Enough reads in flight to keep every worker busy, within the buffer budget */
+    Context.SlotCount = min(max(Context.WorkerCount * 2, 4), HASH_MAX_SLOTS);
+    Context.SlotCount = max(min(Context.SlotCount, HASH_BUFFER_BUDGET / ChunkSize), 2);
+
+    BufferBase = AllocateIoBuffer((SIZE_T)ChunkSize * Context.SlotCount);
+    if (BufferBase == NULL)
+    {
+        ConResPuts(StdOut, IDS_HASH_FAIL);
+        goto done;
+    }
+
+    for (Index = 0; Index < Context.SlotCount; Index++)
+        Context.Slots[Index].Buffer = BufferBase + ((SIZE_T)Index * ChunkSize);
+
+    Status = OpenDiskIoEngine(&Context.Engine, CurrentDisk);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("OpenDiskIoEngine() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_HASH_FAIL);
+        goto done;
+    }
+
+    InitializeQosBucket(&Context.Qos, &Context.QosSettings, NULL);
+    AddQosDevice(&Context.Qos, Context.Engine.FileHandle);
+    Context.Engine.Qos = &Context.Qos;
+
+    Status = StartHashWorkers(&Context);
+    if (NT_SUCCESS(Status))
+    {
+        NtQueryPerformanceCounter(&StartTime, &Frequency);
+        Status = RunHash(&Context);
+        NtQueryPerformanceCounter(&Now, NULL);
+    }
+
+    StopHashWorkers(&Context);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Hash failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_HASH_FAIL);
+        goto done;
+    }
+
+    PrintHashResult(&Context,
+                    pszAlgorithm,
+                    ((ULONGLONG)(Now.QuadPart - StartTime.QuadPart) * 1000) / Frequency.QuadPart);
+
+    if ((pszManifest != NULL) &&
+        !NT_SUCCESS(SaveDigestManifest(pszManifest, Context.Manifest)))
+    {
+        ConResPuts(StdOut, IDS_HASH_MANIFEST_FAIL);
+    }
+
+    goto done;
+
+invalid:
+    ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+
+done:
+    CloseIoEngine(&Context.Engine);
+    FreeIoBuffer(BufferBase);
+
+    if (Context.Manifest != NULL)
+        DestroyDigestManifest(Context.Manifest);
+
+    if (pszManifest != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszManifest);
+}
+
+
+EXIT_CODE
+HashDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    DPRINT("HashDisk()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    HashDiskRange(0,
+                  CurrentDisk->SectorCount.QuadPart * CurrentDisk->BytesPerSector,
+                  argc,
+                  argv);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+HashPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    DPRINT("HashPartition()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    if (CurrentPartition == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+        return EXIT_SUCCESS;
+    }
+
+    if ((CurrentPartition->PartitionNumber == 0) ||
+        ((CurrentDisk->PartitionStyle == PARTITION_STYLE_MBR) &&
+         IsContainerPartition(CurrentPartition->Mbr.PartitionType)))
+    {
+        ConResPuts(StdOut, IDS_HASH_PARTITION_TYPE);
+        return EXIT_SUCCESS;
+    }
+
+    HashDiskRange(CurrentPartition->StartSector.QuadPart * CurrentDisk->BytesPerSector,
+                  CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector,
+                  argc,
+                  argv);
+
+    return EXIT_SUCCESS;
+}
@@ -17,12 +17,30 @@ COMMAND cmds[] =
 //    {L"ADD",         NULL,         NULL,        add_main,                IDS_HELP_ADD,                       MSG_COMMAND_ADD},
     {L"ASSIGN",      NULL,         NULL,        assign_main,             IDS_HELP_ASSIGN,                    MSG_COMMAND_ASSIGN},
 //    {L"ATTACH",      NULL,         NULL,        attach_main,             IDS_HELP_ATTACH,                    MSG_COMMAND_ATTACH},
-//    {L"ATTRIBUTES",  NULL,         NULL,        attributes_main,         IDS_HELP_ATTRIBUTES,                MSG_COMMAND_ATTRIBUTES},
+
+    {L"ATTRIBUTES",  NULL,         NULL,        NULL,                    IDS_HELP_ATTRIBUTES,                MSG_NONE},
+    {L"ATTRIBUTES",  L"DISK",      NULL,        AttributesDisk,          IDS_HELP_ATTRIBUTES_DISK,           MSG_COMMAND_ATTRIBUTES_DISK},
+
     {L"AUTOMOUNT",   NULL,         NULL,        automount_main,          IDS_HELP_AUTOMOUNT,                 MSG_COMMAND_AUTOMOUNT},
+
+    {L"BENCH",       NULL,         NULL,        NULL,                    IDS_HELP_BENCH,                     MSG_NONE},
+    {L"BENCH",       L"DISK",      NULL,        BenchDisk,               IDS_HELP_BENCH_DISK,                MSG_COMMAND_BENCH_DISK},
+    {L"BENCH",       L"PARTITION", NULL,        BenchPartition,          IDS_HELP_BENCH_PARTITION,           MSG_COMMAND_BENCH_PARTITION},
+
 //    {L"BREAK",       NULL,         NULL,        break_main,              IDS_HELP_BREAK,                     MSG_COMMAND_BREAK},
+    {L"CANCEL",      NULL,         NULL,        cancel_main,             IDS_HELP_CANCEL,                    MSG_COMMAND_CANCEL},
     {L"CLEAN",       NULL,         NULL,        clean_main,              IDS_HELP_CLEAN,                     MSG_COMMAND_CLEAN},
+
+    {L"CLONE",       NULL,         NULL,        NULL,                    IDS_HELP_CLONE,                     MSG_NONE},
+    {L"CLONE",       L"DISK",      NULL,        CloneDisk,               IDS_HELP_CLONE_DISK,                MSG_COMMAND_CLONE_DISK},
+    {L"CLONE",       L"PARTITION", NULL,        ClonePartition,          IDS_HELP_CLONE_PARTITION,           MSG_COMMAND_CLONE_PARTITION},
+
 //    {L"COMPACT",     NULL,         NULL,        compact_main,            IDS_HELP_COMPACT,                   MSG_COMMAND_COMPACT},
 
+    {L"COMPARE",     NULL,         NULL,        NULL,                    IDS_HELP_COMPARE,                   MSG_NONE},
+    {L"COMPARE",     L"DISK",      NULL,        CompareDisk,             IDS_HELP_COMPARE_DISK,              MSG_COMMAND_COMPARE_DISK},
+    {L"COMPARE",     L"PARTITION", NULL,        ComparePartition,        IDS_HELP_COMPARE_PARTITION,         MSG_COMMAND_COMPARE_PARTITION},
+
     {L"CONVERT",     NULL,         NULL,        NULL,                    IDS_HELP_CONVERT,                   MSG_NONE},
     {L"CONVERT",     L"GPT",       NULL,        ConvertGPT,              IDS_HELP_CONVERT_GPT,               MSG_COMMAND_CONVERT_GPT},
     {L"CONVERT",     L"MBR",       NULL,        ConvertMBR,              IDS_HELP_CONVERT_MBR,               MSG_COMMAND_CONVERT_MBR},
@@ -42,6 +60,8 @@ COMMAND cmds[] =
     {L"DELETE",      L"PARTITION", NULL,        DeletePartition,         IDS_HELP_DELETE_PARTITION,          MSG_COMMAND_DELETE_PARTITION},
 //    {L"DELETE",      L"VOLUME",    NULL,        DeleteVolume,            IDS_HELP_DELETE_VOLUME,             MSG_COMMAND_DELETE_VOLUME},
 
+    {L"DEPLOY",      NULL,         NULL,        deploy_main,             IDS_HELP_DEPLOY,                    MSG_COMMAND_DEPLOY},
+
 //    {L"DETACH",      NULL,         NULL,        detach_main,             IDS_HELP_DETACH,                    MSG_COMMAND_DETACH},
 
     {L"DETAIL",      NULL,         NULL,        NULL,                    IDS_HELP_DETAIL,                    MSG_NONE},
@@ -50,19 +70,35 @@ COMMAND cmds[] =
     {L"DETAIL",      L"VOLUME",    NULL,        DetailVolume,            IDS_HELP_DETAIL_VOLUME,             MSG_COMMAND_DETAIL_VOLUME},
 
     {L"DUMP",        NULL,         NULL,        NULL,                    IDS_NONE,                           MSG_NONE},
+    {L"DUMP",        L"ARCHIVE",   NULL,        DumpArchive,             IDS_NONE,                           MSG_NONE},
     {L"DUMP",        L"DISK",      NULL,        DumpDisk,                IDS_NONE,                           MSG_NONE},
     {L"DUMP",        L"PARTITION", NULL,        DumpPartition,           IDS_NONE,                           MSG_NONE},
     {L"EXIT",        NULL,         NULL,        NULL,                    IDS_HELP_EXIT,                      MSG_COMMAND_EXIT},
 
 //    {L"EXPAND",      NULL,         NULL,        expand_main,             IDS_HELP_EXPAND,                    MSG_COMMAND_EXPAND},
+
+    {L"EXPORT",      NULL,         NULL,        NULL,                    IDS_HELP_EXPORT,                    MSG_NONE},
+    {L"EXPORT",      L"PARTITION", NULL,        ExportPartition,         IDS_HELP_EXPORT_PARTITION,          MSG_COMMAND_EXPORT_PARTITION},
+
 //    {L"EXTEND",      NULL,         NULL,        extend_main,             IDS_HELP_EXTEND,                    MSG_COMMAND_EXTEND},
     {L"FILESYSTEMS", NULL,         NULL,        filesystems_main,        IDS_HELP_FILESYSTEMS,               MSG_COMMAND_FILESYSTEMS},
+    {L"FOREACH",     NULL,         NULL,        NULL,                    IDS_HELP_FOREACH,                   MSG_COMMAND_FOREACH},
     {L"FORMAT",      NULL,         NULL,        format_main,             IDS_HELP_FORMAT,                    MSG_COMMAND_FORMAT},
     {L"GPT",         NULL,         NULL,        gpt_main,                IDS_HELP_GPT,                       MSG_COMMAND_GPT},
+
+    {L"HASH",        NULL,         NULL,        NULL,                    IDS_HELP_HASH,                      MSG_NONE},
+    {L"HASH",        L"DISK",      NULL,        HashDisk,                IDS_HELP_HASH_DISK,                 MSG_COMMAND_HASH_DISK},
+    {L"HASH",        L"PARTITION", NULL,        HashPartition,           IDS_HELP_HASH_PARTITION,            MSG_COMMAND_HASH_PARTITION},
+
     {L"HELP",        NULL,         NULL,        help_main,               IDS_HELP_HELP,                      MSG_COMMAND_HELP},
-//    {L"IMPORT",      NULL,         NULL,        import_main,             IDS_HELP_IMPORT,                    MSG_COMMAND_IMPORT},
+
+    {L"IMPORT",      NULL,         NULL,        NULL,                    IDS_HELP_IMPORT,                    MSG_NONE},
+    {L"IMPORT",      L"PARTITION", NULL,        ImportPartition,         IDS_HELP_IMPORT_PARTITION,          MSG_COMMAND_IMPORT_PARTITION},
+
     {L"INACTIVE",    NULL,         NULL,        inactive_main,           IDS_HELP_INACTIVE,                  MSG_COMMAND_INACTIVE},
 
+    {L"JOBS",        NULL,         NULL,        jobs_main,               IDS_HELP_JOBS,                      MSG_COMMAND_JOBS},
+
     {L"LIST",        NULL,         NULL,        NULL,                    IDS_HELP_LIST,                      MSG_NONE},
     {L"LIST",        L"DISK",      NULL,        ListDisk,                IDS_HELP_LIST_DISK,                 MSG_COMMAND_LIST_DISK},
     {L"LIST",        L"PARTITION", NULL,        ListPartition,           IDS_HELP_LIST_PARTITION,            MSG_COMMAND_LIST_PARTITION},
@@ -70,13 +106,28 @@ COMMAND cmds[] =
 //    {L"LIST",        L"VDISK",     NULL,        ListVirtualDisk,         IDS_HELP_LIST_VDISK,                MSG_COMMAND_LIST_VDISK},
 
 //    {L"MERGE",       NULL,         NULL,        merge_main,              IDS_HELP_MERGE,                     MSG_COMMAND_MERGE},
+
+    {L"MONITOR",     NULL,         NULL,        NULL,                    IDS_HELP_MONITOR,                   MSG_NONE},
+    {L"MONITOR",     L"DISK",      NULL,        MonitorDisk,             IDS_HELP_MONITOR_DISK,              MSG_COMMAND_MONITOR_DISK},
+
+    {L"MOVE",        NULL,         NULL,        NULL,                    IDS_HELP_MOVE,                      MSG_NONE},
+    {L"MOVE",        L"PARTITION", NULL,        MovePartition,           IDS_HELP_MOVE_PARTITION,            MSG_COMMAND_MOVE_PARTITION},
+
 //    {L"OFFLINE",     NULL,         NULL,        offline_main,            IDS_HELP_OFFLINE,                   MSG_COMMAND_OFFLINE},
 //    {L"ONLINE",      NULL,         NULL,        online_main,             IDS_HELP_ONLINE,                    MSG_COMMAND_ONLINE},
+
+    {L"REALIGN",     NULL,         NULL,        NULL,                    IDS_HELP_REALIGN,                   MSG_NONE},
+    {L"REALIGN",     L"PARTITION", NULL,        RealignPartition,        IDS_HELP_REALIGN_PARTITION,         MSG_COMMAND_REALIGN_PARTITION},
+
 //    {L"RECOVER",     NULL,         NULL,        recover_main,            IDS_HELP_RECOVER,                   MSG_COMMAND_RECOVER},
     {L"REM",         NULL,         NULL,        NULL,                    IDS_HELP_REM,                       MSG_COMMAND_REM},
     {L"REMOVE",      NULL,         NULL,        remove_main,             IDS_HELP_REMOVE,                    MSG_COMMAND_REMOVE},
 //    {L"REPAIR",      NULL,         NULL,        repair_main,             IDS_HELP_REPAIR,                    MSG_COMMAND_REPAIR},
     {L"RESCAN",      NULL,         NULL,        rescan_main,             IDS_HELP_RESCAN,                    MSG_COMMAND_RESCAN},
+
+    {L"RESTORE",     NULL,         NULL,        NULL,                    IDS_HELP_RESTORE,                   MSG_NONE},
+    {L"RESTORE",     L"PARTITION", NULL,        RestorePartition,        IDS_HELP_RESTORE_PARTITION,         MSG_COMMAND_RESTORE_PARTITION},
+
 //    {L"RETAIN",      NULL,         NULL,        retain_main,             IDS_HELP_RETAIN,                    MSG_COMMAND_RETAIN},
 //    {L"SAN",         NULL,         NULL,        san_main,                IDS_HELP_SAN,                       MSG_COMMAND_SAN},
 
@@ -87,18 +138,45 @@ COMMAND cmds[] =
 //    {L"SELECT",      L"VDISK",     NULL,        SelectVirtualDisk,       IDS_HELP_SELECT_VDISK,              MSG_COMMAND_SELECT_VDISK},
 
     {L"SET",         NULL,         NULL,        setid_main,              IDS_HELP_SETID,                     MSG_COMMAND_SETID},
+    {L"SET",         L"QOS",       NULL,        SetQos,                  IDS_HELP_SET_QOS,                   MSG_COMMAND_SET_QOS},
+    {L"SET",         L"IO",        NULL,        SetIo,                   IDS_HELP_SET_IO,                    MSG_COMMAND_SET_IO},
     {L"SETID",       NULL,         NULL,        setid_main,              IDS_HELP_SETID,                     MSG_COMMAND_SETID},
 //    {L"SHRINK",      NULL,         NULL,        shrink_main,             IDS_HELP_SHRINK,                    MSG_COMMAND_SHRINK},
 
     {L"UNIQUEID",    NULL,         NULL,        NULL,                    IDS_HELP_UNIQUEID,                  MSG_NONE},
     {L"UNIQUEID",    L"DISK",      NULL,        UniqueIdDisk,            IDS_HELP_UNIQUEID_DISK,             MSG_COMMAND_UNIQUEID_DISK},
 
+    {L"WAIT",        NULL,         NULL,        wait_main,               IDS_HELP_WAIT,                      MSG_COMMAND_WAIT},
+
     {NULL,           NULL,         NULL,        NULL,                    IDS_NONE,                           MSG_NONE}
 };
 
+/* Commands that do not change a disk, and may run while a job works on it */
+static PCWSTR JobSafeCmds[] =
+{
+    L"CANCEL", L"DETAIL", L"HELP", L"JOBS", L"LIST", L"SELECT", L"WAIT", NULL
+};
+
 
 /* FUNCTIONS *****************************************************************/
 
+static
+BOOL
+IsJobSafeCommand(
+    _In_ PCOMMAND cmdptr)
+{
+    INT i;
+
+    for (i = 0; JobSafeCmds[i] != NULL; i++)
+    {
+        if (_wcsicmp(cmdptr->cmd1, JobSafeCmds[i]) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+
 /*
  * InterpretCmd(char *cmd_line, char *arg_line):
  * compares the command name to a list of available commands, and
@@ -148,40 +226,40 @@ InterpretCmd(
     }
 
     if (cmdptr3 != NULL)
-    {
-        if (cmdptr3->func == NULL)
-            return HelpCommand(cmdptr3);
-        else
-            return cmdptr3->func(argc, argv);
-    }
+        cmdptr = cmdptr3;
     else if (cmdptr2 != NULL)
-    {
-        if (cmdptr2->func == NULL)
-            return HelpCommand(cmdptr2);
-        else
-            return cmdptr2->func(argc, argv);
-    }
+        cmdptr = cmdptr2;
     else if (cmdptr1 != NULL)
+        cmdptr = cmdptr1;
+    else
     {
-        if (cmdptr1->func == NULL)
-            return HelpCommand(cmdptr1);
-        else
-            return cmdptr1->func(argc, argv);
+        HelpCommandList();
+        return EXIT_SUCCESS;
     }
 
-    HelpCommandList();
+    if (cmdptr->func == NULL)
+        return HelpCommand(cmdptr);
+
+    /* Jobs that finished in the background report before the next command */
+    ReapJobs();
+
+    if (!IsJobSafeCommand(cmdptr))
+        WaitForSelectedDisk();
 
-    return EXIT_SUCCESS;
+    return cmdptr->func(argc, argv);
 }
 
 
 /*
  * InterpretScript(char *line):
  * The main function used for when reading commands from scripts.
+ * A FOREACH command reads its block from the stream; without a stream
+ * it only shows its help.
  */
 EXIT_CODE
 InterpretScript(
-    _In_ PWSTR input_line)
+    _In_ PWSTR input_line,
+    _In_opt_ FILE *Stream)
 {
     PWSTR args_vector[MAX_ARGS_COUNT];
     INT args_count = 0;
@@ -217,6 +295,9 @@ InterpretScript(
         ptr++;
     }
 
+    if ((Stream != NULL) && (args_count > 0) && (_wcsicmp(args_vector[0], L"foreach") == 0))
+        return ForEachDisk(args_count, args_vector, Stream);
+
     /* sends the string to find the command */
     return InterpretCmd(args_count, args_vector);
 }
@@ -275,6 +356,9 @@ InterpretMain(VOID)
         }
 
         /* Send the string to find the command */
-        ExitCode = InterpretCmd(args_count, args_vector);
+        if ((args_count > 0) && (_wcsicmp(args_vector[0], L"foreach") == 0))
+            ExitCode = ForEachDisk(args_count, args_vector, stdin);
+        else
+            ExitCode = InterpretCmd(args_count, args_vector);
     }
 }
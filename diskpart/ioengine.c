@@ -0,0 +1,703 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/ioengine.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define IO_DEFAULT_QUEUE_DEPTH  16
+#define IO_MAX_QUEUE_DEPTH      256
+
+/* Engine and queue depth of the commands that do their I/O through an engine */
+static IO_ENGINE_TYPE IoEngineType = IoEngineBuffered;
+static ULONG IoQueueDepth = IO_DEFAULT_QUEUE_DEPTH;
+
+static PCWSTR IoEngineNames[] =
+{
+    L"BUFFERED", L"DIRECT", L"ASYNC", L"MAPPED"
+};
+
+/* FUNCTIONS ******************************************************************/
+
+/*
+ * Buffers of unbuffered requests must be aligned to the sector size. Fresh
+ * pages are page aligned and zeroed, so they suit every engine.
+ */
+PVOID
+AllocateIoBuffer(
+    _In_ SIZE_T Length)
+{
+    PVOID Buffer = NULL;
+
+    if (!NT_SUCCESS(NtAllocateVirtualMemory(NtCurrentProcess(),
+                                            &Buffer,
+                                            0,
+                                            &Length,
+                                            MEM_RESERVE | MEM_COMMIT,
+                                            PAGE_READWRITE)))
+    {
+        DPRINT1("Failed to allocate an I/O buffer!\n");
+        return NULL;
+    }
+
+    return Buffer;
+}
+
+
+VOID
+FreeIoBuffer(
+    _In_opt_ PVOID Buffer)
+{
+    SIZE_T Length = 0;
+
+    if (Buffer != NULL)
+        NtFreeVirtualMemory(NtCurrentProcess(), &Buffer, &Length, MEM_RELEASE);
+}
+
+
+/*
+ * Maps the whole file into memory, so its requests are plain copies that go
+ * through the page cache of the section. Devices have no section and stay
+ * with buffered requests.
+ */
+static
+NTSTATUS
+MapIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ BOOL bWrite)
+{
+    FILE_STANDARD_INFORMATION StandardInfo;
+    IO_STATUS_BLOCK Iosb;
+    ULONG Protect = bWrite ? PAGE_READWRITE : PAGE_READONLY;
+    NTSTATUS Status;
+
+    Status = NtQueryInformationFile(Engine->FileHandle,
+                                    &Iosb,
+                                    &StandardInfo,
+                                    sizeof(StandardInfo),
+                                    FileStandardInformation);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if (StandardInfo.EndOfFile.QuadPart == 0)
+        return STATUS_MAPPED_FILE_SIZE_ZERO;
+
+    Status = NtCreateSection(&Engine->SectionHandle,
+                             SECTION_MAP_READ | (bWrite ? SECTION_MAP_WRITE : 0),
+                             NULL,
+                             NULL,
+                             Protect,
+                             SEC_COMMIT,
+                             Engine->FileHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        Engine->SectionHandle = NULL;
+        return Status;
+    }
+
+    Status = NtMapViewOfSection(Engine->SectionHandle,
+                                NtCurrentProcess(),
+                                (PVOID *)&Engine->View,
+                                0,
+                                0,
+                                NULL,
+                                &Engine->ViewSize,
+                                ViewUnmap,
+                                0,
+                                Protect);
+    if (!NT_SUCCESS(Status))
+    {
+        NtClose(Engine->SectionHandle);
+        Engine->SectionHandle = NULL;
+        Engine->View = NULL;
+        return Status;
+    }
+
+    /* The view is rounded up to whole pages */
+    Engine->ViewSize = (SIZE_T)StandardInfo.EndOfFile.QuadPart;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Unbuffered reads must cover whole sectors, even at the end of an image
+ * file. Raw devices may not report a sector size, but their callers read
+ * whole sectors anyway.
+ */
+static
+ULONG
+GetIoAlignment(
+    _In_ HANDLE FileHandle)
+{
+    FILE_FS_SIZE_INFORMATION SizeInfo;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Status = NtQueryVolumeInformationFile(FileHandle,
+                                          &Iosb,
+                                          &SizeInfo,
+                                          sizeof(SizeInfo),
+                                          FileFsSizeInformation);
+    if (!NT_SUCCESS(Status))
+        return 0;
+
+    return SizeInfo.BytesPerSector;
+}
+
+
+static
+NTSTATUS
+CreateIoRequests(
+    _Inout_ PIO_ENGINE Engine)
+{
+    NTSTATUS Status;
+    ULONG i;
+
+    Engine->Requests = RtlAllocateHeap(RtlGetProcessHeap(),
+                                       HEAP_ZERO_MEMORY,
+                                       Engine->QueueDepth * sizeof(IO_REQUEST));
+    if (Engine->Requests == NULL)
+        return STATUS_NO_MEMORY;
+
+    for (i = 0; i < Engine->QueueDepth; i++)
+    {
+        Status = NtCreateEvent(&Engine->Requests[i].Event,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               NotificationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("NtCreateEvent() failed (Status 0x%08lx)\n", Status);
+            return Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Opens a disk, a partition or an image file with the engine that is set
+ * with SET IO. The engine is closed with CloseIoEngine even if opening it
+ * failed.
+ */
+NTSTATUS
+OpenIoEngine(
+    _Out_ PIO_ENGINE Engine,
+    _In_ PUNICODE_STRING Name,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG ShareAccess)
+{
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    ULONG OpenOptions;
+    NTSTATUS Status;
+
+    RtlZeroMemory(Engine, sizeof(IO_ENGINE));
+    Engine->Type = IoEngineType;
+    Engine->QueueDepth = (IoEngineType == IoEngineAsync) ? IoQueueDepth : 1;
+    Engine->bWrite = (DesiredAccess & (FILE_WRITE_DATA | GENERIC_WRITE)) != 0;
+
+    switch (Engine->Type)
+    {
+        case IoEngineDirect:
+            OpenOptions = FILE_SYNCHRONOUS_IO_NONALERT | FILE_NO_INTERMEDIATE_BUFFERING;
+            DesiredAccess |= SYNCHRONIZE;
+            break;
+
+        case IoEngineAsync:
+            /* No FILE_SYNCHRONOUS_IO_* option: the requests are overlapped */
+            OpenOptions = FILE_NO_INTERMEDIATE_BUFFERING;
+            break;
+
+        default:
+            OpenOptions = FILE_SYNCHRONOUS_IO_NONALERT;
+            DesiredAccess |= SYNCHRONIZE;
+            break;
+    }
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    Status = NtOpenFile(&Engine->FileHandle,
+                        DesiredAccess,
+                        &ObjectAttributes,
+                        &Iosb,
+                        ShareAccess,
+                        OpenOptions);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+        Engine->FileHandle = NULL;
+        return Status;
+    }
+
+    if (Engine->Type == IoEngineMapped)
+    {
+        Status = MapIoEngine(Engine, Engine->bWrite);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT("Not mapped, using buffered requests (Status 0x%08lx)\n", Status);
+            Engine->Type = IoEngineBuffered;
+        }
+    }
+
+    if ((Engine->Type == IoEngineDirect) || (Engine->Type == IoEngineAsync))
+        Engine->Alignment = GetIoAlignment(Engine->FileHandle);
+
+    if (Engine->Type == IoEngineAsync)
+        return CreateIoRequests(Engine);
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Opens a whole disk for reading. A synchronous engine uses the handle from
+ * the disk handle cache, so a script that reads many sectors opens the disk
+ * once.
+ */
+NTSTATUS
+OpenDiskIoEngine(
+    _Out_ PIO_ENGINE Engine,
+    _In_ PDISKENTRY DiskEntry)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    NTSTATUS Status;
+
+    /* Devices cannot be mapped */
+    if ((IoEngineType != IoEngineBuffered) && (IoEngineType != IoEngineMapped))
+    {
+        StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                         L"\\Device\\Harddisk%lu\\Partition0",
+                         DiskEntry->DiskNumber);
+        RtlInitUnicodeString(&Name, szBuffer);
+
+        /* The cached handles may be open for writing */
+        return OpenIoEngine(Engine,
+                            &Name,
+                            FILE_READ_DATA | FILE_READ_ATTRIBUTES,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE);
+    }
+
+    RtlZeroMemory(Engine, sizeof(IO_ENGINE));
+    Engine->Type = IoEngineBuffered;
+    Engine->QueueDepth = 1;
+
+    Status = GetDiskHandle(DiskEntry, FALSE, &Engine->FileHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        Engine->FileHandle = NULL;
+        return Status;
+    }
+
+    Engine->bCachedHandle = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+WaitForIoRequest(
+    _Inout_ PIO_ENGINE Engine,
+    _Inout_ PIO_REQUEST Request)
+{
+    NTSTATUS Status;
+
+    if (!Request->bPending)
+        return STATUS_SUCCESS;
+
+    NtWaitForSingleObject(Request->Event, FALSE, NULL);
+    Request->bPending = FALSE;
+
+    Status = Request->Iosb.Status;
+    if (NT_SUCCESS(Status) && (Request->Iosb.Information < Request->Length))
+        Status = STATUS_END_OF_FILE;
+
+    if (!NT_SUCCESS(Status) && NT_SUCCESS(Engine->Status))
+    {
+        DPRINT1("I/O request failed (Status 0x%08lx)\n", Status);
+        Engine->Status = Status;
+    }
+
+    return Status;
+}
+
+
+/*
+ * Requests are issued in a ring, so the next one reuses the slot of the
+ * oldest request once the queue is full.
+ */
+static
+PIO_REQUEST
+GetIoRequest(
+    _Inout_ PIO_ENGINE Engine)
+{
+    PIO_REQUEST Request;
+
+    Request = &Engine->Requests[Engine->NextRequest];
+    Engine->NextRequest = (Engine->NextRequest + 1) % Engine->QueueDepth;
+
+    WaitForIoRequest(Engine, Request);
+
+    return Request;
+}
+
+
+static
+NTSTATUS
+TransferIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ BOOL bWrite,
+    _In_ ULONGLONG ullOffset,
+    _In_ PVOID Buffer,
+    _In_ ULONG ulLength,
+    _Out_opt_ PIO_REQUEST *ppRequest)
+{
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER FileOffset;
+    PIO_REQUEST Request;
+    ULONG ulTransfer = ulLength;
+    NTSTATUS Status;
+
+    if (!NT_SUCCESS(Engine->Status))
+        return Engine->Status;
+
+    if (Engine->Qos != NULL)
+    {
+        Status = ThrottleQosRequest(Engine->Qos, ulLength);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    if (Engine->Type == IoEngineMapped)
+    {
+        if ((ullOffset > Engine->ViewSize) || (ulLength > Engine->ViewSize - ullOffset))
+            return STATUS_END_OF_FILE;
+
+        if (bWrite)
+            RtlCopyMemory(&Engine->View[ullOffset], Buffer, ulLength);
+        else
+            RtlCopyMemory(Buffer, &Engine->View[ullOffset], ulLength);
+
+        return STATUS_SUCCESS;
+    }
+
+    FileOffset.QuadPart = ullOffset;
+
+    /* The tail of an image file is read as a whole sector */
+    if (!bWrite && (Engine->Alignment != 0))
+        ulTransfer = (ulLength + Engine->Alignment - 1) & ~(Engine->Alignment - 1);
+
+    if (Engine->Type != IoEngineAsync)
+    {
+        if (bWrite)
+            Status = NtWriteFile(Engine->FileHandle, NULL, NULL, NULL, &Iosb,
+                                 Buffer, ulLength, &FileOffset, NULL);
+        else
+            Status = NtReadFile(Engine->FileHandle, NULL, NULL, NULL, &Iosb,
+                                Buffer, ulTransfer, &FileOffset, NULL);
+
+        if (NT_SUCCESS(Status) && (Iosb.Information < ulLength))
+            Status = STATUS_END_OF_FILE;
+
+        return Status;
+    }
+
+    Request = GetIoRequest(Engine);
+    if (!NT_SUCCESS(Engine->Status))
+        return Engine->Status;
+
+    Request->Length = ulLength;
+    Request->Sequence = Engine->Submitted++;
+
+    if (bWrite)
+        Status = NtWriteFile(Engine->FileHandle, Request->Event, NULL, NULL, &Request->Iosb,
+                             Buffer, ulLength, &FileOffset, NULL);
+    else
+        Status = NtReadFile(Engine->FileHandle, Request->Event, NULL, NULL, &Request->Iosb,
+                            Buffer, ulTransfer, &FileOffset, NULL);
+
+    if ((Status != STATUS_PENDING) && !NT_SUCCESS(Status))
+    {
+        DPRINT1("I/O request failed (Status 0x%08lx)\n", Status);
+        Engine->Status = Status;
+        return Status;
+    }
+
+    /* The event is signaled even if the request completed at once */
+    Request->bPending = TRUE;
+
+    if (ppRequest != NULL)
+        *ppRequest = Request;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Reads always complete before returning, as the caller needs the data.
+ * Queued writes may still be in flight. The buffer must have room for the
+ * read rounded up to the sector size.
+ */
+NTSTATUS
+ReadIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullOffset,
+    _Out_writes_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength)
+{
+    PIO_REQUEST Request = NULL;
+    NTSTATUS Status;
+
+    Status = TransferIoEngine(Engine, FALSE, ullOffset, Buffer, ulLength, &Request);
+    if (NT_SUCCESS(Status) && (Request != NULL))
+        Status = WaitForIoRequest(Engine, Request);
+
+    return Status;
+}
+
+
+/*
+ * An asynchronous engine queues the read and returns at once, so several
+ * reads can be in flight. The data is there once WaitForIoEngine has passed
+ * a mark taken after the call. The other engines read at once.
+ */
+NTSTATUS
+QueueReadIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullOffset,
+    _Out_writes_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength)
+{
+    return TransferIoEngine(Engine, FALSE, ullOffset, Buffer, ulLength, NULL);
+}
+
+
+/*
+ * An asynchronous engine queues the write and returns at once, so the
+ * buffer must stay untouched until FlushIoEngine has returned. A failed
+ * write is reported by a later call.
+ */
+NTSTATUS
+WriteIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullOffset,
+    _In_reads_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength)
+{
+    return TransferIoEngine(Engine, TRUE, ullOffset, Buffer, ulLength, NULL);
+}
+
+
+/* Marks the requests issued so far, see WaitForIoEngine */
+ULONGLONG
+GetIoEngineMark(
+    _In_ PIO_ENGINE Engine)
+{
+    return Engine->Submitted;
+}
+
+
+/*
+ * Waits for the requests that were issued before the mark was taken, so
+ * their buffers can be used again. Later requests may still be in flight.
+ */
+NTSTATUS
+WaitForIoEngine(
+    _Inout_ PIO_ENGINE Engine,
+    _In_ ULONGLONG ullMark)
+{
+    ULONG i;
+
+    if (Engine->Requests != NULL)
+    {
+        for (i = 0; i < Engine->QueueDepth; i++)
+        {
+            if (Engine->Requests[i].Sequence < ullMark)
+                WaitForIoRequest(Engine, &Engine->Requests[i]);
+        }
+    }
+
+    return Engine->Status;
+}
+
+
+/*
+ * Waits for the queued requests and brings the written data to the media:
+ * the dirty pages of a mapped file, or the cache of the device.
+ */
+NTSTATUS
+FlushIoEngine(
+    _Inout_ PIO_ENGINE Engine)
+{
+    IO_STATUS_BLOCK Iosb;
+    PVOID BaseAddress;
+    SIZE_T Length;
+    NTSTATUS Status;
+    ULONG i;
+
+    if (Engine->Requests != NULL)
+    {
+        for (i = 0; i < Engine->QueueDepth; i++)
+            WaitForIoRequest(Engine, &Engine->Requests[i]);
+    }
+
+    if (!NT_SUCCESS(Engine->Status))
+        return Engine->Status;
+
+    if (Engine->View != NULL)
+    {
+        BaseAddress = Engine->View;
+        Length = Engine->ViewSize;
+        Status = NtFlushVirtualMemory(NtCurrentProcess(), &BaseAddress, &Length, &Iosb);
+        if (!NT_SUCCESS(Status))
+            Engine->Status = Status;
+    }
+    else if (Engine->bWrite && (Engine->FileHandle != NULL))
+    {
+        Status = NtFlushBuffersFile(Engine->FileHandle, &Iosb);
+        if (Status == STATUS_PENDING)
+        {
+            NtWaitForSingleObject(Engine->FileHandle, FALSE, NULL);
+            Status = Iosb.Status;
+        }
+
+        /* Devices without a write cache may refuse the flush */
+        if (!NT_SUCCESS(Status) &&
+            (Status != STATUS_INVALID_DEVICE_REQUEST) &&
+            (Status != STATUS_NOT_SUPPORTED))
+        {
+            DPRINT1("NtFlushBuffersFile() failed (Status 0x%08lx)\n", Status);
+            Engine->Status = Status;
+        }
+    }
+
+    return Engine->Status;
+}
+
+
+VOID
+CloseIoEngine(
+    _Inout_ PIO_ENGINE Engine)
+{
+    ULONG i;
+
+    /* Never close the handle under pending requests */
+    FlushIoEngine(Engine);
+
+    if (Engine->Requests != NULL)
+    {
+        for (i = 0; i < Engine->QueueDepth; i++)
+        {
+            if (Engine->Requests[i].Event != NULL)
+                NtClose(Engine->Requests[i].Event);
+        }
+
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Engine->Requests);
+        Engine->Requests = NULL;
+    }
+
+    if (Engine->View != NULL)
+    {
+        NtUnmapViewOfSection(NtCurrentProcess(), Engine->View);
+        Engine->View = NULL;
+    }
+
+    if (Engine->SectionHandle != NULL)
+    {
+        NtClose(Engine->SectionHandle);
+        Engine->SectionHandle = NULL;
+    }
+
+    if ((Engine->FileHandle != NULL) && !Engine->bCachedHandle)
+    {
+        NtClose(Engine->FileHandle);
+        Engine->FileHandle = NULL;
+    }
+}
+
+
+EXIT_CODE
+SetIo(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    IO_ENGINE_TYPE Type = IoEngineType;
+    ULONG ulQueueDepth = IoQueueDepth;
+    PWSTR pszSuffix = NULL;
+    ULONG j;
+    INT i;
+
+    DPRINT("SetIo()\n");
+
+    if (argc == 2)
+    {
+        ConPuts(StdOut, L"\n");
+        ConResPrintf(StdOut, IDS_IO_ENGINE, IoEngineNames[IoEngineType]);
+        ConResPrintf(StdOut, IDS_IO_QUEUE_DEPTH, IoQueueDepth);
+        ConPuts(StdOut, L"\n");
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"engine=", &pszSuffix))
+        {
+            for (j = 0; j < ARRAYSIZE(IoEngineNames); j++)
+            {
+                if (_wcsicmp(pszSuffix, IoEngineNames[j]) == 0)
+                    break;
+            }
+
+            if (j == ARRAYSIZE(IoEngineNames))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+
+            Type = (IO_ENGINE_TYPE)j;
+        }
+        else if (HasPrefix(argv[i], L"qd=", &pszSuffix))
+        {
+            if (!IsDecString(pszSuffix))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+
+            ulQueueDepth = wcstoul(pszSuffix, NULL, 10);
+            if ((ulQueueDepth == 0) || (ulQueueDepth > IO_MAX_QUEUE_DEPTH))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    /* Running jobs keep the engine they were started with */
+    IoEngineType = Type;
+    IoQueueDepth = ulQueueDepth;
+
+    ConResPuts(StdOut, IDS_IO_SET);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,816 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/jobs.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+/*
+ * Background jobs for commands given the NOWAIT option.
+ *
+ * A command checks its arguments and updates the partition list on the
+ * interpreter thread, then hands its I/O to a job. Jobs run on a pool of
+ * worker threads, one job per disk at a time. The workers never touch the
+ * disk and volume lists: the completion of a job reports its result and
+ * updates the lists on the interpreter thread, before the next command runs.
+ * Commands that change a disk wait for its jobs first, and the lists are only
+ * rebuilt once no job is left, as the completions still refer to entries.
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define JOB_MAX_WORKERS         16
+#define JOB_COMMAND_LENGTH      80
+
+typedef enum _JOB_STATE
+{
+    JobQueued,
+    JobRunning,
+    JobFinished,    /* The routine returned, the completion did not run yet */
+    JobCompleted
+} JOB_STATE;
+
+typedef struct _JOB
+{
+    LIST_ENTRY ListEntry;
+    ULONG JobId;
+    ULONG DiskNumber[2];        /* JOB_NO_DISK for an unused entry */
+    WCHAR szCommand[JOB_COMMAND_LENGTH];
+    PJOB_ROUTINE Routine;
+    PJOB_COMPLETION Completion;
+    PVOID Context;
+    JOB_STATE State;
+    NTSTATUS Status;
+    volatile LONG bCancel;
+    volatile ULONG ulPercent;
+    HANDLE OutputHandle;        /* Streams of the command that started the job */
+    HANDLE ErrorHandle;
+} JOB;
+
+/* The list and the job states are guarded by JobLock. Only the interpreter
+   thread inserts and removes jobs, so it may walk the list without it. */
+static LIST_ENTRY JobListHead = {&JobListHead, &JobListHead};
+static RTL_CRITICAL_SECTION JobLock;
+static HANDLE JobWorkEvent = NULL;      /* A queued job may be runnable */
+static HANDLE JobDoneEvent = NULL;      /* A job has finished */
+static HANDLE JobWorkers[JOB_MAX_WORKERS];
+static ULONG JobWorkerCount = 0;
+static ULONG NextJobId = 1;
+static BOOL bStopJobWorkers = FALSE;
+static BOOL bRescanAfterJobs = FALSE;
+static BOOL bAlwaysNoWait = FALSE;
+static BOOL bQuietJobs = FALSE;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+BOOL
+IsJobOnDisk(
+    _In_ PJOB Job,
+    _In_ ULONG DiskNumber)
+{
+    if (DiskNumber == JOB_ALL_DISKS)
+        return TRUE;
+
+    return (DiskNumber != JOB_NO_DISK) &&
+           ((Job->DiskNumber[0] == DiskNumber) || (Job->DiskNumber[1] == DiskNumber));
+}
+
+
+static
+BOOL
+DoJobsShareDisk(
+    _In_ PJOB Job,
+    _In_ PJOB OtherJob)
+{
+    return IsJobOnDisk(OtherJob, Job->DiskNumber[0]) ||
+           IsJobOnDisk(OtherJob, Job->DiskNumber[1]);
+}
+
+
+/*
+ * Returns the oldest queued job whose disks are free. A job also waits for
+ * the older queued jobs on its disks, so jobs on one disk run in order.
+ * Called with JobLock held.
+ */
+static
+PJOB
+GetRunnableJob(VOID)
+{
+    PLIST_ENTRY Entry, OtherEntry;
+    PJOB Job, OtherJob;
+    BOOL bBlocked, bOlder;
+
+    for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = Entry->Flink)
+    {
+        Job = CONTAINING_RECORD(Entry, JOB, ListEntry);
+        if (Job->State != JobQueued)
+            continue;
+
+        bBlocked = FALSE;
+        bOlder = TRUE;
+        for (OtherEntry = JobListHead.Flink; OtherEntry != &JobListHead; OtherEntry = OtherEntry->Flink)
+        {
+            OtherJob = CONTAINING_RECORD(OtherEntry, JOB, ListEntry);
+            if (OtherJob == Job)
+            {
+                bOlder = FALSE;
+                continue;
+            }
+
+            if (((OtherJob->State == JobRunning) ||
+                 ((OtherJob->State == JobQueued) && bOlder)) &&
+                DoJobsShareDisk(Job, OtherJob))
+            {
+                bBlocked = TRUE;
+                break;
+            }
+        }
+
+        if (!bBlocked)
+            return Job;
+    }
+
+    return NULL;
+}
+
+
+static
+NTSTATUS
+NTAPI
+JobWorkerThread(
+    _In_ PVOID Parameter)
+{
+    PJOB Job;
+    NTSTATUS Status;
+    BOOL bStop = FALSE;
+
+    UNREFERENCED_PARAMETER(Parameter);
+
+    while (!bStop)
+    {
+        NtWaitForSingleObject(JobWorkEvent, FALSE, NULL);
+
+        for (;;)
+        {
+            RtlEnterCriticalSection(&JobLock);
+
+            Job = NULL;
+            bStop = bStopJobWorkers;
+            if (!bStop)
+            {
+                Job = GetRunnableJob();
+                if (Job != NULL)
+                    Job->State = JobRunning;
+            }
+
+            /* The event wakes a single worker, which hands on the rest of the queue */
+            if (bStop || ((Job != NULL) && (GetRunnableJob() != NULL)))
+                NtSetEvent(JobWorkEvent, NULL);
+
+            RtlLeaveCriticalSection(&JobLock);
+
+            if (Job == NULL)
+                break;
+
+            Status = Job->Routine(Job, Job->Context);
+
+            RtlEnterCriticalSection(&JobLock);
+            Job->Status = Status;
+            Job->State = JobFinished;
+            RtlLeaveCriticalSection(&JobLock);
+
+            NtSetEvent(JobDoneEvent, NULL);
+        }
+    }
+
+    RtlExitUserThread(STATUS_SUCCESS);
+    return STATUS_SUCCESS;
+}
+
+
+static
+BOOL
+InitializeJobs(VOID)
+{
+    NTSTATUS Status;
+
+    if (JobWorkEvent != NULL)
+        return TRUE;
+
+    Status = NtCreateEvent(&JobDoneEvent,
+                           EVENT_ALL_ACCESS,
+                           NULL,
+                           SynchronizationEvent,
+                           FALSE);
+    if (NT_SUCCESS(Status))
+    {
+        Status = NtCreateEvent(&JobWorkEvent,
+                               EVENT_ALL_ACCESS,
+                               NULL,
+                               SynchronizationEvent,
+                               FALSE);
+        if (!NT_SUCCESS(Status))
+        {
+            NtClose(JobDoneEvent);
+            JobDoneEvent = NULL;
+        }
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtCreateEvent() failed (Status 0x%08lx)\n", Status);
+        return FALSE;
+    }
+
+    RtlInitializeCriticalSection(&JobLock);
+
+    return TRUE;
+}
+
+
+static
+VOID
+StartJobWorker(VOID)
+{
+    NTSTATUS Status;
+
+    Status = RtlCreateUserThread(NtCurrentProcess(),
+                                 NULL,
+                                 FALSE,
+                                 0,
+                                 0,
+                                 0,
+                                 JobWorkerThread,
+                                 NULL,
+                                 &JobWorkers[JobWorkerCount],
+                                 NULL);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Starting job worker %lu failed (Status 0x%08lx)\n", JobWorkerCount, Status);
+        return;
+    }
+
+    JobWorkerCount++;
+}
+
+
+static
+PJOB
+FindJob(
+    _In_ ULONG JobId)
+{
+    PLIST_ENTRY Entry;
+    PJOB Job;
+
+    for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = Entry->Flink)
+    {
+        Job = CONTAINING_RECORD(Entry, JOB, ListEntry);
+        if (Job->JobId == JobId)
+            return Job;
+    }
+
+    return NULL;
+}
+
+
+static
+VOID
+RescanSelection(VOID)
+{
+    RescanAndSelect((CurrentDisk != NULL) ? CurrentDisk->DiskNumber : JOB_NO_DISK,
+                    (CurrentPartition != NULL) ? CurrentPartition->StartSector.QuadPart : 0);
+}
+
+
+/*
+ * Runs the I/O of a command. With NOWAIT the routine runs as a job on the
+ * given disks, which stay busy until it has finished; otherwise, or when no
+ * job can be started, it runs in place. The completion always runs, on the
+ * interpreter thread.
+ */
+VOID
+StartJob(
+    _In_ BOOL bNoWait,
+    _In_ INT argc,
+    _In_ PWSTR *argv,
+    _In_ ULONG DiskNumber,
+    _In_ ULONG OtherDiskNumber,
+    _In_ PJOB_ROUTINE Routine,
+    _In_ PJOB_COMPLETION Completion,
+    _In_ PVOID Context)
+{
+    PLIST_ENTRY Entry;
+    PJOB Job = NULL;
+    ULONG ActiveCount = 0;
+    INT i;
+
+    /* The routine may write anywhere on its disks */
+    InvalidateDiskSectorCache(DiskNumber);
+    InvalidateDiskSectorCache(OtherDiskNumber);
+
+    if ((bNoWait || bAlwaysNoWait) && InitializeJobs())
+        Job = RtlAllocateHeap(RtlGetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(JOB));
+
+    if (Job == NULL)
+    {
+        Completion(Routine(NULL, Context), Context);
+        return;
+    }
+
+    for (i = 0; i < argc; i++)
+    {
+        if (i > 0)
+            StringCchCatW(Job->szCommand, ARRAYSIZE(Job->szCommand), L" ");
+        StringCchCatW(Job->szCommand, ARRAYSIZE(Job->szCommand), argv[i]);
+    }
+
+    Job->DiskNumber[0] = DiskNumber;
+    Job->DiskNumber[1] = OtherDiskNumber;
+    Job->Routine = Routine;
+    Job->Completion = Completion;
+    Job->Context = Context;
+    Job->State = JobQueued;
+    Job->OutputHandle = ConStreamGetOSHandle(StdOut);
+    Job->ErrorHandle = ConStreamGetOSHandle(StdErr);
+
+    RtlEnterCriticalSection(&JobLock);
+
+    Job->JobId = NextJobId++;
+    InsertTailList(&JobListHead, &Job->ListEntry);
+
+    for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = Entry->Flink)
+    {
+        if (CONTAINING_RECORD(Entry, JOB, ListEntry)->State <= JobRunning)
+            ActiveCount++;
+    }
+
+    RtlLeaveCriticalSection(&JobLock);
+
+    /* The pool grows until every queued or running job has a worker */
+    if ((ActiveCount > JobWorkerCount) && (JobWorkerCount < JOB_MAX_WORKERS))
+        StartJobWorker();
+
+    if (JobWorkerCount == 0)
+    {
+        RtlEnterCriticalSection(&JobLock);
+        RemoveEntryList(&Job->ListEntry);
+        RtlLeaveCriticalSection(&JobLock);
+
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Job);
+        Completion(Routine(NULL, Context), Context);
+        return;
+    }
+
+    if (!bQuietJobs)
+        ConResPrintf(StdOut, IDS_JOB_QUEUED, Job->JobId);
+
+    NtSetEvent(JobWorkEvent, NULL);
+}
+
+
+/*
+ * Makes the commands that support NOWAIT start a job even without the
+ * option, while FOREACH or a parallel script runs. Quiet jobs report nothing
+ * but the output of their completion, like a command that ran in place.
+ */
+VOID
+SetAlwaysNoWait(
+    _In_ BOOL bNoWait,
+    _In_ BOOL bQuiet)
+{
+    bAlwaysNoWait = bNoWait;
+    bQuietJobs = bNoWait && bQuiet;
+}
+
+
+BOOL
+IsJobCancelled(
+    _In_opt_ PJOB Job)
+{
+    return (Job != NULL) && (Job->bCancel != FALSE);
+}
+
+
+VOID
+SetJobProgress(
+    _In_opt_ PJOB Job,
+    _In_ ULONG ulPercent)
+{
+    if (Job != NULL)
+        Job->ulPercent = ulPercent;
+}
+
+
+/*
+ * Tells whether a job on the disk is queued, running, or waits for its
+ * completion.
+ */
+BOOL
+HasActiveJobs(
+    _In_ ULONG DiskNumber)
+{
+    PLIST_ENTRY Entry;
+    PJOB Job;
+    BOOL bActive = FALSE;
+
+    if (IsListEmpty(&JobListHead))
+        return FALSE;
+
+    RtlEnterCriticalSection(&JobLock);
+
+    for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = Entry->Flink)
+    {
+        Job = CONTAINING_RECORD(Entry, JOB, ListEntry);
+        if ((Job->State != JobCompleted) && IsJobOnDisk(Job, DiskNumber))
+        {
+            bActive = TRUE;
+            break;
+        }
+    }
+
+    RtlLeaveCriticalSection(&JobLock);
+
+    return bActive;
+}
+
+
+/*
+ * Runs the completions of the finished jobs. The jobs stay in the list
+ * until they are waited for.
+ */
+VOID
+ReapJobs(VOID)
+{
+    PLIST_ENTRY Entry;
+    PJOB Job;
+    HANDLE OutputHandle, ErrorHandle;
+    BOOL bFinished;
+
+    for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = Entry->Flink)
+    {
+        Job = CONTAINING_RECORD(Entry, JOB, ListEntry);
+
+        RtlEnterCriticalSection(&JobLock);
+        bFinished = (Job->State == JobFinished);
+        if (bFinished)
+            Job->State = JobCompleted;
+        RtlLeaveCriticalSection(&JobLock);
+
+        if (!bFinished)
+            continue;
+
+        /* The completion reports to the streams of the command that started the job */
+        OutputHandle = ConStreamGetOSHandle(StdOut);
+        ErrorHandle = ConStreamGetOSHandle(StdErr);
+        ConStreamSetOSHandle(StdOut, Job->OutputHandle);
+        ConStreamSetOSHandle(StdErr, Job->ErrorHandle);
+
+        if (!bQuietJobs)
+            ConResPrintf(StdOut, IDS_JOB_FINISHED, Job->JobId, Job->szCommand);
+        Job->Completion(Job->Status, Job->Context);
+        Job->Context = NULL;
+
+        ConStreamSetOSHandle(StdOut, OutputHandle);
+        ConStreamSetOSHandle(StdErr, ErrorHandle);
+    }
+
+    if (bRescanAfterJobs && !HasActiveJobs(JOB_ALL_DISKS))
+    {
+        bRescanAfterJobs = FALSE;
+        RescanSelection();
+    }
+}
+
+
+/*
+ * Rebuilds the lists for a completion that changed a partition table, or
+ * defers it until the last job has finished.
+ */
+VOID
+RescanAfterJobs(VOID)
+{
+    if (HasActiveJobs(JOB_ALL_DISKS))
+        bRescanAfterJobs = TRUE;
+    else
+        RescanSelection();
+}
+
+
+VOID
+WaitForDiskJobs(
+    _In_ ULONG DiskNumber)
+{
+    for (;;)
+    {
+        ReapJobs();
+
+        if (!HasActiveJobs(DiskNumber))
+            break;
+
+        NtWaitForSingleObject(JobDoneEvent, FALSE, NULL);
+    }
+}
+
+
+/*
+ * Waits until a job has finished, if any is active, and runs the completions.
+ */
+VOID
+WaitForAnyJob(VOID)
+{
+    ReapJobs();
+
+    if (!HasActiveJobs(JOB_ALL_DISKS))
+        return;
+
+    NtWaitForSingleObject(JobDoneEvent, FALSE, NULL);
+    ReapJobs();
+}
+
+
+/*
+ * Waits for the jobs on the selected disk, and on the disk of the selected
+ * volume, before a command changes them.
+ */
+VOID
+WaitForSelectedDisk(VOID)
+{
+    PDISKENTRY DiskEntry;
+
+    if ((CurrentDisk != NULL) && HasActiveJobs(CurrentDisk->DiskNumber))
+    {
+        if (!bQuietJobs)
+            ConResPrintf(StdOut, IDS_JOB_WAITING, CurrentDisk->DiskNumber);
+        WaitForDiskJobs(CurrentDisk->DiskNumber);
+    }
+
+    if (CurrentVolume == NULL)
+        return;
+
+    DiskEntry = GetDiskForVolume(CurrentVolume);
+    if ((DiskEntry != NULL) && HasActiveJobs(DiskEntry->DiskNumber))
+    {
+        if (!bQuietJobs)
+            ConResPrintf(StdOut, IDS_JOB_WAITING, DiskEntry->DiskNumber);
+        WaitForDiskJobs(DiskEntry->DiskNumber);
+    }
+}
+
+
+/*
+ * Waits for one job, or for all of them if JobId is 0, and removes them from
+ * the list. Returns FALSE if one of them failed; cancelled jobs do not count.
+ */
+BOOL
+WaitForJobs(
+    _In_ ULONG JobId)
+{
+    PLIST_ENTRY Entry, NextEntry;
+    PJOB Job;
+    BOOL bPending, bSuccess = TRUE;
+
+    if ((JobId != 0) && (FindJob(JobId) == NULL))
+    {
+        ConResPrintf(StdOut, IDS_JOB_NOT_FOUND, JobId);
+        return TRUE;
+    }
+
+    /* Only this thread completes jobs, so the state can be read unlocked */
+    do
+    {
+        ReapJobs();
+
+        bPending = FALSE;
+        for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = Entry->Flink)
+        {
+            Job = CONTAINING_RECORD(Entry, JOB, ListEntry);
+            if (((JobId == 0) || (Job->JobId == JobId)) && (Job->State != JobCompleted))
+                bPending = TRUE;
+        }
+
+        if (bPending)
+            NtWaitForSingleObject(JobDoneEvent, FALSE, NULL);
+    } while (bPending);
+
+    for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = NextEntry)
+    {
+        NextEntry = Entry->Flink;
+        Job = CONTAINING_RECORD(Entry, JOB, ListEntry);
+        if ((JobId != 0) && (Job->JobId != JobId))
+            continue;
+
+        if (!NT_SUCCESS(Job->Status) && (Job->Status != STATUS_CANCELLED))
+        {
+            if (!bQuietJobs)
+                ConResPrintf(StdOut, IDS_JOB_FAILED, Job->JobId, Job->szCommand);
+            bSuccess = FALSE;
+        }
+
+        RtlEnterCriticalSection(&JobLock);
+        RemoveEntryList(&Job->ListEntry);
+        RtlLeaveCriticalSection(&JobLock);
+
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Job);
+    }
+
+    return bSuccess;
+}
+
+
+VOID
+DestroyJobs(VOID)
+{
+    ULONG Index;
+
+    if (JobWorkEvent == NULL)
+        return;
+
+    WaitForJobs(0);
+
+    RtlEnterCriticalSection(&JobLock);
+    bStopJobWorkers = TRUE;
+    RtlLeaveCriticalSection(&JobLock);
+
+    NtSetEvent(JobWorkEvent, NULL);
+
+    for (Index = 0; Index < JobWorkerCount; Index++)
+    {
+        NtWaitForSingleObject(JobWorkers[Index], FALSE, NULL);
+        NtClose(JobWorkers[Index]);
+    }
+
+    JobWorkerCount = 0;
+
+    NtClose(JobWorkEvent);
+    JobWorkEvent = NULL;
+
+    NtClose(JobDoneEvent);
+    JobDoneEvent = NULL;
+
+    RtlDeleteCriticalSection(&JobLock);
+}
+
+
+static
+BOOL
+ParseJobId(
+    _In_ PWSTR pszJobId,
+    _Out_ PULONG pJobId)
+{
+    PWSTR pszEnd;
+
+    *pJobId = wcstoul(pszJobId, &pszEnd, 10);
+
+    return (*pJobId != 0) && (*pszEnd == UNICODE_NULL);
+}
+
+
+EXIT_CODE
+cancel_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PJOB Job;
+    ULONG JobId;
+    BOOL bCancelled = FALSE;
+
+    DPRINT("Cancel()\n");
+
+    if ((argc != 2) || !ParseJobId(argv[1], &JobId))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
+    }
+
+    Job = FindJob(JobId);
+    if (Job != NULL)
+    {
+        RtlEnterCriticalSection(&JobLock);
+
+        if (Job->State == JobQueued)
+        {
+            /* It never starts, and its completion releases the context */
+            Job->Status = STATUS_CANCELLED;
+            Job->State = JobFinished;
+            bCancelled = TRUE;
+        }
+        else if (Job->State == JobRunning)
+        {
+            /* The routine stops at its next check */
+            Job->bCancel = TRUE;
+            bCancelled = TRUE;
+        }
+
+        RtlLeaveCriticalSection(&JobLock);
+    }
+
+    if (!bCancelled)
+    {
+        ConResPrintf(StdOut, IDS_JOB_NOT_FOUND, JobId);
+        return EXIT_SUCCESS;
+    }
+
+    ConResPrintf(StdOut, IDS_JOB_CANCELLING, JobId);
+
+    /* Jobs queued behind a cancelled one may start now */
+    NtSetEvent(JobWorkEvent, NULL);
+    ReapJobs();
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+jobs_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PLIST_ENTRY Entry;
+    PJOB Job;
+    JOB_STATE State;
+    NTSTATUS Status;
+    WCHAR szState[40];
+    UINT uState;
+
+    DPRINT("Jobs()\n");
+
+    if (argc > 1)
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
+    }
+
+    if (IsListEmpty(&JobListHead))
+    {
+        ConResPuts(StdOut, IDS_JOBS_NONE);
+        return EXIT_SUCCESS;
+    }
+
+    ConResPuts(StdOut, IDS_JOBS_HEAD);
+    ConResPuts(StdOut, IDS_JOBS_LINE);
+
+    for (Entry = JobListHead.Flink; Entry != &JobListHead; Entry = Entry->Flink)
+    {
+        Job = CONTAINING_RECORD(Entry, JOB, ListEntry);
+
+        RtlEnterCriticalSection(&JobLock);
+        State = Job->State;
+        Status = Job->Status;
+        RtlLeaveCriticalSection(&JobLock);
+
+        if (State == JobQueued)
+            uState = IDS_JOB_STATE_QUEUED;
+        else if (State == JobRunning)
+            uState = IDS_JOB_STATE_RUNNING;
+        else if (Status == STATUS_CANCELLED)
+            uState = IDS_JOB_STATE_CANCELLED;
+        else if (!NT_SUCCESS(Status))
+            uState = IDS_JOB_STATE_FAILED;
+        else
+            uState = IDS_JOB_STATE_COMPLETED;
+
+        LoadStringW(GetModuleHandle(NULL),
+                    uState,
+                    szState,
+                    ARRAYSIZE(szState));
+
+        ConResPrintf(StdOut, IDS_JOBS_FORMAT,
+                     Job->JobId,
+                     szState,
+                     ((State >= JobFinished) && NT_SUCCESS(Status)) ? 100 : Job->ulPercent,
+                     Job->szCommand);
+    }
+
+    ConPuts(StdOut, L"\n");
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+wait_main(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    ULONG JobId = 0;
+
+    DPRINT("Wait()\n");
+
+    if ((argc > 2) ||
+        ((argc == 2) && (_wcsicmp(argv[1], L"all") != 0) && !ParseJobId(argv[1], &JobId)))
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        return EXIT_SUCCESS;
+    }
+
+    /* A failed job fails the script that waits for it */
+    if (!WaitForJobs(JobId))
+        return EXIT_FATAL;
+
+    return EXIT_SUCCESS;
+}
@@ -1,13 +1,36 @@
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/netlink.h>
 
 #define MAX_LINE 1024
 
+/* The sizes in sysfs are always counted in 512-byte sectors */
+#define SYSFS_SECTOR_SIZE 512ULL
+
+#define SIZE_1KB  (1024ULL)
+#define SIZE_10KB (10ULL * SIZE_1KB)
+#define SIZE_1MB  (1024ULL * SIZE_1KB)
+#define SIZE_10MB (10ULL * SIZE_1MB)
+#define SIZE_1GB  (1024ULL * SIZE_1MB)
+#define SIZE_10GB (10ULL * SIZE_1GB)
+#define SIZE_1TB  (1024ULL * SIZE_1GB)
+#define SIZE_10TB (10ULL * SIZE_1TB)
+
+/* The devices are settled after this long without a block uevent */
+#define SETTLE_QUIET_MS 250
+#define SETTLE_POLL_MS  100
+
 typedef enum exit_code
 {
     EXIT_OK = 0,
@@ -19,6 +42,28 @@ typedef enum exit_code
     EXIT_EXIT
 } exit_code;
 
+/* What udev recorded about a device, read from its database */
+typedef struct udev_info
+{
+    char table_type[8];
+    char part_scheme[8];
+    char part_type[40];
+    char fs_type[32];
+    char fs_label[256];
+} udev_info;
+
+typedef struct part_info
+{
+    char name[NAME_MAX + 1];
+    unsigned long long number;
+    unsigned long long start;
+    unsigned long long size;
+} part_info;
+
+/* Held open, so the attributes are opened relative to it */
+static int sysfs_block_fd = -1;
+static char current_disk[NAME_MAX + 1];
+
 static void trim(char *s)
 {
     char *start = s;
@@ -50,23 +95,178 @@ static void show_help(void)
 {
     puts("Available commands:");
     puts("  help           Show this help");
-    puts("  list disk      List block devices from /sys/block");
+    puts("  list disk      List the disks from /sys/block");
+    puts("  list partition List the partitions of the selected disk");
     puts("  list volume    List mounted volumes using lsblk");
+    puts("  select disk    Select a disk by its number");
     puts("  exit           Exit diskpart");
 }
 
-static void list_disk(void)
+static int open_sysfs_block(void)
+{
+    if (sysfs_block_fd < 0)
+        sysfs_block_fd = open("/sys/block", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    return sysfs_block_fd;
+}
+
+static int read_attr(int dirfd, const char *path, char *buf, size_t len)
+{
+    ssize_t n;
+    int fd;
+
+    fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    n = read(fd, buf, len - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+
+    buf[n] = '\0';
+    trim(buf);
+    return 0;
+}
+
+static unsigned long long read_attr_ull(int dirfd, const char *path)
 {
-    DIR *d = opendir("/sys/block");
+    char buf[32];
+
+    if (read_attr(dirfd, path, buf, sizeof(buf)) != 0)
+        return 0;
+
+    return strtoull(buf, NULL, 10);
+}
+
+static void copy_property(char *dst, size_t len, const char *line, const char *key)
+{
+    size_t keylen = strlen(key);
+
+    if (strncmp(line, key, keylen) || line[keylen] != '=')
+        return;
+
+    snprintf(dst, len, "%s", line + keylen + 1);
+    trim(dst);
+}
+
+/* Never opens the device itself, a slow or failing LUN cannot block here */
+static void read_udev_info(int dirfd, udev_info *info)
+{
+    char dev[32];
+    char path[64];
+    char line[256];
+    FILE *f;
+
+    memset(info, 0, sizeof(*info));
+
+    if (read_attr(dirfd, "dev", dev, sizeof(dev)) != 0)
+        return;
+
+    snprintf(path, sizeof(path), "/run/udev/data/b%s", dev);
+    f = fopen(path, "re");
+    if (f == NULL)
+        return;
+
+    /* The properties are stored as E:KEY=value */
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (strncmp(line, "E:", 2))
+            continue;
+
+        copy_property(info->table_type, sizeof(info->table_type), line + 2, "ID_PART_TABLE_TYPE");
+        copy_property(info->part_scheme, sizeof(info->part_scheme), line + 2, "ID_PART_ENTRY_SCHEME");
+        copy_property(info->part_type, sizeof(info->part_type), line + 2, "ID_PART_ENTRY_TYPE");
+        copy_property(info->fs_type, sizeof(info->fs_type), line + 2, "ID_FS_TYPE");
+        copy_property(info->fs_label, sizeof(info->fs_label), line + 2, "ID_FS_LABEL");
+    }
+
+    fclose(f);
+}
+
+static void format_size(unsigned long long size, char *buf, size_t len)
+{
+    const char *unit;
+
+    if (size >= SIZE_10TB)
+    {
+        size = (size + SIZE_1TB / 2) / SIZE_1TB;
+        unit = "TB";
+    }
+    else if (size >= SIZE_10GB)
+    {
+        size = (size + SIZE_1GB / 2) / SIZE_1GB;
+        unit = "GB";
+    }
+    else if (size >= SIZE_10MB)
+    {
+        size = (size + SIZE_1MB / 2) / SIZE_1MB;
+        unit = "MB";
+    }
+    else if (size >= SIZE_10KB)
+    {
+        size = (size + SIZE_1KB / 2) / SIZE_1KB;
+        unit = "KB";
+    }
+    else
+    {
+        unit = "B";
+    }
+
+    snprintf(buf, len, "%4llu %-2s", size, unit);
+}
+
+/* Orders sdb before sdaa, like the kernel names them */
+static int compare_names(const void *a, const void *b)
+{
+    const char *name_a = *(const char * const *)a;
+    const char *name_b = *(const char * const *)b;
+    size_t len_a = strlen(name_a);
+    size_t len_b = strlen(name_b);
+
+    if (len_a != len_b)
+        return (len_a < len_b) ? -1 : 1;
+
+    return strcmp(name_a, name_b);
+}
+
+static void free_disks(char **disks, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        free(disks[i]);
+
+    free(disks);
+}
+
+/* Returns the disks in the order of their numbers */
+static char **collect_disks(size_t *count)
+{
+    char **disks = NULL;
+    char **grown;
+    size_t capacity = 0;
     struct dirent *ent;
+    DIR *d;
+    int fd;
+
+    *count = 0;
 
+    if (open_sysfs_block() < 0)
+        return NULL;
+
+    /* fdopendir() owns the descriptor, the held one stays open */
+    fd = openat(sysfs_block_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    d = fdopendir(fd);
     if (d == NULL)
     {
-        fprintf(stderr, "Unable to read /sys/block: %s\\n", strerror(errno));
-        return;
+        close(fd);
+        return NULL;
     }
 
-    puts("Disks:");
     while ((ent = readdir(d)) != NULL)
     {
         if (ent->d_name[0] == '.')
@@ -76,10 +276,343 @@ static void list_disk(void)
             !strncmp(ent->d_name, "ram", 3))
             continue;
 
-        printf("  %s\n", ent->d_name);
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(disks, capacity * sizeof(*disks));
+            if (grown == NULL)
+                break;
+            disks = grown;
+        }
+
+        disks[*count] = strdup(ent->d_name);
+        if (disks[*count] == NULL)
+            break;
+        (*count)++;
     }
 
     closedir(d);
+
+    if (*count > 1)
+        qsort(disks, *count, sizeof(*disks), compare_names);
+
+    return disks;
+}
+
+static int compare_partitions(const void *a, const void *b)
+{
+    const part_info *part_a = a;
+    const part_info *part_b = b;
+
+    if (part_a->start != part_b->start)
+        return (part_a->start < part_b->start) ? -1 : 1;
+
+    return 0;
+}
+
+/* Returns the partitions the kernel found on the disk, by their offset */
+static part_info *collect_partitions(int diskfd, size_t *count)
+{
+    part_info *parts = NULL;
+    part_info *grown;
+    size_t capacity = 0;
+    struct dirent *ent;
+    char path[NAME_MAX + 16];
+    unsigned long long number;
+    DIR *d;
+    int fd;
+
+    *count = 0;
+
+    fd = openat(diskfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    d = fdopendir(fd);
+    if (d == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        /* Only the partition subdirectories have a partition number */
+        snprintf(path, sizeof(path), "%s/partition", ent->d_name);
+        number = read_attr_ull(diskfd, path);
+        if (number == 0)
+            continue;
+
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            grown = realloc(parts, capacity * sizeof(*parts));
+            if (grown == NULL)
+                break;
+            parts = grown;
+        }
+
+        snprintf(parts[*count].name, sizeof(parts[*count].name), "%s", ent->d_name);
+        parts[*count].number = number;
+
+        snprintf(path, sizeof(path), "%s/start", ent->d_name);
+        parts[*count].start = read_attr_ull(diskfd, path) * SYSFS_SECTOR_SIZE;
+
+        snprintf(path, sizeof(path), "%s/size", ent->d_name);
+        parts[*count].size = read_attr_ull(diskfd, path) * SYSFS_SECTOR_SIZE;
+
+        (*count)++;
+    }
+
+    closedir(d);
+
+    if (*count > 1)
+        qsort(parts, *count, sizeof(*parts), compare_partitions);
+
+    return parts;
+}
+
+/* The only column that needs the partitions of the disk */
+static unsigned long long get_free_size(int diskfd, unsigned long long disk_size)
+{
+    part_info *parts;
+    size_t count, i;
+    unsigned long long used = 0;
+
+    parts = collect_partitions(diskfd, &count);
+    for (i = 0; i < count; i++)
+        used += parts[i].size;
+    free(parts);
+
+    return (used < disk_size) ? disk_size - used : 0;
+}
+
+static void print_disk(int index, const char *name)
+{
+    udev_info info;
+    unsigned long long size, free_size;
+    char size_buf[16];
+    char free_buf[16];
+    const char *status;
+    int diskfd;
+    int err;
+
+    diskfd = openat(sysfs_block_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (diskfd < 0)
+    {
+        /* Leave no gap in the disk numbers */
+        err = errno;
+        printf("%c Disk %-3d  %-10s\n",
+               strcmp(current_disk, name) ? ' ' : '*',
+               index,
+               (err == ENOENT) ? "Missing" : "Error");
+        fprintf(stderr, "Unable to read /sys/block/%s: %s\n", name, strerror(err));
+        return;
+    }
+
+    size = read_attr_ull(diskfd, "size") * SYSFS_SECTOR_SIZE;
+    read_udev_info(diskfd, &info);
+
+    if (size == 0)
+    {
+        status = read_attr_ull(diskfd, "removable") ? "No Media" : "Offline";
+        free_size = 0;
+    }
+    else
+    {
+        status = read_attr_ull(diskfd, "ro") ? "Read Only" : "Online";
+        free_size = get_free_size(diskfd, size);
+    }
+
+    format_size(size, size_buf, sizeof(size_buf));
+    format_size(free_size, free_buf, sizeof(free_buf));
+
+    printf("%c Disk %-3d  %-10s  %-7s  %-7s   %1s    %1s\n",
+           strcmp(current_disk, name) ? ' ' : '*',
+           index,
+           status,
+           size_buf,
+           free_buf,
+           " ",
+           strcmp(info.table_type, "gpt") ? " " : "*");
+
+    close(diskfd);
+}
+
+static void list_disk(void)
+{
+    char **disks;
+    size_t count, i;
+
+    disks = collect_disks(&count);
+    if (disks == NULL && sysfs_block_fd < 0)
+    {
+        fprintf(stderr, "Unable to read /sys/block: %s\n", strerror(errno));
+        return;
+    }
+
+    puts("");
+    puts("  Disk ###  Status      Size     Free     Dyn  Gpt");
+    puts("  --------  ----------  -------  -------  ---  ---");
+
+    for (i = 0; i < count; i++)
+        print_disk((int)i, disks[i]);
+
+    puts("\n");
+
+    free_disks(disks, count);
+}
+
+static const char *get_partition_type(const part_info *part, const udev_info *info)
+{
+    if (!strcmp(info->part_scheme, "gpt"))
+    {
+        if (!strcasecmp(info->part_type, "ebd0a0a2-b9e5-4433-87c0-68b6b72699c7"))
+            return "Primary";
+        if (!strcasecmp(info->part_type, "c12a7328-f81f-11d2-ba4b-00a0c93ec93b"))
+            return "System";
+        if (!strcasecmp(info->part_type, "e3c9e316-0b5c-4db8-817d-f92df00215ae"))
+            return "Reserved";
+        return "Unknown";
+    }
+
+    if (!strcmp(info->part_type, "0x5") ||
+        !strcmp(info->part_type, "0xf") ||
+        !strcmp(info->part_type, "0x85"))
+        return "Extended";
+
+    /* The logical partitions of an MBR disk are numbered from 5 */
+    return (part->number > 4) ? "Logical" : "Primary";
+}
+
+static void print_misaligned_partitions(int diskfd, const part_info *parts, size_t count)
+{
+    unsigned long long physical, optimal, alignment;
+    unsigned long long offset;
+    size_t i;
+
+    physical = read_attr_ull(diskfd, "queue/physical_block_size");
+    optimal = read_attr_ull(diskfd, "queue/optimal_io_size");
+    alignment = read_attr_ull(diskfd, "alignment_offset");
+
+    if (physical == 0)
+        return;
+
+    for (i = 0; i < count; i++)
+    {
+        /* The kernel shows an extended partition as its first sectors */
+        if (parts[i].size <= 2 * SIZE_1KB && parts[i].number <= 4)
+            continue;
+
+        offset = parts[i].start;
+
+        if ((offset % physical) != (alignment % physical))
+        {
+            printf("\nPartition %zu is not aligned to the %llu-byte physical sector size.\n"
+                   "Every write to it needs a read-modify-write cycle on the disk.\n",
+                   i + 1, physical);
+        }
+        else if (optimal != 0 && (offset % optimal) != (alignment % optimal))
+        {
+            printf("\nPartition %zu is not aligned to the %llu-byte optimal I/O size.\n"
+                   "Large writes to it are split across stripes and run slower.\n",
+                   i + 1, optimal);
+        }
+    }
+}
+
+static void list_partition(void)
+{
+    part_info *parts;
+    udev_info info;
+    size_t count, i;
+    char size_buf[16];
+    char offset_buf[16];
+    int diskfd = -1;
+    int partfd;
+
+    if (current_disk[0] != '\0' && open_sysfs_block() >= 0)
+        diskfd = openat(sysfs_block_fd, current_disk, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (diskfd < 0)
+    {
+        puts("\nThere is no disk to list partitions.\nPlease select a disk and try again.\n");
+        return;
+    }
+
+    parts = collect_partitions(diskfd, &count);
+    if (count == 0)
+    {
+        puts("\nThere are no partitions on this disk to show.\n");
+        free(parts);
+        close(diskfd);
+        return;
+    }
+
+    puts("");
+    puts("  Partition ###  Type              Size     Offset  Fs     Label");
+    puts("  -------------  ----------------  -------  -------  -----  ----------------");
+
+    for (i = 0; i < count; i++)
+    {
+        memset(&info, 0, sizeof(info));
+        partfd = openat(diskfd, parts[i].name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (partfd >= 0)
+        {
+            read_udev_info(partfd, &info);
+            close(partfd);
+        }
+
+        format_size(parts[i].size, size_buf, sizeof(size_buf));
+        format_size(parts[i].start, offset_buf, sizeof(offset_buf));
+
+        printf("  Partition %-3zu  %-16s  %-7s  %-7s  %-5s  %s\n",
+               i + 1,
+               get_partition_type(&parts[i], &info),
+               size_buf,
+               offset_buf,
+               info.fs_type,
+               info.fs_label);
+    }
+
+    print_misaligned_partitions(diskfd, parts, count);
+    puts("");
+
+    free(parts);
+    close(diskfd);
+}
+
+static exit_code select_disk(const char *arg)
+{
+    char **disks;
+    size_t count;
+    char *end;
+    unsigned long index;
+
+    errno = 0;
+    index = strtoul(arg, &end, 10);
+    if (arg[0] == '\0' || *end != '\0' || errno != 0)
+    {
+        fputs("The arguments specified for this command are not valid.\n", stderr);
+        return EXIT_CMD_ARG;
+    }
+
+    disks = collect_disks(&count);
+    if (index >= count)
+    {
+        puts("\nInvalid disk.\n");
+        free_disks(disks, count);
+        return EXIT_OK;
+    }
+
+    snprintf(current_disk, sizeof(current_disk), "%s", disks[index]);
+    printf("\nDisk %lu is now the selected disk.\n\n", index);
+
+    free_disks(disks, count);
+    return EXIT_OK;
 }
 
 static void list_volume(void)
@@ -90,6 +623,155 @@ static void list_volume(void)
         fprintf(stderr, "Failed to run lsblk (exit code %d).\\n", rc);
 }
 
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int open_uevent_socket(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    /* Group 1 carries the kernel events, group 2 the events udev has handled */
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1 | 2;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int is_block_uevent(const char *buf, size_t len)
+{
+    size_t i;
+
+    /* The properties are NUL separated, after a header that is skipped over */
+    for (i = 0; i < len; i += strlen(buf + i) + 1)
+    {
+        if (!strcmp(buf + i, "SUBSYSTEM=block"))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Returns nonzero if any of the pending uevents is about a block device */
+static int drain_uevents(int fd)
+{
+    char buf[8192];
+    ssize_t len;
+    int block = 0;
+
+    while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0)
+    {
+        buf[len] = '\0';
+        if (is_block_uevent(buf, (size_t)len))
+            block = 1;
+    }
+
+    return block;
+}
+
+static int udev_queue_busy(void)
+{
+    return access("/run/udev/queue", F_OK) == 0;
+}
+
+/* Checks that every disk and partition the kernel knows has its /dev node */
+static int device_nodes_ready(void)
+{
+    DIR *d = opendir("/sys/class/block");
+    struct dirent *ent;
+    struct stat st;
+    char path[PATH_MAX];
+    char *p;
+    int ready = 1;
+
+    if (d == NULL)
+        return 1;
+
+    while (ready && (ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        /* Names like cciss!c0d0 live in a subdirectory of /dev */
+        snprintf(path, sizeof(path), "/dev/%s", ent->d_name);
+        for (p = path; *p != '\0'; p++)
+        {
+            if (*p == '!')
+                *p = '/';
+        }
+
+        if (stat(path, &st) != 0 || !S_ISBLK(st.st_mode))
+            ready = 0;
+    }
+
+    closedir(d);
+    return ready;
+}
+
+/*
+ * Waits up to timeout seconds for hot-plugged devices to settle: until the
+ * udev queue is empty, every block device has its node and no block uevent
+ * arrived for a while. Without the uevent socket the nodes are polled.
+ */
+static void settle_devices(int timeout)
+{
+    long long deadline = monotonic_ms() + (long long)timeout * 1000;
+    long long last_event = monotonic_ms();
+    long long now;
+    struct pollfd pfd;
+    int wait_ms;
+    int fd;
+
+    fd = open_uevent_socket();
+
+    for (;;)
+    {
+        now = monotonic_ms();
+
+        if (now - last_event >= SETTLE_QUIET_MS &&
+            !udev_queue_busy() && device_nodes_ready())
+            break;
+
+        if (now >= deadline)
+            break;
+
+        wait_ms = (int)((deadline - now < SETTLE_POLL_MS) ? (deadline - now) : SETTLE_POLL_MS);
+
+        if (fd < 0)
+        {
+            usleep((useconds_t)wait_ms * 1000);
+            continue;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, wait_ms) > 0 && drain_uevents(fd))
+            last_event = monotonic_ms();
+    }
+
+    if (fd >= 0)
+        close(fd);
+}
+
 static exit_code run_command(char *line)
 {
     trim(line);
@@ -112,6 +794,20 @@ static exit_code run_command(char *line)
         return EXIT_OK;
     }
 
+    if (!strcasecmp(line, "list partition"))
+    {
+        list_partition();
+        return EXIT_OK;
+    }
+
+    if (!strncasecmp(line, "select disk", 11) &&
+        (line[11] == '\0' || isspace((unsigned char)line[11])))
+    {
+        line += 11;
+        trim(line);
+        return select_disk(line);
+    }
+
     if (!strcasecmp(line, "list volume"))
     {
         list_volume();
@@ -216,7 +912,7 @@ int main(int argc, char **argv)
     show_header();
 
     if (timeout > 0)
-        sleep((unsigned int)timeout);
+        settle_devices(timeout);
 
     if (script != NULL)
         return run_script(script);
@@ -186,6 +186,54 @@ ListDisk(
 }
 
 
+static
+ULONG
+PrintMisalignedPartitions(
+    _In_ PLIST_ENTRY ListHead,
+    _In_ ULONG PartNumber)
+{
+    PLIST_ENTRY Entry;
+    PPARTENTRY PartEntry;
+    ULONG ulBoundary;
+
+    for (Entry = ListHead->Flink; Entry != ListHead; Entry = Entry->Flink)
+    {
+        PartEntry = CONTAINING_RECORD(Entry, PARTENTRY, ListEntry);
+
+        if (CurrentDisk->PartitionStyle == PARTITION_STYLE_GPT)
+        {
+            if (IsEqualGUID(&PartEntry->Gpt.PartitionType, &PARTITION_ENTRY_UNUSED_GUID))
+                continue;
+        }
+        else
+        {
+            if (PartEntry->Mbr.PartitionType == PARTITION_ENTRY_UNUSED)
+                continue;
+
+            /* The extended partition only holds the EBR chain */
+            if (IsContainerPartition(PartEntry->Mbr.PartitionType))
+            {
+                PartNumber++;
+                continue;
+            }
+        }
+
+        ulBoundary = GetPartitionMisalignment(CurrentDisk, PartEntry);
+        if (ulBoundary != 0)
+        {
+            ConResPrintf(StdOut,
+                         (ulBoundary == CurrentDisk->PhysicalSectorSize) ? IDS_LIST_PARTITION_MISALIGNED_SECTOR : IDS_LIST_PARTITION_MISALIGNED_STRIPE,
+                         PartNumber,
+                         ulBoundary);
+        }
+
+        PartNumber++;
+    }
+
+    return PartNumber;
+}
+
+
 EXIT_CODE
 ListPartition(
     _In_ INT argc,
@@ -270,7 +318,9 @@ ListPartition(
                              PartNumber++,
                              szPartitionTypeBuffer,
                              szSizeBuffer,
-                             szOffsetBuffer);
+                             szOffsetBuffer,
+                             PartEntry->FileSystemName,
+                             PartEntry->VolumeLabel);
             }
 
             Entry = Entry->Flink;
@@ -297,7 +347,9 @@ ListPartition(
                              PartNumber++,
                              szPartitionTypeBuffer,
                              szSizeBuffer,
-                             szOffsetBuffer);
+                             szOffsetBuffer,
+                             PartEntry->FileSystemName,
+                             PartEntry->VolumeLabel);
             }
 
             Entry = Entry->Flink;
@@ -348,13 +400,20 @@ ListPartition(
                              PartNumber++,
                              szPartitionTypeBuffer,
                              szSizeBuffer,
-                             szOffsetBuffer);
+                             szOffsetBuffer,
+                             PartEntry->FileSystemName,
+                             PartEntry->VolumeLabel);
             }
 
             Entry = Entry->Flink;
         }
     }
 
+    /* Numbering follows the table above: primary partitions first */
+    PartNumber = PrintMisalignedPartitions(&CurrentDisk->PrimaryPartListHead, 1);
+    if (CurrentDisk->PartitionStyle == PARTITION_STYLE_MBR)
+        PrintMisalignedPartitions(&CurrentDisk->LogicalPartListHead, PartNumber);
+
     ConPuts(StdOut, L"\n");
 
     return EXIT_SUCCESS;
@@ -0,0 +1,362 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/monitor.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+#include <conio.h>
+
+#define NDEBUG
+#include <debug.h>
+
+#define MONITOR_DEFAULT_INTERVAL    1000
+
+typedef struct _MONITOR_ENTRY
+{
+    HANDLE Handle;
+    ULONG DiskNumber;
+    ULONG PartitionNumber;  /* 0: whole disk */
+    BOOL Valid;
+    DISK_PERFORMANCE Last;
+} MONITOR_ENTRY, *PMONITOR_ENTRY;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+NTSTATUS
+OpenMonitorEntry(
+    _In_ PMONITOR_ENTRY MonitorEntry)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition%lu",
+                     MonitorEntry->DiskNumber,
+                     MonitorEntry->PartitionNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    /* Counters are queried without data access, so busy disks stay undisturbed */
+    return NtOpenFile(&MonitorEntry->Handle,
+                      FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+                      &ObjectAttributes,
+                      &Iosb,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      FILE_SYNCHRONOUS_IO_NONALERT);
+}
+
+
+static
+NTSTATUS
+SampleMonitorEntry(
+    _In_ PMONITOR_ENTRY MonitorEntry,
+    _Out_ PDISK_PERFORMANCE Performance)
+{
+    IO_STATUS_BLOCK Iosb;
+
+    return NtDeviceIoControlFile(MonitorEntry->Handle,
+                                 NULL,
+                                 NULL,
+                                 NULL,
+                                 &Iosb,
+                                 IOCTL_DISK_PERFORMANCE,
+                                 NULL,
+                                 0,
+                                 Performance,
+                                 sizeof(DISK_PERFORMANCE));
+}
+
+
+static
+VOID
+PrintMonitorEntry(
+    _In_ PMONITOR_ENTRY MonitorEntry,
+    _In_ PDISK_PERFORMANCE Current)
+{
+    ULONGLONG Elapsed, Reads, Writes, ServiceTime, IdleTime;
+    ULONGLONG Latency, Utilization;
+
+    /* All times are reported in 100ns units */
+    Elapsed = Current->QueryTime.QuadPart - MonitorEntry->Last.QueryTime.QuadPart;
+    if (Elapsed == 0)
+        Elapsed = 1;
+
+    Reads = Current->ReadCount - MonitorEntry->Last.ReadCount;
+    Writes = Current->WriteCount - MonitorEntry->Last.WriteCount;
+    ServiceTime = (Current->ReadTime.QuadPart - MonitorEntry->Last.ReadTime.QuadPart) +
+                  (Current->WriteTime.QuadPart - MonitorEntry->Last.WriteTime.QuadPart);
+    IdleTime = Current->IdleTime.QuadPart - MonitorEntry->Last.IdleTime.QuadPart;
+
+    Latency = ((Reads + Writes) != 0) ? (ServiceTime / 10) / (Reads + Writes) : 0;
+    Utilization = (IdleTime < Elapsed) ? 100 - ((IdleTime * 100) / Elapsed) : 0;
+
+    ConResPrintf(StdOut,
+                 (MonitorEntry->PartitionNumber == 0) ? IDS_MONITOR_DISK_FORMAT : IDS_MONITOR_PARTITION_FORMAT,
+                 (MonitorEntry->PartitionNumber == 0) ? MonitorEntry->DiskNumber : MonitorEntry->PartitionNumber,
+                 (Reads * 10000000) / Elapsed,
+                 (Writes * 10000000) / Elapsed,
+                 (((Current->BytesRead.QuadPart - MonitorEntry->Last.BytesRead.QuadPart) * 10000000) / Elapsed) / 1024,
+                 (((Current->BytesWritten.QuadPart - MonitorEntry->Last.BytesWritten.QuadPart) * 10000000) / Elapsed) / 1024,
+                 Latency,
+                 Current->QueueDepth,
+                 Utilization);
+}
+
+
+static
+VOID
+PrintMonitorFailure(
+    _In_ PMONITOR_ENTRY MonitorEntry)
+{
+    if (MonitorEntry->PartitionNumber == 0)
+        ConResPrintf(StdOut, IDS_MONITOR_FAIL, MonitorEntry->DiskNumber);
+    else
+        ConResPrintf(StdOut, IDS_MONITOR_PARTITION_FAIL,
+                     MonitorEntry->PartitionNumber,
+                     MonitorEntry->DiskNumber);
+}
+
+
+static
+ULONG
+AddMonitorPartitions(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PLIST_ENTRY ListHead,
+    _Out_opt_ PMONITOR_ENTRY MonitorEntries)
+{
+    PLIST_ENTRY Entry;
+    PPARTENTRY PartEntry;
+    ULONG Count = 0;
+
+    for (Entry = ListHead->Flink; Entry != ListHead; Entry = Entry->Flink)
+    {
+        PartEntry = CONTAINING_RECORD(Entry, PARTENTRY, ListEntry);
+        if (!PartEntry->IsPartitioned || (PartEntry->PartitionNumber == 0))
+            continue;
+
+        if (MonitorEntries != NULL)
+        {
+            MonitorEntries[Count].DiskNumber = DiskEntry->DiskNumber;
+            MonitorEntries[Count].PartitionNumber = PartEntry->PartitionNumber;
+        }
+
+        Count++;
+    }
+
+    return Count;
+}
+
+
+static
+ULONG
+AddMonitorDisk(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ BOOL bPartitions,
+    _Out_opt_ PMONITOR_ENTRY MonitorEntries)
+{
+    ULONG Count = 1;
+
+    if (MonitorEntries != NULL)
+    {
+        MonitorEntries[0].DiskNumber = DiskEntry->DiskNumber;
+        MonitorEntries[0].PartitionNumber = 0;
+    }
+
+    if (bPartitions)
+    {
+        Count += AddMonitorPartitions(DiskEntry,
+                                      &DiskEntry->PrimaryPartListHead,
+                                      (MonitorEntries != NULL) ? &MonitorEntries[Count] : NULL);
+        Count += AddMonitorPartitions(DiskEntry,
+                                      &DiskEntry->LogicalPartListHead,
+                                      (MonitorEntries != NULL) ? &MonitorEntries[Count] : NULL);
+    }
+
+    return Count;
+}
+
+
+static
+ULONG
+BuildMonitorList(
+    _In_ BOOL bAll,
+    _In_ BOOL bPartitions,
+    _Out_opt_ PMONITOR_ENTRY MonitorEntries)
+{
+    PLIST_ENTRY Entry;
+    PDISKENTRY DiskEntry;
+    ULONG Count = 0;
+
+    if (!bAll)
+        return AddMonitorDisk(CurrentDisk, bPartitions, MonitorEntries);
+
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
+        Count += AddMonitorDisk(DiskEntry,
+                                bPartitions,
+                                (MonitorEntries != NULL) ? &MonitorEntries[Count] : NULL);
+    }
+
+    return Count;
+}
+
+
+EXIT_CODE
+MonitorDisk(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    PMONITOR_ENTRY MonitorEntries = NULL;
+    DISK_PERFORMANCE Current;
+    ULONG ulInterval = MONITOR_DEFAULT_INTERVAL;
+    ULONG ulCount = 0, ulEntryCount, ulSample, i;
+    BOOL bAll = FALSE, bPartitions = FALSE, bOnce = FALSE;
+    PWSTR pszSuffix = NULL;
+    NTSTATUS Status;
+    INT j;
+
+    DPRINT("MonitorDisk()\n");
+
+    for (j = 2; j < argc; j++)
+    {
+        if (_wcsicmp(argv[j], L"all") == 0)
+        {
+            bAll = TRUE;
+        }
+        else if (_wcsicmp(argv[j], L"partitions") == 0)
+        {
+            bPartitions = TRUE;
+        }
+        else if (_wcsicmp(argv[j], L"once") == 0)
+        {
+            bOnce = TRUE;
+        }
+        else if (HasPrefix(argv[j], L"interval=", &pszSuffix))
+        {
+            /* interval=<N> (ms) */
+            ulInterval = wcstoul(pszSuffix, NULL, 10);
+            if (ulInterval == 0)
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[j], L"count=", &pszSuffix))
+        {
+            /* count=<N> */
+            ulCount = wcstoul(pszSuffix, NULL, 10);
+            if (ulCount == 0)
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (!bAll && (CurrentDisk == NULL))
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    /* ONCE prints a single interval, which is what scripts want */
+    if (bOnce)
+        ulCount = 1;
+
+    ulEntryCount = BuildMonitorList(bAll, bPartitions, NULL);
+    if (ulEntryCount == 0)
+        return EXIT_SUCCESS;
+
+    MonitorEntries = RtlAllocateHeap(RtlGetProcessHeap(),
+                                     HEAP_ZERO_MEMORY,
+                                     ulEntryCount * sizeof(MONITOR_ENTRY));
+    if (MonitorEntries == NULL)
+    {
+        DPRINT1("Failed to allocate the monitor list!\n");
+        return EXIT_SUCCESS;
+    }
+
+    BuildMonitorList(bAll, bPartitions, MonitorEntries);
+
+    /* Open every device once; each tick then costs one IOCTL per device */
+    for (i = 0; i < ulEntryCount; i++)
+    {
+        Status = OpenMonitorEntry(&MonitorEntries[i]);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("NtOpenFile() failed (Status 0x%08lx)\n", Status);
+            MonitorEntries[i].Handle = NULL;
+            PrintMonitorFailure(&MonitorEntries[i]);
+            continue;
+        }
+
+        Status = SampleMonitorEntry(&MonitorEntries[i], &MonitorEntries[i].Last);
+        MonitorEntries[i].Valid = NT_SUCCESS(Status);
+        if (!MonitorEntries[i].Valid)
+            PrintMonitorFailure(&MonitorEntries[i]);
+    }
+
+    if (ulCount == 0)
+        ConResPuts(StdOut, IDS_MONITOR_STOP);
+
+    for (ulSample = 1; (ulCount == 0) || (ulSample <= ulCount); ulSample++)
+    {
+        Sleep(ulInterval);
+
+        ConResPrintf(StdOut, IDS_MONITOR_SAMPLE, ulSample, ulInterval);
+        ConResPuts(StdOut, IDS_MONITOR_HEAD);
+        ConResPuts(StdOut, IDS_MONITOR_LINE);
+
+        for (i = 0; i < ulEntryCount; i++)
+        {
+            if (!MonitorEntries[i].Valid)
+                continue;
+
+            Status = SampleMonitorEntry(&MonitorEntries[i], &Current);
+            if (!NT_SUCCESS(Status))
+            {
+                MonitorEntries[i].Valid = FALSE;
+                continue;
+            }
+
+            PrintMonitorEntry(&MonitorEntries[i], &Current);
+            MonitorEntries[i].Last = Current;
+        }
+
+        if ((ulCount == 0) && _kbhit())
+        {
+            _getwch();
+            break;
+        }
+    }
+
+    ConPuts(StdOut, L"\n");
+
+    for (i = 0; i < ulEntryCount; i++)
+    {
+        if (MonitorEntries[i].Handle != NULL)
+            NtClose(MonitorEntries[i].Handle);
+    }
+
+    RtlFreeHeap(RtlGetProcessHeap(), 0, MonitorEntries);
+
+    return EXIT_SUCCESS;
+}
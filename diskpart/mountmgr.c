@@ -410,3 +410,92 @@ done:
 
     return Ret;
 }
+
+
+/*
+ * Waits until the mount manager database changes, for at most the given
+ * number of milliseconds. EpicNumber holds the change count that was seen
+ * last and receives the new one. Returns STATUS_TIMEOUT if nothing changed.
+ */
+NTSTATUS
+WaitForMountManagerChange(
+    _Inout_ PULONG EpicNumber,
+    _In_ ULONG ulMilliseconds)
+{
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    UNICODE_STRING DeviceName;
+    MOUNTMGR_CHANGE_NOTIFY_INFO Info;
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER Timeout;
+    HANDLE MountMgrHandle;
+    HANDLE EventHandle;
+    NTSTATUS Status;
+
+    RtlInitUnicodeString(&DeviceName, MOUNTMGR_DEVICE_NAME);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &DeviceName,
+                               0,
+                               NULL,
+                               NULL);
+
+    /* Asynchronous, so the wait can time out */
+    Status = NtOpenFile(&MountMgrHandle,
+                        GENERIC_READ,
+                        &ObjectAttributes,
+                        &Iosb,
+                        0,
+                        0);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("NtOpenFile() Status 0x%08lx\n", Status);
+        return Status;
+    }
+
+    Status = NtCreateEvent(&EventHandle,
+                           EVENT_ALL_ACCESS,
+                           NULL,
+                           NotificationEvent,
+                           FALSE);
+    if (!NT_SUCCESS(Status))
+    {
+        NtClose(MountMgrHandle);
+        return Status;
+    }
+
+    /* Completes as soon as the epic number differs from the given one */
+    Info.EpicNumber = *EpicNumber;
+    Status = NtDeviceIoControlFile(MountMgrHandle,
+                                   EventHandle,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_MOUNTMGR_CHANGE_NOTIFY,
+                                   &Info,
+                                   sizeof(Info),
+                                   &Info,
+                                   sizeof(Info));
+    if (Status == STATUS_PENDING)
+    {
+        Timeout.QuadPart = -(LONGLONG)ulMilliseconds * 10000;
+        Status = NtWaitForSingleObject(EventHandle, FALSE, &Timeout);
+        if (Status == STATUS_TIMEOUT)
+        {
+            NtCancelIoFile(MountMgrHandle, &Iosb);
+            NtWaitForSingleObject(EventHandle, FALSE, NULL);
+            Status = STATUS_TIMEOUT;
+        }
+        else
+        {
+            Status = Iosb.Status;
+        }
+    }
+
+    if (NT_SUCCESS(Status) && (Status != STATUS_TIMEOUT))
+        *EpicNumber = Info.EpicNumber;
+
+    NtClose(EventHandle);
+    NtClose(MountMgrHandle);
+
+    return Status;
+}
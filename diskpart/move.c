@@ -0,0 +1,953 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/move.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define MOVE_JOURNAL_MAGIC          0x4C4E4A4D  /* "MJNL" */
+#define MOVE_JOURNAL_VERSION        1
+#define MOVE_JOURNAL_DATA_OFFSET    4096
+#define MOVE_DEFAULT_JOURNAL        L"\\SystemRoot\\diskpart.jnl"
+#define MOVE_CHUNK_SIZE             (8 * 1024 * 1024)
+
+/*
+ * The journal is rewritten after every chunk. A chunk whose write would
+ * overwrite its own source (a shift smaller than a chunk) is saved in the
+ * journal first, so an interrupted move can always be resumed.
+ */
+typedef struct _MOVE_JOURNAL
+{
+    ULONG Magic;
+    ULONG Version;
+    ULONG DiskNumber;
+    ULONG BytesPerSector;
+    ULONGLONG DiskSectorCount;
+    ULONGLONG OldStartSector;
+    ULONGLONG NewStartSector;
+    ULONGLONG SectorCount;
+    ULONG ChunkSectors;
+    ULONG DataSaved;        /* The data of NextChunk follows the header */
+    ULONGLONG NextChunk;
+} MOVE_JOURNAL, *PMOVE_JOURNAL;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+NTSTATUS
+OpenMoveJournal(
+    _In_opt_ PWSTR pszFileName,
+    _In_ ULONG CreateDisposition,
+    _Out_ PHANDLE JournalHandle)
+{
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    if (pszFileName == NULL)
+    {
+        RtlInitUnicodeString(&Name, MOVE_DEFAULT_JOURNAL);
+    }
+    else if (!RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+    {
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    /* Every journal update must be on the media before the next chunk is written */
+    Status = NtCreateFile(JournalHandle,
+                          FILE_GENERIC_READ | FILE_GENERIC_WRITE | DELETE,
+                          &ObjectAttributes,
+                          &Iosb,
+                          NULL,
+                          FILE_ATTRIBUTE_NORMAL,
+                          0,
+                          CreateDisposition,
+                          FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE | FILE_WRITE_THROUGH,
+                          NULL,
+                          0);
+
+    if (pszFileName != NULL)
+        RtlFreeUnicodeString(&Name);
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+WriteMoveJournal(
+    _In_ HANDLE JournalHandle,
+    _In_ PMOVE_JOURNAL Journal,
+    _In_opt_ PVOID Data,
+    _In_ ULONG DataLength)
+{
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER FileOffset;
+    NTSTATUS Status;
+
+    /* The data goes first: the header must never point to a partial copy */
+    if (Data != NULL)
+    {
+        FileOffset.QuadPart = MOVE_JOURNAL_DATA_OFFSET;
+        Status = NtWriteFile(JournalHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &Iosb,
+                             Data,
+                             DataLength,
+                             &FileOffset,
+                             NULL);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    FileOffset.QuadPart = 0;
+    return NtWriteFile(JournalHandle,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &Iosb,
+                       Journal,
+                       sizeof(MOVE_JOURNAL),
+                       &FileOffset,
+                       NULL);
+}
+
+
+static
+VOID
+DeleteMoveJournal(
+    _In_ HANDLE JournalHandle)
+{
+    FILE_DISPOSITION_INFORMATION DispositionInfo;
+    IO_STATUS_BLOCK Iosb;
+
+    DispositionInfo.DeleteFile = TRUE;
+    NtSetInformationFile(JournalHandle,
+                         &Iosb,
+                         &DispositionInfo,
+                         sizeof(DispositionInfo),
+                         FileDispositionInformation);
+}
+
+
+static
+VOID
+GetMoveChunk(
+    _In_ PMOVE_JOURNAL Journal,
+    _In_ ULONGLONG ullChunk,
+    _Out_ PULONGLONG pullOffset,
+    _Out_ PULONG pulSectors)
+{
+    ULONGLONG ullEnd;
+
+    /*
+     * Moving down copies from the start of the partition, moving up copies
+     * from its end, so that no chunk overwrites source data not yet copied.
+     */
+    if (Journal->NewStartSector < Journal->OldStartSector)
+    {
+        *pullOffset = ullChunk * Journal->ChunkSectors;
+        *pulSectors = (ULONG)min((ULONGLONG)Journal->ChunkSectors, Journal->SectorCount - *pullOffset);
+    }
+    else
+    {
+        ullEnd = Journal->SectorCount - (ullChunk * Journal->ChunkSectors);
+        *pulSectors = (ULONG)min((ULONGLONG)Journal->ChunkSectors, ullEnd);
+        *pullOffset = ullEnd - *pulSectors;
+    }
+}
+
+
+/*
+ * The boot sector of FAT and NTFS volumes records the start of the partition
+ * in its hidden sectors field. Boot code relies on it, so it follows the move.
+ */
+static
+NTSTATUS
+UpdateHiddenSectors(
+    _In_ PIO_ENGINE Engine,
+    _In_ PUCHAR Buffer,
+    _In_ PMOVE_JOURNAL Journal)
+{
+    ULONGLONG ullOffset;
+    NTSTATUS Status;
+
+    /* The field has 32 bits, a truncated start would point boot code elsewhere */
+    if ((Journal->OldStartSector > MAXULONG) || (Journal->NewStartSector > MAXULONG))
+    {
+        ConResPuts(StdOut, IDS_MOVE_HIDDEN_SECTORS);
+        return STATUS_SUCCESS;
+    }
+
+    ullOffset = Journal->NewStartSector * Journal->BytesPerSector;
+
+    Status = ReadIoEngine(Engine, ullOffset, Buffer, Journal->BytesPerSector);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if ((*(PUSHORT)&Buffer[510] != 0xAA55) ||
+        (*(PULONG)&Buffer[0x1C] != (ULONG)Journal->OldStartSector))
+        return STATUS_SUCCESS;
+
+    *(PULONG)&Buffer[0x1C] = (ULONG)Journal->NewStartSector;
+
+    Status = WriteIoEngine(Engine, ullOffset, Buffer, Journal->BytesPerSector);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    return FlushIoEngine(Engine);
+}
+
+
+/*
+ * Copies the partition through the engine that is set with SET IO. Chunk N
+ * is written while chunk N+1 is read into the other buffer, and the engine
+ * is flushed to the media before the journal records the chunk as done.
+ */
+static
+NTSTATUS
+CopyPartitionData(
+    _In_ PIO_ENGINE Engine,
+    _In_ HANDLE JournalHandle,
+    _In_ PMOVE_JOURNAL Journal)
+{
+    PUCHAR Buffers[2];
+    PUCHAR BufferBase;
+    SIZE_T ChunkSize;
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER FileOffset, Frequency, StartTime, Now;
+    ULONGLONG ullChunkCount, ullOffset, ullNextOffset, ullBytes = 0, ullElapsedMs;
+    ULONG ulSectors, ulNextSectors, ulLength, Current = 0;
+    BOOL bSaveData;
+    NTSTATUS Status;
+
+    ullChunkCount = (Journal->SectorCount + Journal->ChunkSectors - 1) / Journal->ChunkSectors;
+
+    /* A write overlaps its own source only if the shift is smaller than a chunk */
+    if (Journal->NewStartSector < Journal->OldStartSector)
+        bSaveData = (Journal->OldStartSector - Journal->NewStartSector) < Journal->ChunkSectors;
+    else
+        bSaveData = (Journal->NewStartSector - Journal->OldStartSector) < Journal->ChunkSectors;
+
+    ChunkSize = (SIZE_T)Journal->ChunkSectors * Journal->BytesPerSector;
+    BufferBase = AllocateIoBuffer(2 * ChunkSize);
+    if (BufferBase == NULL)
+        return STATUS_NO_MEMORY;
+
+    Buffers[0] = BufferBase;
+    Buffers[1] = BufferBase + ChunkSize;
+
+    NtQueryPerformanceCounter(&StartTime, &Frequency);
+
+    /* Load the first chunk, from the journal if its source may be damaged */
+    if (Journal->NextChunk < ullChunkCount)
+    {
+        GetMoveChunk(Journal, Journal->NextChunk, &ullOffset, &ulSectors);
+        ulLength = ulSectors * Journal->BytesPerSector;
+
+        if (Journal->DataSaved)
+        {
+            FileOffset.QuadPart = MOVE_JOURNAL_DATA_OFFSET;
+            Status = NtReadFile(JournalHandle,
+                                NULL,
+                                NULL,
+                                NULL,
+                                &Iosb,
+                                Buffers[0],
+                                ulLength,
+                                &FileOffset,
+                                NULL);
+        }
+        else
+        {
+            Status = ReadIoEngine(Engine,
+                                  (Journal->OldStartSector + ullOffset) * Journal->BytesPerSector,
+                                  Buffers[0],
+                                  ulLength);
+        }
+
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Failed to read the first chunk (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+    }
+
+    /* Write chunk N while chunk N+1 is read into the other buffer */
+    while (Journal->NextChunk < ullChunkCount)
+    {
+        GetMoveChunk(Journal, Journal->NextChunk, &ullOffset, &ulSectors);
+        ulLength = ulSectors * Journal->BytesPerSector;
+
+        if (bSaveData && !Journal->DataSaved)
+        {
+            Journal->DataSaved = TRUE;
+            Status = WriteMoveJournal(JournalHandle, Journal, Buffers[Current], ulLength);
+            if (!NT_SUCCESS(Status))
+            {
+                DPRINT1("WriteMoveJournal() failed (Status 0x%08lx)\n", Status);
+                goto done;
+            }
+        }
+
+        Status = WriteIoEngine(Engine,
+                               (Journal->NewStartSector + ullOffset) * Journal->BytesPerSector,
+                               Buffers[Current],
+                               ulLength);
+
+        if (NT_SUCCESS(Status) && (Journal->NextChunk + 1 < ullChunkCount))
+        {
+            GetMoveChunk(Journal, Journal->NextChunk + 1, &ullNextOffset, &ulNextSectors);
+            Status = QueueReadIoEngine(Engine,
+                                       (Journal->OldStartSector + ullNextOffset) * Journal->BytesPerSector,
+                                       Buffers[Current ^ 1],
+                                       ulNextSectors * Journal->BytesPerSector);
+        }
+
+        /* The chunk must be on the media before the journal moves past it */
+        if (NT_SUCCESS(Status))
+            Status = FlushIoEngine(Engine);
+
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("Chunk %I64u failed (Status 0x%08lx)\n", Journal->NextChunk, Status);
+            goto done;
+        }
+
+        ullBytes += ulLength;
+
+        Journal->NextChunk++;
+        Journal->DataSaved = FALSE;
+        Status = WriteMoveJournal(JournalHandle, Journal, NULL, 0);
+        if (!NT_SUCCESS(Status))
+        {
+            DPRINT1("WriteMoveJournal() failed (Status 0x%08lx)\n", Status);
+            goto done;
+        }
+
+        ConResPrintf(StdOut, IDS_MOVE_PROGRESS, (ULONG)((Journal->NextChunk * 100) / ullChunkCount));
+        Current ^= 1;
+    }
+
+    Status = UpdateHiddenSectors(Engine, Buffers[0], Journal);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("UpdateHiddenSectors() failed (Status 0x%08lx)\n", Status);
+        goto done;
+    }
+
+    NtQueryPerformanceCounter(&Now, NULL);
+    ullElapsedMs = ((ULONGLONG)(Now.QuadPart - StartTime.QuadPart) * 1000) / Frequency.QuadPart;
+    if (ullElapsedMs == 0)
+        ullElapsedMs = 1;
+
+    ConResPrintf(StdOut, IDS_MOVE_THROUGHPUT,
+                 ullBytes / (SIZE_1KB * SIZE_1KB),
+                 ullElapsedMs,
+                 ((ullBytes / SIZE_1KB) * 1000) / ullElapsedMs / 1024);
+
+done:
+    /* Never release buffers that are still owned by pending requests */
+    FlushIoEngine(Engine);
+    FreeIoBuffer(BufferBase);
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+OpenMoveDevice(
+    _In_ ULONG DiskNumber,
+    _In_ ULONG PartitionNumber,
+    _In_ ULONG OpenOptions,
+    _Out_ PHANDLE FileHandle)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition%lu",
+                     DiskNumber,
+                     PartitionNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    return NtOpenFile(FileHandle,
+                      GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
+                      &ObjectAttributes,
+                      &Iosb,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE,
+                      OpenOptions);
+}
+
+
+/*
+ * Locks and dismounts the volume on the partition. The returned handle keeps
+ * the volume locked until the new partition layout has been written.
+ */
+static
+NTSTATUS
+LockMovePartition(
+    _In_ PPARTENTRY PartEntry,
+    _Out_ PHANDLE VolumeHandle)
+{
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    *VolumeHandle = NULL;
+
+    if (PartEntry->PartitionNumber == 0)
+        return STATUS_SUCCESS;
+
+    Status = OpenMoveDevice(PartEntry->DiskEntry->DiskNumber,
+                            PartEntry->PartitionNumber,
+                            FILE_SYNCHRONOUS_IO_NONALERT,
+                            VolumeHandle);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtFsControlFile(*VolumeHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &Iosb,
+                             FSCTL_LOCK_VOLUME,
+                             NULL,
+                             0,
+                             NULL,
+                             0);
+    if (NT_SUCCESS(Status))
+    {
+        Status = NtFsControlFile(*VolumeHandle,
+                                 NULL,
+                                 NULL,
+                                 NULL,
+                                 &Iosb,
+                                 FSCTL_DISMOUNT_VOLUME,
+                                 NULL,
+                                 0,
+                                 NULL,
+                                 0);
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        NtClose(*VolumeHandle);
+        *VolumeHandle = NULL;
+    }
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+CommitMove(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PPARTENTRY PartEntry,
+    _In_ ULONGLONG ullNewStartSector)
+{
+    PartEntry->StartSector.QuadPart = ullNewStartSector;
+    DiskEntry->Dirty = TRUE;
+
+    if (DiskEntry->PartitionStyle == PARTITION_STYLE_GPT)
+    {
+        UpdateGptDiskLayout(DiskEntry, FALSE);
+        return WriteGptPartitions(DiskEntry);
+    }
+
+    UpdateMbrDiskLayout(DiskEntry);
+    return WriteMbrPartitions(DiskEntry);
+}
+
+
+static
+VOID
+RunMove(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PPARTENTRY PartEntry,
+    _In_ HANDLE JournalHandle,
+    _In_ PMOVE_JOURNAL Journal)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    IO_ENGINE Engine;
+    HANDLE VolumeHandle = NULL;
+    NTSTATUS Status;
+
+    Status = LockMovePartition(PartEntry, &VolumeHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("LockMovePartition() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_MOVE_PARTITION_IN_USE);
+        return;
+    }
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition0",
+                     DiskEntry->DiskNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    Status = OpenIoEngine(&Engine,
+                          &Name,
+                          GENERIC_READ | GENERIC_WRITE,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE);
+    if (NT_SUCCESS(Status))
+        Status = CopyPartitionData(&Engine, JournalHandle, Journal);
+    else
+        DPRINT1("OpenIoEngine() failed (Status 0x%08lx)\n", Status);
+
+    CloseIoEngine(&Engine);
+    if (!NT_SUCCESS(Status))
+        goto done;
+
+    Status = CommitMove(DiskEntry, PartEntry, Journal->NewStartSector);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("CommitMove() failed (Status 0x%08lx)\n", Status);
+        goto done;
+    }
+
+    DeleteMoveJournal(JournalHandle);
+
+done:
+    if (VolumeHandle != NULL)
+        NtClose(VolumeHandle);
+
+    if (!NT_SUCCESS(Status))
+    {
+        ConResPuts(StdOut, IDS_MOVE_PARTITION_FAIL);
+        return;
+    }
+
+    RescanAndSelect(Journal->DiskNumber, Journal->NewStartSector);
+    ConResPuts(StdOut, IDS_MOVE_PARTITION_SUCCESS);
+}
+
+
+static
+BOOL
+IsMoveTargetFree(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PPARTENTRY PartEntry,
+    _In_ ULONGLONG ullNewStartSector)
+{
+    PPARTENTRY PrevPartEntry, NextPartEntry;
+    ULONGLONG ullLow, ullHigh;
+
+    /* The partition may only slide into the unpartitioned space around it */
+    ullLow = PartEntry->StartSector.QuadPart;
+    ullHigh = PartEntry->StartSector.QuadPart + PartEntry->SectorCount.QuadPart;
+
+    PrevPartEntry = GetPrevUnpartitionedEntry(PartEntry);
+    if (PrevPartEntry != NULL)
+        ullLow = PrevPartEntry->StartSector.QuadPart;
+
+    NextPartEntry = GetNextUnpartitionedEntry(PartEntry);
+    if (NextPartEntry != NULL)
+        ullHigh = NextPartEntry->StartSector.QuadPart + NextPartEntry->SectorCount.QuadPart;
+
+    ullLow = max(ullLow, DiskEntry->StartSector.QuadPart);
+    ullHigh = min(ullHigh, DiskEntry->EndSector.QuadPart + 1);
+
+    return (ullNewStartSector >= ullLow) &&
+           (ullNewStartSector + PartEntry->SectorCount.QuadPart <= ullHigh);
+}
+
+
+static
+BOOL
+IsMovablePartition(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PPARTENTRY PartEntry)
+{
+    /* Logical partitions drag their EBR chain along, which is not supported */
+    if (PartEntry->LogicalPartition)
+        return FALSE;
+
+    if ((DiskEntry->PartitionStyle == PARTITION_STYLE_MBR) &&
+        IsContainerPartition(PartEntry->Mbr.PartitionType))
+        return FALSE;
+
+    return TRUE;
+}
+
+
+static
+VOID
+StartMove(
+    _In_ ULONGLONG ullNewStartSector,
+    _In_opt_ PWSTR pszJournal)
+{
+    MOVE_JOURNAL Journal;
+    HANDLE JournalHandle = NULL;
+    NTSTATUS Status;
+
+    if (!IsMovablePartition(CurrentDisk, CurrentPartition))
+    {
+        ConResPuts(StdOut, IDS_MOVE_PARTITION_TYPE);
+        return;
+    }
+
+    if (ullNewStartSector == CurrentPartition->StartSector.QuadPart)
+    {
+        ConResPuts(StdOut, IDS_MOVE_PARTITION_ALREADY);
+        return;
+    }
+
+    if (!IsMoveTargetFree(CurrentDisk, CurrentPartition, ullNewStartSector))
+    {
+        ConResPuts(StdOut, IDS_MOVE_PARTITION_NO_SPACE);
+        return;
+    }
+
+    /* An existing journal belongs to an interrupted move */
+    Status = OpenMoveJournal(pszJournal, FILE_CREATE, &JournalHandle);
+    if (Status == STATUS_OBJECT_NAME_COLLISION)
+    {
+        ConResPuts(StdOut, IDS_MOVE_JOURNAL_PENDING);
+        return;
+    }
+    else if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("OpenMoveJournal() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_MOVE_JOURNAL_FAIL);
+        return;
+    }
+
+    RtlZeroMemory(&Journal, sizeof(Journal));
+    Journal.Magic = MOVE_JOURNAL_MAGIC;
+    Journal.Version = MOVE_JOURNAL_VERSION;
+    Journal.DiskNumber = CurrentDisk->DiskNumber;
+    Journal.BytesPerSector = CurrentDisk->BytesPerSector;
+    Journal.DiskSectorCount = CurrentDisk->SectorCount.QuadPart;
+    Journal.OldStartSector = CurrentPartition->StartSector.QuadPart;
+    Journal.NewStartSector = ullNewStartSector;
+    Journal.SectorCount = CurrentPartition->SectorCount.QuadPart;
+    Journal.ChunkSectors = MOVE_CHUNK_SIZE / CurrentDisk->BytesPerSector;
+
+    Status = WriteMoveJournal(JournalHandle, &Journal, NULL, 0);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("WriteMoveJournal() failed (Status 0x%08lx)\n", Status);
+        DeleteMoveJournal(JournalHandle);
+        NtClose(JournalHandle);
+        ConResPuts(StdOut, IDS_MOVE_JOURNAL_FAIL);
+        return;
+    }
+
+    RunMove(CurrentDisk, CurrentPartition, JournalHandle, &Journal);
+
+    NtClose(JournalHandle);
+}
+
+
+static
+VOID
+ResumeMove(
+    _In_opt_ PWSTR pszJournal)
+{
+    MOVE_JOURNAL Journal;
+    HANDLE JournalHandle = NULL;
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER FileOffset;
+    PLIST_ENTRY DiskListEntry, PartListEntry;
+    PDISKENTRY DiskEntry = NULL;
+    PPARTENTRY PartEntry = NULL;
+    ULONGLONG ullChunkCount;
+    NTSTATUS Status;
+
+    Status = OpenMoveJournal(pszJournal, FILE_OPEN, &JournalHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        ConResPuts(StdOut, IDS_MOVE_RESUME_NONE);
+        return;
+    }
+
+    FileOffset.QuadPart = 0;
+    Status = NtReadFile(JournalHandle,
+                        NULL,
+                        NULL,
+                        NULL,
+                        &Iosb,
+                        &Journal,
+                        sizeof(Journal),
+                        &FileOffset,
+                        NULL);
+    if (!NT_SUCCESS(Status) ||
+        (Iosb.Information != sizeof(Journal)) ||
+        (Journal.Magic != MOVE_JOURNAL_MAGIC) ||
+        (Journal.Version != MOVE_JOURNAL_VERSION) ||
+        (Journal.ChunkSectors == 0))
+    {
+        ConResPuts(StdOut, IDS_MOVE_RESUME_NONE);
+        goto done;
+    }
+
+    /* Disk numbers may change across reboots, so the geometry must match too */
+    for (DiskListEntry = DiskListHead.Flink;
+         DiskListEntry != &DiskListHead;
+         DiskListEntry = DiskListEntry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(DiskListEntry, DISKENTRY, ListEntry);
+        if ((DiskEntry->DiskNumber == Journal.DiskNumber) &&
+            (DiskEntry->BytesPerSector == Journal.BytesPerSector) &&
+            (DiskEntry->SectorCount.QuadPart == Journal.DiskSectorCount))
+            break;
+
+        DiskEntry = NULL;
+    }
+
+    if (DiskEntry != NULL)
+    {
+        for (PartListEntry = DiskEntry->PrimaryPartListHead.Flink;
+             PartListEntry != &DiskEntry->PrimaryPartListHead;
+             PartListEntry = PartListEntry->Flink)
+        {
+            PartEntry = CONTAINING_RECORD(PartListEntry, PARTENTRY, ListEntry);
+            if (PartEntry->IsPartitioned &&
+                (PartEntry->SectorCount.QuadPart == Journal.SectorCount) &&
+                ((PartEntry->StartSector.QuadPart == Journal.OldStartSector) ||
+                 (PartEntry->StartSector.QuadPart == Journal.NewStartSector)))
+                break;
+
+            PartEntry = NULL;
+        }
+    }
+
+    if (PartEntry == NULL)
+    {
+        ConResPuts(StdOut, IDS_MOVE_RESUME_NONE);
+        goto done;
+    }
+
+    /* The layout was written, only the journal was left behind */
+    if (PartEntry->StartSector.QuadPart == Journal.NewStartSector)
+    {
+        DeleteMoveJournal(JournalHandle);
+        RescanAndSelect(Journal.DiskNumber, Journal.NewStartSector);
+        ConResPuts(StdOut, IDS_MOVE_PARTITION_SUCCESS);
+        goto done;
+    }
+
+    ullChunkCount = (Journal.SectorCount + Journal.ChunkSectors - 1) / Journal.ChunkSectors;
+    ConResPrintf(StdOut, IDS_MOVE_RESUME,
+                 Journal.DiskNumber,
+                 (ULONG)((min(Journal.NextChunk, ullChunkCount) * 100) / ullChunkCount));
+
+    RunMove(DiskEntry, PartEntry, JournalHandle, &Journal);
+
+done:
+    NtClose(JournalHandle);
+}
+
+
+EXIT_CODE
+MovePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    ULONGLONG ullNewStartSector = 0;
+    PWSTR pszJournal = NULL;
+    PWSTR pszSuffix = NULL;
+    BOOL bResume = FALSE;
+    INT i;
+
+    DPRINT("MovePartition()\n");
+
+    for (i = 2; i < argc; i++)
+    {
+        if (_wcsicmp(argv[i], L"resume") == 0)
+        {
+            bResume = TRUE;
+        }
+        else if (HasPrefix(argv[i], L"journal=", &pszSuffix))
+        {
+            /* journal=<file> */
+            if (pszJournal != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszJournal);
+
+            pszJournal = DuplicateQuotedString(pszSuffix);
+            if (pszJournal == NULL)
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else if (HasPrefix(argv[i], L"offset=", &pszSuffix))
+        {
+            /* offset=<N> (KB) */
+            if ((CurrentDisk == NULL) || !ParseOffset(pszSuffix, &ullNewStartSector))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                goto done;
+            }
+        }
+        else
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            goto done;
+        }
+    }
+
+    /* RESUME finds its disk and partition in the journal */
+    if (bResume)
+    {
+        if (ullNewStartSector != 0)
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        else
+            ResumeMove(pszJournal);
+        goto done;
+    }
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        goto done;
+    }
+
+    if (CurrentPartition == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+        goto done;
+    }
+
+    if (ullNewStartSector == 0)
+    {
+        ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+        goto done;
+    }
+
+    StartMove(ullNewStartSector, pszJournal);
+
+done:
+    if (pszJournal != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszJournal);
+
+    return EXIT_SUCCESS;
+}
+
+
+EXIT_CODE
+RealignPartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    ULONGLONG ullStartSector, ullNewStartSector;
+    ULONG ulAlignment = 0;
+    PWSTR pszJournal = NULL;
+    PWSTR pszSuffix = NULL;
+    INT i;
+
+    DPRINT("RealignPartition()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    if (CurrentPartition == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"align=", &pszSuffix))
+        {
+            /* align=<N> (KB) */
+            if (!ParseAlignment(pszSuffix, &ulAlignment))
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                goto done;
+            }
+        }
+        else if (HasPrefix(argv[i], L"journal=", &pszSuffix))
+        {
+            /* journal=<file> */
+            if (pszJournal != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszJournal);
+
+            pszJournal = DuplicateQuotedString(pszSuffix);
+            if (pszJournal == NULL)
+            {
+                ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+                return EXIT_SUCCESS;
+            }
+        }
+        else
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            goto done;
+        }
+    }
+
+    /* The disk alignment already covers its physical sector and stripe sizes */
+    if (ulAlignment == 0)
+        ulAlignment = CurrentDisk->SectorAlignment;
+
+    ullStartSector = CurrentPartition->StartSector.QuadPart;
+    if ((ullStartSector >= CurrentDisk->AlignmentOffset) &&
+        (((ullStartSector - CurrentDisk->AlignmentOffset) % ulAlignment) == 0))
+    {
+        ConResPuts(StdOut, IDS_REALIGN_PARTITION_ALREADY);
+        goto done;
+    }
+
+    /* Prefer the boundary below the partition, it keeps the free space behind it */
+    ullNewStartSector = 0;
+    if (ullStartSector >= CurrentDisk->AlignmentOffset + ulAlignment)
+    {
+        ullNewStartSector = AlignDown(ullStartSector - CurrentDisk->AlignmentOffset, ulAlignment) +
+                            CurrentDisk->AlignmentOffset;
+        if (!IsMoveTargetFree(CurrentDisk, CurrentPartition, ullNewStartSector))
+            ullNewStartSector = 0;
+    }
+
+    if (ullNewStartSector == 0)
+    {
+        ullNewStartSector = AlignDown(max(ullStartSector, (ULONGLONG)CurrentDisk->AlignmentOffset) -
+                                      CurrentDisk->AlignmentOffset + ulAlignment - 1, ulAlignment) +
+                            CurrentDisk->AlignmentOffset;
+        if (!IsMoveTargetFree(CurrentDisk, CurrentPartition, ullNewStartSector))
+        {
+            ConResPuts(StdOut, IDS_MOVE_PARTITION_NO_SPACE);
+            goto done;
+        }
+    }
+
+    StartMove(ullNewStartSector, pszJournal);
+
+done:
+    if (pszJournal != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszJournal);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,566 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/parallel.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+/*
+ * Runs the parts of a script that use different disks in parallel (/J).
+ *
+ * The script is split into segments: a SELECT DISK <N> line and the lines
+ * after it that only use the selected disk. Any other line is a barrier that
+ * runs alone, once everything before it has finished. The segments between
+ * two barriers run in lock step, like a FOREACH block, one line at a time on
+ * each segment whose disk has no job left, and their long commands run as
+ * jobs. Segments on the same disk run in script order.
+ *
+ * The output of each segment is captured in a temporary file and replayed in
+ * script order, so the output reads as if the script had run serially.
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+typedef enum _LINE_KIND
+{
+    LineBarrier,        /* Runs alone, after everything before it */
+    LineSelectDisk,     /* SELECT DISK <N>, starts a segment */
+    LineDiskLocal       /* Only uses the selected disk */
+} LINE_KIND;
+
+typedef enum _SEGMENT_STATE
+{
+    SegmentWaiting,
+    SegmentRunning,
+    SegmentDraining,    /* All lines ran, jobs of the disk are left */
+    SegmentDone
+} SEGMENT_STATE;
+
+typedef struct _SEGMENT
+{
+    ULONG DiskNumber;
+    ULONG FirstLine;
+    ULONG LineCount;
+    ULONG NextLine;         /* Relative to FirstLine */
+    SEGMENT_STATE State;
+    SELECTION Selection;
+    HANDLE OutputHandle;    /* Captured output */
+} SEGMENT, *PSEGMENT;
+
+typedef struct _SCRIPT
+{
+    PWSTR *Lines;
+    ULONG LineCount;
+    PSEGMENT Segments;      /* At most one segment per line */
+} SCRIPT, *PSCRIPT;
+
+/* Commands that only use the selected disk; a NULL second word matches any */
+static PCWSTR DiskCommands[][2] =
+{
+    {L"active", NULL},
+    {L"attributes", L"disk"},
+    {L"clean", NULL},
+    {L"convert", NULL},
+    {L"create", L"partition"},
+    {L"delete", L"partition"},
+    {L"detail", L"disk"},
+    {L"detail", L"partition"},
+    {L"gpt", NULL},
+    {L"inactive", NULL},
+    {L"list", L"partition"},
+    {L"rem", NULL},
+    {L"select", L"partition"},
+    {L"setid", NULL},
+    {L"uniqueid", L"disk"}
+};
+
+/* Commands that manage jobs themselves; scripts with them run serially */
+static PCWSTR JobCommands[] =
+{
+    L"cancel", L"foreach", L"jobs", L"wait"
+};
+
+/* FUNCTIONS ******************************************************************/
+
+static
+INT
+SplitLine(
+    _Inout_ PWSTR pszLine,
+    _Out_writes_(MaxArgs) PWSTR *argv,
+    _In_ INT MaxArgs)
+{
+    BOOL bWhiteSpace = TRUE;
+    INT argc = 0;
+
+    for (; *pszLine != UNICODE_NULL; pszLine++)
+    {
+        if (iswspace(*pszLine))
+        {
+            *pszLine = UNICODE_NULL;
+            bWhiteSpace = TRUE;
+        }
+        else if (bWhiteSpace)
+        {
+            if (argc == MaxArgs)
+                break;
+
+            argv[argc++] = pszLine;
+            bWhiteSpace = FALSE;
+        }
+    }
+
+    return argc;
+}
+
+
+static
+LINE_KIND
+GetLineKind(
+    _In_ PCWSTR pszLine,
+    _Out_ PULONG pulDiskNumber)
+{
+    WCHAR szBuffer[MAX_STRING_SIZE];
+    PWSTR argv[4];
+    INT argc;
+    ULONG Index;
+
+    *pulDiskNumber = JOB_NO_DISK;
+
+    StringCchCopyW(szBuffer, ARRAYSIZE(szBuffer), pszLine);
+    argc = SplitLine(szBuffer, argv, ARRAYSIZE(argv));
+    if (argc == 0)
+        return LineDiskLocal;
+
+    if ((argc == 3) &&
+        (_wcsicmp(argv[0], L"select") == 0) &&
+        (_wcsicmp(argv[1], L"disk") == 0) &&
+        IsDecString(argv[2]))
+    {
+        *pulDiskNumber = wcstoul(argv[2], NULL, 10);
+        return LineSelectDisk;
+    }
+
+    for (Index = 0; Index < ARRAYSIZE(DiskCommands); Index++)
+    {
+        if ((_wcsicmp(argv[0], DiskCommands[Index][0]) == 0) &&
+            ((DiskCommands[Index][1] == NULL) ||
+             ((argc >= 2) && (_wcsicmp(argv[1], DiskCommands[Index][1]) == 0))))
+            return LineDiskLocal;
+    }
+
+    return LineBarrier;
+}
+
+
+static
+BOOL
+IsJobLine(
+    _In_ PCWSTR pszLine)
+{
+    WCHAR szBuffer[MAX_STRING_SIZE];
+    PWSTR argv[MAX_ARGS_COUNT];
+    INT argc, i;
+    ULONG Index;
+
+    StringCchCopyW(szBuffer, ARRAYSIZE(szBuffer), pszLine);
+    argc = SplitLine(szBuffer, argv, ARRAYSIZE(argv));
+    if (argc == 0)
+        return FALSE;
+
+    for (Index = 0; Index < ARRAYSIZE(JobCommands); Index++)
+    {
+        if (_wcsicmp(argv[0], JobCommands[Index]) == 0)
+            return TRUE;
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+        if (_wcsicmp(argv[i], L"nowait") == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+static
+VOID
+FreeScript(
+    _In_ PSCRIPT Script)
+{
+    ULONG Index;
+
+    if (Script->Lines != NULL)
+    {
+        for (Index = 0; Index < Script->LineCount; Index++)
+            RtlFreeHeap(RtlGetProcessHeap(), 0, Script->Lines[Index]);
+
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Script->Lines);
+    }
+
+    if (Script->Segments != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Script->Segments);
+}
+
+
+static
+BOOL
+LoadScript(
+    _In_ FILE *Stream,
+    _Out_ PSCRIPT Script)
+{
+    WCHAR szBuffer[MAX_STRING_SIZE];
+    PWSTR *NewLines;
+    ULONG MaxLines = 0;
+
+    RtlZeroMemory(Script, sizeof(*Script));
+
+    while (fgetws(szBuffer, ARRAYSIZE(szBuffer), Stream) != NULL)
+    {
+        if (Script->LineCount == MaxLines)
+        {
+            MaxLines = (MaxLines == 0) ? 64 : (MaxLines * 2);
+            if (Script->Lines == NULL)
+                NewLines = RtlAllocateHeap(RtlGetProcessHeap(), 0, MaxLines * sizeof(PWSTR));
+            else
+                NewLines = RtlReAllocateHeap(RtlGetProcessHeap(), 0, Script->Lines, MaxLines * sizeof(PWSTR));
+            if (NewLines == NULL)
+                goto fail;
+
+            Script->Lines = NewLines;
+        }
+
+        Script->Lines[Script->LineCount] = DuplicateString(szBuffer);
+        if (Script->Lines[Script->LineCount] == NULL)
+            goto fail;
+
+        Script->LineCount++;
+    }
+
+    if (Script->LineCount == 0)
+        return TRUE;
+
+    Script->Segments = RtlAllocateHeap(RtlGetProcessHeap(),
+                                       HEAP_ZERO_MEMORY,
+                                       Script->LineCount * sizeof(SEGMENT));
+    if (Script->Segments != NULL)
+        return TRUE;
+
+fail:
+    FreeScript(Script);
+    return FALSE;
+}
+
+
+static
+EXIT_CODE
+RunLine(
+    _In_ PSCRIPT Script,
+    _In_ ULONG Line)
+{
+    WCHAR szBuffer[MAX_STRING_SIZE];
+
+    StringCchCopyW(szBuffer, ARRAYSIZE(szBuffer), Script->Lines[Line]);
+
+    return InterpretScript(szBuffer, NULL);
+}
+
+
+static
+HANDLE
+CreateCaptureFile(VOID)
+{
+    WCHAR szPath[MAX_PATH];
+    WCHAR szFileName[MAX_PATH];
+
+    if ((GetTempPathW(ARRAYSIZE(szPath), szPath) == 0) ||
+        (GetTempFileNameW(szPath, L"dpj", 0, szFileName) == 0))
+        return INVALID_HANDLE_VALUE;
+
+    return CreateFileW(szFileName,
+                       GENERIC_READ | GENERIC_WRITE,
+                       0,
+                       NULL,
+                       CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                       NULL);
+}
+
+
+/* The file holds the text as the stream wrote it, so it is copied as is */
+static
+VOID
+ReplayCaptureFile(
+    _In_ HANDLE FileHandle)
+{
+    HANDLE OutputHandle = ConStreamGetOSHandle(StdOut);
+    BYTE Buffer[4096];
+    DWORD dwRead, dwWritten;
+
+    SetFilePointer(FileHandle, 0, NULL, FILE_BEGIN);
+
+    while (ReadFile(FileHandle, Buffer, sizeof(Buffer), &dwRead, NULL) && (dwRead != 0))
+        WriteFile(OutputHandle, Buffer, dwRead, &dwWritten, NULL);
+}
+
+
+static
+EXIT_CODE
+RunSegmentLine(
+    _In_ PSCRIPT Script,
+    _In_ PSEGMENT Segment)
+{
+    HANDLE OutputHandle, ErrorHandle;
+    EXIT_CODE Result;
+
+    OutputHandle = ConStreamGetOSHandle(StdOut);
+    ErrorHandle = ConStreamGetOSHandle(StdErr);
+    ConStreamSetOSHandle(StdOut, Segment->OutputHandle);
+    ConStreamSetOSHandle(StdErr, Segment->OutputHandle);
+
+    /* Completions may rebuild the lists, so select afterwards */
+    ReapJobs();
+    RestoreSelection(&Segment->Selection);
+
+    Result = RunLine(Script, Segment->FirstLine + Segment->NextLine);
+    Segment->NextLine++;
+
+    ReapJobs();
+    SaveSelection(&Segment->Selection);
+
+    ConStreamSetOSHandle(StdOut, OutputHandle);
+    ConStreamSetOSHandle(StdErr, ErrorHandle);
+
+    return Result;
+}
+
+
+static
+BOOL
+IsSegmentRunnable(
+    _In_ PSCRIPT Script,
+    _In_ ULONG SegmentIndex)
+{
+    ULONG Index;
+
+    for (Index = 0; Index < SegmentIndex; Index++)
+    {
+        if ((Script->Segments[Index].DiskNumber == Script->Segments[SegmentIndex].DiskNumber) &&
+            (Script->Segments[Index].State != SegmentDone))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Runs the segments between two barriers, on at most ulMaxDisks disks at a
+ * time. A failing line stops all segments after their running lines.
+ */
+static
+EXIT_CODE
+RunSegments(
+    _In_ PSCRIPT Script,
+    _In_ ULONG SegmentCount,
+    _In_ ULONG ulMaxDisks)
+{
+    PSEGMENT Segment;
+    SELECTION Selection;
+    ULONG Index, Line, ActiveCount = 0, DoneCount = 0;
+    BOOL bProgress, bStop = FALSE;
+    EXIT_CODE Result = EXIT_SUCCESS, LineResult;
+
+    SaveSelection(&Selection);
+
+    for (Index = 0; Index < SegmentCount; Index++)
+    {
+        Segment = &Script->Segments[Index];
+        Segment->Selection = Selection;
+        Segment->OutputHandle = CreateCaptureFile();
+        if (Segment->OutputHandle != INVALID_HANDLE_VALUE)
+            continue;
+
+        /* Without a capture the output would mix, so run the lines in order */
+        DPRINT1("Cannot capture the output of disk %lu\n", Segment->DiskNumber);
+        while (Index-- > 0)
+            CloseHandle(Script->Segments[Index].OutputHandle);
+
+        Segment = &Script->Segments[SegmentCount - 1];
+        for (Line = Script->Segments[0].FirstLine; Line < Segment->FirstLine + Segment->LineCount; Line++)
+        {
+            Result = RunLine(Script, Line);
+            if (Result != EXIT_SUCCESS)
+                break;
+        }
+
+        return Result;
+    }
+
+    SetAlwaysNoWait(TRUE, TRUE);
+
+    while (DoneCount < SegmentCount)
+    {
+        ReapJobs();
+        bProgress = FALSE;
+
+        for (Index = 0; Index < SegmentCount; Index++)
+        {
+            Segment = &Script->Segments[Index];
+
+            if ((Segment->State == SegmentDraining) && !HasActiveJobs(Segment->DiskNumber))
+            {
+                Segment->State = SegmentDone;
+                ActiveCount--;
+                DoneCount++;
+                bProgress = TRUE;
+            }
+            else if ((Segment->State == SegmentWaiting) && bStop)
+            {
+                Segment->State = SegmentDone;
+                DoneCount++;
+                bProgress = TRUE;
+            }
+            else if ((Segment->State == SegmentWaiting) &&
+                     (ActiveCount < ulMaxDisks) &&
+                     IsSegmentRunnable(Script, Index))
+            {
+                Segment->State = SegmentRunning;
+                ActiveCount++;
+            }
+        }
+
+        for (Index = 0; Index < SegmentCount; Index++)
+        {
+            Segment = &Script->Segments[Index];
+            if (Segment->State != SegmentRunning)
+                continue;
+
+            /* A line that has to wait for the disk would hold up the other disks */
+            if (!bStop && HasActiveJobs(Segment->DiskNumber))
+                continue;
+
+            if (!bStop)
+            {
+                LineResult = RunSegmentLine(Script, Segment);
+                bProgress = TRUE;
+
+                if (LineResult != EXIT_SUCCESS)
+                {
+                    Result = LineResult;
+                    bStop = TRUE;
+                }
+            }
+
+            if (bStop || (Segment->NextLine == Segment->LineCount))
+                Segment->State = SegmentDraining;
+        }
+
+        if (!bProgress)
+            WaitForAnyJob();
+    }
+
+    /*
+     * WaitForJobs() only returns once every job has completed, so no worker
+     * still holds a captured output when it is replayed and closed. A failed
+     * job fails the script, as after a serial run.
+     */
+    if (!WaitForJobs(0) && ((Result == EXIT_SUCCESS) || (Result == EXIT_EXIT)))
+        Result = EXIT_FATAL;
+
+    SetAlwaysNoWait(FALSE, FALSE);
+
+    for (Index = 0; Index < SegmentCount; Index++)
+    {
+        ReplayCaptureFile(Script->Segments[Index].OutputHandle);
+        CloseHandle(Script->Segments[Index].OutputHandle);
+    }
+
+    /* The selection is the one the last segment left, as after a serial run */
+    RestoreSelection(&Script->Segments[SegmentCount - 1].Selection);
+
+    return Result;
+}
+
+
+/*
+ * Runs a script with up to ulMaxDisks disks in parallel. Returns FALSE,
+ * with the stream rewound, if the script has to run serially: it starts or
+ * waits for jobs itself, or it could not be loaded.
+ */
+BOOL
+RunParallelScript(
+    _In_ FILE *Stream,
+    _In_ ULONG ulMaxDisks,
+    _Out_ EXIT_CODE *pResult)
+{
+    SCRIPT Script;
+    PSEGMENT Segment = NULL;
+    ULONG Line, DiskNumber, SegmentCount = 0;
+    LINE_KIND Kind;
+    EXIT_CODE Result = EXIT_SUCCESS;
+
+    if (!LoadScript(Stream, &Script))
+    {
+        fseek(Stream, 0, SEEK_SET);
+        return FALSE;
+    }
+
+    for (Line = 0; Line < Script.LineCount; Line++)
+    {
+        if (IsJobLine(Script.Lines[Line]))
+        {
+            FreeScript(&Script);
+            fseek(Stream, 0, SEEK_SET);
+            return FALSE;
+        }
+    }
+
+    for (Line = 0; Line < Script.LineCount; Line++)
+    {
+        Kind = GetLineKind(Script.Lines[Line], &DiskNumber);
+
+        if (Kind == LineSelectDisk)
+        {
+            Segment = &Script.Segments[SegmentCount++];
+            Segment->DiskNumber = DiskNumber;
+            Segment->FirstLine = Line;
+            Segment->LineCount = 1;
+            continue;
+        }
+
+        if ((Kind == LineDiskLocal) && (Segment != NULL))
+        {
+            Segment->LineCount++;
+            continue;
+        }
+
+        /* A barrier, or a line that uses a disk selected before the segments */
+        if (SegmentCount > 0)
+        {
+            Result = RunSegments(&Script, SegmentCount, ulMaxDisks);
+            RtlZeroMemory(Script.Segments, SegmentCount * sizeof(SEGMENT));
+            SegmentCount = 0;
+            Segment = NULL;
+
+            if (Result != EXIT_SUCCESS)
+                break;
+        }
+
+        Result = RunLine(&Script, Line);
+        if (Result != EXIT_SUCCESS)
+            break;
+    }
+
+    if ((Result == EXIT_SUCCESS) && (SegmentCount > 0))
+        Result = RunSegments(&Script, SegmentCount, ulMaxDisks);
+
+    FreeScript(&Script);
+
+    *pResult = Result;
+    return TRUE;
+}
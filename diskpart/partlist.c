@@ -197,6 +197,120 @@ AlignDown(
     return Temp * Alignment;
 }
 
+
+static
+ULONG
+GetLeastCommonMultiple(
+    _In_ ULONG Value1,
+    _In_ ULONG Value2)
+{
+    ULONG a = Value1, b = Value2, t;
+
+    while (b != 0)
+    {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return (Value1 / a) * Value2;
+}
+
+
+static
+VOID
+GetDiskAlignment(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG DiskNumber,
+    _In_ PDISKENTRY DiskEntry)
+{
+    STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR AlignmentDescriptor;
+    ULONG Alignment = 1024 * 1024;
+    ULONG OptimalAlignment;
+    ULONG ulGranularity, ulOptimalLength;
+    ULONGLONG ullStripe, ullUnit;
+
+    DiskEntry->PhysicalSectorSize = DiskEntry->BytesPerSector;
+    DiskEntry->OptimalTransferSize = 0;
+    DiskEntry->OptimalGranularity = 0;
+    DiskEntry->AlignmentOffset = 0;
+
+    /*
+     * Physical sector size and the offset of the first naturally aligned
+     * logical sector as reported by the storage stack. BytesPerCacheLine is
+     * the size of a cache line, not of a stripe, so it is not used.
+     */
+    if (QueryStorageProperty(FileHandle,
+                             StorageAccessAlignmentProperty,
+                             &AlignmentDescriptor,
+                             sizeof(AlignmentDescriptor)))
+    {
+        if ((AlignmentDescriptor.BytesPerPhysicalSector > DiskEntry->BytesPerSector) &&
+            (AlignmentDescriptor.BytesPerPhysicalSector % DiskEntry->BytesPerSector) == 0)
+            DiskEntry->PhysicalSectorSize = AlignmentDescriptor.BytesPerPhysicalSector;
+
+        if ((AlignmentDescriptor.BytesOffsetForSectorAlignment < DiskEntry->PhysicalSectorSize) &&
+            (AlignmentDescriptor.BytesOffsetForSectorAlignment % DiskEntry->BytesPerSector) == 0)
+            DiskEntry->AlignmentOffset = AlignmentDescriptor.BytesOffsetForSectorAlignment / DiskEntry->BytesPerSector;
+    }
+
+    /*
+     * The full stripe and the stripe unit come from the Block Limits page.
+     * Values that are no multiple of the physical sector are bogus, and so
+     * are the huge maximum transfers some bridges report as optimal.
+     */
+    if (QueryBlockLimits(DiskNumber, &ulGranularity, &ulOptimalLength))
+    {
+        ullStripe = (ULONGLONG)ulOptimalLength * DiskEntry->BytesPerSector;
+        ullUnit = (ULONGLONG)ulGranularity * DiskEntry->BytesPerSector;
+
+        if ((ullStripe > DiskEntry->PhysicalSectorSize) &&
+            (ullStripe <= MAXIMUM_PARTITION_ALIGNMENT) &&
+            (ullStripe % DiskEntry->PhysicalSectorSize) == 0)
+        {
+            DiskEntry->OptimalTransferSize = (ULONG)ullStripe;
+
+            if ((ullUnit >= DiskEntry->PhysicalSectorSize) &&
+                (ullUnit < ullStripe) &&
+                (ullStripe % ullUnit) == 0)
+                DiskEntry->OptimalGranularity = (ULONG)ullUnit;
+        }
+    }
+
+    /* Keep the 1MB default and round it up to every reported granularity */
+    Alignment = GetLeastCommonMultiple(Alignment, DiskEntry->PhysicalSectorSize);
+    if (DiskEntry->OptimalTransferSize != 0)
+    {
+        OptimalAlignment = GetLeastCommonMultiple(Alignment, DiskEntry->OptimalTransferSize);
+        if (OptimalAlignment <= MAXIMUM_PARTITION_ALIGNMENT)
+            Alignment = OptimalAlignment;
+    }
+
+    DiskEntry->SectorAlignment = Alignment / DiskEntry->BytesPerSector;
+    DiskEntry->CylinderAlignment = Alignment / DiskEntry->BytesPerSector;
+}
+
+
+ULONG
+GetPartitionMisalignment(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PPARTENTRY PartEntry)
+{
+    ULONGLONG Offset, AlignmentOffset;
+
+    Offset = PartEntry->StartSector.QuadPart * DiskEntry->BytesPerSector;
+    AlignmentOffset = (ULONGLONG)DiskEntry->AlignmentOffset * DiskEntry->BytesPerSector;
+
+    if ((Offset % DiskEntry->PhysicalSectorSize) != (AlignmentOffset % DiskEntry->PhysicalSectorSize))
+        return DiskEntry->PhysicalSectorSize;
+
+    if ((DiskEntry->OptimalTransferSize != 0) &&
+        (Offset % DiskEntry->OptimalTransferSize) != (AlignmentOffset % DiskEntry->OptimalTransferSize))
+        return DiskEntry->OptimalTransferSize;
+
+    return 0;
+}
+
 static
 VOID
 GetDriverName(
@@ -539,6 +653,7 @@ AddMbrPartitionToDisk(
     PartEntry->PartitionNumber = PartitionInfo->PartitionNumber;
     PartEntry->PartitionIndex = PartitionIndex;
 
+    /* The file system is probed for all partitions of the disk at once */
     if (IsContainerPartition(PartEntry->Mbr.PartitionType))
     {
         PartEntry->FormatState = Unformatted;
@@ -546,57 +661,6 @@ AddMbrPartitionToDisk(
         if (LogicalPartition == FALSE && DiskEntry->ExtendedPartition == NULL)
             DiskEntry->ExtendedPartition = PartEntry;
     }
-    else if ((PartEntry->Mbr.PartitionType == PARTITION_FAT_12) ||
-             (PartEntry->Mbr.PartitionType == PARTITION_FAT_16) ||
-             (PartEntry->Mbr.PartitionType == PARTITION_HUGE) ||
-             (PartEntry->Mbr.PartitionType == PARTITION_XINT13) ||
-             (PartEntry->Mbr.PartitionType == PARTITION_FAT32) ||
-             (PartEntry->Mbr.PartitionType == PARTITION_FAT32_XINT13))
-    {
-#if 0
-        if (CheckFatFormat())
-        {
-            PartEntry->FormatState = Preformatted;
-        }
-        else
-        {
-            PartEntry->FormatState = Unformatted;
-        }
-#endif
-        PartEntry->FormatState = Preformatted;
-    }
-    else if (PartEntry->Mbr.PartitionType == PARTITION_LINUX)
-    {
-#if 0
-        if (CheckExt2Format())
-        {
-            PartEntry->FormatState = Preformatted;
-        }
-        else
-        {
-            PartEntry->FormatState = Unformatted;
-        }
-#endif
-        PartEntry->FormatState = Preformatted;
-    }
-    else if (PartEntry->Mbr.PartitionType == PARTITION_IFS)
-    {
-#if 0
-        if (CheckNtfsFormat())
-        {
-            PartEntry->FormatState = Preformatted;
-        }
-        else if (CheckHpfsFormat())
-        {
-            PartEntry->FormatState = Preformatted;
-        }
-        else
-        {
-            PartEntry->FormatState = Unformatted;
-        }
-#endif
-        PartEntry->FormatState = Preformatted;
-    }
     else
     {
         PartEntry->FormatState = UnknownFormat;
@@ -648,8 +712,8 @@ AddGptPartitionToDisk(
     PartEntry->PartitionNumber = PartitionInfo->PartitionNumber;
     PartEntry->PartitionIndex = PartitionIndex;
 
-    /* TODO: Determine the format state */
-    PartEntry->FormatState = Unformatted;
+    /* The file system is probed for all partitions of the disk at once */
+    PartEntry->FormatState = UnknownFormat;
 
     InsertTailList(&DiskEntry->PrimaryPartListHead,
                    &PartEntry->ListEntry);
@@ -1134,7 +1198,6 @@ AddDiskToList(
     NTSTATUS Status;
     PPARTITION_SECTOR Mbr;
     PULONG Buffer;
-    LARGE_INTEGER FileOffset;
     WCHAR Identifier[20];
     ULONG Checksum;
     ULONG Signature;
@@ -1204,28 +1267,41 @@ AddDiskToList(
     }
 
 
+    DiskEntry = RtlAllocateHeap(RtlGetProcessHeap(),
+                                HEAP_ZERO_MEMORY,
+                                sizeof(DISKENTRY));
+    if (DiskEntry == NULL)
+    {
+        if (pBuffer)
+            RtlFreeHeap(RtlGetProcessHeap(), 0, pBuffer);
+        return;
+    }
+
+    /* The MBR is read through the sector cache of the disk */
+    InitializeListHead(&DiskEntry->SectorCacheListHead);
+    DiskEntry->DiskNumber = DiskNumber;
+    DiskEntry->BytesPerSector = DiskGeometry.BytesPerSector;
+
     Mbr = (PARTITION_SECTOR*)RtlAllocateHeap(RtlGetProcessHeap(),
                                              0,
                                              DiskGeometry.BytesPerSector);
     if (Mbr == NULL)
     {
+        if (pBuffer)
+            RtlFreeHeap(RtlGetProcessHeap(), 0, pBuffer);
+        RtlFreeHeap(RtlGetProcessHeap(), 0, DiskEntry);
         return;
     }
 
-    FileOffset.QuadPart = 0;
-    Status = NtReadFile(FileHandle,
-                        NULL,
-                        NULL,
-                        NULL,
-                        &Iosb,
-                        (PVOID)Mbr,
-                        DiskGeometry.BytesPerSector,
-                        &FileOffset,
-                        NULL);
+    Status = ReadCachedSectors(DiskEntry, FileHandle, 0, 1, Mbr);
     if (!NT_SUCCESS(Status))
     {
+        if (pBuffer)
+            RtlFreeHeap(RtlGetProcessHeap(), 0, pBuffer);
         RtlFreeHeap(RtlGetProcessHeap(), 0, Mbr);
-        DPRINT1("NtReadFile failed, status=%x\n", Status);
+        InvalidateSectorCache(DiskEntry);
+        RtlFreeHeap(RtlGetProcessHeap(), 0, DiskEntry);
+        DPRINT1("ReadCachedSectors failed, status=%x\n", Status);
         return;
     }
     Signature = Mbr->Signature;
@@ -1243,17 +1319,6 @@ AddDiskToList(
                      L"%08x-%08x-A", Checksum, Signature);
     DPRINT("Identifier: %S\n", Identifier);
 
-    DiskEntry = RtlAllocateHeap(RtlGetProcessHeap(),
-                                HEAP_ZERO_MEMORY,
-                                sizeof(DISKENTRY));
-    if (DiskEntry == NULL)
-    {
-        if (pBuffer)
-            RtlFreeHeap(RtlGetProcessHeap(), 0, pBuffer);
-        RtlFreeHeap(RtlGetProcessHeap(), 0, Mbr);
-        return;
-    }
-
     if (pBuffer)
     {
         PSTORAGE_DESCRIPTOR_HEADER pDescriptorHeader;
@@ -1431,12 +1496,15 @@ AddDiskToList(
 
 //    DiskEntry->SectorAlignment = DiskGeometry.SectorsPerTrack;
 //    DiskEntry->CylinderAlignment = DiskGeometry.SectorsPerTrack * DiskGeometry.TracksPerCylinder;
-    DiskEntry->SectorAlignment = (1024 * 1024) / DiskGeometry.BytesPerSector;
-    DiskEntry->CylinderAlignment = (1024 * 1024) / DiskGeometry.BytesPerSector;
+    GetDiskAlignment(FileHandle, DiskNumber, DiskEntry);
 
     DPRINT("SectorCount: %I64u\n", DiskEntry->SectorCount);
     DPRINT("SectorAlignment: %lu\n", DiskEntry->SectorAlignment);
     DPRINT("CylinderAlignment: %lu\n", DiskEntry->CylinderAlignment);
+    DPRINT("PhysicalSectorSize: %lu\n", DiskEntry->PhysicalSectorSize);
+    DPRINT("OptimalTransferSize: %lu\n", DiskEntry->OptimalTransferSize);
+    DPRINT("OptimalGranularity: %lu\n", DiskEntry->OptimalGranularity);
+    DPRINT("AlignmentOffset: %lu\n", DiskEntry->AlignmentOffset);
 
     DiskEntry->DiskNumber = DiskNumber;
     DiskEntry->Port = ScsiAddress.PortNumber;
@@ -1530,6 +1598,8 @@ AddDiskToList(
 
         ScanForUnpartitionedGptDiskSpace(DiskEntry);
     }
+
+    ProbeFileSystems(DiskEntry);
 }
 
 
@@ -1624,6 +1694,10 @@ DestroyPartitionList(VOID)
         Entry = RemoveHeadList(&DiskListHead);
         DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
 
+        /* The disk may be gone after a rescan */
+        CloseDiskHandles(DiskEntry);
+        InvalidateSectorCache(DiskEntry);
+
         /* Release driver name */
         RtlFreeUnicodeString(&DiskEntry->DriverName);
 
@@ -1829,7 +1903,6 @@ GetVolumeSize(
 }
 
 
-static
 PDISKENTRY
 GetDiskForVolume(
     _In_ PVOLENTRY VolumeEntry)
@@ -2221,13 +2294,124 @@ DestroyVolumeList(VOID)
 }
 
 
+static
+PPARTENTRY
+FindPartitionByStart(
+    _In_ PLIST_ENTRY ListHead,
+    _In_ ULONGLONG ullStartSector)
+{
+    PLIST_ENTRY Entry;
+    PPARTENTRY PartEntry;
+
+    for (Entry = ListHead->Flink; Entry != ListHead; Entry = Entry->Flink)
+    {
+        PartEntry = CONTAINING_RECORD(Entry, PARTENTRY, ListEntry);
+        if (PartEntry->IsPartitioned && (PartEntry->StartSector.QuadPart == ullStartSector))
+            return PartEntry;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Selects the given disk and the partition starting at ullStartSector
+ * (0: no partition). Selections are kept by number and start sector where
+ * the lists may be rebuilt, as the entries are freed.
+ */
+VOID
+SelectDiskAndPartition(
+    _In_ ULONG DiskNumber,
+    _In_ ULONGLONG ullStartSector)
+{
+    PLIST_ENTRY Entry;
+    PDISKENTRY DiskEntry;
+
+    CurrentDisk = NULL;
+    CurrentPartition = NULL;
+
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
+        if (DiskEntry->DiskNumber != DiskNumber)
+            continue;
+
+        CurrentDisk = DiskEntry;
+
+        if (ullStartSector != 0)
+        {
+            CurrentPartition = FindPartitionByStart(&DiskEntry->PrimaryPartListHead, ullStartSector);
+            if (CurrentPartition == NULL)
+                CurrentPartition = FindPartitionByStart(&DiskEntry->LogicalPartListHead, ullStartSector);
+        }
+
+        break;
+    }
+}
+
+
+VOID
+SaveSelection(
+    _Out_ PSELECTION Selection)
+{
+    Selection->DiskNumber = (CurrentDisk != NULL) ? CurrentDisk->DiskNumber : JOB_NO_DISK;
+    Selection->ullStartSector = (CurrentPartition != NULL) ? CurrentPartition->StartSector.QuadPart : 0;
+    Selection->VolumeNumber = (CurrentVolume != NULL) ? CurrentVolume->VolumeNumber : SELECTION_NO_VOLUME;
+}
+
+
+VOID
+RestoreSelection(
+    _In_ PSELECTION Selection)
+{
+    PLIST_ENTRY Entry;
+    PVOLENTRY VolumeEntry;
+
+    SelectDiskAndPartition(Selection->DiskNumber, Selection->ullStartSector);
+
+    CurrentVolume = NULL;
+    if (Selection->VolumeNumber == SELECTION_NO_VOLUME)
+        return;
+
+    for (Entry = VolumeListHead.Flink; Entry != &VolumeListHead; Entry = Entry->Flink)
+    {
+        VolumeEntry = CONTAINING_RECORD(Entry, VOLENTRY, ListEntry);
+        if (VolumeEntry->VolumeNumber == Selection->VolumeNumber)
+        {
+            CurrentVolume = VolumeEntry;
+            break;
+        }
+    }
+}
+
+
+/*
+ * Rebuilds the disk and volume lists after the partition tables were changed
+ * and selects the given disk and the partition starting at ullStartSector
+ * (0: no partition) again. Background jobs finish first, as their
+ * completions refer to the current lists.
+ */
+VOID
+RescanAndSelect(
+    _In_ ULONG DiskNumber,
+    _In_ ULONGLONG ullStartSector)
+{
+    WaitForDiskJobs(JOB_ALL_DISKS);
+
+    DestroyVolumeList();
+    DestroyPartitionList();
+    CreatePartitionList();
+    CreateVolumeList();
+
+    SelectDiskAndPartition(DiskNumber, ullStartSector);
+}
+
+
 NTSTATUS
 WriteMbrPartitions(
     _In_ PDISKENTRY DiskEntry)
 {
     NTSTATUS Status;
-    OBJECT_ATTRIBUTES ObjectAttributes;
-    UNICODE_STRING Name;
     HANDLE FileHandle;
     IO_STATUS_BLOCK Iosb;
     ULONG BufferSize;
@@ -2235,7 +2419,6 @@ WriteMbrPartitions(
     ULONG PartitionCount;
     PLIST_ENTRY ListEntry;
     PPARTENTRY PartEntry;
-    WCHAR DstPath[MAX_PATH];
 
     DPRINT("WriteMbrPartitions() Disk: %lu\n", DiskEntry->DiskNumber);
 
@@ -2243,28 +2426,9 @@ WriteMbrPartitions(
     if (!DiskEntry->Dirty)
         return STATUS_SUCCESS;
 
-    StringCchPrintfW(DstPath, ARRAYSIZE(DstPath),
-                     L"\\Device\\Harddisk%lu\\Partition0",
-                     DiskEntry->DiskNumber);
-    RtlInitUnicodeString(&Name, DstPath);
-
-    InitializeObjectAttributes(&ObjectAttributes,
-                               &Name,
-                               OBJ_CASE_INSENSITIVE,
-                               NULL,
-                               NULL);
-
-    Status = NtOpenFile(&FileHandle,
-                        GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
-                        &ObjectAttributes,
-                        &Iosb,
-                        0,
-                        FILE_SYNCHRONOUS_IO_NONALERT);
+    Status = GetDiskHandle(DiskEntry, TRUE, &FileHandle);
     if (!NT_SUCCESS(Status))
-    {
-        DPRINT1("NtOpenFile() failed (Status %lx)\n", Status);
         return Status;
-    }
 
     //
     // FIXME: We first *MUST* use IOCTL_DISK_CREATE_DISK to initialize
@@ -2288,7 +2452,9 @@ WriteMbrPartitions(
                                    BufferSize,
                                    DiskEntry->LayoutBuffer,
                                    BufferSize);
-    NtClose(FileHandle);
+
+    /* The partition tables have been rewritten */
+    InvalidateSectorCache(DiskEntry);
 
     /*
      * IOCTL_DISK_SET_DRIVE_LAYOUT calls IoWritePartitionTable(), which converts
@@ -2341,6 +2507,9 @@ WriteMbrPartitions(
     /* The layout has been successfully updated, the disk is not dirty anymore */
     DiskEntry->Dirty = FALSE;
 
+    /* Let the partition devices arrive before they are used */
+    WaitForPartitionDevices(DiskEntry);
+
     return Status;
 }
 
@@ -2350,12 +2519,9 @@ WriteGptPartitions(
     _In_ PDISKENTRY DiskEntry)
 {
     NTSTATUS Status;
-    OBJECT_ATTRIBUTES ObjectAttributes;
-    UNICODE_STRING Name;
     HANDLE FileHandle;
     IO_STATUS_BLOCK Iosb;
     ULONG BufferSize;
-    WCHAR DstPath[MAX_PATH];
 
     DPRINT("WriteGptPartitions() Disk: %lu\n", DiskEntry->DiskNumber);
 
@@ -2363,28 +2529,9 @@ WriteGptPartitions(
     if (!DiskEntry->Dirty)
         return STATUS_SUCCESS;
 
-    StringCchPrintfW(DstPath, ARRAYSIZE(DstPath),
-                     L"\\Device\\Harddisk%lu\\Partition0",
-                     DiskEntry->DiskNumber);
-    RtlInitUnicodeString(&Name, DstPath);
-
-    InitializeObjectAttributes(&ObjectAttributes,
-                               &Name,
-                               OBJ_CASE_INSENSITIVE,
-                               NULL,
-                               NULL);
-
-    Status = NtOpenFile(&FileHandle,
-                        GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
-                        &ObjectAttributes,
-                        &Iosb,
-                        0,
-                        FILE_SYNCHRONOUS_IO_NONALERT);
+    Status = GetDiskHandle(DiskEntry, TRUE, &FileHandle);
     if (!NT_SUCCESS(Status))
-    {
-        DPRINT1("NtOpenFile() failed (Status %lx)\n", Status);
         return Status;
-    }
 
     //
     // FIXME: We first *MUST* use IOCTL_DISK_CREATE_DISK to initialize
@@ -2405,7 +2552,9 @@ WriteGptPartitions(
                                    BufferSize,
                                    DiskEntry->LayoutBuffer,
                                    BufferSize);
-    NtClose(FileHandle);
+
+    /* The partition tables have been rewritten */
+    InvalidateSectorCache(DiskEntry);
 
     /* Check whether the IOCTL_DISK_SET_DRIVE_LAYOUT_EX call succeeded */
     if (!NT_SUCCESS(Status))
@@ -2417,6 +2566,9 @@ WriteGptPartitions(
     /* The layout has been successfully updated, the disk is not dirty anymore */
     DiskEntry->Dirty = FALSE;
 
+    /* Let the partition devices arrive before they are used */
+    WaitForPartitionDevices(DiskEntry);
+
     return Status;
 }
 
@@ -2474,6 +2626,26 @@ GetPrimaryPartitionCount(
 }
 
 
+BOOL
+IsDiskEmpty(
+    _In_ PDISKENTRY DiskEntry)
+{
+    PLIST_ENTRY Entry;
+    PPARTENTRY PartEntry;
+
+    for (Entry = DiskEntry->PrimaryPartListHead.Flink;
+         Entry != &DiskEntry->PrimaryPartListHead;
+         Entry = Entry->Flink)
+    {
+        PartEntry = CONTAINING_RECORD(Entry, PARTENTRY, ListEntry);
+        if (PartEntry->IsPartitioned)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
 static
 ULONG
 GetLogicalPartitionCount(
@@ -0,0 +1,443 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/qos.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define QOS_FULL_SCALE          1024
+#define QOS_MIN_SCALE           16      /* The limits never back off below 1/64 */
+#define QOS_SAMPLE_INTERVAL     250     /* Milliseconds between two latency samples */
+#define QOS_BURST_DIVISOR       8       /* The bucket holds 125ms worth of tokens */
+
+/* Limits for the commands that are given no QOS= option */
+static QOS_SETTINGS GlobalQos = {0, 0, 0, QosPriorityNormal};
+
+static PCWSTR QosPriorityNames[] =
+{
+    L"NORMAL", L"LOW", L"IDLE"
+};
+
+/* FUNCTIONS ******************************************************************/
+
+static
+BOOL
+ParseQosNumber(
+    _In_ PWSTR pszValue,
+    _Out_ PULONG pulValue)
+{
+    if (!IsDecString(pszValue))
+        return FALSE;
+
+    *pulValue = wcstoul(pszValue, NULL, 10);
+
+    return TRUE;
+}
+
+
+/*
+ * Applies a single KEY=VALUE setting. SET QOS takes them as separate
+ * arguments, the QOS= option of a command as a comma separated list.
+ */
+static
+BOOL
+ApplyQosSetting(
+    _Inout_ PQOS_SETTINGS Settings,
+    _In_ PWSTR pszSetting)
+{
+    PWSTR pszSuffix = NULL;
+    ULONG i;
+
+    if (_wcsicmp(pszSetting, L"none") == 0)
+    {
+        RtlZeroMemory(Settings, sizeof(QOS_SETTINGS));
+        return TRUE;
+    }
+
+    if (HasPrefix(pszSetting, L"bandwidth=", &pszSuffix))
+        return ParseQosNumber(pszSuffix, &Settings->ulBandwidth);
+
+    if (HasPrefix(pszSetting, L"iops=", &pszSuffix))
+        return ParseQosNumber(pszSuffix, &Settings->ulIops);
+
+    if (HasPrefix(pszSetting, L"latency=", &pszSuffix))
+        return ParseQosNumber(pszSuffix, &Settings->ulLatency);
+
+    if (HasPrefix(pszSetting, L"priority=", &pszSuffix))
+    {
+        for (i = 0; i < ARRAYSIZE(QosPriorityNames); i++)
+        {
+            if (_wcsicmp(pszSuffix, QosPriorityNames[i]) == 0)
+            {
+                Settings->Priority = (QOS_PRIORITY)i;
+                return TRUE;
+            }
+        }
+    }
+
+    return FALSE;
+}
+
+
+VOID
+GetQosSettings(
+    _Out_ PQOS_SETTINGS Settings)
+{
+    *Settings = GlobalQos;
+}
+
+
+/*
+ * Parses the value of a QOS= option. The settings start out as the global
+ * ones, so an option only needs to name the limits that differ.
+ */
+BOOL
+ParseQosSettings(
+    _In_ PWSTR pszValue,
+    _Inout_ PQOS_SETTINGS Settings)
+{
+    WCHAR szBuffer[MAX_PATH];
+    PWSTR pszSetting, pszNext;
+
+    if (FAILED(StringCchCopyW(szBuffer, ARRAYSIZE(szBuffer), pszValue)))
+        return FALSE;
+
+    for (pszSetting = szBuffer; pszSetting != NULL; pszSetting = pszNext)
+    {
+        pszNext = wcschr(pszSetting, L',');
+        if (pszNext != NULL)
+            *pszNext++ = UNICODE_NULL;
+
+        if (!ApplyQosSetting(Settings, pszSetting))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static
+BOOL
+QueryQosDevice(
+    _In_ HANDLE DeviceHandle,
+    _Out_ PDISK_PERFORMANCE Performance)
+{
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    Status = NtDeviceIoControlFile(DeviceHandle,
+                                   NULL,
+                                   NULL,
+                                   NULL,
+                                   &Iosb,
+                                   IOCTL_DISK_PERFORMANCE,
+                                   NULL,
+                                   0,
+                                   Performance,
+                                   sizeof(DISK_PERFORMANCE));
+
+    return NT_SUCCESS(Status);
+}
+
+
+VOID
+InitializeQosBucket(
+    _Out_ PQOS_BUCKET Bucket,
+    _In_ PQOS_SETTINGS Settings,
+    _In_opt_ PJOB Job)
+{
+    RtlZeroMemory(Bucket, sizeof(QOS_BUCKET));
+    Bucket->Settings = *Settings;
+    Bucket->Job = Job;
+    Bucket->Scale = QOS_FULL_SCALE;
+
+    NtQueryPerformanceCounter(&Bucket->LastRefill, &Bucket->Frequency);
+    Bucket->LastSample = Bucket->LastRefill;
+}
+
+
+/*
+ * Applies the priority to a handle that the command does its I/O on. The
+ * first device whose counters can be read is the one whose latency makes
+ * the limits back off; image files have no such counters.
+ */
+VOID
+AddQosDevice(
+    _Inout_ PQOS_BUCKET Bucket,
+    _In_ HANDLE FileHandle)
+{
+    FILE_IO_PRIORITY_HINT_INFORMATION PriorityHint;
+    DISK_PERFORMANCE Performance;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    if (Bucket->Settings.Priority != QosPriorityNormal)
+    {
+        PriorityHint.PriorityHint = (Bucket->Settings.Priority == QosPriorityIdle) ?
+                                    IoPriorityVeryLow : IoPriorityLow;
+
+        Status = NtSetInformationFile(FileHandle,
+                                      &Iosb,
+                                      &PriorityHint,
+                                      sizeof(PriorityHint),
+                                      FileIoPriorityHintInformation);
+        if (!NT_SUCCESS(Status))
+            DPRINT1("NtSetInformationFile() failed (Status 0x%08lx)\n", Status);
+    }
+
+    if ((Bucket->Settings.ulLatency == 0) || (Bucket->DeviceHandle != NULL))
+        return;
+
+    if (!QueryQosDevice(FileHandle, &Performance))
+        return;
+
+    Bucket->DeviceHandle = FileHandle;
+    Bucket->LastServiceTime = Performance.ReadTime.QuadPart + Performance.WriteTime.QuadPart;
+    Bucket->LastRequestCount = Performance.ReadCount + Performance.WriteCount;
+}
+
+
+/* Bytes per second that the bucket lets through, 0 for no limit */
+static
+ULONGLONG
+GetQosByteRate(
+    _In_ PQOS_BUCKET Bucket)
+{
+    if (Bucket->Settings.ulBandwidth != 0)
+        return ((ULONGLONG)Bucket->Settings.ulBandwidth * SIZE_1MB * Bucket->Scale) / QOS_FULL_SCALE;
+
+    return (Bucket->BaseRate * Bucket->Scale) / QOS_FULL_SCALE;
+}
+
+
+/* Thousandths of a request per second that the bucket lets through, 0 for no limit */
+static
+ULONGLONG
+GetQosRequestRate(
+    _In_ PQOS_BUCKET Bucket)
+{
+    return ((ULONGLONG)Bucket->Settings.ulIops * 1000 * Bucket->Scale) / QOS_FULL_SCALE;
+}
+
+
+/*
+ * Halves the limits while the requests of the device, including those of
+ * other programs, take longer than the latency target, and raises them step
+ * by step once the device has recovered. Without a bandwidth limit, the
+ * first back off starts from the throughput of the last interval.
+ */
+static
+VOID
+SampleQosLatency(
+    _Inout_ PQOS_BUCKET Bucket,
+    _In_ PLARGE_INTEGER Now)
+{
+    DISK_PERFORMANCE Performance;
+    ULONGLONG Elapsed, ServiceTime, Latency;
+    ULONG Requests;
+
+    Elapsed = Now->QuadPart - Bucket->LastSample.QuadPart;
+    if (Elapsed * 1000 < (ULONGLONG)Bucket->Frequency.QuadPart * QOS_SAMPLE_INTERVAL)
+        return;
+
+    if (!QueryQosDevice(Bucket->DeviceHandle, &Performance))
+    {
+        DPRINT1("Failed to query the device counters, the limits stay fixed\n");
+        Bucket->DeviceHandle = NULL;
+        return;
+    }
+
+    /* Times are reported in 100ns units */
+    ServiceTime = (Performance.ReadTime.QuadPart + Performance.WriteTime.QuadPart) - Bucket->LastServiceTime;
+    Requests = (Performance.ReadCount + Performance.WriteCount) - Bucket->LastRequestCount;
+    Latency = (Requests != 0) ? (ServiceTime / 10000) / Requests : 0;
+
+    if (Latency > Bucket->Settings.ulLatency)
+    {
+        if ((Bucket->Settings.ulBandwidth == 0) && (Bucket->BaseRate == 0))
+            Bucket->BaseRate = (Bucket->SampleBytes * Bucket->Frequency.QuadPart) / Elapsed;
+
+        Bucket->Scale = max(Bucket->Scale / 2, QOS_MIN_SCALE);
+    }
+    else if ((Latency < Bucket->Settings.ulLatency / 2) && (Bucket->Scale < QOS_FULL_SCALE))
+    {
+        Bucket->Scale = min(Bucket->Scale + (QOS_FULL_SCALE / 16), QOS_FULL_SCALE);
+
+        /* Back at full speed, a command without a bandwidth limit is unlimited again */
+        if (Bucket->Scale == QOS_FULL_SCALE)
+            Bucket->BaseRate = 0;
+    }
+
+    DPRINT("Latency %I64u ms, scale %lu\n", Latency, Bucket->Scale);
+
+    Bucket->LastSample = *Now;
+    Bucket->LastServiceTime = Performance.ReadTime.QuadPart + Performance.WriteTime.QuadPart;
+    Bucket->LastRequestCount = Performance.ReadCount + Performance.WriteCount;
+    Bucket->SampleBytes = 0;
+}
+
+
+static
+LONGLONG
+RefillQosTokens(
+    _In_ LONGLONG Tokens,
+    _In_ ULONGLONG Rate,
+    _In_ ULONGLONG Elapsed,
+    _In_ ULONGLONG Frequency)
+{
+    LONGLONG Burst = (LONGLONG)(Rate / QOS_BURST_DIVISOR);
+
+    Tokens += (LONGLONG)((Rate * Elapsed) / Frequency);
+
+    return min(Tokens, Burst);
+}
+
+
+/* Milliseconds until a bucket in debt is even again */
+static
+ULONG
+GetQosDelay(
+    _In_ LONGLONG Tokens,
+    _In_ ULONGLONG Rate)
+{
+    if ((Rate == 0) || (Tokens >= 0))
+        return 0;
+
+    return (ULONG)(((ULONGLONG)(-Tokens) * 1000) / Rate) + 1;
+}
+
+
+/*
+ * Waits until the bucket has tokens for a request of the given length, then
+ * takes them. A request may leave the bucket in debt, so requests of any
+ * size pass and the following ones wait for the debt to be repaid. Waits
+ * are cut into sample intervals, so the limits keep adapting and a job can
+ * be cancelled.
+ */
+NTSTATUS
+ThrottleQosRequest(
+    _Inout_ PQOS_BUCKET Bucket,
+    _In_ ULONG ulLength)
+{
+    LARGE_INTEGER Now;
+    ULONGLONG ByteRate, RequestRate, Elapsed;
+    ULONG ulDelay;
+
+    if ((Bucket->Settings.ulBandwidth == 0) &&
+        (Bucket->Settings.ulIops == 0) &&
+        (Bucket->DeviceHandle == NULL))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    for (;;)
+    {
+        if (IsJobCancelled(Bucket->Job))
+            return STATUS_CANCELLED;
+
+        NtQueryPerformanceCounter(&Now, NULL);
+
+        if (Bucket->DeviceHandle != NULL)
+            SampleQosLatency(Bucket, &Now);
+
+        ByteRate = GetQosByteRate(Bucket);
+        RequestRate = GetQosRequestRate(Bucket);
+
+        /* A long pause must not turn into a burst */
+        Elapsed = min((ULONGLONG)(Now.QuadPart - Bucket->LastRefill.QuadPart),
+                      (ULONGLONG)Bucket->Frequency.QuadPart);
+        Bucket->LastRefill = Now;
+
+        Bucket->ByteTokens = RefillQosTokens(Bucket->ByteTokens, ByteRate, Elapsed, Bucket->Frequency.QuadPart);
+        Bucket->RequestTokens = RefillQosTokens(Bucket->RequestTokens, RequestRate, Elapsed, Bucket->Frequency.QuadPart);
+
+        ulDelay = max(GetQosDelay(Bucket->ByteTokens, ByteRate),
+                      GetQosDelay(Bucket->RequestTokens, RequestRate));
+        if (ulDelay == 0)
+            break;
+
+        Sleep(min(ulDelay, QOS_SAMPLE_INTERVAL));
+    }
+
+    if (ByteRate != 0)
+        Bucket->ByteTokens -= ulLength;
+
+    if (RequestRate != 0)
+        Bucket->RequestTokens -= 1000;
+
+    Bucket->SampleBytes += ulLength;
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+PrintQosSettings(VOID)
+{
+    if ((GlobalQos.ulBandwidth == 0) &&
+        (GlobalQos.ulIops == 0) &&
+        (GlobalQos.ulLatency == 0) &&
+        (GlobalQos.Priority == QosPriorityNormal))
+    {
+        ConResPuts(StdOut, IDS_QOS_NONE);
+        return;
+    }
+
+    ConPuts(StdOut, L"\n");
+
+    if (GlobalQos.ulBandwidth != 0)
+        ConResPrintf(StdOut, IDS_QOS_BANDWIDTH, GlobalQos.ulBandwidth);
+
+    if (GlobalQos.ulIops != 0)
+        ConResPrintf(StdOut, IDS_QOS_IOPS, GlobalQos.ulIops);
+
+    ConResPrintf(StdOut, IDS_QOS_PRIORITY, QosPriorityNames[GlobalQos.Priority]);
+
+    if (GlobalQos.ulLatency != 0)
+        ConResPrintf(StdOut, IDS_QOS_LATENCY, GlobalQos.ulLatency);
+
+    ConPuts(StdOut, L"\n");
+}
+
+
+EXIT_CODE
+SetQos(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    QOS_SETTINGS Settings;
+    INT i;
+
+    DPRINT("SetQos()\n");
+
+    if (argc == 2)
+    {
+        PrintQosSettings();
+        return EXIT_SUCCESS;
+    }
+
+    Settings = GlobalQos;
+
+    for (i = 2; i < argc; i++)
+    {
+        if (!ApplyQosSetting(&Settings, argv[i]))
+        {
+            ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    /* Running jobs keep the limits they were started with */
+    GlobalQos = Settings;
+
+    ConResPuts(StdOut, IDS_QOS_SET);
+
+    return EXIT_SUCCESS;
+}
@@ -13,6 +13,9 @@ rescan_main(
     _In_ INT argc,
     _In_ PWSTR *argv)
 {
+    /* The completions of pending jobs refer to the current lists */
+    WaitForDiskJobs(JOB_ALL_DISKS);
+
     ConResPuts(StdOut, IDS_RESCAN_START);
     DestroyVolumeList();
     DestroyPartitionList();
@@ -49,6 +49,18 @@
 #define IDS_CREATE_PARTITION_SUCCESS   1051
 #define IDS_CREATE_PARTITION_INVALID_STYLE 1052
 
+#define IDS_BENCH_PROFILE              1059
+#define IDS_BENCH_TARGET               1060
+#define IDS_BENCH_TEST                 1061
+#define IDS_BENCH_THROUGHPUT           1062
+#define IDS_BENCH_IOPS                 1063
+#define IDS_BENCH_LATENCY              1064
+#define IDS_BENCH_PERCENTILES          1065
+#define IDS_BENCH_SEQUENTIAL           1066
+#define IDS_BENCH_RANDOM               1067
+#define IDS_BENCH_OPEN_FAIL            1068
+#define IDS_BENCH_FAIL                 1069
+
 #define IDS_DELETE_PARTITION_FAIL      1070
 #define IDS_DELETE_PARTITION_SUCCESS   1071
 #define IDS_DELETE_PARTITION_SYSTEM    1072
@@ -79,6 +91,33 @@
 #define IDS_DETAIL_NO_DISKS            1137
 #define IDS_DETAIL_NO_VOLUME           1138
 
+#define IDS_DETAIL_INFO_SECTOR_CACHE   1139
+#define IDS_DETAIL_INFO_SECTOR_SIZE    1140
+#define IDS_DETAIL_INFO_ALIGNMENT_OFFSET 1141
+#define IDS_DETAIL_INFO_MAX_TRANSFER   1142
+#define IDS_DETAIL_INFO_QUEUEING       1143
+#define IDS_DETAIL_INFO_ROTATIONAL     1144
+#define IDS_DETAIL_INFO_READ_CACHE     1145
+#define IDS_DETAIL_INFO_WRITE_CACHE    1146
+#define IDS_DETAIL_INFO_READ_AHEAD     1147
+#define IDS_DETAIL_INFO_TRIM           1148
+#define IDS_DETAIL_INFO_PARTITION_ALIGNMENT 1149
+
+#define IDS_ATTRIBUTES_DISK_UNSUPPORTED 1150
+#define IDS_ATTRIBUTES_DISK_SET_FAIL   1151
+#define IDS_ATTRIBUTES_DISK_SET_SUCCESS 1152
+#define IDS_ATTRIBUTES_DISK_FILE_FAIL  1153
+#define IDS_ATTRIBUTES_DISK_SAVED      1154
+
+#define IDS_DETAIL_PARTITION_ALIGNED   1160
+#define IDS_DETAIL_PARTITION_MISALIGNED_SECTOR 1161
+#define IDS_DETAIL_PARTITION_MISALIGNED_STRIPE 1162
+#define IDS_DETAIL_PARTITION_FILESYSTEM 1163
+#define IDS_DETAIL_PARTITION_LABEL     1164
+#define IDS_DETAIL_VOLUME_CLUSTER_SIZE 1165
+#define IDS_DETAIL_VOLUME_RECOMMENDED 1166
+#define IDS_DETAIL_VOLUME_STRIPE       1167
+
 #define IDS_FILESYSTEMS_CURRENT        1170
 #define IDS_FILESYSTEMS_FORMATTING     1171
 #define IDS_FILESYSTEMS_TYPE           1172
@@ -89,6 +128,8 @@
 #define IDS_FORMAT_FAIL                1180
 #define IDS_FORMAT_SUCCESS             1181
 #define IDS_FORMAT_PROGRESS            1182
+#define IDS_FORMAT_RECOMMENDED         1183
+#define IDS_FORMAT_RECOMMENDED_UNIT    1184
 
 #define IDS_GPT_FAIL                   1190
 #define IDS_GPT_SUCCESS                1191
@@ -100,6 +141,110 @@
 #define IDS_INACTIVE_ALREADY           1212
 #define IDS_INACTIVE_NO_MBR            1213
 
+#define IDS_CLONE_FAIL                 1220
+#define IDS_CLONE_SUCCESS              1221
+#define IDS_CLONE_PROGRESS             1222
+#define IDS_CLONE_RESULT               1223
+#define IDS_CLONE_STYLE_MISMATCH       1224
+#define IDS_CLONE_SECTOR_MISMATCH      1225
+#define IDS_CLONE_NO_SPACE             1226
+#define IDS_CLONE_TARGET_NOT_EMPTY     1227
+#define IDS_CLONE_PARTITION_TYPE       1228
+#define IDS_CLONE_USED                 1229
+#define IDS_CLONE_USED_UNSUPPORTED     1230
+
+#define IDS_DEPLOY_FAIL                1240
+#define IDS_DEPLOY_SUCCESS             1241
+#define IDS_DEPLOY_PARTIAL             1242
+#define IDS_DEPLOY_PROGRESS            1243
+#define IDS_DEPLOY_SOURCE              1244
+#define IDS_DEPLOY_HEAD                1245
+#define IDS_DEPLOY_LINE                1246
+#define IDS_DEPLOY_FORMAT              1247
+#define IDS_DEPLOY_STATUS_VERIFIED     1248
+#define IDS_DEPLOY_STATUS_WRITTEN      1249
+#define IDS_DEPLOY_STATUS_MISMATCH     1250
+#define IDS_DEPLOY_STATUS_FAILED       1251
+#define IDS_DEPLOY_TARGET_FAILED       1252
+#define IDS_DEPLOY_NO_DISK             1253
+#define IDS_DEPLOY_TOO_SMALL           1254
+#define IDS_DEPLOY_NOT_EMPTY           1255
+
+#define IDS_RESTORE_FAIL               1260
+#define IDS_RESTORE_SUCCESS            1261
+#define IDS_RESTORE_PROGRESS           1262
+#define IDS_RESTORE_RESULT             1263
+#define IDS_RESTORE_PARTITION_TYPE     1264
+#define IDS_RESTORE_TOO_LARGE          1265
+#define IDS_RESTORE_IN_USE             1266
+#define IDS_RESTORE_MANIFEST_STALE     1267
+#define IDS_RESTORE_MANIFEST_FAIL      1268
+
+#define IDS_HASH_FAIL                  1270
+#define IDS_HASH_PROGRESS              1271
+#define IDS_HASH_RESULT                1272
+#define IDS_HASH_PARTITION_TYPE        1273
+#define IDS_HASH_MANIFEST_FAIL         1274
+
+#define IDS_COMPARE_FAIL               1280
+#define IDS_COMPARE_PROGRESS           1281
+#define IDS_COMPARE_NO_DISK            1282
+#define IDS_COMPARE_NO_PARTITION       1283
+#define IDS_COMPARE_PARTITION_TYPE     1284
+#define IDS_COMPARE_SIZE               1285
+#define IDS_COMPARE_IDENTICAL          1286
+#define IDS_COMPARE_FIRST              1287
+#define IDS_COMPARE_HEAD               1288
+#define IDS_COMPARE_LINE               1289
+#define IDS_COMPARE_FORMAT             1290
+#define IDS_COMPARE_SUMMARY            1291
+#define IDS_COMPARE_RESULT             1292
+
+#define IDS_ARCHIVE_PARTITION_TYPE     1300
+#define IDS_EXPORT_FAIL                1301
+#define IDS_EXPORT_PROGRESS            1302
+#define IDS_EXPORT_RESULT              1303
+#define IDS_IMPORT_FAIL                1304
+#define IDS_IMPORT_PROGRESS            1305
+#define IDS_IMPORT_RESULT              1306
+#define IDS_IMPORT_INVALID             1307
+#define IDS_IMPORT_TOO_LARGE           1308
+#define IDS_IMPORT_IN_USE              1309
+
+#define IDS_JOBS_HEAD                  1310
+#define IDS_JOBS_LINE                  1311
+#define IDS_JOBS_FORMAT                1312
+#define IDS_JOBS_NONE                  1313
+#define IDS_JOB_QUEUED                 1314
+#define IDS_JOB_FINISHED               1315
+#define IDS_JOB_FAILED                 1316
+#define IDS_JOB_WAITING                1317
+#define IDS_JOB_CANCELLING             1318
+#define IDS_JOB_NOT_FOUND              1319
+#define IDS_JOB_STATE_QUEUED           1320
+#define IDS_JOB_STATE_RUNNING          1321
+#define IDS_JOB_STATE_COMPLETED        1322
+#define IDS_JOB_STATE_FAILED           1323
+#define IDS_JOB_STATE_CANCELLED        1324
+
+#define IDS_FOREACH_PROMPT             1325
+#define IDS_FOREACH_BAD_BLOCK          1326
+#define IDS_FOREACH_NONE               1327
+#define IDS_FOREACH_START              1328
+#define IDS_FOREACH_COMMAND            1329
+#define IDS_FOREACH_STOPPED            1330
+
+#define IDS_QOS_NONE                   1331
+#define IDS_QOS_BANDWIDTH              1332
+#define IDS_QOS_IOPS                   1333
+#define IDS_QOS_PRIORITY               1334
+#define IDS_QOS_LATENCY                1335
+#define IDS_QOS_SET                    1336
+
+#define IDS_IO_ENGINE                  1337
+#define IDS_IO_QUEUE_DEPTH             1338
+#define IDS_IO_SET                     1339
+
 #define IDS_LIST_DISK_HEAD             3300
 #define IDS_LIST_DISK_LINE             3301
 #define IDS_LIST_DISK_FORMAT           3302
@@ -111,6 +256,32 @@
 #define IDS_LIST_VOLUME_HEAD           3308
 #define IDS_LIST_VOLUME_LINE           3309
 #define IDS_LIST_VOLUME_FORMAT         3310
+#define IDS_LIST_PARTITION_MISALIGNED_SECTOR 3311
+#define IDS_LIST_PARTITION_MISALIGNED_STRIPE 3312
+
+#define IDS_MONITOR_HEAD               3400
+#define IDS_MONITOR_LINE               3401
+#define IDS_MONITOR_DISK_FORMAT        3402
+#define IDS_MONITOR_PARTITION_FORMAT   3403
+#define IDS_MONITOR_SAMPLE             3404
+#define IDS_MONITOR_STOP               3405
+#define IDS_MONITOR_FAIL               3406
+#define IDS_MONITOR_PARTITION_FAIL     3407
+
+#define IDS_MOVE_PARTITION_FAIL        3420
+#define IDS_MOVE_PARTITION_SUCCESS     3421
+#define IDS_MOVE_PARTITION_NO_SPACE    3422
+#define IDS_MOVE_PARTITION_TYPE        3423
+#define IDS_MOVE_PARTITION_IN_USE      3424
+#define IDS_MOVE_PARTITION_ALREADY     3425
+#define IDS_MOVE_PROGRESS              3426
+#define IDS_MOVE_THROUGHPUT            3427
+#define IDS_MOVE_JOURNAL_FAIL          3428
+#define IDS_MOVE_JOURNAL_PENDING       3429
+#define IDS_MOVE_RESUME                3430
+#define IDS_MOVE_RESUME_NONE           3431
+#define IDS_REALIGN_PARTITION_ALREADY  3432
+#define IDS_MOVE_HIDDEN_SECTORS        3433
 
 #define IDS_REMOVE_FAIL                4000
 #define IDS_REMOVE_SUCCESS             4001
@@ -228,6 +399,38 @@
 #define IDS_HELP_UNIQUEID                  119
 #define IDS_HELP_UNIQUEID_DISK             120
 
+#define IDS_HELP_BENCH                     121
+#define IDS_HELP_BENCH_DISK                122
+#define IDS_HELP_BENCH_PARTITION           123
+#define IDS_HELP_MONITOR                   124
+#define IDS_HELP_MONITOR_DISK              125
+#define IDS_HELP_ATTRIBUTES_DISK           126
+#define IDS_HELP_MOVE                      127
+#define IDS_HELP_MOVE_PARTITION            128
+#define IDS_HELP_REALIGN                   129
+#define IDS_HELP_REALIGN_PARTITION         130
+#define IDS_HELP_CLONE                     131
+#define IDS_HELP_CLONE_DISK                132
+#define IDS_HELP_CLONE_PARTITION           133
+#define IDS_HELP_DEPLOY                    134
+#define IDS_HELP_RESTORE                   135
+#define IDS_HELP_RESTORE_PARTITION         136
+#define IDS_HELP_HASH                      137
+#define IDS_HELP_HASH_DISK                 138
+#define IDS_HELP_HASH_PARTITION            139
+#define IDS_HELP_COMPARE                   140
+#define IDS_HELP_COMPARE_DISK              141
+#define IDS_HELP_COMPARE_PARTITION         142
+#define IDS_HELP_EXPORT                    143
+#define IDS_HELP_EXPORT_PARTITION          144
+#define IDS_HELP_IMPORT_PARTITION          145
+#define IDS_HELP_CANCEL                    146
+#define IDS_HELP_JOBS                      147
+#define IDS_HELP_WAIT                      148
+#define IDS_HELP_FOREACH                   149
+#define IDS_HELP_SET_QOS                   150
+#define IDS_HELP_SET_IO                    151
+
 #define IDS_ERROR_MSG_NO_SCRIPT  5000
 #define IDS_ERROR_MSG_BAD_ARG    5001
 #define IDS_ERROR_INVALID_ARGS   5002
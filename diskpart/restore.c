@@ -0,0 +1,673 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/restore.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define RESTORE_CHUNK_SIZE          (1024 * 1024)
+#define RESTORE_QUEUE_DEPTH         4
+
+typedef struct _RESTORE_SLOT
+{
+    PUCHAR SourceBuffer;
+    PUCHAR TargetBuffer;
+    ULONGLONG Chunk;
+    ULONG Length;                   /* 0 if the slot holds no chunk */
+    ULONGLONG SourceMark;           /* Image engine mark that covers the image read */
+    ULONGLONG TargetMark;           /* Disk engine mark that covers the partition read */
+    ULONGLONG WriteMark;            /* Disk engine mark that covers the write */
+} RESTORE_SLOT, *PRESTORE_SLOT;
+
+typedef struct _RESTORE_CONTEXT
+{
+    IO_ENGINE Image;
+    IO_ENGINE Disk;
+    ULONGLONG PartitionOffset;      /* Bytes, start of the partition on the disk */
+    ULONG HiddenSectors;            /* Start sector of the partition */
+    ULONGLONG ImageLength;
+    ULONGLONG ChunkCount;
+    ULONGLONG NextChunk;
+    BOOL bDelta;
+    QOS_SETTINGS QosSettings;
+    QOS_BUCKET Qos;
+
+    /* Digest of every chunk of the image, NULL without a manifest */
+    PDIGEST_MANIFEST Manifest;
+    BOOL bManifestLoaded;           /* The image is only read for chunks that differ */
+
+    ULONGLONG ChunksDone;
+    ULONGLONG ChunksChanged;
+    ULONGLONG BytesRead;
+    ULONGLONG BytesCompared;
+    ULONGLONG BytesWritten;
+} RESTORE_CONTEXT, *PRESTORE_CONTEXT;
+
+/* FUNCTIONS ******************************************************************/
+
+/*
+ * Queues the reads of the next chunk in the slot, once the slot has been
+ * written. A full restore only reads the image. A delta restore reads the
+ * partition, and also the image unless a manifest holds the digests of the
+ * image chunks.
+ */
+static
+NTSTATUS
+StartRestoreChunk(
+    _In_ PRESTORE_CONTEXT Context,
+    _In_ PRESTORE_SLOT Slot)
+{
+    NTSTATUS Status;
+
+    Status = WaitForIoEngine(&Context->Disk, Slot->WriteMark);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    if (Context->NextChunk >= Context->ChunkCount)
+    {
+        Slot->Length = 0;
+        return STATUS_SUCCESS;
+    }
+
+    Slot->Chunk = Context->NextChunk++;
+    Slot->Length = (ULONG)min((ULONGLONG)RESTORE_CHUNK_SIZE,
+                              Context->ImageLength - (Slot->Chunk * RESTORE_CHUNK_SIZE));
+
+    if (!Context->bDelta || !Context->bManifestLoaded)
+    {
+        Status = QueueReadIoEngine(&Context->Image,
+                                   Slot->Chunk * RESTORE_CHUNK_SIZE,
+                                   Slot->SourceBuffer,
+                                   Slot->Length);
+        Slot->SourceMark = GetIoEngineMark(&Context->Image);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    if (Context->bDelta)
+    {
+        Status = QueueReadIoEngine(&Context->Disk,
+                                   Context->PartitionOffset + (Slot->Chunk * RESTORE_CHUNK_SIZE),
+                                   Slot->TargetBuffer,
+                                   Slot->Length);
+        Slot->TargetMark = GetIoEngineMark(&Context->Disk);
+        if (!NT_SUCCESS(Status))
+            return Status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * The boot sector of the image holds the start sector of the partition it
+ * was taken from. It gets the start of the partition it is restored to.
+ */
+static
+VOID
+FixRestoreBootSector(
+    _In_ PRESTORE_CONTEXT Context,
+    _In_ PRESTORE_SLOT Slot)
+{
+    if ((Slot->Chunk == 0) &&
+        (*(PUSHORT)&Slot->SourceBuffer[510] == 0xAA55) &&
+        (*(PULONG)&Slot->SourceBuffer[0x1C] != 0))
+    {
+        *(PULONG)&Slot->SourceBuffer[0x1C] = Context->HiddenSectors;
+    }
+}
+
+
+static
+NTSTATUS
+WriteRestoreSlot(
+    _In_ PRESTORE_CONTEXT Context,
+    _In_ PRESTORE_SLOT Slot)
+{
+    NTSTATUS Status;
+
+    Status = WriteIoEngine(&Context->Disk,
+                           Context->PartitionOffset + (Slot->Chunk * RESTORE_CHUNK_SIZE),
+                           Slot->SourceBuffer,
+                           Slot->Length);
+    Slot->WriteMark = GetIoEngineMark(&Context->Disk);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Context->ChunksChanged++;
+    Context->BytesWritten += Slot->Length;
+
+    return STATUS_SUCCESS;
+}
+
+
+/* Waits for the reads of the slot and writes the chunk if it has to be */
+static
+NTSTATUS
+CompleteRestoreSlot(
+    _In_ PRESTORE_CONTEXT Context,
+    _In_ PRESTORE_SLOT Slot)
+{
+    UCHAR Digest[MAXIMUM_DIGEST_SIZE];
+    PUCHAR ChunkDigest = NULL;
+    BOOL bSourceRead;
+    NTSTATUS Status;
+
+    bSourceRead = !Context->bDelta || !Context->bManifestLoaded;
+    if (Context->Manifest != NULL)
+        ChunkDigest = &Context->Manifest->Digests[Slot->Chunk * Context->Manifest->DigestSize];
+
+    if (bSourceRead)
+    {
+        Status = WaitForIoEngine(&Context->Image, Slot->SourceMark);
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        Context->BytesRead += Slot->Length;
+
+        /* The manifest describes the image as it is, so hash before the fixup */
+        if (ChunkDigest != NULL)
+            ComputeDigest(Context->Manifest->Algorithm, Slot->SourceBuffer, Slot->Length, ChunkDigest);
+
+        FixRestoreBootSector(Context, Slot);
+    }
+
+    if (!Context->bDelta)
+        return WriteRestoreSlot(Context, Slot);
+
+    Status = WaitForIoEngine(&Context->Disk, Slot->TargetMark);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Context->BytesCompared += Slot->Length;
+
+    if (bSourceRead)
+    {
+        if (RtlCompareMemory(Slot->SourceBuffer, Slot->TargetBuffer, Slot->Length) == Slot->Length)
+            return STATUS_SUCCESS;
+
+        return WriteRestoreSlot(Context, Slot);
+    }
+
+    ComputeDigest(Context->Manifest->Algorithm, Slot->TargetBuffer, Slot->Length, Digest);
+    if (RtlCompareMemory(Digest, ChunkDigest, Context->Manifest->DigestSize) == Context->Manifest->DigestSize)
+        return STATUS_SUCCESS;
+
+    /* Only the chunks that differ are read from the image */
+    Status = ReadIoEngine(&Context->Image,
+                          Slot->Chunk * RESTORE_CHUNK_SIZE,
+                          Slot->SourceBuffer,
+                          Slot->Length);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Context->BytesRead += Slot->Length;
+    FixRestoreBootSector(Context, Slot);
+
+    return WriteRestoreSlot(Context, Slot);
+}
+
+
+/*
+ * Restores the chunks through the engines set with SET IO. The reads of the
+ * next slots are queued while a slot is compared or written, and a slot is
+ * only read again after the slot behind it has been written.
+ */
+static
+NTSTATUS
+RunRestore(
+    _In_ PRESTORE_CONTEXT Context)
+{
+    RESTORE_SLOT Slots[RESTORE_QUEUE_DEPTH];
+    ULONG Index;
+    ULONG ulPercent, ulLastPercent = 0;
+    PUCHAR BufferBase;
+    LARGE_INTEGER Frequency, StartTime, Now;
+    ULONGLONG ullElapsedMs;
+    NTSTATUS Status, FlushStatus;
+
+    RtlZeroMemory(Slots, sizeof(Slots));
+
+    BufferBase = AllocateIoBuffer((SIZE_T)RESTORE_CHUNK_SIZE * 2 * RESTORE_QUEUE_DEPTH);
+    if (BufferBase == NULL)
+        return STATUS_NO_MEMORY;
+
+    for (Index = 0; Index < RESTORE_QUEUE_DEPTH; Index++)
+    {
+        Slots[Index].SourceBuffer = BufferBase + ((SIZE_T)Index * 2 * RESTORE_CHUNK_SIZE);
+        Slots[Index].TargetBuffer = Slots[Index].SourceBuffer + RESTORE_CHUNK_SIZE;
+    }
+
+    /* The partition goes first, so its disk is the device whose latency counts */
+    InitializeQosBucket(&Context->Qos, &Context->QosSettings, NULL);
+    AddQosDevice(&Context->Qos, Context->Disk.FileHandle);
+    AddQosDevice(&Context->Qos, Context->Image.FileHandle);
+    Context->Disk.Qos = &Context->Qos;
+    Context->Image.Qos = &Context->Qos;
+
+    NtQueryPerformanceCounter(&StartTime, &Frequency);
+
+    /* The last slot is read once the first one has been written */
+    Status = STATUS_SUCCESS;
+    for (Index = 0; (Index < RESTORE_QUEUE_DEPTH - 1) && NT_SUCCESS(Status); Index++)
+        Status = StartRestoreChunk(Context, &Slots[Index]);
+
+    /* The slots hold the chunks in order, so the first empty slot ends the restore */
+    Index = 0;
+    while (NT_SUCCESS(Status) && (Slots[Index].Length != 0))
+    {
+        Status = CompleteRestoreSlot(Context, &Slots[Index]);
+        if (!NT_SUCCESS(Status))
+            break;
+
+        Context->ChunksDone++;
+
+        ulPercent = (ULONG)((Context->ChunksDone * 100) / Context->ChunkCount);
+        if (ulPercent != ulLastPercent)
+        {
+            ConResPrintf(StdOut, IDS_RESTORE_PROGRESS, ulPercent);
+            ulLastPercent = ulPercent;
+        }
+
+        Status = StartRestoreChunk(Context, &Slots[(Index + RESTORE_QUEUE_DEPTH - 1) % RESTORE_QUEUE_DEPTH]);
+        Index = (Index + 1) % RESTORE_QUEUE_DEPTH;
+    }
+
+    if (!NT_SUCCESS(Status))
+        DPRINT1("Restore I/O failed (Status 0x%08lx)\n", Status);
+
+    /* Never release buffers that are still owned by pending requests */
+    FlushIoEngine(&Context->Image);
+    FlushStatus = FlushIoEngine(&Context->Disk);
+    if (NT_SUCCESS(Status))
+        Status = FlushStatus;
+
+    if (NT_SUCCESS(Status))
+    {
+        NtQueryPerformanceCounter(&Now, NULL);
+        ullElapsedMs = ((ULONGLONG)(Now.QuadPart - StartTime.QuadPart) * 1000) / Frequency.QuadPart;
+
+        ConResPrintf(StdOut, IDS_RESTORE_RESULT,
+                     Context->BytesRead / (SIZE_1KB * SIZE_1KB),
+                     Context->BytesCompared / (SIZE_1KB * SIZE_1KB),
+                     Context->BytesWritten / (SIZE_1KB * SIZE_1KB),
+                     Context->ChunksChanged,
+                     Context->ChunkCount,
+                     ullElapsedMs);
+    }
+
+    FreeIoBuffer(BufferBase);
+
+    return Status;
+}
+
+
+static
+NTSTATUS
+OpenRestoreImage(
+    _In_ PWSTR pszFileName,
+    _Out_ PIO_ENGINE Engine,
+    _Out_ PULONGLONG pullLength,
+    _Out_ PLARGE_INTEGER pWriteTime)
+{
+    UNICODE_STRING Name;
+    IO_STATUS_BLOCK Iosb;
+    FILE_STANDARD_INFORMATION StandardInfo;
+    FILE_BASIC_INFORMATION BasicInfo;
+    NTSTATUS Status;
+
+    if (!RtlDosPathNameToNtPathName_U(pszFileName, &Name, NULL, NULL))
+        return STATUS_OBJECT_NAME_INVALID;
+
+    Status = OpenIoEngine(Engine, &Name, FILE_GENERIC_READ, FILE_SHARE_READ);
+    RtlFreeUnicodeString(&Name);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtQueryInformationFile(Engine->FileHandle,
+                                    &Iosb,
+                                    &StandardInfo,
+                                    sizeof(StandardInfo),
+                                    FileStandardInformation);
+    if (NT_SUCCESS(Status))
+    {
+        Status = NtQueryInformationFile(Engine->FileHandle,
+                                        &Iosb,
+                                        &BasicInfo,
+                                        sizeof(BasicInfo),
+                                        FileBasicInformation);
+    }
+
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    *pullLength = StandardInfo.EndOfFile.QuadPart;
+    *pWriteTime = BasicInfo.LastWriteTime;
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Loads the chunk digests of the image from a manifest. A manifest that does
+ * not match the size, the last write time or the chunk size of the image is
+ * out of date, and a new one is built while the image is restored. A
+ * manifest without a write time was made by HASH and is bound by size only.
+ */
+static
+VOID
+LoadRestoreManifest(
+    _In_ PWSTR pszFileName,
+    _In_ PRESTORE_CONTEXT Context,
+    _In_ PLARGE_INTEGER pWriteTime)
+{
+    PDIGEST_MANIFEST Manifest;
+    NTSTATUS Status;
+
+    Status = LoadDigestManifest(pszFileName, &Manifest);
+    if (NT_SUCCESS(Status))
+    {
+        if ((Manifest->ChunkSize == RESTORE_CHUNK_SIZE) &&
+            (Manifest->Length == Context->ImageLength) &&
+            ((Manifest->WriteTime.QuadPart == 0) ||
+             (Manifest->WriteTime.QuadPart == pWriteTime->QuadPart)))
+        {
+            Context->Manifest = Manifest;
+            Context->bManifestLoaded = TRUE;
+            return;
+        }
+
+        DestroyDigestManifest(Manifest);
+        ConResPuts(StdOut, IDS_RESTORE_MANIFEST_STALE);
+    }
+    else if (Status != STATUS_OBJECT_NAME_NOT_FOUND)
+    {
+        ConResPuts(StdOut, IDS_RESTORE_MANIFEST_STALE);
+    }
+
+    /* A new manifest is built while the image is restored */
+    CreateDigestManifest(DigestSha256,
+                         RESTORE_CHUNK_SIZE,
+                         Context->ImageLength,
+                         pWriteTime,
+                         &Context->Manifest);
+}
+
+
+static
+NTSTATUS
+OpenRestoreDisk(
+    _In_ ULONG DiskNumber,
+    _Out_ PIO_ENGINE Engine)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition0",
+                     DiskNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    return OpenIoEngine(Engine,
+                        &Name,
+                        GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE);
+}
+
+
+/*
+ * Locks and dismounts the volume on the partition, so the file system does
+ * not see its data change underneath it. The returned handle keeps the lock.
+ */
+static
+NTSTATUS
+LockRestorePartition(
+    _Out_ PHANDLE VolumeHandle)
+{
+    WCHAR szBuffer[MAX_PATH];
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    NTSTATUS Status;
+
+    StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                     L"\\Device\\Harddisk%lu\\Partition%lu",
+                     CurrentDisk->DiskNumber,
+                     CurrentPartition->PartitionNumber);
+
+    RtlInitUnicodeString(&Name, szBuffer);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    Status = NtOpenFile(VolumeHandle,
+                        GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
+                        &ObjectAttributes,
+                        &Iosb,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        FILE_SYNCHRONOUS_IO_NONALERT);
+    if (!NT_SUCCESS(Status))
+        return Status;
+
+    Status = NtFsControlFile(*VolumeHandle,
+                             NULL,
+                             NULL,
+                             NULL,
+                             &Iosb,
+                             FSCTL_LOCK_VOLUME,
+                             NULL,
+                             0,
+                             NULL,
+                             0);
+    if (NT_SUCCESS(Status))
+    {
+        Status = NtFsControlFile(*VolumeHandle,
+                                 NULL,
+                                 NULL,
+                                 NULL,
+                                 &Iosb,
+                                 FSCTL_DISMOUNT_VOLUME,
+                                 NULL,
+                                 0,
+                                 NULL,
+                                 0);
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        NtClose(*VolumeHandle);
+        *VolumeHandle = NULL;
+    }
+
+    return Status;
+}
+
+
+EXIT_CODE
+RestorePartition(
+    _In_ INT argc,
+    _In_ PWSTR *argv)
+{
+    RESTORE_CONTEXT Context;
+    PWSTR pszImage = NULL, pszManifest = NULL, pszSuffix = NULL;
+    LARGE_INTEGER WriteTime;
+    HANDLE VolumeHandle = NULL;
+    NTSTATUS Status;
+    INT i;
+
+    DPRINT("RestorePartition()\n");
+
+    if (CurrentDisk == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_DISK);
+        return EXIT_SUCCESS;
+    }
+
+    if (CurrentPartition == NULL)
+    {
+        ConResPuts(StdOut, IDS_SELECT_NO_PARTITION);
+        return EXIT_SUCCESS;
+    }
+
+    RtlZeroMemory(&Context, sizeof(Context));
+    GetQosSettings(&Context.QosSettings);
+
+    for (i = 2; i < argc; i++)
+    {
+        if (HasPrefix(argv[i], L"image=", &pszSuffix))
+        {
+            /* image=<file> */
+            if (pszImage != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszImage);
+
+            pszImage = DuplicateQuotedString(pszSuffix);
+            if (pszImage == NULL)
+                goto invalid;
+        }
+        else if (HasPrefix(argv[i], L"manifest=", &pszSuffix))
+        {
+            /* manifest=<file> */
+            if (pszManifest != NULL)
+                RtlFreeHeap(RtlGetProcessHeap(), 0, pszManifest);
+
+            pszManifest = DuplicateQuotedString(pszSuffix);
+            if (pszManifest == NULL)
+                goto invalid;
+        }
+        else if (HasPrefix(argv[i], L"mode=", &pszSuffix))
+        {
+            /* mode=full|delta */
+            if (_wcsicmp(pszSuffix, L"delta") == 0)
+                Context.bDelta = TRUE;
+            else if (_wcsicmp(pszSuffix, L"full") == 0)
+                Context.bDelta = FALSE;
+            else
+                goto invalid;
+        }
+        else if (HasPrefix(argv[i], L"qos=", &pszSuffix))
+        {
+            /* qos=<setting>[,<setting>...] */
+            if (!ParseQosSettings(pszSuffix, &Context.QosSettings))
+                goto invalid;
+        }
+        else
+        {
+            goto invalid;
+        }
+    }
+
+    if (pszImage == NULL)
+        goto invalid;
+
+    if ((CurrentPartition->PartitionNumber == 0) ||
+        ((CurrentDisk->PartitionStyle == PARTITION_STYLE_MBR) &&
+         IsContainerPartition(CurrentPartition->Mbr.PartitionType)))
+    {
+        ConResPuts(StdOut, IDS_RESTORE_PARTITION_TYPE);
+        goto done;
+    }
+
+    Status = OpenRestoreImage(pszImage, &Context.Image, &Context.ImageLength, &WriteTime);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("OpenRestoreImage() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_RESTORE_FAIL);
+        goto done;
+    }
+
+    if ((Context.ImageLength == 0) ||
+        (Context.ImageLength > CurrentPartition->SectorCount.QuadPart * CurrentDisk->BytesPerSector) ||
+        ((Context.ImageLength % CurrentDisk->BytesPerSector) != 0))
+    {
+        ConResPuts(StdOut, IDS_RESTORE_TOO_LARGE);
+        goto done;
+    }
+
+    Context.ChunkCount = (Context.ImageLength + RESTORE_CHUNK_SIZE - 1) / RESTORE_CHUNK_SIZE;
+    Context.PartitionOffset = CurrentPartition->StartSector.QuadPart * CurrentDisk->BytesPerSector;
+    Context.HiddenSectors = CurrentPartition->StartSector.LowPart;
+
+    if (pszManifest != NULL)
+    {
+        LoadRestoreManifest(pszManifest, &Context, &WriteTime);
+        if (Context.Manifest == NULL)
+        {
+            ConResPuts(StdOut, IDS_RESTORE_FAIL);
+            goto done;
+        }
+
+        /* A full restore reads the whole image anyway */
+        if (Context.bManifestLoaded && !Context.bDelta)
+        {
+            DestroyDigestManifest(Context.Manifest);
+            Context.Manifest = NULL;
+        }
+    }
+
+    Status = LockRestorePartition(&VolumeHandle);
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("LockRestorePartition() failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_RESTORE_IN_USE);
+        goto done;
+    }
+
+    /*
+     * The lock only keeps the file system dismounted while the image is
+     * written. The data goes to the raw disk through Partition0, which the
+     * volume lock does not cover.
+     */
+    Status = OpenRestoreDisk(CurrentDisk->DiskNumber, &Context.Disk);
+    if (NT_SUCCESS(Status))
+        Status = RunRestore(&Context);
+
+    CloseIoEngine(&Context.Disk);
+
+    NtClose(VolumeHandle);
+
+    if (NT_SUCCESS(Status) && (Context.Manifest != NULL) && !Context.bManifestLoaded)
+    {
+        if (!NT_SUCCESS(SaveDigestManifest(pszManifest, Context.Manifest)))
+            ConResPuts(StdOut, IDS_RESTORE_MANIFEST_FAIL);
+    }
+
+    /* The partition may hold a different file system now */
+    RescanAndSelect(CurrentDisk->DiskNumber, CurrentPartition->StartSector.QuadPart);
+
+    if (!NT_SUCCESS(Status))
+    {
+        DPRINT1("Restore failed (Status 0x%08lx)\n", Status);
+        ConResPuts(StdOut, IDS_RESTORE_FAIL);
+        goto done;
+    }
+
+    ConResPuts(StdOut, IDS_RESTORE_SUCCESS);
+    goto done;
+
+invalid:
+    ConResPuts(StdErr, IDS_ERROR_INVALID_ARGS);
+
+done:
+    CloseIoEngine(&Context.Image);
+
+    if (Context.Manifest != NULL)
+        DestroyDigestManifest(Context.Manifest);
+
+    if (pszManifest != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszManifest);
+
+    if (pszImage != NULL)
+        RtlFreeHeap(RtlGetProcessHeap(), 0, pszImage);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,341 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/sectorcache.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+/*
+ * Keeps the metadata sectors that were read last, so the partition table,
+ * the boot sectors and the superblocks are read from the disk once. Every
+ * disk has its own cache of whole, aligned blocks, the least recently used
+ * block makes room for a new one.
+ *
+ * DiskPart never writes these sectors directly: the layout is written with
+ * IOCTLs and the data by jobs, and both drop the cached blocks of the disk.
+ * While a job runs on a disk its sectors are not cached at all. A rescan
+ * starts over with empty caches.
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+#define SECTOR_CACHE_BLOCK_SIZE 4096
+#define SECTOR_CACHE_BLOCKS     32
+
+typedef struct _SECTOR_CACHE_BLOCK
+{
+    LIST_ENTRY ListEntry;       /* Most recently used first */
+    ULONGLONG ullOffset;        /* Bytes, block aligned */
+    ULONG ulLength;             /* Shorter at the end of the disk */
+    UCHAR Data[ANYSIZE_ARRAY];
+} SECTOR_CACHE_BLOCK, *PSECTOR_CACHE_BLOCK;
+
+/* FUNCTIONS ******************************************************************/
+
+static
+ULONG
+GetCacheBlockSize(
+    _In_ PDISKENTRY DiskEntry)
+{
+    return max(SECTOR_CACHE_BLOCK_SIZE, DiskEntry->BytesPerSector);
+}
+
+
+static
+PSECTOR_CACHE_BLOCK
+FindCacheBlock(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ ULONGLONG ullOffset)
+{
+    PLIST_ENTRY Entry;
+    PSECTOR_CACHE_BLOCK Block;
+
+    for (Entry = DiskEntry->SectorCacheListHead.Flink;
+         Entry != &DiskEntry->SectorCacheListHead;
+         Entry = Entry->Flink)
+    {
+        Block = CONTAINING_RECORD(Entry, SECTOR_CACHE_BLOCK, ListEntry);
+        if (Block->ullOffset == ullOffset)
+        {
+            RemoveEntryList(&Block->ListEntry);
+            InsertHeadList(&DiskEntry->SectorCacheListHead, &Block->ListEntry);
+            return Block;
+        }
+    }
+
+    return NULL;
+}
+
+
+static
+PSECTOR_CACHE_BLOCK
+CreateCacheBlock(
+    _In_ ULONGLONG ullOffset,
+    _In_reads_bytes_(ulLength) PVOID Data,
+    _In_ ULONG ulLength)
+{
+    PSECTOR_CACHE_BLOCK Block;
+
+    Block = RtlAllocateHeap(RtlGetProcessHeap(),
+                            0,
+                            FIELD_OFFSET(SECTOR_CACHE_BLOCK, Data[ulLength]));
+    if (Block == NULL)
+        return NULL;
+
+    Block->ullOffset = ullOffset;
+    Block->ulLength = ulLength;
+    RtlCopyMemory(Block->Data, Data, ulLength);
+
+    return Block;
+}
+
+
+static
+VOID
+InsertCacheBlock(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PSECTOR_CACHE_BLOCK Block)
+{
+    PSECTOR_CACHE_BLOCK OldestBlock;
+
+    if (DiskEntry->SectorCacheCount >= SECTOR_CACHE_BLOCKS)
+    {
+        OldestBlock = CONTAINING_RECORD(RemoveTailList(&DiskEntry->SectorCacheListHead),
+                                        SECTOR_CACHE_BLOCK,
+                                        ListEntry);
+        RtlFreeHeap(RtlGetProcessHeap(), 0, OldestBlock);
+        DiskEntry->SectorCacheCount--;
+    }
+
+    InsertHeadList(&DiskEntry->SectorCacheListHead, &Block->ListEntry);
+    DiskEntry->SectorCacheCount++;
+}
+
+
+/*
+ * Reads one block with the given handle, or else with the engine set by
+ * SET IO.
+ */
+static
+NTSTATUS
+LoadCacheBlock(
+    _In_ PDISKENTRY DiskEntry,
+    _In_opt_ HANDLE FileHandle,
+    _In_ ULONGLONG ullOffset,
+    _Out_ PSECTOR_CACHE_BLOCK *ppBlock)
+{
+    IO_ENGINE Engine;
+    IO_STATUS_BLOCK Iosb;
+    LARGE_INTEGER FileOffset;
+    ULONGLONG ullDiskLength;
+    ULONG ulLength;
+    PVOID Buffer;
+    NTSTATUS Status;
+
+    ulLength = GetCacheBlockSize(DiskEntry);
+
+    /* The size is not known yet while the disk is added to the list */
+    ullDiskLength = DiskEntry->SectorCount.QuadPart * DiskEntry->BytesPerSector;
+    if (ullDiskLength != 0)
+    {
+        if (ullOffset >= ullDiskLength)
+            return STATUS_END_OF_FILE;
+
+        ulLength = (ULONG)min((ULONGLONG)ulLength, ullDiskLength - ullOffset);
+    }
+
+    /* Aligned, as a direct or asynchronous engine reads unbuffered */
+    Buffer = AllocateIoBuffer(ulLength);
+    if (Buffer == NULL)
+        return STATUS_NO_MEMORY;
+
+    if (FileHandle != NULL)
+    {
+        FileOffset.QuadPart = ullOffset;
+        Status = NtReadFile(FileHandle,
+                            NULL,
+                            NULL,
+                            NULL,
+                            &Iosb,
+                            Buffer,
+                            ulLength,
+                            &FileOffset,
+                            NULL);
+        if (NT_SUCCESS(Status) && (Iosb.Information != ulLength))
+            Status = STATUS_END_OF_FILE;
+    }
+    else
+    {
+        Status = OpenDiskIoEngine(&Engine, DiskEntry);
+        if (NT_SUCCESS(Status))
+            Status = ReadIoEngine(&Engine, ullOffset, Buffer, ulLength);
+        CloseIoEngine(&Engine);
+    }
+
+    if (NT_SUCCESS(Status))
+    {
+        *ppBlock = CreateCacheBlock(ullOffset, Buffer, ulLength);
+        if (*ppBlock == NULL)
+            Status = STATUS_NO_MEMORY;
+    }
+    else
+    {
+        DPRINT1("Reading the sectors failed (Status 0x%08lx)\n", Status);
+    }
+
+    FreeIoBuffer(Buffer);
+
+    return Status;
+}
+
+
+/*
+ * Reads sectors of the disk through its cache. FileHandle is only needed
+ * while the disk is added to the list; otherwise the blocks that are not
+ * cached are read with the engine set by SET IO.
+ */
+NTSTATUS
+ReadCachedSectors(
+    _In_ PDISKENTRY DiskEntry,
+    _In_opt_ HANDLE FileHandle,
+    _In_ ULONGLONG ullSector,
+    _In_ ULONG ulSectorCount,
+    _Out_writes_bytes_(ulSectorCount * DiskEntry->BytesPerSector) PVOID Buffer)
+{
+    PSECTOR_CACHE_BLOCK Block;
+    ULONGLONG ullOffset, ullBlockOffset;
+    ULONG ulLength, ulSkip, ulCopy;
+    BOOL bBypass;
+    NTSTATUS Status;
+
+    ullOffset = ullSector * DiskEntry->BytesPerSector;
+    ulLength = ulSectorCount * DiskEntry->BytesPerSector;
+
+    /* A job may change the sectors at any time */
+    bBypass = HasActiveJobs(DiskEntry->DiskNumber);
+    if (bBypass)
+        InvalidateSectorCache(DiskEntry);
+
+    while (ulLength > 0)
+    {
+        ullBlockOffset = AlignDown(ullOffset, GetCacheBlockSize(DiskEntry));
+
+        Block = bBypass ? NULL : FindCacheBlock(DiskEntry, ullBlockOffset);
+        if (Block != NULL)
+        {
+            DiskEntry->SectorCacheHits++;
+        }
+        else
+        {
+            DiskEntry->SectorCacheMisses++;
+
+            Status = LoadCacheBlock(DiskEntry, FileHandle, ullBlockOffset, &Block);
+            if (!NT_SUCCESS(Status))
+                return Status;
+
+            if (!bBypass)
+                InsertCacheBlock(DiskEntry, Block);
+        }
+
+        Status = STATUS_SUCCESS;
+
+        ulSkip = (ULONG)(ullOffset - ullBlockOffset);
+        if (ulSkip < Block->ulLength)
+        {
+            ulCopy = min(Block->ulLength - ulSkip, ulLength);
+            RtlCopyMemory(Buffer, &Block->Data[ulSkip], ulCopy);
+        }
+        else
+        {
+            Status = STATUS_END_OF_FILE;
+        }
+
+        if (bBypass)
+            RtlFreeHeap(RtlGetProcessHeap(), 0, Block);
+
+        if (!NT_SUCCESS(Status))
+            return Status;
+
+        Buffer = (PUCHAR)Buffer + ulCopy;
+        ullOffset += ulCopy;
+        ulLength -= ulCopy;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+/*
+ * Keeps the whole blocks of sectors that were read by other means, like the
+ * heads of the partitions read by the file system probes.
+ */
+VOID
+CacheSectors(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ ULONGLONG ullOffset,
+    _In_reads_bytes_(ulLength) PVOID Buffer,
+    _In_ ULONG ulLength)
+{
+    PSECTOR_CACHE_BLOCK Block;
+    ULONG ulBlockSize = GetCacheBlockSize(DiskEntry);
+    ULONGLONG ullBlockOffset;
+
+    if (HasActiveJobs(DiskEntry->DiskNumber))
+        return;
+
+    ullBlockOffset = AlignDown(ullOffset + ulBlockSize - 1, ulBlockSize);
+
+    while (ullBlockOffset + ulBlockSize <= ullOffset + ulLength)
+    {
+        if (FindCacheBlock(DiskEntry, ullBlockOffset) == NULL)
+        {
+            Block = CreateCacheBlock(ullBlockOffset,
+                                     (PUCHAR)Buffer + (ULONG)(ullBlockOffset - ullOffset),
+                                     ulBlockSize);
+            if (Block == NULL)
+                return;
+
+            InsertCacheBlock(DiskEntry, Block);
+        }
+
+        ullBlockOffset += ulBlockSize;
+    }
+}
+
+
+VOID
+InvalidateSectorCache(
+    _In_ PDISKENTRY DiskEntry)
+{
+    PSECTOR_CACHE_BLOCK Block;
+
+    while (!IsListEmpty(&DiskEntry->SectorCacheListHead))
+    {
+        Block = CONTAINING_RECORD(RemoveHeadList(&DiskEntry->SectorCacheListHead),
+                                  SECTOR_CACHE_BLOCK,
+                                  ListEntry);
+        RtlFreeHeap(RtlGetProcessHeap(), 0, Block);
+    }
+
+    DiskEntry->SectorCacheCount = 0;
+}
+
+
+VOID
+InvalidateDiskSectorCache(
+    _In_ ULONG DiskNumber)
+{
+    PLIST_ENTRY Entry;
+    PDISKENTRY DiskEntry;
+
+    for (Entry = DiskListHead.Flink; Entry != &DiskListHead; Entry = Entry->Flink)
+    {
+        DiskEntry = CONTAINING_RECORD(Entry, DISKENTRY, ListEntry);
+        if (DiskEntry->DiskNumber == DiskNumber)
+            InvalidateSectorCache(DiskEntry);
+    }
+}
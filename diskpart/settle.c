@@ -0,0 +1,238 @@
+/*
+ * PROJECT:         ReactOS DiskPart
+ * LICENSE:         GPL - See COPYING in the top level directory
+ * FILE:            base/system/diskpart/settle.c
+ * PURPOSE:         Manages all the partitions of the OS in an interactive way.
+ * PROGRAMMERS:     DiskPart contributors
+ */
+
+/*
+ * Waits for the disk and partition devices to settle instead of sleeping
+ * for a fixed time. The devices are settled when every device that should
+ * exist can be opened and the mount manager has not seen a change for a
+ * short while; a hot-plugged disk or a new partition changes its database
+ * when the volume arrives.
+ */
+
+#include "diskpart.h"
+
+#define NDEBUG
+#include <debug.h>
+
+/* The devices are settled after this long without a change */
+#define SETTLE_QUIET_INTERVAL   250
+/* Longest wait for the partitions after the layout was written */
+#define SETTLE_LAYOUT_TIMEOUT   10000
+
+typedef BOOL (*PSETTLE_CHECK)(PVOID Context);
+
+/* FUNCTIONS ******************************************************************/
+
+static
+ULONGLONG
+GetMilliseconds(VOID)
+{
+    LARGE_INTEGER Counter, Frequency;
+
+    NtQueryPerformanceCounter(&Counter, &Frequency);
+
+    return ((ULONGLONG)Counter.QuadPart * 1000) / Frequency.QuadPart;
+}
+
+
+static
+BOOL
+IsDeviceReady(
+    _In_ PWSTR pszDeviceName)
+{
+    UNICODE_STRING Name;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    IO_STATUS_BLOCK Iosb;
+    HANDLE FileHandle;
+    NTSTATUS Status;
+
+    RtlInitUnicodeString(&Name, pszDeviceName);
+
+    InitializeObjectAttributes(&ObjectAttributes,
+                               &Name,
+                               OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    Status = NtOpenFile(&FileHandle,
+                        FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+                        &ObjectAttributes,
+                        &Iosb,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        FILE_SYNCHRONOUS_IO_NONALERT);
+    if (!NT_SUCCESS(Status))
+        return FALSE;
+
+    NtClose(FileHandle);
+
+    return TRUE;
+}
+
+
+/* Checks that every disk the system counts can be opened */
+static
+BOOL
+AreDisksReady(
+    _In_opt_ PVOID Context)
+{
+    SYSTEM_DEVICE_INFORMATION Sdi;
+    WCHAR szBuffer[MAX_PATH];
+    ULONG ReturnSize;
+    ULONG DiskNumber;
+    NTSTATUS Status;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    Status = NtQuerySystemInformation(SystemDeviceInformation,
+                                      &Sdi,
+                                      sizeof(SYSTEM_DEVICE_INFORMATION),
+                                      &ReturnSize);
+    if (!NT_SUCCESS(Status))
+        return TRUE;
+
+    for (DiskNumber = 0; DiskNumber < Sdi.NumberOfDisks; DiskNumber++)
+    {
+        StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                         L"\\Device\\Harddisk%lu\\Partition0",
+                         DiskNumber);
+        if (!IsDeviceReady(szBuffer))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static
+BOOL
+ArePartitionListReady(
+    _In_ PDISKENTRY DiskEntry,
+    _In_ PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry;
+    PPARTENTRY PartEntry;
+    WCHAR szBuffer[MAX_PATH];
+
+    for (Entry = ListHead->Flink; Entry != ListHead; Entry = Entry->Flink)
+    {
+        PartEntry = CONTAINING_RECORD(Entry, PARTENTRY, ListEntry);
+        if (!PartEntry->IsPartitioned || (PartEntry->PartitionNumber == 0))
+            continue;
+
+        StringCchPrintfW(szBuffer, ARRAYSIZE(szBuffer),
+                         L"\\Device\\Harddisk%lu\\Partition%lu",
+                         DiskEntry->DiskNumber,
+                         PartEntry->PartitionNumber);
+        if (!IsDeviceReady(szBuffer))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* Checks that the partitions of one disk can be opened */
+static
+BOOL
+ArePartitionsReady(
+    _In_opt_ PVOID Context)
+{
+    PDISKENTRY DiskEntry = (PDISKENTRY)Context;
+
+    return ArePartitionListReady(DiskEntry, &DiskEntry->PrimaryPartListHead) &&
+           ArePartitionListReady(DiskEntry, &DiskEntry->LogicalPartListHead);
+}
+
+
+/*
+ * Waits until the check succeeds and the mount manager has been quiet for
+ * a while, or the timeout expires. Returns TRUE if the mount manager saw a
+ * change meanwhile.
+ */
+static
+BOOL
+WaitForSettle(
+    _In_ ULONG ulTimeout,
+    _In_ PSETTLE_CHECK CheckRoutine,
+    _In_opt_ PVOID Context)
+{
+    ULONGLONG ullDeadline, ullNow;
+    ULONG EpicNumber = 0;
+    BOOL bPrimed;
+    BOOL bChanged = FALSE;
+    LARGE_INTEGER Interval;
+    NTSTATUS Status;
+
+    ullDeadline = GetMilliseconds() + ulTimeout;
+
+    /* Learn the current epic number; it only waits if the number is zero */
+    Status = WaitForMountManagerChange(&EpicNumber, 0);
+    bPrimed = NT_SUCCESS(Status);
+
+    for (;;)
+    {
+        ullNow = GetMilliseconds();
+        if (ullNow >= ullDeadline)
+            break;
+
+        if (bPrimed)
+        {
+            Status = WaitForMountManagerChange(&EpicNumber,
+                                               (ULONG)min(ullDeadline - ullNow, SETTLE_QUIET_INTERVAL));
+            if (Status != STATUS_TIMEOUT)
+            {
+                /* Something arrived or left, wait for quiet again */
+                if (NT_SUCCESS(Status))
+                {
+                    bChanged = TRUE;
+                    continue;
+                }
+
+                bPrimed = FALSE;
+            }
+        }
+        else
+        {
+            /* Without the mount manager, poll the devices */
+            Interval.QuadPart = -(LONGLONG)min(ullDeadline - ullNow, SETTLE_QUIET_INTERVAL) * 10000;
+            NtDelayExecution(FALSE, &Interval);
+        }
+
+        if (CheckRoutine(Context))
+            break;
+    }
+
+    return bChanged;
+}
+
+
+/*
+ * Waits up to the given number of seconds for hot-plugged disks to settle.
+ * Returns TRUE if the devices changed, so the lists must be rescanned.
+ */
+BOOL
+WaitForDevices(
+    _In_ ULONG ulSeconds)
+{
+    return WaitForSettle(ulSeconds * 1000, AreDisksReady, NULL);
+}
+
+
+/*
+ * Waits for the partitions of a disk after its layout was written, so the
+ * following commands find their devices.
+ */
+VOID
+WaitForPartitionDevices(
+    _In_ PDISKENTRY DiskEntry)
+{
+    if (ArePartitionsReady(DiskEntry))
+        return;
+
+    WaitForSettle(SETTLE_LAYOUT_TIMEOUT, ArePartitionsReady, DiskEntry);
+}